@@ -66,12 +66,6 @@ THE SOFTWARE.
 
 #include "dht.h"
 
-#ifndef HAVE_MEMMEM
-#ifdef __GLIBC__
-#define HAVE_MEMMEM
-#endif
-#endif
-
 #ifndef MSG_CONFIRM
 #define MSG_CONFIRM 0
 #endif
@@ -201,18 +195,25 @@ struct node {
     time_t reply_time;          /* time of last correct reply received */
     time_t pinged_time;         /* time of last request */
     int pinged;                 /* how many requests we sent since last reply */
-    struct node *next;
 };
 
+#define DHT_BUCKET_NODES 8
+#define DHT_MAX_BUCKETS 160
+
 struct bucket {
     int af;
     unsigned char first[20];
     int count;                  /* number of nodes */
     int time;                   /* time of last reply in this bucket */
-    struct node *nodes;
+    struct node nodes[DHT_BUCKET_NODES];
     struct sockaddr_storage cached;  /* the address of a likely candidate */
     int cachedlen;
-    struct bucket *next;
+};
+
+struct table {
+    int af;
+    int numbuckets;             /* buckets in use, the last one is ours */
+    struct bucket buckets[DHT_MAX_BUCKETS];
 };
 
 struct search_node {
@@ -221,6 +222,7 @@ struct search_node {
     int sslen;
     time_t request_time;        /* the time of the last unanswered request */
     time_t reply_time;          /* the time of the last reply */
+    struct timeval request_tv;  /* of the last get_peers */
     int pinged;
     unsigned char token[40];
     int token_len;
@@ -242,7 +244,8 @@ struct search {
     int done;
     struct search_node nodes[SEARCH_NODES];
     int numnodes;
-    struct search *next;
+    struct search *next;        /* by increasing step_time */
+    struct search *prev;
 };
 
 struct peer {
@@ -267,51 +270,147 @@ struct peer {
 #define DHT_MAX_SEARCHES 1024
 #endif
 
+/* A lookup keeps up to dht_search_alpha get_peers requests in flight.  A
+   request counts as lost after a timeout derived from the round trip time
+   of earlier replies, so a slow node does not hold the lookup back. */
+#ifndef DHT_SEARCH_ALPHA
+#define DHT_SEARCH_ALPHA 3
+#endif
+
+#define SEARCH_TIMEOUT_INITIAL 2000
+#define SEARCH_TIMEOUT_MIN 250
+#define SEARCH_TIMEOUT_MAX 5000
+
 /* The time after which we consider a search to be expirable. */
 #ifndef DHT_SEARCH_EXPIRE_TIME
 #define DHT_SEARCH_EXPIRE_TIME (62 * 60)
 #endif
 
+/* Message and broadcast payloads above DHT_FRAGMENT_SIZE are sent as
+   numbered parts of one message id and put together by the receiver.
+   At most DHT_MAX_REASSEMBLIES messages are kept partial, each for
+   DHT_REASSEMBLY_TIME seconds. */
+#ifndef DHT_FRAGMENT_SIZE
+#define DHT_FRAGMENT_SIZE 1024
+#endif
+
+#ifndef DHT_MAX_FRAGMENTS
+#define DHT_MAX_FRAGMENTS 64
+#endif
+
+#ifndef DHT_MAX_REASSEMBLIES
+#define DHT_MAX_REASSEMBLIES 32
+#endif
+
+#ifndef DHT_REASSEMBLY_TIME
+#define DHT_REASSEMBLY_TIME 30
+#endif
+
+#define MESSAGE_ID_SIZE 8
+
+/* Broadcasts are passed on to at most DHT_BROADCAST_FANOUT nodes of each
+   routing table, and ids of the ones seen in the last
+   DHT_BROADCAST_SEEN_TIME seconds are remembered to drop copies. */
+#ifndef DHT_BROADCAST_FANOUT
+#define DHT_BROADCAST_FANOUT 8
+#endif
+
+#ifndef DHT_BROADCAST_SEEN
+#define DHT_BROADCAST_SEEN 4096
+#endif
+
+#ifndef DHT_BROADCAST_SEEN_TIME
+#define DHT_BROADCAST_SEEN_TIME (10 * 60)
+#endif
+
+/* With dht_reliable, message datagrams are numbered per destination node
+   and acked by the receiver with the next number it expects and a bitmap
+   of the DHT_RELIABLE_WINDOW numbers after it.  Unacked datagrams are
+   sent again after a timeout derived from the smoothed round trip time,
+   doubled on each retry. */
+#ifndef DHT_MAX_CHANNELS
+#define DHT_MAX_CHANNELS 64
+#endif
+
+#ifndef DHT_MAX_UNACKED
+#define DHT_MAX_UNACKED 256
+#endif
+
+#ifndef DHT_MAX_RETRANSMITS
+#define DHT_MAX_RETRANSMITS 8
+#endif
+
+#define DHT_RELIABLE_WINDOW 64
+#define CHANNEL_ID_SIZE 4
+#define RTO_INITIAL 1000
+#define RTO_MIN 200
+#define RTO_MAX 8000
+
+/* Storage is an open addressing table keyed by info hash, a slot with
+   maxpeers 0 is free. */
 struct storage {
     unsigned char id[20];
     int numpeers, maxpeers;
-    struct peer *peers;
-    struct storage *next;
+    struct peer peer;           /* inline, while maxpeers is 1 */
+    struct peer *peers;         /* allocated once maxpeers is above 1 */
 };
 
-static struct storage * find_storage(const unsigned char *id);
+static struct storage * find_storage(struct DhtNode *dht,
+                                     const unsigned char *id);
+static struct peer * storage_peers(struct storage *st);
 static void flush_search_node(struct search_node *n, struct search *sr);
+static void free_reassembly(struct reassembly *r);
+static long ms_since(struct DhtNode *dht, const struct timeval *tv);
 
-static int send_ping(const struct sockaddr *sa, int salen,
+static int send_ping(struct DhtNode *dht, const struct sockaddr *sa, int salen,
                      const unsigned char *tid, int tid_len);
-static int send_pong(const struct sockaddr *sa, int salen,
+static int send_pong(struct DhtNode *dht, const struct sockaddr *sa, int salen,
                      const unsigned char *tid, int tid_len);
-static int send_find_node(const struct sockaddr *sa, int salen,
-                          const unsigned char *tid, int tid_len,
+static int send_find_node(struct DhtNode *dht, const struct sockaddr *sa,
+                          int salen, const unsigned char *tid, int tid_len,
                           const unsigned char *target, int want, int confirm);
-static int send_nodes_peers(const struct sockaddr *sa, int salen,
-                            const unsigned char *tid, int tid_len,
+static int send_nodes_peers(struct DhtNode *dht, const struct sockaddr *sa,
+                            int salen, const unsigned char *tid, int tid_len,
                             const unsigned char *nodes, int nodes_len,
                             const unsigned char *nodes6, int nodes6_len,
                             int af, struct storage *st,
                             const unsigned char *token, int token_len);
-static int send_closest_nodes(const struct sockaddr *sa, int salen,
-                              const unsigned char *tid, int tid_len,
-                              const unsigned char *id, int want,
-                              int af, struct storage *st,
-                              const unsigned char *token, int token_len);
-static int send_get_peers(const struct sockaddr *sa, int salen,
-                          unsigned char *tid, int tid_len,
+static int send_closest_nodes(struct DhtNode *dht, const struct sockaddr *sa,
+                              int salen, const unsigned char *tid, int tid_len,
+                              const unsigned char *id, int want, int af,
+                              struct storage *st, const unsigned char *token,
+                              int token_len);
+static int send_get_peers(struct DhtNode *dht, const struct sockaddr *sa,
+                          int salen, unsigned char *tid, int tid_len,
                           unsigned char *infohash, int want, int confirm);
-static int send_announce_peer(const struct sockaddr *sa, int salen,
-                              unsigned char *tid, int tid_len,
+static int send_announce_peer(struct DhtNode *dht, const struct sockaddr *sa,
+                              int salen, unsigned char *tid, int tid_len,
                               unsigned char *infohas, unsigned short port,
                               unsigned char *token, int token_len, int confirm);
-static int send_peer_announced(const struct sockaddr *sa, int salen,
-                               unsigned char *tid, int tid_len);
-static int send_error(const struct sockaddr *sa, int salen,
-                      unsigned char *tid, int tid_len,
+static int send_peer_announced(struct DhtNode *dht, const struct sockaddr *sa,
+                               int salen, const unsigned char *tid,
+                               int tid_len);
+static int send_error(struct DhtNode *dht, const struct sockaddr *sa,
+                      int salen, const unsigned char *tid, int tid_len,
                       int code, const char *message);
+static int send_payload(struct DhtNode *dht, const char *query,
+                        const unsigned char *mid, const unsigned char *data,
+                        int len, struct channel *c, const struct sockaddr *sa,
+                        int salen);
+static struct channel * find_channel(struct DhtNode *dht,
+                                     const unsigned char *id, int create);
+static int reliable_receive(struct DhtNode *dht, const unsigned char *id,
+                            const struct sockaddr *from, int fromlen,
+                            const struct message_view *m);
+static void reliable_ack(struct DhtNode *dht, const unsigned char *id,
+                         const struct message_view *m);
+static void reliable_retransmit(struct DhtNode *dht);
+static int reliable_room(struct DhtNode *dht, const struct channel *c,
+                         int parts);
+static void track_unacked(struct DhtNode *dht, struct channel *c,
+                          unsigned int seq, const struct bencode *b,
+                          const struct sockaddr *sa, int salen);
+static void free_unacked(struct unacked *u);
 
 #define ERROR         0
 #define REPLY         1
@@ -321,22 +420,43 @@ static int send_error(const struct sockaddr *sa, int salen,
 #define ANNOUNCE_PEER 5
 #define MESSAGE       6
 #define BROADCAST     7
+#define ACK           8
 
 #define WANT4 1
 #define WANT6 2
 
+/* A string in a received message, points into the receive buffer. */
+struct bspan {
+    const unsigned char *p;
+    int len;
+};
+
+/* The fields of a received message we care about, filled by a single
+   pass of parse_message.  Ids point to 20 octets, zeroes if missing. */
+struct message_view {
+    struct bspan tid;
+    const unsigned char *id;
+    const unsigned char *info_hash;
+    const unsigned char *target;
+    unsigned short port;        /* 0 if missing or out of range */
+    struct bspan token;
+    struct bspan nodes;
+    struct bspan nodes6;
+    struct bspan values;        /* contents of the values list */
+    int want;                   /* -1 if missing */
+    struct bspan payload;       /* of message and broadcast */
+    struct bspan mid;
+    int part, parts;            /* parts 0 if not split, -1 if invalid */
+    struct bspan ch;
+    struct bspan sack;
+    long seq, ack;              /* -1 if missing */
+};
+
 static int parse_message(const unsigned char *buf, int buflen,
-                         unsigned char *tid_return, int *tid_len,
-                         unsigned char *id_return,
-                         unsigned char *info_hash_return,
-                         unsigned char *target_return,
-                         unsigned short *port_return,
-                         unsigned char *token_return, int *token_len,
-                         unsigned char *nodes_return, int *nodes_len,
-                         unsigned char *nodes6_return, int *nodes6_len,
-                         unsigned char *values_return, int *values_len,
-                         unsigned char *values6_return, int *values6_len,
-                         int *want_return);
+                         struct message_view *m);
+static void message_values(const struct message_view *m,
+                           unsigned char *values_return, int *values_len,
+                           unsigned char *values6_return, int *values6_len);
 
 static const unsigned char zeroes[20] = {0};
 static const unsigned char ones[20] = {
@@ -348,52 +468,120 @@ static const unsigned char v4prefix[16] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0
 };
 
-static int dht_socket = -1;
-static int dht_socket6 = -1;
+/* Searches are also indexed by target id and by tid, open addressing
+   with linear probing, at most half full. */
+#define SEARCH_INDEX_SIZE (2 * DHT_MAX_SEARCHES + 1)
+#define SEARCH_BY_ID 0
+#define SEARCH_BY_TID 1
 
-static time_t search_time;
-static time_t confirm_nodes_time;
-static time_t rotate_secrets_time;
+/* Partial message of a sender, a slot with type 0 is free. */
+struct reassembly {
+    unsigned char id[20];
+    unsigned char mid[MESSAGE_ID_SIZE];
+    int type;
+    int parts, received;
+    int length;                 /* known once the last part is in */
+    unsigned char have[(DHT_MAX_FRAGMENTS + 7) / 8];
+    time_t time;
+    unsigned char *data;        /* parts * DHT_FRAGMENT_SIZE */
+};
 
-static unsigned char myid[20];
-static int have_v = 0;
-static unsigned char my_v[9];
-static unsigned char secret[8];
-static unsigned char oldsecret[8];
+/* Seen broadcast ids, set associative with BROADCAST_SEEN_WAYS entries
+   per set, the oldest entry of a set is replaced. */
+#define BROADCAST_SEEN_WAYS 4
+struct broadcast_seen {
+    unsigned char mid[MESSAGE_ID_SIZE];
+    time_t time;                /* 0 for a free entry */
+};
 
-static struct bucket *buckets = NULL;
-static struct bucket *buckets6 = NULL;
-static struct storage *storage;
-static int numstorage;
+/* Both directions of reliable messaging with one node, a slot with time
+   0 is free.  The channel id is random, the receiver starts over when it
+   changes. */
+struct channel {
+    unsigned char id[20];
+    time_t time;                /* of last use */
+    unsigned char ch[CHANNEL_ID_SIZE];
+    unsigned int next_seq;
+    int unacked;
+    int srtt, rttvar, rto;      /* milliseconds, srtt 0 until sampled */
+    unsigned char recv_ch[CHANNEL_ID_SIZE];
+    unsigned int recv_next;
+    unsigned long long recv_mask;   /* bit i for recv_next + 1 + i */
+};
 
-static struct search *searches = NULL;
-static int numsearches;
-static unsigned short search_id;
+/* Copy of a sent datagram until it is acked, c is NULL for a free slot. */
+struct unacked {
+    struct channel *c;
+    unsigned int seq;
+    struct sockaddr_storage ss;
+    int sslen;
+    struct timeval sent;
+    int rto, retries;
+    int len;
+    unsigned char *buf;
+};
 
 /* The maximum number of nodes that we snub.  There is probably little
    reason to increase this value. */
 #ifndef DHT_MAX_BLACKLISTED
 #define DHT_MAX_BLACKLISTED 10
 #endif
-static struct sockaddr_storage blacklist[DHT_MAX_BLACKLISTED];
-int next_blacklisted;
-
-static struct timeval now;
-static time_t mybucket_grow_time, mybucket6_grow_time;
-static time_t expire_stuff_time;
 
 #define MAX_TOKEN_BUCKET_TOKENS 400
-static time_t token_bucket_time;
-static int token_bucket_tokens;
+
+/* All state of one node.  Nodes share nothing, so several of them can
+   live in one process, each driven from its own thread. */
+struct DhtNode {
+    int dht_socket;
+    int dht_socket6;
+
+    time_t search_time;
+    time_t confirm_nodes_time;
+    time_t rotate_secrets_time;
+
+    unsigned char myid[20];
+    int have_v;
+    unsigned char my_v[9];
+    unsigned char secret[8];
+    unsigned char oldsecret[8];
+
+    struct table *table;
+    struct table *table6;
+    struct storage *storage;
+    int storage_size;           /* slots, power of 2 */
+    int numstorage;
+
+    struct search *searches;
+    struct search *last_search;
+    int numsearches;
+    struct search *search_index[2][SEARCH_INDEX_SIZE];
+    unsigned short search_id;
+    int search_srtt, search_rttvar;   /* milliseconds, srtt 0 until sampled */
+
+    struct reassembly reassembly[DHT_MAX_REASSEMBLIES];
+    struct broadcast_seen broadcast_seen[DHT_BROADCAST_SEEN];
+    struct channel channels[DHT_MAX_CHANNELS];
+    struct unacked unacked[DHT_MAX_UNACKED];
+
+    struct sockaddr_storage blacklist[DHT_MAX_BLACKLISTED];
+    int next_blacklisted;
+
+    struct timeval now;
+    time_t mybucket_grow_time, mybucket6_grow_time;
+    time_t expire_stuff_time;
+
+    time_t token_bucket_time;
+    int token_bucket_tokens;
+};
 
 bool dht_debug = false;
+bool dht_reliable = false;
+int dht_search_alpha = DHT_SEARCH_ALPHA;
 
 #ifdef __GNUC__
     __attribute__ ((format (printf, 1, 2)))
 #endif
 
-char buf[1024];
-
 //*****************************************************************************
 //*****************************************************************************
 static void debugf(const char *format, ...)
@@ -403,6 +591,7 @@ static void debugf(const char *format, ...)
         return;
     }
 
+    char buf[1024];
     va_list args;
     va_start(args, format);
     vsnprintf(buf, 1024, format, args);
@@ -476,6 +665,19 @@ int id_cmp(const unsigned char *restrict id1, const unsigned char *restrict id2)
     return memcmp(id1, id2, 20);
 }
 
+//*****************************************************************************
+// FNV-1a over the whole id, for the storage and search tables
+//*****************************************************************************
+static unsigned int
+id_hash(const unsigned char *id)
+{
+    unsigned int h = 2166136261U;
+    int i;
+    for(i = 0; i < 20; i++)
+        h = (h ^ id[i]) * 16777619U;
+    return h;
+}
+
 //*****************************************************************************
 // Find the lowest 1 bit in an id
 //*****************************************************************************
@@ -547,71 +749,87 @@ xorcmp(const unsigned char *id1, const unsigned char *id2,
 }
 
 //*****************************************************************************
-// We keep buckets in a sorted linked list.  A bucket b ranges from
-// b->first inclusive up to b->next->first exclusive
+// Routing table of a family, bucket i holds the ids sharing exactly i
+// leading bits with myid.  The last bucket in use is ours and also holds
+// all longer prefixes, splitting it just opens the next index
+//*****************************************************************************
+static struct table *
+find_table(struct DhtNode *dht, int af)
+{
+    if(af == AF_INET)
+        return dht->table;
+    if(af == AF_INET6)
+        return dht->table6;
+    return NULL;
+}
+
+//*****************************************************************************
 //*****************************************************************************
 static int
-in_bucket(const unsigned char *id, struct bucket *b)
+in_bucket(struct DhtNode *dht, const unsigned char *id, struct bucket *b)
+{
+    struct table *t = find_table(dht, b->af);
+    int i = b - t->buckets;
+    int bits = common_bits(id, dht->myid);
+
+    return i == t->numbuckets - 1 ? bits >= i : bits == i;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static struct bucket *
+find_bucket(struct DhtNode *dht, unsigned const char *id, int af)
 {
-    return id_cmp(b->first, id) <= 0 &&
-        (b->next == NULL || id_cmp(id, b->next->first) < 0);
+    struct table *t = find_table(dht, af);
+
+    if(t == NULL)
+        return NULL;
+
+    return &t->buckets[MIN(common_bits(id, dht->myid), t->numbuckets - 1)];
 }
 
 //*****************************************************************************
+// Neighbour buckets are the ones with one bit more or less in common
 //*****************************************************************************
 static struct bucket *
-find_bucket(unsigned const char *id, int af)
+next_bucket(struct DhtNode *dht, struct bucket *b)
 {
-    struct bucket *b = af == AF_INET ? buckets : buckets6;
+    struct table *t = find_table(dht, b->af);
 
-    if(b == NULL)
+    if(b - t->buckets + 1 >= t->numbuckets)
         return NULL;
 
-    while(1) {
-        if(b->next == NULL)
-            return b;
-        if(id_cmp(id, b->next->first) < 0)
-            return b;
-        b = b->next;
-    }
+    return b + 1;
 }
 
 //*****************************************************************************
 //*****************************************************************************
 static struct bucket *
-previous_bucket(struct bucket *b)
+previous_bucket(struct DhtNode *dht, struct bucket *b)
 {
-    struct bucket *p = b->af == AF_INET ? buckets : buckets6;
+    struct table *t = find_table(dht, b->af);
 
-    if(b == p)
+    if(b == t->buckets)
         return NULL;
 
-    while(1) {
-        if(p->next == NULL)
-            return NULL;
-        if(p->next == b)
-            return p;
-        p = p->next;
-    }
+    return b - 1;
 }
 
 //*****************************************************************************
-// Every bucket contains an unordered list of nodes
+// Every bucket contains an unordered array of nodes
 //*****************************************************************************
 static struct node *
-find_node(const unsigned char *id, int af)
+find_node(struct DhtNode *dht, const unsigned char *id, int af)
 {
-    struct bucket *b = find_bucket(id, af);
-    struct node *n;
+    struct bucket *b = find_bucket(dht, id, af);
+    int i;
 
     if(b == NULL)
         return NULL;
 
-    n = b->nodes;
-    while(n) {
-        if(id_cmp(n->id, id) == 0)
-            return n;
-        n = n->next;
+    for(i = 0; i < b->count; i++) {
+        if(id_cmp(b->nodes[i].id, id) == 0)
+            return &b->nodes[i];
     }
     return NULL;
 }
@@ -622,49 +840,38 @@ find_node(const unsigned char *id, int af)
 static struct node *
 random_node(struct bucket *b)
 {
-    struct node *n;
-    int nn;
-
     if(b->count == 0)
         return NULL;
 
-    nn = random() % b->count;
-    n = b->nodes;
-    while(nn > 0 && n) {
-        n = n->next;
-        nn--;
-    }
-    return n;
+    return &b->nodes[random() % b->count];
 }
 
 //*****************************************************************************
-// Return the middle id of a bucket
+// Set the lowest id of a bucket, the prefix of myid with the last bit
+// flipped unless the bucket is ours
 //*****************************************************************************
-static int
-bucket_middle(struct bucket *b, unsigned char *id_return)
+static void
+bucket_first(struct DhtNode *dht, struct bucket *b, int bits, int mine)
 {
-    int bit1 = lowbit(b->first);
-    int bit2 = b->next ? lowbit(b->next->first) : -1;
-    int bit = MAX(bit1, bit2) + 1;
-
-    if(bit >= 160)
-        return -1;
+    memset(b->first, 0, 20);
+    memcpy(b->first, dht->myid, bits / 8);
+    if(bits >= 160)
+        return;
 
-    memcpy(id_return, b->first, 20);
-    id_return[bit / 8] |= (0x80 >> (bit % 8));
-    return 1;
+    b->first[bits / 8] = dht->myid[bits / 8] & (0xFF00 >> (bits % 8));
+    if(!mine && (dht->myid[bits / 8] & (0x80 >> (bits % 8))) == 0)
+        b->first[bits / 8] |= 0x80 >> (bits % 8);
 }
 
 //*****************************************************************************
 // Return a random id within a bucket
 //*****************************************************************************
 static int
-bucket_random(struct bucket *b, unsigned char *id_return)
+bucket_random(struct DhtNode *dht, struct bucket *b, unsigned char *id_return)
 {
-    int bit1 = lowbit(b->first);
-    int bit2 = b->next ? lowbit(b->next->first) : -1;
-    int bit = MAX(bit1, bit2) + 1;
-    int i;
+    struct table *t = find_table(dht, b->af);
+    int i = b - t->buckets;
+    int bit = i == t->numbuckets - 1 ? i : i + 1;
 
     if(bit >= 160) {
         memcpy(id_return, b->first, 20);
@@ -679,33 +886,16 @@ bucket_random(struct bucket *b, unsigned char *id_return)
     return 1;
 }
 
-//*****************************************************************************
-// Insert a new node into a bucket
-//*****************************************************************************
-static struct node *
-insert_node(struct node *node)
-{
-    struct bucket *b = find_bucket(node->id, node->ss.ss_family);
-
-    if(b == NULL)
-        return NULL;
-
-    node->next = b->nodes;
-    b->nodes = node;
-    b->count++;
-    return node;
-}
-
 //*****************************************************************************
 // This is our definition of a known-good node
 //*****************************************************************************
 static int
-node_good(struct node *node)
+node_good(struct DhtNode *dht, struct node *node)
 {
     return
         node->pinged <= 2 &&
-        node->reply_time >= now.tv_sec - 7200 &&
-        node->time >= now.tv_sec - 900;
+        node->reply_time >= dht->now.tv_sec - 7200 &&
+        node->time >= dht->now.tv_sec - 900;
 }
 
 //*****************************************************************************
@@ -739,7 +929,7 @@ tid_match(const unsigned char *tid, const char *prefix,
 // Every bucket caches the address of a likely node.  Ping it
 //*****************************************************************************
 static int
-send_cached_ping(struct bucket *b)
+send_cached_ping(struct DhtNode *dht, struct bucket *b)
 {
     unsigned char tid[4];
     int rc;
@@ -749,7 +939,7 @@ send_cached_ping(struct bucket *b)
 
     debugf("Sending ping to cached node.\n");
     make_tid(tid, "pn", 0);
-    rc = send_ping((struct sockaddr*)&b->cached, b->cachedlen, tid, 4);
+    rc = send_ping(dht, (struct sockaddr*)&b->cached, b->cachedlen, tid, 4);
     b->cached.ss_family = 0;
     b->cachedlen = 0;
     return rc;
@@ -760,12 +950,12 @@ send_cached_ping(struct bucket *b)
 // and, if that reaches 3, sends a ping to a new candidate
 //*****************************************************************************
 static void
-pinged(struct node *n, struct bucket *b)
+pinged(struct DhtNode *dht, struct node *n, struct bucket *b)
 {
     n->pinged++;
-    n->pinged_time = now.tv_sec;
+    n->pinged_time = dht->now.tv_sec;
     if(n->pinged >= 3)
-        send_cached_ping(b ? b : find_bucket(n->id, n->ss.ss_family));
+        send_cached_ping(dht, b ? b : find_bucket(dht, n->id, n->ss.ss_family));
 }
 
 //*****************************************************************************
@@ -773,7 +963,8 @@ pinged(struct node *n, struct bucket *b)
 // incorrect messages
 //*****************************************************************************
 static void
-blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
+blacklist_node(struct DhtNode *dht, const unsigned char *id,
+               const struct sockaddr *sa, int salen)
 {
     int i;
 
@@ -783,13 +974,13 @@ blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
         struct node *n;
         struct search *sr;
         /* Make the node easy to discard. */
-        n = find_node(id, sa->sa_family);
+        n = find_node(dht, id, sa->sa_family);
         if(n) {
             n->pinged = 3;
-            pinged(n, NULL);
+            pinged(dht, n, NULL);
         }
         /* Discard it from any searches in progress. */
-        sr = searches;
+        sr = dht->searches;
         while(sr) {
             for(i = 0; i < sr->numnodes; i++)
                 if(id_cmp(sr->nodes[i].id, id) == 0)
@@ -798,14 +989,14 @@ blacklist_node(const unsigned char *id, const struct sockaddr *sa, int salen)
         }
     }
     /* And make sure we don't hear from it again. */
-    memcpy(&blacklist[next_blacklisted], sa, salen);
-    next_blacklisted = (next_blacklisted + 1) % DHT_MAX_BLACKLISTED;
+    memcpy(&dht->blacklist[dht->next_blacklisted], sa, salen);
+    dht->next_blacklisted = (dht->next_blacklisted + 1) % DHT_MAX_BLACKLISTED;
 }
 
 //*****************************************************************************
 //*****************************************************************************
 static int
-node_blacklisted(const struct sockaddr *sa, int salen)
+node_blacklisted(struct DhtNode *dht, const struct sockaddr *sa, int salen)
 {
     int i;
 
@@ -816,7 +1007,7 @@ node_blacklisted(const struct sockaddr *sa, int salen)
         return 1;
 
     for(i = 0; i < DHT_MAX_BLACKLISTED; i++) {
-        if(memcmp(&blacklist[i], sa, salen) == 0)
+        if(memcmp(&dht->blacklist[i], sa, salen) == 0)
             return 1;
     }
 
@@ -824,42 +1015,39 @@ node_blacklisted(const struct sockaddr *sa, int salen)
 }
 
 //*****************************************************************************
-// Split a bucket into two equal parts
+// Split our bucket, nodes sharing one more bit with myid move to the
+// next index which becomes our bucket
 //*****************************************************************************
 static struct bucket *
-split_bucket(struct bucket *b)
+split_bucket(struct DhtNode *dht, struct bucket *b)
 {
+    struct table *t = find_table(dht, b->af);
     struct bucket *newb;
-    struct node *nodes;
-    int rc;
-    unsigned char new_id[20];
+    int i = b - t->buckets, j;
 
-    rc = bucket_middle(b, new_id);
-    if(rc < 0)
+    if(i != t->numbuckets - 1 || t->numbuckets >= DHT_MAX_BUCKETS)
         return NULL;
 
-    newb = static_cast<struct bucket *>(calloc(1, sizeof(struct bucket)));
-    if(newb == NULL)
-        return NULL;
+    send_cached_ping(dht, b);
 
+    newb = b + 1;
+    memset(newb, 0, sizeof(struct bucket));
     newb->af = b->af;
-
-    send_cached_ping(b);
-
-    memcpy(newb->first, new_id, 20);
     newb->time = b->time;
+    bucket_first(dht, b, i, 0);
+    bucket_first(dht, newb, i + 1, 1);
 
-    nodes = b->nodes;
-    b->nodes = NULL;
-    b->count = 0;
-    newb->next = b->next;
-    b->next = newb;
-    while(nodes) {
-        struct node *n;
-        n = nodes;
-        nodes = nodes->next;
-        insert_node(n);
+    j = 0;
+    while(j < b->count) {
+        if(common_bits(b->nodes[j].id, dht->myid) > i) {
+            newb->nodes[newb->count++] = b->nodes[j];
+            b->nodes[j] = b->nodes[--b->count];
+        } else {
+            j++;
+        }
     }
+
+    t->numbuckets++;
     return b;
 }
 
@@ -868,93 +1056,90 @@ split_bucket(struct bucket *b)
 // the node sent a message, 2 if it sent us a reply
 //*****************************************************************************
 static struct node *
-new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
-         int confirm)
+new_node(struct DhtNode *dht, const unsigned char *id,
+         const struct sockaddr *sa, int salen, int confirm)
 {
-    struct bucket *b = find_bucket(id, sa->sa_family);
+    struct bucket *b = find_bucket(dht, id, sa->sa_family);
     struct node *n;
-    int mybucket, split;
+    int mybucket, split, i;
 
     if(b == NULL)
         return NULL;
 
-    if(id_cmp(id, myid) == 0)
+    if(id_cmp(id, dht->myid) == 0)
         return NULL;
 
-    if(is_martian(sa) || node_blacklisted(sa, salen))
+    if(is_martian(sa) || node_blacklisted(dht, sa, salen))
         return NULL;
 
-    mybucket = in_bucket(myid, b);
+    mybucket = in_bucket(dht, dht->myid, b);
 
     if(confirm == 2)
-        b->time = now.tv_sec;
+        b->time = dht->now.tv_sec;
 
-    n = b->nodes;
-    while(n) {
+    for(i = 0; i < b->count; i++) {
+        n = &b->nodes[i];
         if(id_cmp(n->id, id) == 0) {
-            if(confirm || n->time < now.tv_sec - 15 * 60) {
+            if(confirm || n->time < dht->now.tv_sec - 15 * 60) {
                 /* Known node.  Update stuff. */
                 memcpy((struct sockaddr*)&n->ss, sa, salen);
                 if(confirm)
-                    n->time = now.tv_sec;
+                    n->time = dht->now.tv_sec;
                 if(confirm >= 2) {
-                    n->reply_time = now.tv_sec;
+                    n->reply_time = dht->now.tv_sec;
                     n->pinged = 0;
                     n->pinged_time = 0;
                 }
             }
             return n;
         }
-        n = n->next;
     }
 
     /* New node. */
 
     if(mybucket) {
         if(sa->sa_family == AF_INET)
-            mybucket_grow_time = now.tv_sec;
+            dht->mybucket_grow_time = dht->now.tv_sec;
         else
-            mybucket6_grow_time = now.tv_sec;
+            dht->mybucket6_grow_time = dht->now.tv_sec;
     }
 
     /* First, try to get rid of a known-bad node. */
-    n = b->nodes;
-    while(n) {
-        if(n->pinged >= 3 && n->pinged_time < now.tv_sec - 15) {
+    for(i = 0; i < b->count; i++) {
+        n = &b->nodes[i];
+        if(n->pinged >= 3 && n->pinged_time < dht->now.tv_sec - 15) {
             memcpy(n->id, id, 20);
             memcpy((struct sockaddr*)&n->ss, sa, salen);
-            n->time = confirm ? now.tv_sec : 0;
-            n->reply_time = confirm >= 2 ? now.tv_sec : 0;
+            n->time = confirm ? dht->now.tv_sec : 0;
+            n->reply_time = confirm >= 2 ? dht->now.tv_sec : 0;
             n->pinged_time = 0;
             n->pinged = 0;
             return n;
         }
-        n = n->next;
     }
 
-    if(b->count >= 8) {
+    if(b->count >= DHT_BUCKET_NODES) {
         /* Bucket full.  Ping a dubious node */
         int dubious = 0;
-        n = b->nodes;
-        while(n) {
+        for(i = 0; i < b->count; i++) {
+            n = &b->nodes[i];
             /* Pick the first dubious node that we haven't pinged in the
                last 15 seconds.  This gives nodes the time to reply, but
                tends to concentrate on the same nodes, so that we get rid
                of bad nodes fast. */
-            if(!node_good(n)) {
+            if(!node_good(dht, n)) {
                 dubious = 1;
-                if(n->pinged_time < now.tv_sec - 15) {
+                if(n->pinged_time < dht->now.tv_sec - 15) {
                     unsigned char tid[4];
                     debugf("Sending ping to dubious node.\n");
                     make_tid(tid, "pn", 0);
-                    send_ping((struct sockaddr*)&n->ss, n->sslen,
+                    send_ping(dht, (struct sockaddr*)&n->ss, n->sslen,
                               tid, 4);
                     n->pinged++;
-                    n->pinged_time = now.tv_sec;
+                    n->pinged_time = dht->now.tv_sec;
                     break;
                 }
             }
-            n = n->next;
         }
 
         split = 0;
@@ -963,16 +1148,13 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
                 split = 1;
             /* If there's only one bucket, split eagerly.  This is
                incorrect unless there's more than 8 nodes in the DHT. */
-            else if(b->af == AF_INET && buckets->next == NULL)
-                split = 1;
-            else if(b->af == AF_INET6 && buckets6->next == NULL)
+            else if(find_table(dht, b->af)->numbuckets == 1)
                 split = 1;
         }
 
-        if(split) {
+        if(split && split_bucket(dht, b)) {
             debugf("Splitting.\n");
-            b = split_bucket(b);
-            return new_node(id, sa, salen, confirm);
+            return new_node(dht, id, sa, salen, confirm);
         }
 
         /* No space for this node.  Cache it away for later. */
@@ -985,17 +1167,13 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
     }
 
     /* Create a new node. */
-    n = static_cast<struct node *>(calloc(1, sizeof(struct node)));
-    if(n == NULL)
-        return NULL;
+    n = &b->nodes[b->count++];
+    memset(n, 0, sizeof(struct node));
     memcpy(n->id, id, 20);
     memcpy(&n->ss, sa, salen);
     n->sslen = salen;
-    n->time = confirm ? now.tv_sec : 0;
-    n->reply_time = confirm >= 2 ? now.tv_sec : 0;
-    n->next = b->nodes;
-    b->nodes = n;
-    b->count++;
+    n->time = confirm ? dht->now.tv_sec : 0;
+    n->reply_time = confirm >= 2 ? dht->now.tv_sec : 0;
     return n;
 }
 
@@ -1005,38 +1183,28 @@ new_node(const unsigned char *id, const struct sockaddr *sa, int salen,
 // recover as soon as we find better ones
 //*****************************************************************************
 static int
-expire_buckets(struct bucket *b)
+expire_buckets(struct DhtNode *dht, struct table *t)
 {
-    while(b) {
-        struct node *n, *p;
-        int changed = 0;
+    int i, j;
 
-        while(b->nodes && b->nodes->pinged >= 4) {
-            n = b->nodes;
-            b->nodes = n->next;
-            b->count--;
-            changed = 1;
-            free(n);
-        }
+    for(i = 0; t != NULL && i < t->numbuckets; i++) {
+        struct bucket *b = &t->buckets[i];
+        int changed = 0;
 
-        p = b->nodes;
-        while(p) {
-            while(p->next && p->next->pinged >= 4) {
-                n = p->next;
-                p->next = n->next;
-                b->count--;
+        j = 0;
+        while(j < b->count) {
+            if(b->nodes[j].pinged >= 4) {
+                b->nodes[j] = b->nodes[--b->count];
                 changed = 1;
-                free(n);
+            } else {
+                j++;
             }
-            p = p->next;
         }
 
         if(changed)
-            send_cached_ping(b);
-
-        b = b->next;
+            send_cached_ping(dht, b);
     }
-    expire_stuff_time = now.tv_sec + 120 + random() % 240;
+    dht->expire_stuff_time = dht->now.tv_sec + 120 + random() % 240;
     return 1;
 }
 
@@ -1046,28 +1214,203 @@ expire_buckets(struct bucket *b)
 // a unique transaction id, a short (and hence small enough to fit in the
 // transaction id of the protocol packets)
 //*****************************************************************************
+static unsigned int
+tid_hash(unsigned short tid, int af)
+{
+    return (tid * 40503U + af) % SEARCH_INDEX_SIZE;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static unsigned int
+search_hash(const struct search *sr, int by)
+{
+    if(by == SEARCH_BY_TID)
+        return tid_hash(sr->tid, sr->af);
+    return (id_hash(sr->id) + sr->af) % SEARCH_INDEX_SIZE;
+}
+
+//*****************************************************************************
+//*****************************************************************************
 static struct search *
-find_search(unsigned short tid, int af)
+find_search(struct DhtNode *dht, unsigned short tid, int af)
 {
-    struct search *sr = searches;
-    while(sr) {
-        if(sr->tid == tid && sr->af == af)
-            return sr;
-        sr = sr->next;
+    struct search **index = dht->search_index[SEARCH_BY_TID];
+    unsigned int i = tid_hash(tid, af);
+
+    while(index[i]) {
+        if(index[i]->tid == tid && index[i]->af == af)
+            return index[i];
+        i = (i + 1) % SEARCH_INDEX_SIZE;
+    }
+    return NULL;
+}
+
+//*****************************************************************************
+// A search for a given target, there is at most one per family
+//*****************************************************************************
+static struct search *
+find_search_id(struct DhtNode *dht, const unsigned char *id, int af)
+{
+    struct search **index = dht->search_index[SEARCH_BY_ID];
+    unsigned int i = (id_hash(id) + af) % SEARCH_INDEX_SIZE;
+
+    while(index[i]) {
+        if(index[i]->af == af && id_cmp(index[i]->id, id) == 0)
+            return index[i];
+        i = (i + 1) % SEARCH_INDEX_SIZE;
     }
     return NULL;
 }
 
+//*****************************************************************************
+//*****************************************************************************
+static void
+index_search(struct DhtNode *dht, struct search *sr)
+{
+    int by;
+    for(by = SEARCH_BY_ID; by <= SEARCH_BY_TID; by++) {
+        struct search **index = dht->search_index[by];
+        unsigned int i = search_hash(sr, by);
+        while(index[i])
+            i = (i + 1) % SEARCH_INDEX_SIZE;
+        index[i] = sr;
+    }
+}
+
+//*****************************************************************************
+// Backward shift deletion, see storage_remove
+//*****************************************************************************
+static void
+unindex_search(struct DhtNode *dht, struct search *sr)
+{
+    int by;
+    for(by = SEARCH_BY_ID; by <= SEARCH_BY_TID; by++) {
+        struct search **index = dht->search_index[by];
+        unsigned int i = search_hash(sr, by), j;
+
+        while(index[i] && index[i] != sr)
+            i = (i + 1) % SEARCH_INDEX_SIZE;
+        if(index[i] == NULL)
+            continue;
+
+        j = i;
+        while(1) {
+            unsigned int home;
+            j = (j + 1) % SEARCH_INDEX_SIZE;
+            if(index[j] == NULL)
+                break;
+            home = search_hash(index[j], by);
+            if((j + SEARCH_INDEX_SIZE - home) % SEARCH_INDEX_SIZE >=
+               (j + SEARCH_INDEX_SIZE - i) % SEARCH_INDEX_SIZE) {
+                index[i] = index[j];
+                i = j;
+            }
+        }
+        index[i] = NULL;
+    }
+}
+
+//*****************************************************************************
+// The search list is kept by increasing step_time, so the oldest
+// searches are found at its head
+//*****************************************************************************
+static void
+unlink_search(struct DhtNode *dht, struct search *sr)
+{
+    if(sr->prev)
+        sr->prev->next = sr->next;
+    else
+        dht->searches = sr->next;
+    if(sr->next)
+        sr->next->prev = sr->prev;
+    else
+        dht->last_search = sr->prev;
+    sr->next = sr->prev = NULL;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static void
+link_search(struct DhtNode *dht, struct search *sr, int tail)
+{
+    if(tail) {
+        sr->prev = dht->last_search;
+        sr->next = NULL;
+        if(dht->last_search)
+            dht->last_search->next = sr;
+        else
+            dht->searches = sr;
+        dht->last_search = sr;
+    } else {
+        sr->prev = NULL;
+        sr->next = dht->searches;
+        if(dht->searches)
+            dht->searches->prev = sr;
+        else
+            dht->last_search = sr;
+        dht->searches = sr;
+    }
+}
+
+//*****************************************************************************
+// Smoothed round trip time of get_peers over all lookups, as in RFC 6298
+//*****************************************************************************
+static void
+search_rtt_sample(struct DhtNode *dht, long rtt)
+{
+    if(dht->search_srtt == 0) {
+        dht->search_srtt = MAX(rtt, 1);
+        dht->search_rttvar = rtt / 2;
+    } else {
+        long delta = dht->search_srtt > rtt ? dht->search_srtt - rtt : rtt - dht->search_srtt;
+        dht->search_rttvar = (3 * dht->search_rttvar + delta) / 4;
+        dht->search_srtt = MAX((7 * dht->search_srtt + rtt) / 8, 1);
+    }
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static long
+search_timeout(struct DhtNode *dht)
+{
+    if(dht->search_srtt == 0)
+        return SEARCH_TIMEOUT_INITIAL;
+    return MIN(MAX(dht->search_srtt + 4 * dht->search_rttvar, SEARCH_TIMEOUT_MIN),
+               SEARCH_TIMEOUT_MAX);
+}
+
+//*****************************************************************************
+// Whether a get_peers to n is still expected to be answered
+//*****************************************************************************
+static int
+search_node_waiting(struct DhtNode *dht, const struct search_node *n)
+{
+    return n->pinged > 0 && !n->replied &&
+        ms_since(dht, &n->request_tv) < search_timeout(dht);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static void
+touch_search(struct DhtNode *dht, struct search *sr)
+{
+    sr->step_time = dht->now.tv_sec;
+    if(sr != dht->last_search) {
+        unlink_search(dht, sr);
+        link_search(dht, sr, 1);
+    }
+}
+
 //*****************************************************************************
 // A search contains a list of nodes, sorted by decreasing distance to the
 // target.  We just got a new candidate, insert it at the right spot or
 // discard it
 //*****************************************************************************
 static int
-insert_search_node(unsigned char *id,
-                   const struct sockaddr *sa, int salen,
-                   struct search *sr, int replied,
-                   unsigned char *token, int token_len)
+insert_search_node(struct DhtNode *dht, const unsigned char *id,
+                   const struct sockaddr *sa, int salen, struct search *sr,
+                   int replied, const unsigned char *token, int token_len)
 {
     struct search_node *n;
     int i, j;
@@ -1106,8 +1449,11 @@ found:
     n->sslen = salen;
 
     if(replied) {
+        /* Only requests sent once give a clean round trip time. */
+        if(n->pinged == 1 && !n->replied)
+            search_rtt_sample(dht, ms_since(dht, &n->request_tv));
         n->replied = 1;
-        n->reply_time = now.tv_sec;
+        n->reply_time = dht->now.tv_sec;
         n->request_time = 0;
         n->pinged = 0;
     }
@@ -1137,23 +1483,15 @@ flush_search_node(struct search_node *n, struct search *sr)
 //*****************************************************************************
 //*****************************************************************************
 static void
-expire_searches(void)
+expire_searches(struct DhtNode *dht)
 {
-    struct search *sr = searches, *previous = NULL;
-
-    while(sr) {
-        struct search *next = sr->next;
-        if(sr->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME) {
-            if(previous)
-                previous->next = next;
-            else
-                searches = next;
-            free(sr);
-            numsearches--;
-        } else {
-            previous = sr;
-        }
-        sr = next;
+    while(dht->searches &&
+          dht->searches->step_time < dht->now.tv_sec - DHT_SEARCH_EXPIRE_TIME) {
+        struct search *sr = dht->searches;
+        unindex_search(dht, sr);
+        unlink_search(dht, sr);
+        free(sr);
+        dht->numsearches--;
     }
 }
 
@@ -1161,7 +1499,8 @@ expire_searches(void)
 // This must always return 0 or 1, never -1, not even on failure (see below)
 //*****************************************************************************
 static int
-search_send_get_peers(struct search *sr, struct search_node *n)
+search_send_get_peers(struct DhtNode *dht, struct search *sr,
+                      struct search_node *n)
 {
     struct node *node;
     unsigned char tid[4];
@@ -1170,52 +1509,87 @@ search_send_get_peers(struct search *sr, struct search_node *n)
         int i;
         for(i = 0; i < sr->numnodes; i++) {
             if(sr->nodes[i].pinged < 3 && !sr->nodes[i].replied &&
-               sr->nodes[i].request_time < now.tv_sec - 15)
+               !search_node_waiting(dht, &sr->nodes[i])) {
                 n = &sr->nodes[i];
+                break;
+            }
         }
     }
 
-    if(!n || n->pinged >= 3 || n->replied ||
-       n->request_time >= now.tv_sec - 15)
+    if(!n || n->pinged >= 3 || n->replied || search_node_waiting(dht, n))
         return 0;
 
     debugf("Sending get_peers.\n");
     make_tid(tid, "gp", sr->tid);
-    send_get_peers((struct sockaddr*)&n->ss, n->sslen, tid, 4, sr->id, -1,
-                   n->reply_time >= now.tv_sec - 15);
+    send_get_peers(dht, (struct sockaddr*)&n->ss, n->sslen, tid, 4, sr->id, -1,
+                   n->reply_time >= dht->now.tv_sec - 15);
     n->pinged++;
-    n->request_time = now.tv_sec;
+    n->request_time = dht->now.tv_sec;
+    n->request_tv = dht->now;
     /* If the node happens to be in our main routing table, mark it
        as pinged. */
-    node = find_node(n->id, n->ss.ss_family);
-    if(node) pinged(node, NULL);
+    node = find_node(dht, n->id, n->ss.ss_family);
+    if(node) pinged(dht, node, NULL);
     return 1;
 }
 
 //*****************************************************************************
-// When a search is in progress, we periodically call search_step to send
-// further requests
+// Send get_peers to the closest nodes, until alpha requests are in flight.
+// Nodes not asked yet go before the ones that timed out.  Returns the
+// number of requests sent
 //*****************************************************************************
-static void
-search_step(struct search *sr, dht_callback *callback, void *closure)
+static int
+search_fill(struct DhtNode *dht, struct search *sr)
 {
-    int i, j;
-    int all_done = 1;
+    int i, retry, inflight = 0, sent = 0;
+    int alpha = MAX(dht_search_alpha, 1);
+
+    for(i = 0; i < sr->numnodes; i++) {
+        if(search_node_waiting(dht, &sr->nodes[i]))
+            inflight++;
+    }
+
+    for(retry = 0; retry < 2; retry++) {
+        for(i = 0; i < sr->numnodes && inflight + sent < alpha; i++) {
+            if(!retry && sr->nodes[i].pinged > 0)
+                continue;
+            sent += search_send_get_peers(dht, sr, &sr->nodes[i]);
+        }
+    }
+
+    return sent;
+}
+
+//*****************************************************************************
+// Whether the first 8 live nodes have replied
+//*****************************************************************************
+static int
+search_replied(const struct search *sr)
+{
+    int i, j = 0;
 
-    /* Check if the first 8 live nodes have replied. */
-    j = 0;
     for(i = 0; i < sr->numnodes && j < 8; i++) {
-        struct search_node *n = &sr->nodes[i];
+        const struct search_node *n = &sr->nodes[i];
         if(n->pinged >= 3)
             continue;
-        if(!n->replied) {
-            all_done = 0;
-            break;
-        }
+        if(!n->replied)
+            return 0;
         j++;
     }
+    return 1;
+}
+
+//*****************************************************************************
+// When a search is in progress, we periodically call search_step to send
+// further requests
+//*****************************************************************************
+static void
+search_step(struct DhtNode *dht, struct search *sr, dht_callback *callback,
+            void *closure)
+{
+    int i, j;
 
-    if(all_done) {
+    if(search_replied(sr)) {
         if(sr->port == 0) {
             goto done;
         } else {
@@ -1233,39 +1607,35 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
                    a positive reply is just as good --, let's deal with it. */
                 if(n->token_len == 0)
                     n->acked = 1;
-                if(!n->acked) {
+                /* Replies may step the search early, do not repeat an
+                   announce sooner than the periodic step would. */
+                if(!n->acked && n->request_time > dht->now.tv_sec - 5) {
+                    all_acked = 0;
+                } else if(!n->acked) {
                     all_acked = 0;
                     debugf("Sending announce_peer.\n");
                     make_tid(tid, "ap", sr->tid);
-                    send_announce_peer((struct sockaddr*)&n->ss,
+                    send_announce_peer(dht, (struct sockaddr*)&n->ss,
                                        sizeof(struct sockaddr_storage),
                                        tid, 4, sr->id, sr->port,
                                        n->token, n->token_len,
-                                       n->reply_time >= now.tv_sec - 15);
+                                       n->reply_time >= dht->now.tv_sec - 15);
                     n->pinged++;
-                    n->request_time = now.tv_sec;
-                    node = find_node(n->id, n->ss.ss_family);
-                    if(node) pinged(node, NULL);
+                    n->request_time = dht->now.tv_sec;
+                    node = find_node(dht, n->id, n->ss.ss_family);
+                    if(node) pinged(dht, node, NULL);
                 }
                 j++;
             }
             if(all_acked)
                 goto done;
         }
-        sr->step_time = now.tv_sec;
+        touch_search(dht, sr);
         return;
     }
 
-    if(sr->step_time + 15 >= now.tv_sec)
-        return;
-
-    j = 0;
-    for(i = 0; i < sr->numnodes; i++) {
-        j += search_send_get_peers(sr, &sr->nodes[i]);
-        if(j >= 3)
-            break;
-    }
-    sr->step_time = now.tv_sec;
+    search_fill(dht, sr);
+    touch_search(dht, sr);
     return;
 
  done:
@@ -1275,41 +1645,49 @@ search_step(struct search *sr, dht_callback *callback, void *closure)
                     sr->af == AF_INET ?
                     DHT_EVENT_SEARCH_DONE : DHT_EVENT_SEARCH_DONE6,
                     sr->id, NULL, 0);
-    sr->step_time = now.tv_sec;
+    touch_search(dht, sr);
 }
 
 //*****************************************************************************
 //*****************************************************************************
 static struct search *
-new_search(void)
+new_search(struct DhtNode *dht)
 {
     struct search *sr, *oldest = NULL;
 
-    /* Find the oldest done search */
-    sr = searches;
+    /* Find the oldest done search, the list is in step_time order */
+    sr = dht->searches;
     while(sr) {
-        if(sr->done &&
-           (oldest == NULL || oldest->step_time > sr->step_time))
+        if(sr->done) {
             oldest = sr;
+            break;
+        }
         sr = sr->next;
     }
 
     /* The oldest slot is expired. */
-    if(oldest && oldest->step_time < now.tv_sec - DHT_SEARCH_EXPIRE_TIME)
-        return oldest;
+    if(oldest && oldest->step_time < dht->now.tv_sec - DHT_SEARCH_EXPIRE_TIME)
+        goto reuse;
 
     /* Allocate a new slot. */
-    if(numsearches < DHT_MAX_SEARCHES) {
+    if(dht->numsearches < DHT_MAX_SEARCHES) {
         sr = static_cast<struct search *>(calloc(1, sizeof(struct search)));
         if(sr != NULL) {
-            sr->next = searches;
-            searches = sr;
-            numsearches++;
+            link_search(dht, sr, 0);
+            dht->numsearches++;
             return sr;
         }
     }
 
     /* Oh, well, never mind.  Reuse the oldest slot. */
+    if(oldest == NULL)
+        return NULL;
+
+ reuse:
+    /* The caller sets a new target and tid, and a zero step_time. */
+    unindex_search(dht, oldest);
+    unlink_search(dht, oldest);
+    link_search(dht, oldest, 0);
     return oldest;
 }
 
@@ -1317,14 +1695,13 @@ new_search(void)
 // Insert the contents of a bucket into a search structure
 //*****************************************************************************
 static void
-insert_search_bucket(struct bucket *b, struct search *sr)
+insert_search_bucket(struct DhtNode *dht, struct bucket *b, struct search *sr)
 {
-    struct node *n;
-    n = b->nodes;
-    while(n) {
-        insert_search_node(n->id, (struct sockaddr*)&n->ss, n->sslen,
+    int i;
+    for(i = 0; i < b->count; i++) {
+        struct node *n = &b->nodes[i];
+        insert_search_node(dht, n->id, (struct sockaddr*)&n->ss, n->sslen,
                            sr, 0, NULL, 0);
-        n = n->next;
     }
 }
 
@@ -1333,12 +1710,12 @@ insert_search_bucket(struct bucket *b, struct search *sr)
 // search is complete
 //*****************************************************************************
 int
-dht_search(const unsigned char *id, int port, int af,
+dht_search(struct DhtNode *dht, const unsigned char *id, int port, int af,
            dht_callback *callback, void *closure)
 {
     struct search *sr;
     struct storage *st;
-    struct bucket *b = find_bucket(id, af);
+    struct bucket *b = find_bucket(dht, id, af);
 
     if(b == NULL) {
         errno = EAFNOSUPPORT;
@@ -1350,23 +1727,24 @@ dht_search(const unsigned char *id, int port, int af,
        this code in private DHTs with very few nodes.  What's wrong
        with flooding? */
     if(callback) {
-        st = find_storage(id);
+        st = find_storage(dht, id);
         if(st) {
             unsigned short swapped;
             unsigned char buf[18];
+            struct peer *peers = storage_peers(st);
             int i;
 
             debugf("Found local data (%d peers).\n", st->numpeers);
 
             for(i = 0; i < st->numpeers; i++) {
-                swapped = htons(st->peers[i].port);
-                if(st->peers[i].len == 4) {
-                    memcpy(buf, st->peers[i].ip, 4);
+                swapped = htons(peers[i].port);
+                if(peers[i].len == 4) {
+                    memcpy(buf, peers[i].ip, 4);
                     memcpy(buf + 4, &swapped, 2);
                     (*callback)(closure, DHT_EVENT_VALUES, id,
                                 (void*)buf, 6);
-                } else if(st->peers[i].len == 16) {
-                    memcpy(buf, st->peers[i].ip, 16);
+                } else if(peers[i].len == 16) {
+                    memcpy(buf, peers[i].ip, 16);
                     memcpy(buf + 16, &swapped, 2);
                     (*callback)(closure, DHT_EVENT_VALUES6, id,
                                 (void*)buf, 18);
@@ -1375,12 +1753,7 @@ dht_search(const unsigned char *id, int port, int af,
         }
     }
 
-    sr = searches;
-    while(sr) {
-        if(sr->af == af && id_cmp(sr->id, id) == 0)
-            break;
-        sr = sr->next;
-    }
+    sr = find_search_id(dht, id, af);
 
     if(sr) {
         /* We're reusing data from an old search.  Reusing the same tid
@@ -1392,7 +1765,7 @@ dht_search(const unsigned char *id, int port, int af,
             struct search_node *n;
             n = &sr->nodes[i];
             /* Discard any doubtful nodes. */
-            if(n->pinged >= 3 || n->reply_time < now.tv_sec - 7200) {
+            if(n->pinged >= 3 || n->reply_time < dht->now.tv_sec - 7200) {
                 flush_search_node(n, sr);
                 goto again;
             }
@@ -1402,35 +1775,36 @@ dht_search(const unsigned char *id, int port, int af,
             n->acked = 0;
         }
     } else {
-        sr = new_search();
+        sr = new_search(dht);
         if(sr == NULL) {
             errno = ENOSPC;
             return -1;
         }
         sr->af = af;
-        sr->tid = search_id++;
+        sr->tid = dht->search_id++;
         sr->step_time = 0;
         memcpy(sr->id, id, 20);
         sr->done = 0;
         sr->numnodes = 0;
+        index_search(dht, sr);
     }
 
     sr->port = port;
 
-    insert_search_bucket(b, sr);
+    insert_search_bucket(dht, b, sr);
 
     if(sr->numnodes < SEARCH_NODES) {
-        struct bucket *p = previous_bucket(b);
-        if(b->next)
-            insert_search_bucket(b->next, sr);
+        struct bucket *p = previous_bucket(dht, b);
+        if(next_bucket(dht, b))
+            insert_search_bucket(dht, next_bucket(dht, b), sr);
         if(p)
-            insert_search_bucket(p, sr);
+            insert_search_bucket(dht, p, sr);
     }
     if(sr->numnodes < SEARCH_NODES)
-        insert_search_bucket(find_bucket(myid, af), sr);
+        insert_search_bucket(dht, find_bucket(dht, dht->myid, af), sr);
 
-    search_step(sr, callback, closure);
-    search_time = now.tv_sec;
+    search_step(dht, sr, callback, closure);
+    dht->search_time = dht->now.tv_sec;
     return 1;
 }
 
@@ -1438,27 +1812,102 @@ dht_search(const unsigned char *id, int port, int af,
 // A struct storage stores all the stored peer addresses for a given info
 // hash
 //*****************************************************************************
+static struct peer *
+storage_peers(struct storage *st)
+{
+    return st->maxpeers > 1 ? st->peers : &st->peer;
+}
+
+//*****************************************************************************
+// Slot holding id, or the free slot ending its probe sequence
+//*****************************************************************************
+static int
+storage_slot(struct DhtNode *dht, const unsigned char *id)
+{
+    int i = id_hash(id) & (dht->storage_size - 1);
+
+    while(dht->storage[i].maxpeers != 0 && id_cmp(dht->storage[i].id, id) != 0)
+        i = (i + 1) & (dht->storage_size - 1);
+    return i;
+}
+
+//*****************************************************************************
+//*****************************************************************************
 static struct storage *
-find_storage(const unsigned char *id)
+find_storage(struct DhtNode *dht, const unsigned char *id)
+{
+    struct storage *st;
+
+    if(dht->storage == NULL)
+        return NULL;
+
+    st = &dht->storage[storage_slot(dht, id)];
+    return st->maxpeers != 0 ? st : NULL;
+}
+
+//*****************************************************************************
+// Double the table, entries are rehashed into the new slots
+//*****************************************************************************
+static int
+storage_grow(struct DhtNode *dht)
+{
+    struct storage *old = dht->storage;
+    int oldsize = dht->storage_size, i;
+    int size = oldsize == 0 ? 64 : 2 * oldsize;
+
+    dht->storage = static_cast<struct storage *>(calloc(size, sizeof(struct storage)));
+    if(dht->storage == NULL) {
+        dht->storage = old;
+        return -1;
+    }
+    dht->storage_size = size;
+
+    for(i = 0; i < oldsize; i++) {
+        if(old[i].maxpeers != 0)
+            dht->storage[storage_slot(dht, old[i].id)] = old[i];
+    }
+    free(old);
+    return 1;
+}
+
+//*****************************************************************************
+// Backward shift deletion, following entries of the probe sequence are
+// moved back into the hole when their home slot allows it
+//*****************************************************************************
+static void
+storage_remove(struct DhtNode *dht, struct storage *st)
 {
-    struct storage *st = storage;
+    int mask = dht->storage_size - 1;
+    int i = st - dht->storage, j = i;
+
+    if(st->maxpeers > 1)
+        free(st->peers);
 
-    while(st) {
-        if(id_cmp(id, st->id) == 0)
+    while(1) {
+        int home;
+        j = (j + 1) & mask;
+        if(dht->storage[j].maxpeers == 0)
             break;
-        st = st->next;
+        home = id_hash(dht->storage[j].id) & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+            dht->storage[i] = dht->storage[j];
+            i = j;
+        }
     }
-    return st;
+
+    memset(&dht->storage[i], 0, sizeof(struct storage));
+    dht->numstorage--;
 }
 
 //*****************************************************************************
 //*****************************************************************************
 static int
-storage_store(const unsigned char *id,
+storage_store(struct DhtNode *dht, const unsigned char *id,
               const struct sockaddr *sa, unsigned short port)
 {
     int i, len;
     struct storage *st;
+    struct peer *peers;
     unsigned char *ip;
 
     if(sa->sa_family == AF_INET) {
@@ -1473,28 +1922,30 @@ storage_store(const unsigned char *id,
         return -1;
     }
 
-    st = find_storage(id);
+    st = find_storage(dht, id);
 
     if(st == NULL) {
-        if(numstorage >= DHT_MAX_HASHES)
+        if(dht->numstorage >= DHT_MAX_HASHES)
+            return -1;
+        /* Keep the load under one half. */
+        if(2 * (dht->numstorage + 1) > dht->storage_size && storage_grow(dht) < 0)
             return -1;
-        st = static_cast<struct storage *>(calloc(1, sizeof(struct storage)));
-        if(st == NULL) return -1;
+        st = &dht->storage[storage_slot(dht, id)];
         memcpy(st->id, id, 20);
-        st->next = storage;
-        storage = st;
-        numstorage++;
+        st->maxpeers = 1;
+        dht->numstorage++;
     }
 
+    peers = storage_peers(st);
     for(i = 0; i < st->numpeers; i++) {
-        if(st->peers[i].port == port && st->peers[i].len == len &&
-           memcmp(st->peers[i].ip, ip, len) == 0)
+        if(peers[i].port == port && peers[i].len == len &&
+           memcmp(peers[i].ip, ip, len) == 0)
             break;
     }
 
     if(i < st->numpeers) {
         /* Already there, only need to refresh */
-        st->peers[i].time = now.tv_sec;
+        peers[i].time = dht->now.tv_sec;
         return 0;
     } else {
         struct peer *p;
@@ -1504,16 +1955,23 @@ storage_store(const unsigned char *id,
             int n;
             if(st->maxpeers >= DHT_MAX_PEERS)
                 return 0;
-            n = st->maxpeers == 0 ? 2 : 2 * st->maxpeers;
-            n = MIN(n, DHT_MAX_PEERS);
-            new_peers = static_cast<struct peer *>(realloc(st->peers, n * sizeof(struct peer)));
-            if(new_peers == NULL)
-                return -1;
+            n = MIN(2 * st->maxpeers, DHT_MAX_PEERS);
+            if(st->maxpeers == 1) {
+                new_peers = static_cast<struct peer *>(malloc(n * sizeof(struct peer)));
+                if(new_peers == NULL)
+                    return -1;
+                new_peers[0] = st->peer;
+            } else {
+                new_peers = static_cast<struct peer *>(realloc(st->peers, n * sizeof(struct peer)));
+                if(new_peers == NULL)
+                    return -1;
+            }
             st->peers = new_peers;
             st->maxpeers = n;
+            peers = new_peers;
         }
-        p = &st->peers[st->numpeers++];
-        p->time = now.tv_sec;
+        p = &peers[st->numpeers++];
+        p->time = dht->now.tv_sec;
         p->len = len;
         memcpy(p->ip, ip, len);
         p->port = port;
@@ -1523,53 +1981,47 @@ storage_store(const unsigned char *id,
 
 //*****************************************************************************
 //*****************************************************************************
-int dht_storage_store(const unsigned char * id, const sockaddr *sa, unsigned short port)
+int dht_storage_store(struct DhtNode *dht, const unsigned char * id,
+                      const sockaddr *sa, unsigned short port)
 {
     // TODO sizeof (id)
     // qDebug() << "new entity";
     // qDebug() << util::base64_encode(std::string((char *)id, 20)).c_str();
 
-    return storage_store(id, sa, port);
+    return storage_store(dht, id, sa, port);
 }
 
 //*****************************************************************************
 //*****************************************************************************
 static int
-expire_storage(void)
-{
-    struct storage *st = storage, *previous = NULL;
-    while(st) {
-        int i = 0;
-        while(i < st->numpeers) {
-            if(st->peers[i].time < now.tv_sec - 32 * 60) {
-                if(i != st->numpeers - 1)
-                    st->peers[i] = st->peers[st->numpeers - 1];
+expire_storage(struct DhtNode *dht)
+{
+    int i = 0;
+    while(i < dht->storage_size) {
+        struct storage *st = &dht->storage[i];
+        struct peer *peers = storage_peers(st);
+        int j = 0;
+
+        if(st->maxpeers == 0) {
+            i++;
+            continue;
+        }
+
+        while(j < st->numpeers) {
+            if(peers[j].time < dht->now.tv_sec - 32 * 60) {
+                if(j != st->numpeers - 1)
+                    peers[j] = peers[st->numpeers - 1];
                 st->numpeers--;
             } else {
-                i++;
+                j++;
             }
         }
 
-        if(st->numpeers == 0) {
-            free(st->peers);
-            if(previous)
-                previous->next = st->next;
-            else
-                storage = st->next;
-            free(st);
-            if(previous)
-                st = previous->next;
-            else
-                st = storage;
-            numstorage--;
-            if(numstorage < 0) {
-                debugf("Eek... numstorage became negative.\n");
-                numstorage = 0;
-            }
-        } else {
-            previous = st;
-            st = st->next;
-        }
+        /* Removal may shift a later entry into this slot, look again. */
+        if(st->numpeers == 0)
+            storage_remove(dht, st);
+        else
+            i++;
     }
     return 1;
 }
@@ -1577,14 +2029,14 @@ expire_storage(void)
 //*****************************************************************************
 //*****************************************************************************
 static int
-rotate_secrets(void)
+rotate_secrets(struct DhtNode *dht)
 {
     int rc;
 
-    rotate_secrets_time = now.tv_sec + 900 + random() % 1800;
+    dht->rotate_secrets_time = dht->now.tv_sec + 900 + random() % 1800;
 
-    memcpy(oldsecret, secret, sizeof(secret));
-    rc = dht_random_bytes(secret, sizeof(secret));
+    memcpy(dht->oldsecret, dht->secret, sizeof(dht->secret));
+    rc = dht_random_bytes(dht->secret, sizeof(dht->secret));
 
     if(rc < 0)
         return -1;
@@ -1601,7 +2053,8 @@ rotate_secrets(void)
 //*****************************************************************************
 //*****************************************************************************
 static void
-make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
+make_token(struct DhtNode *dht, const struct sockaddr *sa, int old,
+           unsigned char *token_return)
 {
     void *ip;
     int iplen;
@@ -1622,23 +2075,23 @@ make_token(const struct sockaddr *sa, int old, unsigned char *token_return)
     }
 
     dht_hash(token_return, TOKEN_SIZE,
-             old ? oldsecret : secret, sizeof(secret),
+             old ? dht->oldsecret : dht->secret, sizeof(dht->secret),
              ip, iplen, (unsigned char*)&port, 2);
 }
 
 //*****************************************************************************
 //*****************************************************************************
 static int
-token_match(const unsigned char *token, int token_len,
+token_match(struct DhtNode *dht, const unsigned char *token, int token_len,
             const struct sockaddr *sa)
 {
     unsigned char t[TOKEN_SIZE];
     if(token_len != TOKEN_SIZE)
         return 0;
-    make_token(sa, 0, t);
+    make_token(dht, sa, 0, t);
     if(memcmp(t, token, TOKEN_SIZE) == 0)
         return 1;
-    make_token(sa, 1, t);
+    make_token(dht, sa, 1, t);
     if(memcmp(t, token, TOKEN_SIZE) == 0)
         return 1;
     return 0;
@@ -1647,27 +2100,27 @@ token_match(const unsigned char *token, int token_len,
 //*****************************************************************************
 //*****************************************************************************
 int
-dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
-          int *incoming_return)
+dht_nodes(struct DhtNode *dht, int af, int *good_return, int *dubious_return,
+          int *cached_return, int *incoming_return)
 {
     int good = 0, dubious = 0, cached = 0, incoming = 0;
-    struct bucket *b = af == AF_INET ? buckets : buckets6;
+    struct table *t = find_table(dht, af);
+    int i, j;
 
-    while(b) {
-        struct node *n = b->nodes;
-        while(n) {
-            if(node_good(n)) {
+    for(i = 0; t != NULL && i < t->numbuckets; i++) {
+        struct bucket *b = &t->buckets[i];
+        for(j = 0; j < b->count; j++) {
+            struct node *n = &b->nodes[j];
+            if(node_good(dht, n)) {
                 good++;
                 if(n->time > n->reply_time)
                     incoming++;
             } else {
                 dubious++;
             }
-            n = n->next;
         }
         if(b->cached.ss_family > 0)
             cached++;
-        b = b->next;
     }
     if(good_return)
         *good_return = good;
@@ -1682,17 +2135,19 @@ dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
 
 //*****************************************************************************
 //*****************************************************************************
-void dump_bucket(std::stringstream & stream, struct bucket *b)
+void dump_bucket(struct DhtNode *dht, std::stringstream & stream,
+                 struct bucket *b)
 {
-    struct node *n = b->nodes;
+    int i;
     stream << "Bucket ";
     print_hex(stream, b->first, 20);
     stream << " count " << b->count
-           << " age " << (int)(now.tv_sec - b->time)
-           <<  (in_bucket(myid, b) ? " (mine)" : "")
+           << " age " << (int)(dht->now.tv_sec - b->time)
+           <<  (in_bucket(dht, dht->myid, b) ? " (mine)" : "")
            <<  (b->cached.ss_family ? " (cached)" : "") << std::endl;
 
-    while(n) {
+    for(i = 0; i < b->count; i++) {
+        struct node *n = &b->nodes[i];
         char buf[512];
         unsigned short port;
         stream << "    Node ";
@@ -1716,55 +2171,48 @@ void dump_bucket(std::stringstream & stream, struct bucket *b)
             stream << " " << buf << ":" << port;
         if(n->time != n->reply_time)
             stream << " age "
-                   <<  (long)(now.tv_sec - n->time)
+                   <<  (long)(dht->now.tv_sec - n->time)
                    << ", "
-                   << (long)(now.tv_sec - n->reply_time);
+                   << (long)(dht->now.tv_sec - n->reply_time);
         else
-            stream << "age " << (long)(now.tv_sec - n->time);
+            stream << "age " << (long)(dht->now.tv_sec - n->time);
         if(n->pinged)
             stream << " (" << n->pinged << ")";
-        if(node_good(n))
+        if(node_good(dht, n))
             stream << " (good)";
         stream << std::endl;
-        n = n->next;
     }
 
 }
 
 //*****************************************************************************
 //*****************************************************************************
-void dht_dump_tables(std::string & s)
+void dht_dump_tables(struct DhtNode *dht, std::string & s)
 {
-    int i;
-    struct bucket  * b;
-    struct storage * st = storage;
-    struct search  * sr = searches;
+    int i, j;
+    struct search  * sr = dht->searches;
 
     std::stringstream stream;
 
     stream << "My id ";
-    print_hex(stream, myid, 20);
+    print_hex(stream, dht->myid, 20);
     stream << std::endl;
 
-    b = buckets;
-    while(b)
+    for(i = 0; dht->table != NULL && i < dht->table->numbuckets; i++)
     {
-        dump_bucket(stream, b);
-        b = b->next;
+        dump_bucket(dht, stream, &dht->table->buckets[i]);
     }
 
-    b = buckets6;
-    while(b)
+    for(i = 0; dht->table6 != NULL && i < dht->table6->numbuckets; i++)
     {
-        dump_bucket(stream, b);
-        b = b->next;
+        dump_bucket(dht, stream, &dht->table6->buckets[i]);
     }
 
     while(sr)
     {
         stream << "Search" << (sr->af == AF_INET6 ? " (IPv6)" : "") << " id ";
         print_hex(stream, sr->id, 20);
-        stream << " age " << (int)(now.tv_sec - sr->step_time)
+        stream << " age " << (int)(dht->now.tv_sec - sr->step_time)
                << (sr->done ? " (done)" : "") << std::endl;
         for(i = 0; i < sr->numnodes; i++)
         {
@@ -1773,44 +2221,50 @@ void dht_dump_tables(std::string & s)
             print_hex(stream, n->id, 20);
             stream << " bits " << common_bits(sr->id, n->id) << " age ";
             if(n->request_time)
-                stream << (int)(now.tv_sec - n->request_time) << ", ";
-            stream << (int)(now.tv_sec - n->reply_time);
+                stream << (int)(dht->now.tv_sec - n->request_time) << ", ";
+            stream << (int)(dht->now.tv_sec - n->reply_time);
             if(n->pinged)
                 stream << " (" << n->pinged << ")";
-            stream << (find_node(n->id, AF_INET) ? " (known)" : "")
+            stream << (find_node(dht, n->id, AF_INET) ? " (known)" : "")
                    << (n->replied ? " (replied)" : "")
                    << std::endl;
         }
         sr = sr->next;
     }
 
-    while(st)
+    for(j = 0; j < dht->storage_size; j++)
     {
+        struct storage * st = &dht->storage[j];
+        struct peer * peers = storage_peers(st);
+        if(st->maxpeers == 0)
+        {
+            continue;
+        }
+
         stream << "Storage ";
         print_hex(stream, st->id, 20);
         stream << " " << st->numpeers << "/" << st->maxpeers << " nodes:";
         for(i = 0; i < st->numpeers; i++)
         {
             char buf[100];
-            if(st->peers[i].len == 4)
+            if(peers[i].len == 4)
             {
-                inet_ntop(AF_INET, st->peers[i].ip, buf, 100);
+                inet_ntop(AF_INET, peers[i].ip, buf, 100);
             }
-            else if(st->peers[i].len == 16)
+            else if(peers[i].len == 16)
             {
                 buf[0] = '[';
-                inet_ntop(AF_INET6, st->peers[i].ip, buf + 1, 98);
+                inet_ntop(AF_INET6, peers[i].ip, buf + 1, 98);
                 strcat(buf, "]");
             }
             else
             {
                 strcpy(buf, "???");
             }
-            stream << " " << buf << ":" << st->peers[i].port << " ("
-                   << (long)(now.tv_sec - st->peers[i].time) << ")"
+            stream << " " << buf << ":" << peers[i].port << " ("
+                   << (long)(dht->now.tv_sec - peers[i].time) << ")"
                    << std::endl;
         }
-        st = st->next;
     }
 
     s = stream.str();
@@ -1819,26 +2273,89 @@ void dht_dump_tables(std::string & s)
 //*****************************************************************************
 //*****************************************************************************
 int
-dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
+dht_storage_count(struct DhtNode *dht)
+{
+    return dht->numstorage;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_search_count(struct DhtNode *dht)
+{
+    return dht->numsearches;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+struct DhtNode *
+dht_node_new(void)
+{
+    struct DhtNode *dht;
+
+    dht = static_cast<struct DhtNode *>(calloc(1, sizeof(struct DhtNode)));
+    if(dht == NULL)
+        return NULL;
+
+    dht->dht_socket = -1;
+    dht->dht_socket6 = -1;
+    return dht;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void
+dht_node_free(struct DhtNode *dht)
+{
+    if(dht == NULL)
+        return;
+
+    if(dht->dht_socket >= 0 || dht->dht_socket6 >= 0)
+        dht_uninit(dht);
+    free(dht);
+}
+
+//*****************************************************************************
+// The node of the calls without one, created on first use
+//*****************************************************************************
+struct DhtNode *
+dht_default_node(void)
+{
+    static struct DhtNode *node = NULL;
+    if(node == NULL)
+        node = dht_node_new();
+    return node;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_init(struct DhtNode *dht, int s, int s6, const unsigned char *id,
+         const unsigned char *v)
 {
     int rc;
 
-    if(dht_socket >= 0 || dht_socket6 >= 0 || buckets || buckets6) {
+    if(dht->dht_socket >= 0 || dht->dht_socket6 >= 0 || dht->table || dht->table6) {
         errno = EBUSY;
         return -1;
     }
 
-    searches = NULL;
-    numsearches = 0;
+    dht->searches = NULL;
+    dht->last_search = NULL;
+    dht->numsearches = 0;
+    memset(dht->search_index, 0, sizeof(dht->search_index));
 
-    storage = NULL;
-    numstorage = 0;
+    dht->storage = NULL;
+    dht->storage_size = 0;
+    dht->numstorage = 0;
 
     if(s >= 0) {
-        buckets = static_cast<struct bucket *>(calloc(sizeof(struct bucket), 1));
-        if(buckets == NULL)
+        dht->table = static_cast<struct table *>(calloc(sizeof(struct table), 1));
+        if(dht->table == NULL)
             return -1;
-        buckets->af = AF_INET;
+        dht->table->af = AF_INET;
+        dht->table->numbuckets = 1;
+        dht->table->buckets[0].af = AF_INET;
 
         rc = set_nonblocking(s, 1);
         if(rc < 0)
@@ -1846,149 +2363,389 @@ dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
     }
 
     if(s6 >= 0) {
-        buckets6 = static_cast<struct bucket *>(calloc(sizeof(struct bucket), 1));
-        if(buckets6 == NULL)
+        dht->table6 = static_cast<struct table *>(calloc(sizeof(struct table), 1));
+        if(dht->table6 == NULL)
             return -1;
-        buckets6->af = AF_INET6;
+        dht->table6->af = AF_INET6;
+        dht->table6->numbuckets = 1;
+        dht->table6->buckets[0].af = AF_INET6;
 
         rc = set_nonblocking(s6, 1);
         if(rc < 0)
             goto fail;
     }
 
-    memcpy(myid, id, 20);
+    memcpy(dht->myid, id, 20);
     if(v) {
-        memcpy(my_v, "1:v4:", 5);
-        memcpy(my_v + 5, v, 4);
-        have_v = 1;
+        memcpy(dht->my_v, "1:v4:", 5);
+        memcpy(dht->my_v + 5, v, 4);
+        dht->have_v = 1;
     } else {
-        have_v = 0;
+        dht->have_v = 0;
     }
 
-    gettimeofday(&now, (struct timezone *)0);
+    gettimeofday(&dht->now, (struct timezone *)0);
 
-    mybucket_grow_time = now.tv_sec;
-    mybucket6_grow_time = now.tv_sec;
-    confirm_nodes_time = now.tv_sec + random() % 3;
+    dht->mybucket_grow_time = dht->now.tv_sec;
+    dht->mybucket6_grow_time = dht->now.tv_sec;
+    dht->confirm_nodes_time = dht->now.tv_sec + random() % 3;
 
-    search_id = random() & 0xFFFF;
-    search_time = 0;
+    dht->search_id = random() & 0xFFFF;
+    dht->search_time = 0;
 
-    next_blacklisted = 0;
+    dht->next_blacklisted = 0;
 
-    token_bucket_time = now.tv_sec;
-    token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
+    dht->token_bucket_time = dht->now.tv_sec;
+    dht->token_bucket_tokens = MAX_TOKEN_BUCKET_TOKENS;
 
-    memset(secret, 0, sizeof(secret));
-    rc = rotate_secrets();
+    memset(dht->secret, 0, sizeof(dht->secret));
+    rc = rotate_secrets(dht);
     if(rc < 0)
         goto fail;
 
-    dht_socket = s;
-    dht_socket6 = s6;
+    dht->dht_socket = s;
+    dht->dht_socket6 = s6;
 
-    expire_buckets(buckets);
-    expire_buckets(buckets6);
+    expire_buckets(dht, dht->table);
+    expire_buckets(dht, dht->table6);
 
     return 1;
 
  fail:
-    free(buckets);
-    buckets = NULL;
+    free(dht->table);
+    dht->table = NULL;
+    free(dht->table6);
+    dht->table6 = NULL;
     return -1;
 }
 
 //*****************************************************************************
 //*****************************************************************************
 int
-dht_uninit()
+dht_uninit(struct DhtNode *dht)
 {
-    if(dht_socket < 0 && dht_socket6 < 0) {
+    int i;
+
+    if(dht->dht_socket < 0 && dht->dht_socket6 < 0) {
         errno = EINVAL;
         return -1;
     }
 
-    dht_socket = -1;
-    dht_socket6 = -1;
+    dht->dht_socket = -1;
+    dht->dht_socket6 = -1;
+
+    free(dht->table);
+    dht->table = NULL;
+
+    free(dht->table6);
+    dht->table6 = NULL;
+
+    for(i = 0; i < dht->storage_size; i++) {
+        if(dht->storage[i].maxpeers > 1)
+            free(dht->storage[i].peers);
+    }
+    free(dht->storage);
+    dht->storage = NULL;
+    dht->storage_size = 0;
+    dht->numstorage = 0;
+
+    while(dht->searches) {
+        struct search *sr = dht->searches;
+        dht->searches = dht->searches->next;
+        free(sr);
+    }
+    dht->last_search = NULL;
+    dht->numsearches = 0;
+    memset(dht->search_index, 0, sizeof(dht->search_index));
+
+    for(i = 0; i < DHT_MAX_REASSEMBLIES; i++)
+        free_reassembly(&dht->reassembly[i]);
+    memset(dht->broadcast_seen, 0, sizeof(dht->broadcast_seen));
+
+    for(i = 0; i < DHT_MAX_UNACKED; i++) {
+        if(dht->unacked[i].c)
+            free_unacked(&dht->unacked[i]);
+    }
+    memset(dht->channels, 0, sizeof(dht->channels));
+
+    return 1;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static void
+free_reassembly(struct reassembly *r)
+{
+    free(r->data);
+    memset(r, 0, sizeof(struct reassembly));
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static void
+expire_reassembly(struct DhtNode *dht)
+{
+    int i;
+
+    for(i = 0; i < DHT_MAX_REASSEMBLIES; i++) {
+        struct reassembly *r = &dht->reassembly[i];
+        if(r->type != 0 && r->time < dht->now.tv_sec - DHT_REASSEMBLY_TIME) {
+            debugf("Message parts timed out (%d of %d).\n",
+                   r->received, r->parts);
+            free_reassembly(r);
+        }
+    }
+}
+
+//*****************************************************************************
+// Keep one part of a split message, returns the message once all of its
+// parts are in and NULL otherwise.  When every slot is taken the oldest
+// partial message is dropped
+//*****************************************************************************
+static struct reassembly *
+reassemble(struct DhtNode *dht, int type, const unsigned char *id,
+           const struct message_view *m)
+{
+    struct reassembly *r = NULL, *slot = NULL;
+    int i, last;
+
+    last = m->part == m->parts - 1;
+    if(m->parts < 2 || m->part < 0 || m->part >= m->parts ||
+       m->mid.len != MESSAGE_ID_SIZE ||
+       (last ? m->payload.len < 1 || m->payload.len > DHT_FRAGMENT_SIZE :
+        m->payload.len != DHT_FRAGMENT_SIZE)) {
+        debugf("Bad message part.\n");
+        return NULL;
+    }
+
+    expire_reassembly(dht);
 
-    while(buckets) {
-        struct bucket *b = buckets;
-        buckets = b->next;
-        while(b->nodes) {
-            struct node *n = b->nodes;
-            b->nodes = n->next;
-            free(n);
+    for(i = 0; i < DHT_MAX_REASSEMBLIES; i++) {
+        struct reassembly *x = &dht->reassembly[i];
+        if(x->type == type && id_cmp(x->id, id) == 0 &&
+           memcmp(x->mid, m->mid.p, MESSAGE_ID_SIZE) == 0) {
+            r = x;
+            break;
         }
-        free(b);
+        if(slot == NULL ||
+           (slot->type != 0 && (x->type == 0 || x->time < slot->time)))
+            slot = x;
     }
 
-    while(buckets6) {
-        struct bucket *b = buckets6;
-        buckets6 = b->next;
-        while(b->nodes) {
-            struct node *n = b->nodes;
-            b->nodes = n->next;
-            free(n);
+    if(r == NULL) {
+        if(slot->type != 0) {
+            debugf("Dropping partial message (%d of %d).\n",
+                   slot->received, slot->parts);
+            free_reassembly(slot);
         }
-        free(b);
+        slot->data = (unsigned char *)malloc(m->parts * DHT_FRAGMENT_SIZE);
+        if(slot->data == NULL)
+            return NULL;
+        slot->type = type;
+        memcpy(slot->id, id, 20);
+        memcpy(slot->mid, m->mid.p, MESSAGE_ID_SIZE);
+        slot->parts = m->parts;
+        slot->time = dht->now.tv_sec;
+        r = slot;
     }
 
-    while(storage) {
-        struct storage *st = storage;
-        storage = storage->next;
-        free(st->peers);
-        free(st);
+    if(r->parts != m->parts) {
+        debugf("Inconsistent message parts.\n");
+        return NULL;
     }
 
-    while(searches) {
-        struct search *sr = searches;
-        searches = searches->next;
-        free(sr);
+    if(r->have[m->part / 8] & (1 << (m->part % 8)))
+        return NULL;
+
+    r->have[m->part / 8] |= 1 << (m->part % 8);
+    memcpy(r->data + m->part * DHT_FRAGMENT_SIZE, m->payload.p, m->payload.len);
+    if(last)
+        r->length = m->part * DHT_FRAGMENT_SIZE + m->payload.len;
+    r->received++;
+
+    return r->received == r->parts ? r : NULL;
+}
+
+//*****************************************************************************
+// The set of a broadcast id, ids are random so their first octets will do
+//*****************************************************************************
+static struct broadcast_seen *
+broadcast_set(struct DhtNode *dht, const unsigned char *mid)
+{
+    unsigned int h;
+    memcpy(&h, mid, sizeof(h));
+    return &dht->broadcast_seen[h % (DHT_BROADCAST_SEEN / BROADCAST_SEEN_WAYS) *
+                           BROADCAST_SEEN_WAYS];
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static int
+broadcast_known(struct DhtNode *dht, const unsigned char *mid)
+{
+    struct broadcast_seen *set = broadcast_set(dht, mid);
+    int i;
+
+    for(i = 0; i < BROADCAST_SEEN_WAYS; i++) {
+        if(set[i].time > dht->now.tv_sec - DHT_BROADCAST_SEEN_TIME &&
+           memcmp(set[i].mid, mid, MESSAGE_ID_SIZE) == 0)
+            return 1;
     }
+    return 0;
+}
 
-    return 1;
+//*****************************************************************************
+//*****************************************************************************
+static void
+broadcast_remember(struct DhtNode *dht, const unsigned char *mid)
+{
+    struct broadcast_seen *set = broadcast_set(dht, mid);
+    int i, oldest = 0;
+
+    for(i = 1; i < BROADCAST_SEEN_WAYS; i++) {
+        if(set[i].time < set[oldest].time)
+            oldest = i;
+    }
+    memcpy(set[oldest].mid, mid, MESSAGE_ID_SIZE);
+    set[oldest].time = dht->now.tv_sec;
+}
+
+//*****************************************************************************
+// Up to max good nodes of t to pass a broadcast on.  Buckets are taken in
+// turns, one node of each per round from a random start, so targets are
+// spread over the id space before the close buckets are drained
+//*****************************************************************************
+static int
+broadcast_targets(struct DhtNode *dht, struct table *t,
+                  const unsigned char *except, struct node **nodes, int max)
+{
+    int start[DHT_MAX_BUCKETS];
+    int i, round, n = 0;
+
+    if(t == NULL)
+        return 0;
+
+    for(i = 0; i < t->numbuckets; i++)
+        start[i] = t->buckets[i].count > 0 ?
+            random() % t->buckets[i].count : 0;
+
+    for(round = 0; round < DHT_BUCKET_NODES && n < max; round++) {
+        for(i = 0; i < t->numbuckets && n < max; i++) {
+            struct bucket *b = &t->buckets[i];
+            struct node *node;
+            if(round >= b->count)
+                continue;
+            node = &b->nodes[(start[i] + round) % b->count];
+            if(!node_good(dht, node) ||
+               (except && id_cmp(node->id, except) == 0))
+                continue;
+            nodes[n++] = node;
+        }
+    }
+    return n;
+}
+
+//*****************************************************************************
+// Push a broadcast to a fanout of both tables, the node it came from is
+// left out.  Returns the number of nodes sent to
+//*****************************************************************************
+static int
+gossip(struct DhtNode *dht, const unsigned char *mid,
+       const unsigned char *data, int len, const unsigned char *except)
+{
+    struct node *nodes[DHT_BROADCAST_FANOUT];
+    int i, n, sent = 0;
+
+    n = broadcast_targets(dht, dht->table, except, nodes, DHT_BROADCAST_FANOUT);
+    for(i = 0; i < n; i++) {
+        if(send_payload(dht, "broadcast", mid, data, len, NULL,
+                        (struct sockaddr*)&nodes[i]->ss, nodes[i]->sslen) >= 0)
+            sent++;
+    }
+
+    n = broadcast_targets(dht, dht->table6, except, nodes, DHT_BROADCAST_FANOUT);
+    for(i = 0; i < n; i++) {
+        if(send_payload(dht, "broadcast", mid, data, len, NULL,
+                        (struct sockaddr*)&nodes[i]->ss, nodes[i]->sslen) >= 0)
+            sent++;
+    }
+
+    debugf("Broadcast passed to %d nodes.\n", sent);
+    return sent;
+}
+
+//*****************************************************************************
+// Complete payload of a message or broadcast from node id, a broadcast
+// is passed on before the application sees it
+//*****************************************************************************
+static void
+deliver_payload(struct DhtNode *dht, int type, const unsigned char *id,
+                const unsigned char *mid, const unsigned char *data, int len)
+{
+    XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
+
+    if (type == MESSAGE)
+    {
+        if (len < 20)
+        {
+            debugf("Message without address.\n");
+            return;
+        }
+
+        std::vector<unsigned char> addr(data, data + 20);
+        std::vector<unsigned char> message(data, data + len);
+        app->onMessageReceived(addr, message);
+    }
+    else
+    {
+        broadcast_remember(dht, mid);
+        gossip(dht, mid, data, len, id);
+
+        std::vector<unsigned char> message(data, data + len);
+        app->onBroadcastReceived(message);
+    }
 }
 
 //*****************************************************************************
 // Rate control for requests we receive
 //*****************************************************************************
 static int
-token_bucket(void)
+token_bucket(struct DhtNode *dht)
 {
-    if(token_bucket_tokens == 0) {
-        token_bucket_tokens = MIN(MAX_TOKEN_BUCKET_TOKENS,
-                                  100 * (now.tv_sec - token_bucket_time));
-        token_bucket_time = now.tv_sec;
+    if(dht->token_bucket_tokens == 0) {
+        dht->token_bucket_tokens = MIN(MAX_TOKEN_BUCKET_TOKENS,
+                                  100 * (dht->now.tv_sec - dht->token_bucket_time));
+        dht->token_bucket_time = dht->now.tv_sec;
     }
 
-    if(token_bucket_tokens == 0)
+    if(dht->token_bucket_tokens == 0)
         return 0;
 
-    token_bucket_tokens--;
+    dht->token_bucket_tokens--;
     return 1;
 }
 
 //*****************************************************************************
 //*****************************************************************************
 static int
-neighbourhood_maintenance(int af)
+neighbourhood_maintenance(struct DhtNode *dht, int af)
 {
     unsigned char id[20];
-    struct bucket *b = find_bucket(myid, af);
+    struct bucket *b = find_bucket(dht, dht->myid, af);
     struct bucket *q;
     struct node *n;
 
     if(b == NULL)
         return 0;
 
-    memcpy(id, myid, 20);
+    memcpy(id, dht->myid, 20);
     id[19] = random() & 0xFF;
     q = b;
-    if(q->next && (q->count == 0 || (random() & 7) == 0))
-        q = b->next;
+    if(next_bucket(dht, q) && (q->count == 0 || (random() & 7) == 0))
+        q = next_bucket(dht, b);
     if(q->count == 0 || (random() & 7) == 0) {
         struct bucket *r;
-        r = previous_bucket(b);
+        r = previous_bucket(dht, b);
         if(r && r->count > 0)
             q = r;
     }
@@ -1996,17 +2753,17 @@ neighbourhood_maintenance(int af)
     if(q) {
         /* Since our node-id is the same in both DHTs, it's probably
            profitable to query both families. */
-        int want = dht_socket >= 0 && dht_socket6 >= 0 ? (WANT4 | WANT6) : -1;
+        int want = dht->dht_socket >= 0 && dht->dht_socket6 >= 0 ? (WANT4 | WANT6) : -1;
         n = random_node(q);
         if(n) {
             unsigned char tid[4];
             debugf("Sending find_node for%s neighborhood maintenance.\n",
                    af == AF_INET6 ? " IPv6" : "");
             make_tid(tid, "fn", 0);
-            send_find_node((struct sockaddr*)&n->ss, n->sslen,
+            send_find_node(dht, (struct sockaddr*)&n->ss, n->sslen,
                            tid, 4, id, want,
-                           n->reply_time >= now.tv_sec - 15);
-            pinged(n, q);
+                           n->reply_time >= dht->now.tv_sec - 15);
+            pinged(dht, n, q);
         }
         return 1;
     }
@@ -2016,15 +2773,15 @@ neighbourhood_maintenance(int af)
 //*****************************************************************************
 //*****************************************************************************
 static int
-bucket_maintenance(int af)
+bucket_maintenance(struct DhtNode *dht, int af)
 {
-    struct bucket *b;
-
-    b = af == AF_INET ? buckets : buckets6;
+    struct table *t = find_table(dht, af);
+    int i;
 
-    while(b) {
+    for(i = 0; t != NULL && i < t->numbuckets; i++) {
+        struct bucket *b = &t->buckets[i];
         struct bucket *q;
-        if(b->time < now.tv_sec - 600) {
+        if(b->time < dht->now.tv_sec - 600) {
             /* This bucket hasn't seen any positive confirmation for a long
                time.  Pick a random id in this bucket's range, and send
                a request to a random node. */
@@ -2032,7 +2789,7 @@ bucket_maintenance(int af)
             struct node *n;
             int rc;
 
-            rc = bucket_random(b, id);
+            rc = bucket_random(dht, b, id);
             if(rc < 0)
                 memcpy(id, b->first, 20);
 
@@ -2040,11 +2797,11 @@ bucket_maintenance(int af)
             /* If the bucket is empty, we try to fill it from a neighbour.
                We also sometimes do it gratuitiously to recover from
                buckets full of broken nodes. */
-            if(q->next && (q->count == 0 || (random() & 7) == 0))
-                q = b->next;
+            if(next_bucket(dht, q) && (q->count == 0 || (random() & 7) == 0))
+                q = next_bucket(dht, b);
             if(q->count == 0 || (random() & 7) == 0) {
                 struct bucket *r;
-                r = previous_bucket(b);
+                r = previous_bucket(dht, b);
                 if(r && r->count > 0)
                     q = r;
             }
@@ -2055,11 +2812,12 @@ bucket_maintenance(int af)
                     unsigned char tid[4];
                     int want = -1;
 
-                    if(dht_socket >= 0 && dht_socket6 >= 0) {
+                    if(dht->dht_socket >= 0 && dht->dht_socket6 >= 0) {
                         struct bucket *otherbucket;
                         otherbucket =
-                            find_bucket(id, af == AF_INET ? AF_INET6 : AF_INET);
-                        if(otherbucket && otherbucket->count < 8)
+                            find_bucket(dht, id, af == AF_INET ? AF_INET6 : AF_INET);
+                        if(otherbucket &&
+                           otherbucket->count < DHT_BUCKET_NODES)
                             /* The corresponding bucket in the other family
                                is emptyish -- querying both is useful. */
                             want = WANT4 | WANT6;
@@ -2074,17 +2832,16 @@ bucket_maintenance(int af)
                     debugf("Sending find_node for%s bucket maintenance.\n",
                            af == AF_INET6 ? " IPv6" : "");
                     make_tid(tid, "fn", 0);
-                    send_find_node((struct sockaddr*)&n->ss, n->sslen,
+                    send_find_node(dht, (struct sockaddr*)&n->ss, n->sslen,
                                    tid, 4, id, want,
-                                   n->reply_time >= now.tv_sec - 15);
-                    pinged(n, q);
+                                   n->reply_time >= dht->now.tv_sec - 15);
+                    pinged(dht, n, q);
                     /* In order to avoid sending queries back-to-back,
                        give up for now and reschedule us soon. */
                     return 1;
                 }
             }
         }
-        b = b->next;
     }
     return 0;
 }
@@ -2092,29 +2849,21 @@ bucket_maintenance(int af)
 //*****************************************************************************
 //*****************************************************************************
 int
-dht_periodic(const unsigned char * buf, size_t buflen,
-             const struct sockaddr *from, int fromlen,
-             time_t *tosleep,
+dht_periodic(struct DhtNode *dht, const unsigned char * buf, size_t buflen,
+             const struct sockaddr *from, int fromlen, time_t *tosleep,
              dht_callback *callback, void *closure)
 {
-    gettimeofday(&now, (struct timezone *)0);
+    gettimeofday(&dht->now, (struct timezone *)0);
 
     if(buflen > 0) {
         int message;
-        unsigned char tid[16], id[20], info_hash[20], target[20];
-        unsigned char nodes[256], nodes6[1024], token[128];
-        int tid_len = 16, token_len = 128;
-        int nodes_len = 256, nodes6_len = 1024;
-        unsigned short port;
-        unsigned char values[2048], values6[2048];
-        int values_len = 2048, values6_len = 2048;
-        int want;
+        struct message_view m;
         unsigned short ttid;
 
         if(is_martian(from))
             goto dontread;
 
-        if(node_blacklisted(from, fromlen)) {
+        if(node_blacklisted(dht, from, fromlen)) {
             debugf("Received packet from blacklisted node.\n");
             goto dontread;
         }
@@ -2125,11 +2874,16 @@ dht_periodic(const unsigned char * buf, size_t buflen,
             return -1;
         }
 
-        message = parse_message(buf, buflen, tid, &tid_len, id, info_hash,
-                                target, &port, token, &token_len,
-                                nodes, &nodes_len, nodes6, &nodes6_len,
-                                values, &values_len, values6, &values6_len,
-                                &want);
+        message = parse_message(buf, buflen, &m);
+
+        const unsigned char *tid = m.tid.p, *id = m.id;
+        const unsigned char *info_hash = m.info_hash, *target = m.target;
+        const unsigned char *token = m.token.p;
+        const unsigned char *nodes = m.nodes.p, *nodes6 = m.nodes6.p;
+        int tid_len = m.tid.len, token_len = m.token.len;
+        int nodes_len = m.nodes.len, nodes6_len = m.nodes6.len;
+        unsigned short port = m.port;
+        int want = m.want;
 
         if(message < 0 || message == ERROR || id_cmp(id, zeroes) == 0) {
             debugf("Unparseable message: ");
@@ -2137,14 +2891,14 @@ dht_periodic(const unsigned char * buf, size_t buflen,
             goto dontread;
         }
 
-        if(id_cmp(id, myid) == 0) {
+        if(id_cmp(id, dht->myid) == 0) {
             debugf("Received message from self.\n");
             goto dontread;
         }
 
         if(message > REPLY) {
             /* Rate limit requests. */
-            if(!token_bucket()) {
+            if(!token_bucket(dht)) {
                 debugf("Dropping request due to rate limiting.\n");
                 goto dontread;
             }
@@ -2161,73 +2915,72 @@ dht_periodic(const unsigned char * buf, size_t buflen,
                     /* This is really annoying, as it means that we will
                        time-out all our searches that go through this node.
                        Kill it. */
-                    blacklist_node(id, from, fromlen);
+                    blacklist_node(dht, id, from, fromlen);
                     goto dontread;
                 }
                 if(tid_match(tid, "pn", NULL)) {
                     debugf("Pong!\n");
-                    new_node(id, from, fromlen, 2);
+                    new_node(dht, id, from, fromlen, 2);
                 } else if(tid_match(tid, "fn", NULL) ||
                           tid_match(tid, "gp", NULL)) {
                     int gp = 0;
                     struct search *sr = NULL;
                     if(tid_match(tid, "gp", &ttid)) {
                         gp = 1;
-                        sr = find_search(ttid, from->sa_family);
+                        sr = find_search(dht, ttid, from->sa_family);
                     }
                     debugf("Nodes found (%d+%d)%s!\n", nodes_len/26, nodes6_len/38,
                            gp ? " for get_peers" : "");
                     if(nodes_len % 26 != 0 || nodes6_len % 38 != 0) {
                         debugf("Unexpected length for node info!\n");
-                        blacklist_node(id, from, fromlen);
+                        blacklist_node(dht, id, from, fromlen);
                     } else if(gp && sr == NULL) {
                         debugf("Unknown search!\n");
-                        new_node(id, from, fromlen, 1);
+                        new_node(dht, id, from, fromlen, 1);
                     } else {
                         int i;
-                        new_node(id, from, fromlen, 2);
+                        new_node(dht, id, from, fromlen, 2);
                         for(i = 0; i < nodes_len / 26; i++) {
-                            unsigned char *ni = nodes + i * 26;
+                            const unsigned char *ni = nodes + i * 26;
                             struct sockaddr_in sin;
-                            if(id_cmp(ni, myid) == 0)
+                            if(id_cmp(ni, dht->myid) == 0)
                                 continue;
                             memset(&sin, 0, sizeof(sin));
                             sin.sin_family = AF_INET;
                             memcpy(&sin.sin_addr, ni + 20, 4);
                             memcpy(&sin.sin_port, ni + 24, 2);
-                            new_node(ni, (struct sockaddr*)&sin, sizeof(sin), 0);
+                            new_node(dht, ni, (struct sockaddr*)&sin, sizeof(sin), 0);
                             if(sr && sr->af == AF_INET) {
-                                insert_search_node(ni,
+                                insert_search_node(dht, ni,
                                                    (struct sockaddr*)&sin,
                                                    sizeof(sin),
                                                    sr, 0, NULL, 0);
                             }
                         }
                         for(i = 0; i < nodes6_len / 38; i++) {
-                            unsigned char *ni = nodes6 + i * 38;
+                            const unsigned char *ni = nodes6 + i * 38;
                             struct sockaddr_in6 sin6;
-                            if(id_cmp(ni, myid) == 0)
+                            if(id_cmp(ni, dht->myid) == 0)
                                 continue;
                             memset(&sin6, 0, sizeof(sin6));
                             sin6.sin6_family = AF_INET6;
                             memcpy(&sin6.sin6_addr, ni + 20, 16);
                             memcpy(&sin6.sin6_port, ni + 36, 2);
-                            new_node(ni, (struct sockaddr*)&sin6, sizeof(sin6), 0);
+                            new_node(dht, ni, (struct sockaddr*)&sin6, sizeof(sin6), 0);
                             if(sr && sr->af == AF_INET6) {
-                                insert_search_node(ni,
+                                insert_search_node(dht, ni,
                                                    (struct sockaddr*)&sin6,
                                                    sizeof(sin6),
                                                    sr, 0, NULL, 0);
                             }
                         }
-                        if(sr)
-                            /* Since we received a reply, the number of
-                               requests in flight has decreased.  Let's push
-                               another request. */
-                            search_send_get_peers(sr, NULL);
                     }
                     if(sr) {
-                        insert_search_node(id, from, fromlen, sr,
+                        unsigned char values[2048], values6[2048];
+                        int values_len = 2048, values6_len = 2048;
+                        message_values(&m, values, &values_len,
+                                       values6, &values6_len);
+                        insert_search_node(dht, id, from, fromlen, sr,
                                            1, token, token_len);
                         if(values_len > 0 || values6_len > 0) {
                             debugf("Got values (%d+%d)!\n",
@@ -2242,27 +2995,35 @@ dht_periodic(const unsigned char * buf, size_t buflen,
                                                 (void*)values6, values6_len);
                             }
                         }
+                        /* Since we received a reply, the number of
+                           requests in flight has decreased.  Push the next
+                           ones now rather than on the periodic step. */
+                        if(!sr->done) {
+                            search_fill(dht, sr);
+                            if(search_replied(sr))
+                                search_step(dht, sr, callback, closure);
+                        }
                     }
                 } else if(tid_match(tid, "ap", &ttid)) {
                     struct search *sr;
                     debugf("Got reply to announce_peer.\n");
-                    sr = find_search(ttid, from->sa_family);
+                    sr = find_search(dht, ttid, from->sa_family);
                     if(!sr) {
                         debugf("Unknown search!\n");
-                        new_node(id, from, fromlen, 1);
+                        new_node(dht, id, from, fromlen, 1);
                     } else {
                         int i;
-                        new_node(id, from, fromlen, 2);
+                        new_node(dht, id, from, fromlen, 2);
                         for(i = 0; i < sr->numnodes; i++)
                             if(id_cmp(sr->nodes[i].id, id) == 0) {
                                 sr->nodes[i].request_time = 0;
-                                sr->nodes[i].reply_time = now.tv_sec;
+                                sr->nodes[i].reply_time = dht->now.tv_sec;
                                 sr->nodes[i].acked = 1;
                                 sr->nodes[i].pinged = 0;
                                 break;
                             }
                         /* See comment for gp above. */
-                        search_send_get_peers(sr, NULL);
+                        search_fill(dht, sr);
                     }
                 } else {
                     debugf("Unexpected reply: ");
@@ -2274,18 +3035,18 @@ dht_periodic(const unsigned char * buf, size_t buflen,
             case PING:
             {
                 debugf("Ping (%d)!\n", tid_len);
-                new_node(id, from, fromlen, 1);
+                new_node(dht, id, from, fromlen, 1);
                 debugf("Sending pong.\n");
-                send_pong(from, fromlen, tid, tid_len);
+                send_pong(dht, from, fromlen, tid, tid_len);
                 break;
             } // PING
 
             case FIND_NODE:
             {
                 debugf("Find node!\n");
-                new_node(id, from, fromlen, 1);
+                new_node(dht, id, from, fromlen, 1);
                 debugf("Sending closest nodes (%d).\n", want);
-                send_closest_nodes(from, fromlen,
+                send_closest_nodes(dht, from, fromlen,
                                    tid, tid_len, target, want,
                                    0, NULL, NULL, 0);
                 break;
@@ -2294,27 +3055,27 @@ dht_periodic(const unsigned char * buf, size_t buflen,
             case GET_PEERS:
             {
                 debugf("Get_peers!\n");
-                new_node(id, from, fromlen, 1);
+                new_node(dht, id, from, fromlen, 1);
                 if(id_cmp(info_hash, zeroes) == 0) {
                     debugf("Eek!  Got get_peers with no info_hash.\n");
-                    send_error(from, fromlen, tid, tid_len,
+                    send_error(dht, from, fromlen, tid, tid_len,
                                203, "Get_peers with no info_hash");
                     break;
                 } else {
-                    struct storage *st = find_storage(info_hash);
+                    struct storage *st = find_storage(dht, info_hash);
                     unsigned char token[TOKEN_SIZE];
-                    make_token(from, 0, token);
+                    make_token(dht, from, 0, token);
                     if(st && st->numpeers > 0) {
                          debugf("Sending found%s peers.\n",
                                 from->sa_family == AF_INET6 ? " IPv6" : "");
-                         send_closest_nodes(from, fromlen,
+                         send_closest_nodes(dht, from, fromlen,
                                             tid, tid_len,
                                             info_hash, want,
                                             from->sa_family, st,
                                             token, TOKEN_SIZE);
                     } else {
                         debugf("Sending nodes for get_peers.\n");
-                        send_closest_nodes(from, fromlen,
+                        send_closest_nodes(dht, from, fromlen,
                                            tid, tid_len, info_hash, want,
                                            0, NULL, token, TOKEN_SIZE);
                     }
@@ -2325,138 +3086,136 @@ dht_periodic(const unsigned char * buf, size_t buflen,
             case ANNOUNCE_PEER:
             {
                 debugf("Announce peer!\n");
-                new_node(id, from, fromlen, 1);
+                new_node(dht, id, from, fromlen, 1);
                 if(id_cmp(info_hash, zeroes) == 0) {
                     debugf("Announce_peer with no info_hash.\n");
-                    send_error(from, fromlen, tid, tid_len,
+                    send_error(dht, from, fromlen, tid, tid_len,
                                203, "Announce_peer with no info_hash");
                     break;
                 }
-                if(!token_match(token, token_len, from)) {
+                if(!token_match(dht, token, token_len, from)) {
                     debugf("Incorrect token for announce_peer.\n");
-                    send_error(from, fromlen, tid, tid_len,
+                    send_error(dht, from, fromlen, tid, tid_len,
                                203, "Announce_peer with wrong token");
                     break;
                 }
                 if(port == 0) {
                     debugf("Announce_peer with forbidden port %d.\n", port);
-                    send_error(from, fromlen, tid, tid_len,
+                    send_error(dht, from, fromlen, tid, tid_len,
                                203, "Announce_peer with forbidden port number");
                     break;
                 }
-                storage_store(info_hash, from, port);
+                storage_store(dht, info_hash, from, port);
                 /* Note that if storage_store failed, we lie to the requestor.
                    This is to prevent them from backtracking, and hence
                    polluting the DHT. */
                 debugf("Sending peer announced.\n");
-                send_peer_announced(from, fromlen, tid, tid_len);
+                send_peer_announced(dht, from, fromlen, tid, tid_len);
                 break;
             } // ANNOUNCE_PEERS
 
             case MESSAGE:
+            case BROADCAST:
             {
-                debugf("Message received!\n");
-                new_node(id, from, fromlen, 1);
+                debugf(message == MESSAGE ? "Message received!\n" :
+                                            "Broadcast Message received!\n");
+                new_node(dht, id, from, fromlen, 1);
 
-                char * ptr = strstr((char *)buf, ":message")+8;
-                size_t len = atoi(ptr);
-                while (isdigit(*ptr))
+                if (message == MESSAGE && m.seq >= 0 &&
+                    !reliable_receive(dht, id, from, fromlen, &m))
                 {
-                    ++ptr;
+                    debugf("Message already received.\n");
+                    break;
                 }
 
-                // :
-                ++ptr;
-
-                std::string message(ptr, ptr+len);
-                message = util::base64_decode(message);
-
-                std::vector<unsigned char> addr;
-                std::copy(message.begin(), message.begin()+20, std::back_inserter(addr));
-
-                std::vector<unsigned char> vmessage;
-                std::copy(message.begin(), message.end(), std::back_inserter(vmessage));
-
-                XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
-                app->onMessageReceived(addr, vmessage);
-
-                break;
-            } // MESSAGE
-
-            case BROADCAST:
-            {
-                debugf("Broadcast Message received!\n");
-                new_node(id, from, fromlen, 1);
-
-                char * ptr = strstr((char *)buf, ":broadcast")+10;
-                size_t len = atoi(ptr);
-                while (isdigit(*ptr))
+                if (message == BROADCAST &&
+                    (m.mid.len != MESSAGE_ID_SIZE || broadcast_known(dht, m.mid.p)))
                 {
-                    ++ptr;
+                    debugf("Broadcast without id or already seen.\n");
+                    break;
                 }
 
-                // :
-                ++ptr;
-
-                std::string message(ptr, ptr+len);
-                message = util::base64_decode(message);
+                if (m.parts == 0)
+                {
+                    deliver_payload(dht, message, id, m.mid.p, m.payload.p, m.payload.len);
+                    break;
+                }
 
-                std::vector<unsigned char> vmessage;
-                std::copy(message.begin(), message.end(), std::back_inserter(vmessage));
+                struct reassembly * r = reassemble(dht, message, id, &m);
+                if (r)
+                {
+                    deliver_payload(dht, message, id, r->mid, r->data, r->length);
+                    free_reassembly(r);
+                }
 
-                XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
-                app->onBroadcastReceived(vmessage);
+                break;
+            } // MESSAGE, BROADCAST
 
+            case ACK:
+                reliable_ack(dht, id, &m);
                 break;
-            } // BROADCAST
         } // switch
     }
 
  dontread:
-    if(now.tv_sec >= rotate_secrets_time)
-        rotate_secrets();
+    reliable_retransmit(dht);
 
-    if(now.tv_sec >= expire_stuff_time) {
-        expire_buckets(buckets);
-        expire_buckets(buckets6);
-        expire_storage();
-        expire_searches();
+    if(dht->now.tv_sec >= dht->rotate_secrets_time)
+        rotate_secrets(dht);
+
+    if(dht->now.tv_sec >= dht->expire_stuff_time) {
+        expire_buckets(dht, dht->table);
+        expire_buckets(dht, dht->table6);
+        expire_storage(dht);
+        expire_searches(dht);
+        expire_reassembly(dht);
     }
 
-    if(search_time > 0 && now.tv_sec >= search_time) {
+    if(dht->search_time > 0 && dht->now.tv_sec >= dht->search_time) {
         struct search *sr;
-        sr = searches;
+        sr = dht->searches;
         while(sr) {
-            if(!sr->done && sr->step_time + 5 <= now.tv_sec) {
-                search_step(sr, callback, closure);
+            /* Stepping moves the search to the tail of the list. */
+            struct search *next = sr->next;
+            if(!sr->done && sr->step_time + 5 <= dht->now.tv_sec) {
+                search_step(dht, sr, callback, closure);
             }
-            sr = sr->next;
+            sr = next;
         }
 
-        search_time = 0;
+        dht->search_time = 0;
 
-        sr = searches;
+        sr = dht->searches;
         while(sr) {
             if(!sr->done) {
                 time_t tm = sr->step_time + 15 + random() % 10;
-                if(search_time == 0 || search_time > tm)
-                    search_time = tm;
+                if(dht->search_time == 0 || dht->search_time > tm)
+                    dht->search_time = tm;
             }
             sr = sr->next;
         }
     }
 
-    if(now.tv_sec >= confirm_nodes_time) {
+    /* Requests that timed out free their slots right away. */
+    if(dht->search_time > 0) {
+        struct search *sr;
+        for(sr = dht->searches; sr; sr = sr->next) {
+            if(!sr->done)
+                search_fill(dht, sr);
+        }
+    }
+
+    if(dht->now.tv_sec >= dht->confirm_nodes_time) {
         int soon = 0;
 
-        soon |= bucket_maintenance(AF_INET);
-        soon |= bucket_maintenance(AF_INET6);
+        soon |= bucket_maintenance(dht, AF_INET);
+        soon |= bucket_maintenance(dht, AF_INET6);
 
         if(!soon) {
-            if(mybucket_grow_time >= now.tv_sec - 150)
-                soon |= neighbourhood_maintenance(AF_INET);
-            if(mybucket6_grow_time >= now.tv_sec - 150)
-                soon |= neighbourhood_maintenance(AF_INET6);
+            if(dht->mybucket_grow_time >= dht->now.tv_sec - 150)
+                soon |= neighbourhood_maintenance(dht, AF_INET);
+            if(dht->mybucket6_grow_time >= dht->now.tv_sec - 150)
+                soon |= neighbourhood_maintenance(dht, AF_INET6);
         }
 
         /* In order to maintain all buckets' age within 600 seconds, worst
@@ -2464,21 +3223,21 @@ dht_periodic(const unsigned char * buf, size_t buflen,
            We want to keep a margin for neighborhood maintenance, so keep
            this within 25 seconds. */
         if(soon)
-            confirm_nodes_time = now.tv_sec + 5 + random() % 20;
+            dht->confirm_nodes_time = dht->now.tv_sec + 5 + random() % 20;
         else
-            confirm_nodes_time = now.tv_sec + 60 + random() % 120;
+            dht->confirm_nodes_time = dht->now.tv_sec + 60 + random() % 120;
     }
 
-    if(confirm_nodes_time > now.tv_sec)
-        *tosleep = confirm_nodes_time - now.tv_sec;
+    if(dht->confirm_nodes_time > dht->now.tv_sec)
+        *tosleep = dht->confirm_nodes_time - dht->now.tv_sec;
     else
         *tosleep = 0;
 
-    if(search_time > 0) {
-        if(search_time <= now.tv_sec)
+    if(dht->search_time > 0) {
+        if(dht->search_time <= dht->now.tv_sec)
             *tosleep = 0;
-        else if(*tosleep > search_time - now.tv_sec)
-            *tosleep = search_time - now.tv_sec;
+        else if(*tosleep > dht->search_time - dht->now.tv_sec)
+            *tosleep = dht->search_time - dht->now.tv_sec;
     }
 
     return 1;
@@ -2487,75 +3246,60 @@ dht_periodic(const unsigned char * buf, size_t buflen,
 //*****************************************************************************
 //*****************************************************************************
 int
-dht_get_nodes(struct sockaddr_in *sin, int *num,
+dht_get_nodes(struct DhtNode *dht, struct sockaddr_in *sin, int *num,
               struct sockaddr_in6 *sin6, int *num6)
 {
-    int i, j;
+    int i, j, k, l;
     struct bucket *b;
-    struct node *n;
 
     i = 0;
 
     /* For restoring to work without discarding too many nodes, the list
        must start with the contents of our bucket. */
-    b = find_bucket(myid, AF_INET);
+    b = find_bucket(dht, dht->myid, AF_INET);
     if(b == NULL)
         goto no_ipv4;
 
-    n = b->nodes;
-    while(n && i < *num) {
-        if(node_good(n)) {
-            sin[i] = *(struct sockaddr_in*)&n->ss;
+    for(l = 0; l < b->count && i < *num; l++) {
+        if(node_good(dht, &b->nodes[l])) {
+            sin[i] = *(struct sockaddr_in*)&b->nodes[l].ss;
             i++;
         }
-        n = n->next;
     }
 
-    b = buckets;
-    while(b && i < *num) {
-        if(!in_bucket(myid, b)) {
-            n = b->nodes;
-            while(n && i < *num) {
-                if(node_good(n)) {
-                    sin[i] = *(struct sockaddr_in*)&n->ss;
-                    i++;
-                }
-                n = n->next;
+    for(k = 0; k < dht->table->numbuckets - 1 && i < *num; k++) {
+        b = &dht->table->buckets[k];
+        for(l = 0; l < b->count && i < *num; l++) {
+            if(node_good(dht, &b->nodes[l])) {
+                sin[i] = *(struct sockaddr_in*)&b->nodes[l].ss;
+                i++;
             }
         }
-        b = b->next;
     }
 
  no_ipv4:
 
     j = 0;
 
-    b = find_bucket(myid, AF_INET6);
+    b = find_bucket(dht, dht->myid, AF_INET6);
     if(b == NULL)
         goto no_ipv6;
 
-    n = b->nodes;
-    while(n && j < *num6) {
-        if(node_good(n)) {
-            sin6[j] = *(struct sockaddr_in6*)&n->ss;
+    for(l = 0; l < b->count && j < *num6; l++) {
+        if(node_good(dht, &b->nodes[l])) {
+            sin6[j] = *(struct sockaddr_in6*)&b->nodes[l].ss;
             j++;
         }
-        n = n->next;
     }
 
-    b = buckets6;
-    while(b && j < *num6) {
-        if(!in_bucket(myid, b)) {
-            n = b->nodes;
-            while(n && j < *num6) {
-                if(node_good(n)) {
-                    sin6[j] = *(struct sockaddr_in6*)&n->ss;
-                    j++;
-                }
-                n = n->next;
+    for(k = 0; k < dht->table6->numbuckets - 1 && j < *num6; k++) {
+        b = &dht->table6->buckets[k];
+        for(l = 0; l < b->count && j < *num6; l++) {
+            if(node_good(dht, &b->nodes[l])) {
+                sin6[j] = *(struct sockaddr_in6*)&b->nodes[l].ss;
+                j++;
             }
         }
-        b = b->next;
     }
 
  no_ipv6:
@@ -2568,7 +3312,8 @@ dht_get_nodes(struct sockaddr_in *sin, int *num,
 //*****************************************************************************
 //*****************************************************************************
 int
-dht_insert_node(const unsigned char *id, struct sockaddr *sa, int salen)
+dht_insert_node(struct DhtNode *dht, const unsigned char *id,
+                struct sockaddr *sa, int salen)
 {
     struct node *n;
 
@@ -2577,175 +3322,217 @@ dht_insert_node(const unsigned char *id, struct sockaddr *sa, int salen)
         return -1;
     }
 
-    n = new_node(id, (struct sockaddr*)sa, salen, 0);
+    n = new_node(dht, id, (struct sockaddr*)sa, salen, 0);
     return !!n;
 }
 
 //*****************************************************************************
 //*****************************************************************************
 int
-dht_ping_node(struct sockaddr *sa, int salen)
+dht_ping_node(struct DhtNode *dht, struct sockaddr *sa, int salen)
 {
     unsigned char tid[4];
 
     debugf("Sending ping.\n");
     make_tid(tid, "pn", 0);
-    return send_ping(sa, salen, tid, 4);
+    return send_ping(dht, sa, salen, tid, 4);
 }
 
 //*****************************************************************************
-// We could use a proper bencoding printer and parser, but the format of
-// DHT messages is fairly stylised, so this seemed simpler
+// Bencode writer over a caller buffer.  A value that does not fit marks
+// the writer full and everything after it is dropped, bencode_send then
+// refuses to send the truncated message
 //*****************************************************************************
-bool INC(int & offset, const int delta, const int size)
+struct bencode {
+    unsigned char *buf;
+    int size;
+    int len;
+    int full;
+};
+
+//*****************************************************************************
+//*****************************************************************************
+static void
+bencode_init(struct bencode *b, unsigned char *buf, int size)
 {
-    if(delta < 0 || offset + delta > size) return false;
-    offset += delta;
-    return true;
+    b->buf = buf;
+    b->size = size;
+    b->len = 0;
+    b->full = 0;
 }
 
-bool COPY(char * buf, int & offset, const unsigned char * src, const int delta, const int size)
+//*****************************************************************************
+//*****************************************************************************
+static void
+bencode_raw(struct bencode *b, const void *data, int len)
 {
-    if(delta < 0 || offset + delta > size) return false;
-    memcpy(buf + offset, src, delta);
-    offset += delta;
-    return true;
+    if(b->full || len < 0 || len > b->size - b->len) {
+        b->full = 1;
+        return;
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static void
+bencode_uint(struct bencode *b, unsigned long v)
+{
+    unsigned char digits[20];
+    int i = sizeof(digits);
+
+    do {
+        digits[--i] = '0' + v % 10;
+        v /= 10;
+    } while(v > 0);
+
+    bencode_raw(b, digits + i, sizeof(digits) - i);
 }
 
-#define ADD_V(buf, offset, size)                        \
-    if(have_v) {                                        \
-        COPY(buf, offset, my_v, sizeof(my_v), size);    \
+//*****************************************************************************
+//*****************************************************************************
+static void
+bencode_int(struct bencode *b, long v)
+{
+    bencode_raw(b, "i", 1);
+    if(v < 0) {
+        bencode_raw(b, "-", 1);
+        bencode_uint(b, -(unsigned long)v);
+    } else {
+        bencode_uint(b, v);
     }
+    bencode_raw(b, "e", 1);
+}
 
 //*****************************************************************************
+// Binary safe, the data is written as is after its length
 //*****************************************************************************
-int dht_send_broadcast(const unsigned char * message, const int length)
+static void
+bencode_string(struct bencode *b, const void *data, int len)
 {
-//    if (!buckets || !buckets->nodes ||
-//        !buckets6 || !buckets6->nodes)
-//    {
-//        // no nodes
-//        return 0;
-//    }
-    if (!storage)
-    {
-        return 0;
+    bencode_uint(b, len);
+    bencode_raw(b, ":", 1);
+    bencode_raw(b, data, len);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static void
+bencode_key(struct bencode *b, const char *key)
+{
+    bencode_string(b, key, strlen(key));
+}
+
+//*****************************************************************************
+// Start of a query (a) or reply (r), the arguments dictionary is left
+// open after our id
+//*****************************************************************************
+static void
+bencode_begin(struct DhtNode *dht, struct bencode *b, int reply)
+{
+    bencode_raw(b, reply ? "d1:rd" : "d1:ad", 5);
+    bencode_key(b, "id");
+    bencode_string(b, dht->myid, 20);
+}
+
+//*****************************************************************************
+// Close the arguments and add the envelope, query is NULL for replies.
+// Messages without tid carry no version either
+//*****************************************************************************
+static void
+bencode_finish(struct DhtNode *dht, struct bencode *b, const char *query,
+               const unsigned char *tid, int tid_len)
+{
+    bencode_raw(b, "e", 1);
+    if(query) {
+        bencode_key(b, "q");
+        bencode_key(b, query);
+    }
+    if(tid) {
+        bencode_key(b, "t");
+        bencode_string(b, tid, tid_len);
+        if(dht->have_v)
+            bencode_raw(b, dht->my_v, sizeof(dht->my_v));
     }
+    bencode_key(b, "y");
+    bencode_key(b, query ? "q" : "r");
+    bencode_raw(b, "e", 1);
+}
 
-    std::string msg((const char *)message, length);
-    msg = util::base64_encode(msg);
+//*****************************************************************************
+//*****************************************************************************
+static void
+bencode_want(struct bencode *b, int want)
+{
+    if(want <= 0)
+        return;
 
-    char buf[512];
-    int i = 0;
+    bencode_key(b, "want");
+    bencode_raw(b, "l", 1);
+    if(want & WANT4)
+        bencode_key(b, "n4");
+    if(want & WANT6)
+        bencode_key(b, "n6");
+    bencode_raw(b, "e", 1);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static int
+bencode_send(struct DhtNode *dht, struct bencode *b, int flags,
+             const struct sockaddr *sa, int salen)
+{
+    if(b->full) {
+        debugf("Message does not fit %d octets, not sent.\n", b->size);
+        errno = ENOSPC;
+        return -1;
+    }
+    return dht_send(dht, (const char *)b->buf, b->len, flags, sa, salen);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int dht_send_broadcast(struct DhtNode *dht, const unsigned char * message,
+                       const int length)
+{
+    if (length > DHT_MAX_FRAGMENTS * DHT_FRAGMENT_SIZE)
     {
-        int rc = _snprintf(buf + i, 512 - i, "d1:ad2:id20:");
-        if (!INC(i, rc, 512)) return -1;
-        if (!COPY(buf, i, myid, 20, 512)) return -1;
-        rc = _snprintf(buf + i, 512 - i, "e1:q9:broadcast%d:", msg.length());
-        if (!INC(i, rc, 512)) return -1;
-        rc = _snprintf(buf + i, 512 - i, "%s", msg.c_str());
-        if (!INC(i, rc, 512)) return -1;
-        rc = _snprintf(buf + i, 512 - i, "1:y1:qe");
-        if (!INC(i, rc, 512)) return -1;
-    }
-
-    struct storage * st = storage;
-    while (st)
+        debugf("Broadcast of %d octets is too long, not sent.\n", length);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // copies coming back are dropped by id
+    unsigned char mid[MESSAGE_ID_SIZE];
+    dht_random_bytes(mid, sizeof(mid));
+    broadcast_remember(dht, mid);
+
+    if (gossip(dht, mid, message, length, NULL) == 0)
     {
-        st->id;
-        st = st->next;
-    }
-
-//    int count = 0;
-//    bucket * b = buckets;
-//    while (b)
-//    {
-//        node * n = b->nodes;
-//        while (n)
-//        {
-//            dht_send(buf, i, 0, (sockaddr *)&n->ss, sizeof(n->ss));
-//            ++count;
-//            n = n->next;
-//        }
-//        b = b->next;
-//    }
-
-//    b = buckets6;
-//    while (b)
-//    {
-//        node * n = b->nodes;
-//        while (n)
-//        {
-//            dht_send(buf, i, 0, (sockaddr *)&n->ss, sizeof(n->ss));
-//            ++count;
-//            n = n->next;
-//        }
-//        b = b->next;
-//    }
-
-//    return (count = 0);
-
-//    search * sr = searches;
-//    while (sr)
-//    {
-//        if (sr->af == AF_INET)
-//        {
-//            if (sr && sr->numnodes)
-//            {
-//                // send to
-//                dht_send(buf, i, 0, (sockaddr *)&sr->nodes[0].ss, sizeof(sr->nodes[0].ss));
-//                break;
-//            }
-//        }
-//        sr = sr->next;
-//    }
-
-//    search * sr6 = searches;
-//    while (sr6)
-//    {
-//        if (sr6->af == AF_INET6)
-//        {
-//            if (sr6 && sr6->numnodes)
-//            {
-//                // send to
-//                dht_send(buf, i, 0, (sockaddr *)&sr6->nodes[0].ss, sizeof(sr6->nodes[0].ss));
-//                break;
-//            }
-//        }
-//        sr6 = sr6->next;
-//    }
-
-//    if (!sr && !sr6)
-//    {
-//        return -1;
-//    }
-
-//    return 0;
-}
-
-//*****************************************************************************
-//*****************************************************************************
-int dht_send_message(const unsigned char * id, const unsigned char * message, const int length)
-{
-    // make message
-    std::string msg((const char *)message, length);
-    msg = util::base64_encode(msg);
-
-    char buf[512];
-    int i = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int dht_send_message(struct DhtNode *dht, const unsigned char * id,
+                     const unsigned char * message, const int length)
+{
+    if (length > DHT_MAX_FRAGMENTS * DHT_FRAGMENT_SIZE)
     {
-        int rc = _snprintf(buf + i, 512 - i, "d1:ad2:id20:");
-        if (!INC(i, rc, 512)) return -1;
-        if (!COPY(buf, i, myid, 20, 512)) return -1;
-        rc = _snprintf(buf + i, 512 - i, "e1:q7:message%d:", msg.length());
-        if (!INC(i, rc, 512)) return -1;
-        rc = _snprintf(buf + i, 512 - i, "%s", msg.c_str());
-        if (!INC(i, rc, 512)) return -1;
-        rc = _snprintf(buf + i, 512 - i, "1:y1:qe");
-        if (!INC(i, rc, 512)) return -1;
-    }
-
-    struct storage * st = find_storage(id);
+        debugf("Message of %d octets is too long, not sent.\n", length);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // one id for all parts
+    unsigned char mid[MESSAGE_ID_SIZE];
+    dht_random_bytes(mid, sizeof(mid));
+
+    struct storage * st = find_storage(dht, id);
     if (st)
     {
         // found local
@@ -2753,35 +3540,44 @@ int dht_send_message(const unsigned char * id, const unsigned char * message, co
     }
 
     // find peer
-    search * sr = searches;
-    while (sr)
+    search * sr = find_search_id(dht, id, AF_INET);
+    if (sr && !sr->numnodes)
     {
-        if (sr->af == AF_INET && id_cmp(sr->id, id) == 0)
-        {
-            if (sr && sr->numnodes)
-            {
-                // send to
-                dht_send(buf, i, 0, (sockaddr *)&sr->nodes[0].ss, sizeof(sr->nodes[0].ss));
-                break;
-            }
-        }
-        sr = sr->next;
+        sr = 0;
+    }
+    search * sr6 = find_search_id(dht, id, AF_INET6);
+    if (sr6 && !sr6->numnodes)
+    {
+        sr6 = 0;
     }
 
-    // find peer
-    search * sr6 = searches;
-    while (sr6)
+    if (dht_reliable && (sr || sr6))
     {
-        if (sr6->af == AF_INET6 && id_cmp(sr6->id, id) == 0)
+        // one node is enough, lost datagrams are sent again
+        search_node * n = sr ? &sr->nodes[0] : &sr6->nodes[0];
+        struct channel * c = find_channel(dht, n->id, 1);
+        if (!c)
         {
-            if (sr6 && sr6->numnodes)
-            {
-                // send to
-                dht_send(buf, i, 0, (sockaddr *)&sr6->nodes[0].ss, sizeof(sr6->nodes[0].ss));
-                break;
-            }
+            debugf("No free channel for reliable message.\n");
+            errno = ENOBUFS;
+            return -1;
         }
-        sr6 = sr6->next;
+        return send_payload(dht, "message", mid, message, length, c,
+                            (sockaddr *)&n->ss, sizeof(n->ss));
+    }
+
+    if (sr)
+    {
+        // send to
+        send_payload(dht, "message", mid, message, length, NULL,
+                     (sockaddr *)&sr->nodes[0].ss, sizeof(sr->nodes[0].ss));
+    }
+
+    if (sr6)
+    {
+        // send to
+        send_payload(dht, "message", mid, message, length, NULL,
+                     (sockaddr *)&sr6->nodes[0].ss, sizeof(sr6->nodes[0].ss));
     }
 
     if (!sr && !sr6)
@@ -2795,7 +3591,7 @@ int dht_send_message(const unsigned char * id, const unsigned char * message, co
 //*****************************************************************************
 //*****************************************************************************
 int
-dht_send(const char * buf, size_t len, int flags,
+dht_send(struct DhtNode *dht, const char * buf, size_t len, int flags,
          const struct sockaddr *sa, int salen)
 {
     int s;
@@ -2803,16 +3599,16 @@ dht_send(const char * buf, size_t len, int flags,
     if(salen == 0)
         abort();
 
-    if(node_blacklisted(sa, salen)) {
+    if(node_blacklisted(dht, sa, salen)) {
         debugf("Attempting to send to blacklisted node.\n");
         errno = EPERM;
         return -1;
     }
 
     if(sa->sa_family == AF_INET)
-        s = dht_socket;
+        s = dht->dht_socket;
     else if(sa->sa_family == AF_INET6)
-        s = dht_socket6;
+        s = dht->dht_socket6;
     else
         s = -1;
 
@@ -2827,115 +3623,75 @@ dht_send(const char * buf, size_t len, int flags,
 //*****************************************************************************
 //*****************************************************************************
 int
-send_ping(const struct sockaddr *sa, int salen,
+send_ping(struct DhtNode *dht, const struct sockaddr *sa, int salen,
           const unsigned char *tid, int tid_len)
 {
-    char buf[512];
-    int i = 0, rc;
-    rc = _snprintf(buf + i, 512 - i, "d1:ad2:id20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, myid, 20, 512)) goto fail;
-    rc = _snprintf(buf + i, 512 - i, "e1:q4:ping1:t%d:", tid_len);
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, tid, tid_len, 512)) goto fail;
-    ADD_V(buf, i, 512);
-    rc = _snprintf(buf + i, 512 - i, "1:y1:qe");
-    if (!INC(i, rc, 512)) goto fail;
-    return dht_send(buf, i, 0, sa, salen);
-
- fail:
-    errno = ENOSPC;
-    return -1;
+    unsigned char buf[512];
+    struct bencode b;
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_begin(dht, &b, 0);
+    bencode_finish(dht, &b, "ping", tid, tid_len);
+    return bencode_send(dht, &b, 0, sa, salen);
 }
 
 //*****************************************************************************
 //*****************************************************************************
 int
-send_pong(const struct sockaddr *sa, int salen,
+send_pong(struct DhtNode *dht, const struct sockaddr *sa, int salen,
           const unsigned char *tid, int tid_len)
 {
-    char buf[512];
-    int i = 0, rc;
-    rc = _snprintf(buf + i, 512 - i, "d1:rd2:id20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, myid, 20, 512)) goto fail;
-    rc = _snprintf(buf + i, 512 - i, "e1:t%d:", tid_len);
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, tid, tid_len, 512)) goto fail;
-    ADD_V(buf, i, 512);
-    rc = _snprintf(buf + i, 512 - i, "1:y1:re");
-    if (!INC(i, rc, 512)) goto fail;
-    return dht_send(buf, i, 0, sa, salen);
-
- fail:
-    errno = ENOSPC;
-    return -1;
+    unsigned char buf[512];
+    struct bencode b;
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_begin(dht, &b, 1);
+    bencode_finish(dht, &b, NULL, tid, tid_len);
+    return bencode_send(dht, &b, 0, sa, salen);
 }
 
 //*****************************************************************************
 //*****************************************************************************
 int
-send_find_node(const struct sockaddr *sa, int salen,
+send_find_node(struct DhtNode *dht, const struct sockaddr *sa, int salen,
                const unsigned char *tid, int tid_len,
                const unsigned char *target, int want, int confirm)
 {
-    char buf[512];
-    int i = 0, rc;
-    rc = _snprintf(buf + i, 512 - i, "d1:ad2:id20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, myid, 20, 512)) goto fail;
-    rc = _snprintf(buf + i, 512 - i, "6:target20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, target, 20, 512)) goto fail;
-    if(want > 0) {
-        rc = _snprintf(buf + i, 512 - i, "4:wantl%s%se",
-                      (want & WANT4) ? "2:n4" : "",
-                      (want & WANT6) ? "2:n6" : "");
-        if (!INC(i, rc, 512)) goto fail;
-    }
-    rc = _snprintf(buf + i, 512 - i, "e1:q9:find_node1:t%d:", tid_len);
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, tid, tid_len, 512)) goto fail;
-    ADD_V(buf, i, 512);
-    rc = _snprintf(buf + i, 512 - i, "1:y1:qe");
-    if (!INC(i, rc, 512)) goto fail;
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
-
- fail:
-    errno = ENOSPC;
-    return -1;
+    unsigned char buf[512];
+    struct bencode b;
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_begin(dht, &b, 0);
+    bencode_key(&b, "target");
+    bencode_string(&b, target, 20);
+    bencode_want(&b, want);
+    bencode_finish(dht, &b, "find_node", tid, tid_len);
+    return bencode_send(dht, &b, confirm ? MSG_CONFIRM : 0, sa, salen);
 }
 
 //*****************************************************************************
 //*****************************************************************************
 int
-send_nodes_peers(const struct sockaddr *sa, int salen,
+send_nodes_peers(struct DhtNode *dht, const struct sockaddr *sa, int salen,
                  const unsigned char *tid, int tid_len,
                  const unsigned char *nodes, int nodes_len,
-                 const unsigned char *nodes6, int nodes6_len,
-                 int af, struct storage *st,
-                 const unsigned char *token, int token_len)
+                 const unsigned char *nodes6, int nodes6_len, int af,
+                 struct storage *st, const unsigned char *token, int token_len)
 {
-    char buf[2048];
-    int i = 0, rc, j0, j, k, len;
+    unsigned char buf[2048];
+    struct bencode b;
+    int j0, j, k, len;
 
-    rc = _snprintf(buf + i, 2048 - i, "d1:rd2:id20:");
-    if (!INC(i, rc, 2048)) goto fail;
-    if (!COPY(buf, i, myid, 20, 2048)) goto fail;
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_begin(dht, &b, 1);
     if(nodes_len > 0) {
-        rc = _snprintf(buf + i, 2048 - i, "5:nodes%d:", nodes_len);
-        if (!INC(i, rc, 2048)) goto fail;
-        if (!COPY(buf, i, nodes, nodes_len, 2048)) goto fail;
+        bencode_key(&b, "nodes");
+        bencode_string(&b, nodes, nodes_len);
     }
     if(nodes6_len > 0) {
-         rc = _snprintf(buf + i, 2048 - i, "6:nodes6%d:", nodes6_len);
-         if (!INC(i, rc, 2048)) goto fail;
-         if (!COPY(buf, i, nodes6, nodes6_len, 2048)) goto fail;
+        bencode_key(&b, "nodes6");
+        bencode_string(&b, nodes6, nodes6_len);
     }
     if(token_len > 0) {
-        rc = _snprintf(buf + i, 2048 - i, "5:token%d:", token_len);
-        if (!INC(i, rc, 2048)) goto fail;
-        if (!COPY(buf, i, token, token_len, 2048)) goto fail;
+        bencode_key(&b, "token");
+        bencode_string(&b, token, token_len);
     }
 
     if(st && st->numpeers > 0) {
@@ -2948,36 +3704,26 @@ send_nodes_peers(const struct sockaddr *sa, int salen,
         j = j0;
         k = 0;
 
-        rc = _snprintf(buf + i, 2048 - i, "6:valuesl");
-        if (!INC(i, rc, 2048)) goto fail;
+        bencode_key(&b, "values");
+        bencode_raw(&b, "l", 1);
         do {
-            if(st->peers[j].len == len) {
+            struct peer *p = &storage_peers(st)[j];
+            if(p->len == len) {
                 unsigned short swapped;
-                swapped = htons(st->peers[j].port);
-                rc = _snprintf(buf + i, 2048 - i, "%d:", len + 2);
-                if (!INC(i, rc, 2048)) goto fail;
-                if (!COPY(buf, i, st->peers[j].ip, len, 2048)) goto fail;
-                if (!COPY(buf, i, (unsigned char *)&swapped, 2, 2048)) goto fail;
+                swapped = htons(p->port);
+                bencode_uint(&b, len + 2);
+                bencode_raw(&b, ":", 1);
+                bencode_raw(&b, p->ip, len);
+                bencode_raw(&b, &swapped, 2);
                 k++;
             }
             j = (j + 1) % st->numpeers;
         } while(j != j0 && k < 50);
-        rc = _snprintf(buf + i, 2048 - i, "e");
-        if (!INC(i, rc, 2048)) goto fail;
+        bencode_raw(&b, "e", 1);
     }
 
-    rc = _snprintf(buf + i, 2048 - i, "e1:t%d:", tid_len);
-    if (!INC(i, rc, 2048)) goto fail;
-    if (!COPY(buf, i, tid, tid_len, 2048)) goto fail;
-    ADD_V(buf, i, 2048);
-    rc = _snprintf(buf + i, 2048 - i, "1:y1:re");
-    if (!INC(i, rc, 2048)) goto fail;
-
-    return dht_send(buf, i, 0, sa, salen);
-
- fail:
-    errno = ENOSPC;
-    return -1;
+    bencode_finish(dht, &b, NULL, tid, tid_len);
+    return bencode_send(dht, &b, 0, sa, salen);
 }
 
 //*****************************************************************************
@@ -3032,14 +3778,13 @@ insert_closest_node(unsigned char *nodes, int numnodes,
 //*****************************************************************************
 //*****************************************************************************
 static int
-buffer_closest_nodes(unsigned char *nodes, int numnodes,
+buffer_closest_nodes(struct DhtNode *dht, unsigned char *nodes, int numnodes,
                      const unsigned char *id, struct bucket *b)
 {
-    struct node *n = b->nodes;
-    while(n) {
-        if(node_good(n))
-            numnodes = insert_closest_node(nodes, numnodes, id, n);
-        n = n->next;
+    int i;
+    for(i = 0; i < b->count; i++) {
+        if(node_good(dht, &b->nodes[i]))
+            numnodes = insert_closest_node(nodes, numnodes, id, &b->nodes[i]);
     }
     return numnodes;
 }
@@ -3047,11 +3792,11 @@ buffer_closest_nodes(unsigned char *nodes, int numnodes,
 //*****************************************************************************
 //*****************************************************************************
 int
-send_closest_nodes(const struct sockaddr *sa, int salen,
+send_closest_nodes(struct DhtNode *dht, const struct sockaddr *sa, int salen,
                    const unsigned char *tid, int tid_len,
-                   const unsigned char *id, int want,
-                   int af, struct storage *st,
-                   const unsigned char *token, int token_len)
+                   const unsigned char *id, int want, int af,
+                   struct storage *st, const unsigned char *token,
+                   int token_len)
 {
     unsigned char nodes[8 * 26];
     unsigned char nodes6[8 * 38];
@@ -3062,32 +3807,33 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
         want = sa->sa_family == AF_INET ? WANT4 : WANT6;
 
     if((want & WANT4)) {
-        b = find_bucket(id, AF_INET);
+        b = find_bucket(dht, id, AF_INET);
         if(b) {
-            numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
-            if(b->next)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b->next);
-            b = previous_bucket(b);
+            numnodes = buffer_closest_nodes(dht, nodes, numnodes, id, b);
+            if(next_bucket(dht, b))
+                numnodes =
+                    buffer_closest_nodes(dht, nodes, numnodes, id, next_bucket(dht, b));
+            b = previous_bucket(dht, b);
             if(b)
-                numnodes = buffer_closest_nodes(nodes, numnodes, id, b);
+                numnodes = buffer_closest_nodes(dht, nodes, numnodes, id, b);
         }
     }
 
     if((want & WANT6)) {
-        b = find_bucket(id, AF_INET6);
+        b = find_bucket(dht, id, AF_INET6);
         if(b) {
-            numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
-            if(b->next)
+            numnodes6 = buffer_closest_nodes(dht, nodes6, numnodes6, id, b);
+            if(next_bucket(dht, b))
                 numnodes6 =
-                    buffer_closest_nodes(nodes6, numnodes6, id, b->next);
-            b = previous_bucket(b);
+                    buffer_closest_nodes(dht, nodes6, numnodes6, id, next_bucket(dht, b));
+            b = previous_bucket(dht, b);
             if(b)
-                numnodes6 = buffer_closest_nodes(nodes6, numnodes6, id, b);
+                numnodes6 = buffer_closest_nodes(dht, nodes6, numnodes6, id, b);
         }
     }
     debugf("  (%d+%d nodes.)\n", numnodes, numnodes6);
 
-    return send_nodes_peers(sa, salen, tid, tid_len,
+    return send_nodes_peers(dht, sa, salen, tid, tid_len,
                             nodes, numnodes * 26,
                             nodes6, numnodes6 * 38,
                             af, st, token, token_len);
@@ -3096,379 +3842,898 @@ send_closest_nodes(const struct sockaddr *sa, int salen,
 //*****************************************************************************
 //*****************************************************************************
 int
-send_get_peers(const struct sockaddr *sa, int salen,
+send_get_peers(struct DhtNode *dht, const struct sockaddr *sa, int salen,
                unsigned char *tid, int tid_len, unsigned char *infohash,
                int want, int confirm)
 {
-    char buf[512];
-    int i = 0, rc;
-
-    rc = _snprintf(buf + i, 512 - i, "d1:ad2:id20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, myid, 20, 512)) goto fail;
-    rc = _snprintf(buf + i, 512 - i, "9:info_hash20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, infohash, 20, 512)) goto fail;
-    if(want > 0) {
-        rc = _snprintf(buf + i, 512 - i, "4:wantl%s%se",
-                      (want & WANT4) ? "2:n4" : "",
-                      (want & WANT6) ? "2:n6" : "");
-        if (!INC(i, rc, 512)) goto fail;
-    }
-    rc = _snprintf(buf + i, 512 - i, "e1:q9:get_peers1:t%d:", tid_len);
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, tid, tid_len, 512)) goto fail;
-    ADD_V(buf, i, 512);
-    rc = _snprintf(buf + i, 512 - i, "1:y1:qe");
-    if (!INC(i, rc, 512)) goto fail;
-    return dht_send(buf, i, confirm ? MSG_CONFIRM : 0, sa, salen);
-
- fail:
-    errno = ENOSPC;
-    return -1;
+    unsigned char buf[512];
+    struct bencode b;
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_begin(dht, &b, 0);
+    bencode_key(&b, "info_hash");
+    bencode_string(&b, infohash, 20);
+    bencode_want(&b, want);
+    bencode_finish(dht, &b, "get_peers", tid, tid_len);
+    return bencode_send(dht, &b, confirm ? MSG_CONFIRM : 0, sa, salen);
 }
 
 //*****************************************************************************
 //*****************************************************************************
 int
-send_announce_peer(const struct sockaddr *sa, int salen,
-                   unsigned char *tid, int tid_len,
-                   unsigned char *infohash, unsigned short port,
-                   unsigned char *token, int token_len, int confirm)
-{
-    char buf[512];
-    int i = 0, rc;
-
-    rc = _snprintf(buf + i, 512 - i, "d1:ad2:id20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, myid, 20, 512)) goto fail;
-    rc = _snprintf(buf + i, 512 - i, "9:info_hash20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, infohash, 20, 512))
-    rc = _snprintf(buf + i, 512 - i, "4:porti%ue5:token%d:", (unsigned)port,
-                  token_len);
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, token, token_len, 512)) goto fail;
-    rc = _snprintf(buf + i, 512 - i, "e1:q13:announce_peer1:t%d:", tid_len);
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, tid, tid_len, 512)) goto fail;
-    ADD_V(buf, i, 512);
-    rc = _snprintf(buf + i, 512 - i, "1:y1:qe");
-    if (!INC(i, rc, 512)) goto fail;
-
-    return dht_send(buf, i, confirm ? 0 : MSG_CONFIRM, sa, salen);
-
- fail:
-    errno = ENOSPC;
-    return -1;
+send_announce_peer(struct DhtNode *dht, const struct sockaddr *sa, int salen,
+                   unsigned char *tid, int tid_len, unsigned char *infohash,
+                   unsigned short port, unsigned char *token, int token_len,
+                   int confirm)
+{
+    unsigned char buf[512];
+    struct bencode b;
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_begin(dht, &b, 0);
+    bencode_key(&b, "info_hash");
+    bencode_string(&b, infohash, 20);
+    bencode_key(&b, "port");
+    bencode_int(&b, port);
+    bencode_key(&b, "token");
+    bencode_string(&b, token, token_len);
+    bencode_finish(dht, &b, "announce_peer", tid, tid_len);
+    return bencode_send(dht, &b, confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
 
 //*****************************************************************************
 //*****************************************************************************
 static int
-send_peer_announced(const struct sockaddr *sa, int salen,
-                    unsigned char *tid, int tid_len)
-{
-    char buf[512];
-    int i = 0, rc;
-
-    rc = _snprintf(buf + i, 512 - i, "d1:rd2:id20:");
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, myid, 20, 512)) goto fail;
-    rc = _snprintf(buf + i, 512 - i, "e1:t%d:", tid_len);
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, tid, tid_len, 512)) goto fail;
-    ADD_V(buf, i, 512);
-    rc = _snprintf(buf + i, 512 - i, "1:y1:re");
-    if (!INC(i, rc, 512)) goto fail;
-    return dht_send(buf, i, 0, sa, salen);
+send_peer_announced(struct DhtNode *dht, const struct sockaddr *sa, int salen,
+                    const unsigned char *tid, int tid_len)
+{
+    unsigned char buf[512];
+    struct bencode b;
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_begin(dht, &b, 1);
+    bencode_finish(dht, &b, NULL, tid, tid_len);
+    return bencode_send(dht, &b, 0, sa, salen);
+}
 
- fail:
-    errno = ENOSPC;
-    return -1;
+//*****************************************************************************
+//*****************************************************************************
+static int
+send_error(struct DhtNode *dht, const struct sockaddr *sa, int salen,
+           const unsigned char *tid, int tid_len, int code,
+           const char *message)
+{
+    unsigned char buf[512];
+    struct bencode b;
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_raw(&b, "d", 1);
+    bencode_key(&b, "e");
+    bencode_raw(&b, "l", 1);
+    bencode_int(&b, code);
+    bencode_key(&b, message);
+    bencode_raw(&b, "e", 1);
+    bencode_key(&b, "t");
+    bencode_string(&b, tid, tid_len);
+    if(dht->have_v)
+        bencode_raw(&b, dht->my_v, sizeof(dht->my_v));
+    bencode_key(&b, "y");
+    bencode_key(&b, "e");
+    bencode_raw(&b, "e", 1);
+    return bencode_send(dht, &b, 0, sa, salen);
 }
 
 //*****************************************************************************
+// Message or broadcast payload to one node, written raw and split in
+// parts of DHT_FRAGMENT_SIZE when it does not fit one datagram
 //*****************************************************************************
 static int
-send_error(const struct sockaddr *sa, int salen,
-           unsigned char *tid, int tid_len,
-           int code, const char *message)
-{
-    char buf[512];
-    int i = 0, rc;
-
-    rc = _snprintf(buf + i, 512 - i, "d1:eli%de%d:",
-                  code, (int)strlen(message));
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, (const unsigned char *)message, (int)strlen(message), 512)) goto fail;
-    rc = _snprintf(buf + i, 512 - i, "e1:t%d:", tid_len);
-    if (!INC(i, rc, 512)) goto fail;
-    if (!COPY(buf, i, tid, tid_len, 512)) goto fail;
-    ADD_V(buf, i, 512);
-    rc = _snprintf(buf + i, 512 - i, "1:y1:ee");
-    if (!INC(i, rc, 512)) goto fail;
-    return dht_send(buf, i, 0, sa, salen);
+send_payload(struct DhtNode *dht, const char *query, const unsigned char *mid,
+             const unsigned char *data, int len, struct channel *c,
+             const struct sockaddr *sa, int salen)
+{
+    unsigned char buf[DHT_FRAGMENT_SIZE + 256];
+    struct bencode b;
+    int parts, i;
+
+    parts = len <= DHT_FRAGMENT_SIZE ? 1 :
+        (len + DHT_FRAGMENT_SIZE - 1) / DHT_FRAGMENT_SIZE;
+    if(parts > DHT_MAX_FRAGMENTS) {
+        errno = EMSGSIZE;
+        return -1;
+    }
 
- fail:
-    errno = ENOSPC;
-    return -1;
+    if(c && !reliable_room(dht, c, parts)) {
+        debugf("Too many unacked datagrams, message not sent.\n");
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for(i = 0; i < parts; i++) {
+        int offset = i * DHT_FRAGMENT_SIZE;
+
+        bencode_init(&b, buf, sizeof(buf));
+        bencode_begin(dht, &b, 0);
+        bencode_key(&b, query);
+        bencode_string(&b, data + offset, MIN(len - offset, DHT_FRAGMENT_SIZE));
+        bencode_key(&b, "mid");
+        bencode_string(&b, mid, MESSAGE_ID_SIZE);
+        if(parts > 1) {
+            bencode_key(&b, "part");
+            bencode_int(&b, i);
+            bencode_key(&b, "parts");
+            bencode_int(&b, parts);
+        }
+        if(c) {
+            bencode_key(&b, "ch");
+            bencode_string(&b, c->ch, CHANNEL_ID_SIZE);
+            bencode_key(&b, "seq");
+            bencode_int(&b, c->next_seq);
+        }
+        bencode_finish(dht, &b, query, NULL, 0);
+
+        /* A reliable datagram that fails to go out now is sent again
+           on timeout. */
+        if(c && !b.full)
+            track_unacked(dht, c, c->next_seq++, &b, sa, salen);
+        if(bencode_send(dht, &b, 0, sa, salen) < 0 && c == NULL)
+            return -1;
+    }
+
+    return 0;
 }
 
 //*****************************************************************************
 //*****************************************************************************
-#undef ADD_V
-
-#ifdef HAVE_MEMMEM
+static long
+ms_since(struct DhtNode *dht, const struct timeval *tv)
+{
+    return (dht->now.tv_sec - tv->tv_sec) * 1000 +
+        (dht->now.tv_usec - tv->tv_usec) / 1000;
+}
 
-static void *
-dht_memmem(const void *haystack, size_t haystacklen,
-           const void *needle, size_t needlelen)
+//*****************************************************************************
+// Channel with node id, a new one takes a free slot or the least recently
+// used channel without unacked datagrams
+//*****************************************************************************
+static struct channel *
+find_channel(struct DhtNode *dht, const unsigned char *id, int create)
 {
-    return memmem(haystack, haystacklen, needle, needlelen);
+    struct channel *slot = NULL;
+    int i;
+
+    for(i = 0; i < DHT_MAX_CHANNELS; i++) {
+        struct channel *c = &dht->channels[i];
+        if(c->time != 0 && id_cmp(c->id, id) == 0) {
+            c->time = dht->now.tv_sec;
+            return c;
+        }
+        if(c->time == 0) {
+            if(slot == NULL || slot->time != 0)
+                slot = c;
+        } else if(c->unacked == 0 &&
+                  (slot == NULL || (slot->time != 0 && c->time < slot->time))) {
+            slot = c;
+        }
+    }
+
+    if(!create || slot == NULL)
+        return NULL;
+
+    memset(slot, 0, sizeof(struct channel));
+    memcpy(slot->id, id, 20);
+    dht_random_bytes(slot->ch, CHANNEL_ID_SIZE);
+    slot->rto = RTO_INITIAL;
+    slot->time = dht->now.tv_sec;
+    return slot;
 }
 
-#else
+//*****************************************************************************
+// Smoothed round trip time and timeout as in RFC 6298
+//*****************************************************************************
+static void
+rtt_sample(struct channel *c, long rtt)
+{
+    if(c->srtt == 0) {
+        c->srtt = MAX(rtt, 1);
+        c->rttvar = rtt / 2;
+    } else {
+        long delta = c->srtt > rtt ? c->srtt - rtt : rtt - c->srtt;
+        c->rttvar = (3 * c->rttvar + delta) / 4;
+        c->srtt = MAX((7 * c->srtt + rtt) / 8, 1);
+    }
+    c->rto = MIN(MAX(c->srtt + 4 * c->rttvar, RTO_MIN), RTO_MAX);
+}
 
 //*****************************************************************************
+// Numbers in flight stay within the receiver window, counted from the
+// oldest unacked datagram
 //*****************************************************************************
-static const unsigned char *
-dht_memmem(const char * haystack, size_t haystacklen,
-           const char * needle, size_t needlelen)
+static int
+reliable_room(struct DhtNode *dht, const struct channel *c, int parts)
 {
-    const char *h = haystack;
-    const char *n = needle;
-    size_t i;
+    unsigned int oldest = c->next_seq;
+    int i, room = 0;
+
+    for(i = 0; i < DHT_MAX_UNACKED; i++) {
+        struct unacked *u = &dht->unacked[i];
+        if(u->c == NULL)
+            room++;
+        else if(u->c == c && u->seq < oldest)
+            oldest = u->seq;
+    }
+    return room >= parts &&
+        c->next_seq + parts - oldest <= DHT_RELIABLE_WINDOW;
+}
 
-    /* size_t is unsigned */
-    if(needlelen > haystacklen)
-        return NULL;
+//*****************************************************************************
+//*****************************************************************************
+static void
+track_unacked(struct DhtNode *dht, struct channel *c, unsigned int seq,
+              const struct bencode *b, const struct sockaddr *sa, int salen)
+{
+    int i;
 
-    for(i = 0; i <= haystacklen - needlelen; i++) {
-        if(memcmp(h + i, n, needlelen) == 0)
-            return (const unsigned char *)(h + i);
+    for(i = 0; i < DHT_MAX_UNACKED; i++) {
+        struct unacked *u = &dht->unacked[i];
+        if(u->c != NULL)
+            continue;
+        u->buf = (unsigned char *)malloc(b->len);
+        if(u->buf == NULL)
+            return;
+        memcpy(u->buf, b->buf, b->len);
+        u->len = b->len;
+        u->c = c;
+        u->seq = seq;
+        memcpy(&u->ss, sa, salen);
+        u->sslen = salen;
+        u->sent = dht->now;
+        u->rto = c->rto;
+        u->retries = 0;
+        c->unacked++;
+        return;
     }
-    return NULL;
 }
 
-#endif
+//*****************************************************************************
+//*****************************************************************************
+static void
+free_unacked(struct unacked *u)
+{
+    u->c->unacked--;
+    free(u->buf);
+    memset(u, 0, sizeof(struct unacked));
+}
 
 //*****************************************************************************
 //*****************************************************************************
 static int
-parse_message(const unsigned char *buf, int buflen,
-              unsigned char *tid_return, int *tid_len,
-              unsigned char *id_return, unsigned char *info_hash_return,
-              unsigned char *target_return, unsigned short *port_return,
-              unsigned char *token_return, int *token_len,
-              unsigned char *nodes_return, int *nodes_len,
-              unsigned char *nodes6_return, int *nodes6_len,
-              unsigned char *values_return, int *values_len,
-              unsigned char *values6_return, int *values6_len,
-              int *want_return)
+send_ack(struct DhtNode *dht, const struct sockaddr *sa, int salen,
+         const struct channel *c)
 {
-    const unsigned char *p;
+    unsigned char buf[512], sack[8];
+    struct bencode b;
+    int i;
 
-    /* This code will happily crash if the buffer is not NUL-terminated. */
-    if(buf[buflen] != '\0') {
-        debugf("Eek!  parse_message with unterminated buffer.\n");
-        return -1;
+    for(i = 0; i < 8; i++)
+        sack[i] = (unsigned char)(c->recv_mask >> (56 - 8 * i));
+
+    bencode_init(&b, buf, sizeof(buf));
+    bencode_begin(dht, &b, 0);
+    bencode_key(&b, "ack");
+    bencode_int(&b, c->recv_next);
+    bencode_key(&b, "ch");
+    bencode_string(&b, c->recv_ch, CHANNEL_ID_SIZE);
+    bencode_key(&b, "sack");
+    bencode_string(&b, sack, 8);
+    bencode_finish(dht, &b, "ack", NULL, 0);
+    return bencode_send(dht, &b, 0, sa, salen);
+}
+
+//*****************************************************************************
+// Record a reliable datagram from node id and ack it, returns 0 for one
+// that was already received.  When the sender gives up on old datagrams
+// the window slides forward past them
+//*****************************************************************************
+static int
+reliable_receive(struct DhtNode *dht, const unsigned char *id,
+                 const struct sockaddr *from, int fromlen,
+                 const struct message_view *m)
+{
+    struct channel *c;
+    unsigned int seq, d;
+    int dup = 0;
+
+    if(m->ch.len != CHANNEL_ID_SIZE)
+        return 0;
+
+    c = find_channel(dht, id, 1);
+    if(c == NULL)
+        return 1;
+
+    if(memcmp(c->recv_ch, m->ch.p, CHANNEL_ID_SIZE) != 0) {
+        memcpy(c->recv_ch, m->ch.p, CHANNEL_ID_SIZE);
+        c->recv_next = 0;
+        c->recv_mask = 0;
     }
 
-#define CHECK(ptr, len)                                                 \
-    if(((unsigned char*)ptr) + (len) > (buf) + (buflen)) goto overflow;
-
-    if(tid_return) {
-        p = dht_memmem((const char *)buf, buflen, "1:t", 3);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 3, &q, 10);
-            if(q && *q == ':' && l > 0 && l < *tid_len) {
-                CHECK(q + 1, l);
-                memcpy(tid_return, q + 1, l);
-                *tid_len = l;
-            } else
-                *tid_len = 0;
-        }
-    }
-    if(id_return) {
-        p = dht_memmem((const char *)buf, buflen, "2:id20:", 7);
-        if(p) {
-            CHECK(p + 7, 20);
-            memcpy(id_return, p + 7, 20);
+    seq = (unsigned int)m->seq;
+    if(seq < c->recv_next) {
+        dup = 1;
+    } else {
+        d = seq - c->recv_next;
+        if(d > DHT_RELIABLE_WINDOW) {
+            d -= DHT_RELIABLE_WINDOW;
+            c->recv_mask = d < 64 ? c->recv_mask >> d : 0;
+            c->recv_next += d;
+        }
+
+        if(seq == c->recv_next) {
+            c->recv_next++;
+            while(c->recv_mask & 1) {
+                c->recv_mask >>= 1;
+                c->recv_next++;
+            }
+            c->recv_mask >>= 1;
         } else {
-            memset(id_return, 0, 20);
+            unsigned long long bit = 1ULL << (seq - c->recv_next - 1);
+            dup = (c->recv_mask & bit) != 0;
+            c->recv_mask |= bit;
         }
     }
-    if(info_hash_return) {
-        p = dht_memmem((const char *)buf, buflen, "9:info_hash20:", 14);
-        if(p) {
-            CHECK(p + 14, 20);
-            memcpy(info_hash_return, p + 14, 20);
-        } else {
-            memset(info_hash_return, 0, 20);
+
+    send_ack(dht, from, fromlen, c);
+    return !dup;
+}
+
+//*****************************************************************************
+// Drop datagrams acked by node id, the round trip time is sampled from
+// the ones sent only once
+//*****************************************************************************
+static void
+reliable_ack(struct DhtNode *dht, const unsigned char *id,
+             const struct message_view *m)
+{
+    struct channel *c;
+    unsigned long long mask = 0;
+    unsigned int ack;
+    long rtt = -1;
+    int i;
+
+    c = find_channel(dht, id, 0);
+    if(c == NULL || m->ack < 0 || m->sack.len != 8 ||
+       m->ch.len != CHANNEL_ID_SIZE ||
+       memcmp(c->ch, m->ch.p, CHANNEL_ID_SIZE) != 0) {
+        debugf("Unexpected ack.\n");
+        return;
+    }
+
+    for(i = 0; i < 8; i++)
+        mask = (mask << 8) | m->sack.p[i];
+    ack = (unsigned int)m->ack;
+
+    for(i = 0; i < DHT_MAX_UNACKED; i++) {
+        struct unacked *u = &dht->unacked[i];
+        if(u->c != c)
+            continue;
+        if(u->seq < ack ||
+           (u->seq > ack && u->seq - ack - 1 < 64 &&
+            (mask & (1ULL << (u->seq - ack - 1))))) {
+            if(u->retries == 0 && (rtt < 0 || ms_since(dht, &u->sent) < rtt))
+                rtt = ms_since(dht, &u->sent);
+            free_unacked(u);
         }
     }
-    if(port_return) {
-        p = dht_memmem((const char *)buf, buflen, "porti", 5);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 5, &q, 10);
-            if(q && *q == 'e' && l > 0 && l < 0x10000)
-                *port_return = static_cast<unsigned short>(l);
-            else
-                *port_return = 0;
-        } else
-            *port_return = 0;
-    }
-    if(target_return) {
-        p = dht_memmem((const char *)buf, buflen, "6:target20:", 11);
-        if(p) {
-            CHECK(p + 11, 20);
-            memcpy(target_return, p + 11, 20);
-        } else {
-            memset(target_return, 0, 20);
-        }
-    }
-    if(token_return) {
-        p = dht_memmem((const char *)buf, buflen, "5:token", 7);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 7, &q, 10);
-            if(q && *q == ':' && l > 0 && l < *token_len) {
-                CHECK(q + 1, l);
-                memcpy(token_return, q + 1, l);
-                *token_len = l;
-            } else
-                *token_len = 0;
-        } else
-            *token_len = 0;
-    }
-
-    if(nodes_len) {
-        p = dht_memmem((const char *)buf, buflen, "5:nodes", 7);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 7, &q, 10);
-            if(q && *q == ':' && l > 0 && l < *nodes_len) {
-                CHECK(q + 1, l);
-                memcpy(nodes_return, q + 1, l);
-                *nodes_len = l;
-            } else
-                *nodes_len = 0;
-        } else
-            *nodes_len = 0;
-    }
-
-    if(nodes6_len) {
-        p = dht_memmem((const char *)buf, buflen, "6:nodes6", 8);
-        if(p) {
-            long l;
-            char *q;
-            l = strtol((char*)p + 8, &q, 10);
-            if(q && *q == ':' && l > 0 && l < *nodes6_len) {
-                CHECK(q + 1, l);
-                memcpy(nodes6_return, q + 1, l);
-                *nodes6_len = l;
-            } else
-                *nodes6_len = 0;
-        } else
-            *nodes6_len = 0;
-    }
-
-    if(values_len || values6_len) {
-        p = dht_memmem((const char *)buf, buflen, "6:valuesl", 9);
-        if(p) {
-            int i = p - buf + 9;
-            int j = 0, j6 = 0;
-            while(1) {
-                long l;
-                char *q;
-                l = strtol((char*)buf + i, &q, 10);
-                if(q && *q == ':' && l > 0) {
-                    CHECK(q + 1, l);
-                    i = q + 1 + l - (char*)buf;
-                    if(l == 6) {
-                        if(j + l > *values_len)
-                            continue;
-                        memcpy((char*)values_return + j, q + 1, l);
-                        j += l;
-                    } else if(l == 18) {
-                        if(j6 + l > *values6_len)
-                            continue;
-                        memcpy((char*)values6_return + j6, q + 1, l);
-                        j6 += l;
-                    } else {
-                        debugf("Received weird value -- %d bytes.\n", (int)l);
+
+    if(rtt >= 0)
+        rtt_sample(c, rtt);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static void
+reliable_retransmit(struct DhtNode *dht)
+{
+    int i;
+
+    for(i = 0; i < DHT_MAX_UNACKED; i++) {
+        struct unacked *u = &dht->unacked[i];
+        if(u->c == NULL || ms_since(dht, &u->sent) < u->rto)
+            continue;
+        if(u->retries >= DHT_MAX_RETRANSMITS) {
+            debugf("Giving up on unacked datagram %u.\n", u->seq);
+            free_unacked(u);
+            continue;
+        }
+        dht_send(dht, (const char *)u->buf, u->len, 0,
+                 (struct sockaddr *)&u->ss, u->sslen);
+        u->retries++;
+        u->sent = dht->now;
+        u->rto = MIN(u->rto * 2, RTO_MAX);
+    }
+}
+
+//*****************************************************************************
+// Milliseconds until an unacked message or a lookup request times out,
+// -1 if none
+//*****************************************************************************
+int
+dht_retransmit_wait(struct DhtNode *dht)
+{
+    struct search *sr;
+    int i;
+    long wait = -1;
+
+    for(i = 0; i < DHT_MAX_UNACKED; i++) {
+        struct unacked *u = &dht->unacked[i];
+        long left;
+        if(u->c == NULL)
+            continue;
+        left = MAX(u->rto - ms_since(dht, &u->sent), 0);
+        if(wait < 0 || left < wait)
+            wait = left;
+    }
+
+    for(sr = dht->searches; sr; sr = sr->next) {
+        if(sr->done)
+            continue;
+        for(i = 0; i < sr->numnodes; i++) {
+            long left;
+            if(!search_node_waiting(dht, &sr->nodes[i]))
+                continue;
+            left = MAX(search_timeout(dht) - ms_since(dht, &sr->nodes[i].request_tv), 0);
+            if(wait < 0 || left < wait)
+                wait = left;
+        }
+    }
+    return (int)wait;
+}
+
+//*****************************************************************************
+// Bencode tokenizer.  Every function returns the position following the
+// value, or NULL if the value is malformed or runs past end.  Strings
+// are returned as spans into the buffer, nothing is copied
+//*****************************************************************************
+static const unsigned char *
+bdecode_string(const unsigned char *p, const unsigned char *end,
+               struct bspan *s)
+{
+    long l = 0;
+
+    if(p >= end || *p < '0' || *p > '9')
+        return NULL;
+
+    while(p < end && *p >= '0' && *p <= '9') {
+        l = l * 10 + (*p - '0');
+        if(l > end - p)
+            return NULL;
+        p++;
+    }
+
+    if(p >= end || *p != ':' || l > end - p - 1)
+        return NULL;
+
+    s->p = p + 1;
+    s->len = l;
+    return p + 1 + l;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static const unsigned char *
+bdecode_int(const unsigned char *p, const unsigned char *end, long *v)
+{
+    const unsigned char *digits;
+    long l = 0;
+    int neg = 0;
+
+    if(p >= end || *p != 'i')
+        return NULL;
+    p++;
+
+    if(p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+
+    digits = p;
+    while(p < end && *p >= '0' && *p <= '9') {
+        if(l > 0x7FFFFFF)
+            return NULL;
+        l = l * 10 + (*p - '0');
+        p++;
+    }
+
+    if(p == digits || p >= end || *p != 'e')
+        return NULL;
+
+    *v = neg ? -l : l;
+    return p + 1;
+}
+
+//*****************************************************************************
+// Skip any value, lists and dictionaries are checked down to the leaves
+//*****************************************************************************
+#define BDECODE_MAX_DEPTH 16
+
+static const unsigned char *
+bdecode_skip(const unsigned char *p, const unsigned char *end, int depth)
+{
+    struct bspan s;
+    long v;
+
+    if(p >= end || depth > BDECODE_MAX_DEPTH)
+        return NULL;
+
+    if(*p == 'i')
+        return bdecode_int(p, end, &v);
+
+    if(*p == 'l' || *p == 'd') {
+        int dict = *p == 'd';
+        p++;
+        while(p < end && *p != 'e') {
+            if(dict) {
+                p = bdecode_string(p, end, &s);
+                if(p == NULL)
+                    return NULL;
+            }
+            p = bdecode_skip(p, end, depth + 1);
+            if(p == NULL)
+                return NULL;
+        }
+        return p < end ? p + 1 : NULL;
+    }
+
+    return bdecode_string(p, end, &s);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+static int
+bspan_is(const struct bspan *s, const char *str)
+{
+    int len = strlen(str);
+    return s->len == len && memcmp(s->p, str, len) == 0;
+}
+
+//*****************************************************************************
+// The a or r dictionary of a message
+//*****************************************************************************
+static const unsigned char *
+parse_arguments(const unsigned char *p, const unsigned char *end,
+                struct message_view *m)
+{
+    struct bspan key, s;
+
+    if(p >= end || *p != 'd')
+        return bdecode_skip(p, end, 1);
+    p++;
+
+    while(p < end && *p != 'e') {
+        const unsigned char *v;
+
+        p = bdecode_string(p, end, &key);
+        if(p == NULL)
+            return NULL;
+        v = p;
+        p = bdecode_skip(p, end, 2);
+        if(p == NULL)
+            return NULL;
+
+        if(*v == 'i') {
+            long l = 0;
+            bdecode_int(v, end, &l);
+            if(bspan_is(&key, "port"))
+                m->port = l > 0 && l < 0x10000 ?
+                    static_cast<unsigned short>(l) : 0;
+            else if(bspan_is(&key, "part"))
+                m->part = l >= 0 && l < DHT_MAX_FRAGMENTS ?
+                    static_cast<int>(l) : -1;
+            else if(bspan_is(&key, "parts"))
+                m->parts = l > 1 && l <= DHT_MAX_FRAGMENTS ?
+                    static_cast<int>(l) : -1;
+            else if(bspan_is(&key, "seq"))
+                m->seq = l >= 0 ? l : -1;
+            else if(bspan_is(&key, "ack"))
+                m->ack = l >= 0 ? l : -1;
+        } else if(*v == 'l') {
+            /* List contents without the enclosing l and e. */
+            s.p = v + 1;
+            s.len = p - v - 2;
+            if(bspan_is(&key, "values")) {
+                m->values = s;
+            } else if(bspan_is(&key, "want")) {
+                const unsigned char *q = s.p;
+                m->want = 0;
+                while(q < s.p + s.len) {
+                    struct bspan flag;
+                    q = bdecode_string(q, end, &flag);
+                    if(q == NULL) {
+                        debugf("eek... unexpected want flag\n");
+                        break;
                     }
-                } else {
-                    break;
+                    if(bspan_is(&flag, "n4"))
+                        m->want |= WANT4;
+                    else if(bspan_is(&flag, "n6"))
+                        m->want |= WANT6;
+                    else
+                        debugf("eek... unexpected want flag\n");
                 }
             }
-            if(i >= buflen || buf[i] != 'e')
-                debugf("eek... unexpected end for values.\n");
-            if(values_len)
-                *values_len = j;
-            if(values6_len)
-                *values6_len = j6;
-        } else {
-            if(values_len)
-                *values_len = 0;
-            if(values6_len)
-                *values6_len = 0;
-        }
-    }
-
-    if(want_return) {
-        p = dht_memmem((const char *)buf, buflen, "4:wantl", 7);
-        if(p) {
-            int i = p - buf + 7;
-            *want_return = 0;
-            while(buf[i] > '0' && buf[i] <= '9' && buf[i + 1] == ':' &&
-                  i + 2 + buf[i] - '0' < buflen) {
-                CHECK(buf + i + 2, buf[i] - '0');
-                if(buf[i] == '2' && memcmp(buf + i + 2, "n4", 2) == 0)
-                    *want_return |= WANT4;
-                else if(buf[i] == '2' && memcmp(buf + i + 2, "n6", 2) == 0)
-                    *want_return |= WANT6;
-                else
-                    debugf("eek... unexpected want flag (%c)\n", buf[i]);
-                i += 2 + buf[i] - '0';
-            }
-            if(i >= buflen || buf[i] != 'e')
-                debugf("eek... unexpected end for want.\n");
+        } else if(*v != 'd') {
+            bdecode_string(v, end, &s);
+            if(bspan_is(&key, "id") && s.len == 20)
+                m->id = s.p;
+            else if(bspan_is(&key, "info_hash") && s.len == 20)
+                m->info_hash = s.p;
+            else if(bspan_is(&key, "target") && s.len == 20)
+                m->target = s.p;
+            else if(bspan_is(&key, "token") && s.len < 128)
+                m->token = s;
+            else if(bspan_is(&key, "nodes"))
+                m->nodes = s;
+            else if(bspan_is(&key, "nodes6"))
+                m->nodes6 = s;
+            else if(bspan_is(&key, "message") || bspan_is(&key, "broadcast"))
+                m->payload = s;
+            else if(bspan_is(&key, "mid"))
+                m->mid = s;
+            else if(bspan_is(&key, "ch"))
+                m->ch = s;
+            else if(bspan_is(&key, "sack"))
+                m->sack = s;
+        }
+    }
+
+    return p < end ? p + 1 : NULL;
+}
+
+//*****************************************************************************
+// One pass over the message, the view points into buf
+//*****************************************************************************
+static int
+parse_message(const unsigned char *buf, int buflen, struct message_view *m)
+{
+    const unsigned char *p = buf, *end = buf + buflen;
+    struct bspan key, y, q;
+
+    memset(m, 0, sizeof(struct message_view));
+    m->id = m->info_hash = m->target = zeroes;
+    m->tid.p = m->token.p = m->nodes.p = m->nodes6.p = buf;
+    m->values.p = m->payload.p = m->mid.p = buf;
+    m->ch.p = m->sack.p = buf;
+    m->want = -1;
+    m->seq = m->ack = -1;
+    y.p = q.p = buf;
+    y.len = q.len = 0;
+
+    if(p >= end || *p != 'd')
+        goto overflow;
+    p++;
+
+    while(p < end && *p != 'e') {
+        p = bdecode_string(p, end, &key);
+        if(p == NULL)
+            goto overflow;
+
+        if(p < end && *p >= '0' && *p <= '9' &&
+           (bspan_is(&key, "t") || bspan_is(&key, "y") ||
+            bspan_is(&key, "q"))) {
+            struct bspan s;
+            p = bdecode_string(p, end, &s);
+            if(key.p[0] == 't') {
+                if(p != NULL && s.len < 16)
+                    m->tid = s;
+            } else if(key.p[0] == 'y')
+                y = s;
+            else
+                q = s;
+        } else if(bspan_is(&key, "a") || bspan_is(&key, "r")) {
+            p = parse_arguments(p, end, m);
         } else {
-            *want_return = -1;
+            p = bdecode_skip(p, end, 1);
         }
+
+        if(p == NULL)
+            goto overflow;
     }
 
-#undef CHECK
+    if(p >= end)
+        goto overflow;
 
-    if(dht_memmem((const char *)buf, buflen, "1:y1:r", 6))
+    if(bspan_is(&y, "r"))
         return REPLY;
-    if(dht_memmem((const char *)buf, buflen, "1:y1:e", 6))
+    if(bspan_is(&y, "e"))
         return ERROR;
-    if(!dht_memmem((const char *)buf, buflen, "1:y1:q", 6))
+    if(!bspan_is(&y, "q"))
         return -1;
-    if(dht_memmem((const char *)buf, buflen, "1:q4:ping", 9))
+    if(bspan_is(&q, "ping"))
         return PING;
-    if(dht_memmem((const char *)buf, buflen, "1:q9:find_node", 14))
-       return FIND_NODE;
-    if(dht_memmem((const char *)buf, buflen, "1:q9:get_peers", 14))
+    if(bspan_is(&q, "find_node"))
+        return FIND_NODE;
+    if(bspan_is(&q, "get_peers"))
         return GET_PEERS;
-    if(dht_memmem((const char *)buf, buflen, "1:q13:announce_peer", 19))
-       return ANNOUNCE_PEER;
-    if(dht_memmem((const char *)buf, buflen, "1:q7:message", 12))
-       return MESSAGE;
-    if(dht_memmem((const char *)buf, buflen, "1:q9:broadcast", 12))
-       return BROADCAST;
+    if(bspan_is(&q, "announce_peer"))
+        return ANNOUNCE_PEER;
+    if(bspan_is(&q, "message"))
+        return MESSAGE;
+    if(bspan_is(&q, "broadcast"))
+        return BROADCAST;
+    if(bspan_is(&q, "ack"))
+        return ACK;
     return -1;
 
  overflow:
     debugf("Truncated message.\n");
     return -1;
 }
+
+//*****************************************************************************
+// Gather the compact peers of the values list, this is the only copy
+//*****************************************************************************
+static void
+message_values(const struct message_view *m,
+               unsigned char *values_return, int *values_len,
+               unsigned char *values6_return, int *values6_len)
+{
+    const unsigned char *p = m->values.p, *end = m->values.p + m->values.len;
+    int j = 0, j6 = 0;
+
+    while(p < end) {
+        struct bspan s;
+        const unsigned char *next = bdecode_skip(p, end, 1);
+        if(next == NULL)
+            break;
+        if(*p >= '0' && *p <= '9') {
+            bdecode_string(p, end, &s);
+            if(s.len == 6 && j + 6 <= *values_len) {
+                memcpy(values_return + j, s.p, 6);
+                j += 6;
+            } else if(s.len == 18 && j6 + 18 <= *values6_len) {
+                memcpy(values6_return + j6, s.p, 18);
+                j6 += 18;
+            } else if(s.len != 6 && s.len != 18) {
+                debugf("Received weird value -- %d bytes.\n", s.len);
+            }
+        }
+        p = next;
+    }
+
+    *values_len = j;
+    *values6_len = j6;
+}
+
+//*****************************************************************************
+// Calls on the default node
+//*****************************************************************************
+int
+dht_init(int s, int s6, const unsigned char *id, const unsigned char *v)
+{
+    return dht_init(dht_default_node(), s, s6, id, v);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_insert_node(const unsigned char *id, struct sockaddr *sa, int salen)
+{
+    return dht_insert_node(dht_default_node(), id, sa, salen);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_ping_node(struct sockaddr *sa, int salen)
+{
+    return dht_ping_node(dht_default_node(), sa, salen);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_periodic(const unsigned char * buf, size_t buflen,
+             const struct sockaddr *from, int fromlen,
+             time_t *tosleep, dht_callback *callback, void *closure)
+{
+    return dht_periodic(dht_default_node(), buf, buflen, from, fromlen,
+                        tosleep, callback, closure);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_storage_store(const unsigned char *id, const struct sockaddr *sa,
+                  unsigned short port)
+{
+    return dht_storage_store(dht_default_node(), id, sa, port);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_search(const unsigned char *id, int port, int af,
+           dht_callback *callback, void *closure)
+{
+    return dht_search(dht_default_node(), id, port, af, callback, closure);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_nodes(int af, int *good_return, int *dubious_return, int *cached_return,
+          int *incoming_return)
+{
+    return dht_nodes(dht_default_node(), af, good_return, dubious_return,
+                     cached_return, incoming_return);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void
+dht_dump_tables(std::string & s)
+{
+    dht_dump_tables(dht_default_node(), s);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_storage_count(void)
+{
+    return dht_storage_count(dht_default_node());
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_search_count(void)
+{
+    return dht_search_count(dht_default_node());
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_get_nodes(struct sockaddr_in *sin, int *num,
+              struct sockaddr_in6 *sin6, int *num6)
+{
+    return dht_get_nodes(dht_default_node(), sin, num, sin6, num6);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_send_message(const unsigned char * id, const unsigned char * message,
+                 const int length)
+{
+    return dht_send_message(dht_default_node(), id, message, length);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_send_broadcast(const unsigned char * message, const int length)
+{
+    return dht_send_broadcast(dht_default_node(), message, length);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_retransmit_wait(void)
+{
+    return dht_retransmit_wait(dht_default_node());
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_send(const char * buf, size_t len, int flags,
+         const struct sockaddr *sa, int salen)
+{
+    return dht_send(dht_default_node(), buf, len, flags, sa, salen);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+int
+dht_uninit(void)
+{
+    return dht_uninit(dht_default_node());
+}
@@ -34,6 +34,43 @@ dht_callback(void *closure, int event,
 #define DHT_EVENT_SEARCH_DONE6 4
 
 extern bool dht_debug;
+/* ack and retransmit messages, see dht_retransmit_wait */
+extern bool dht_reliable;
+/* get_peers requests in flight per lookup */
+extern int dht_search_alpha;
+
+/* A node keeps its own routing table, storage, searches and sockets, so
+   several nodes can run in one process, each on its own thread.  The
+   calls without a node work on dht_default_node(). */
+struct DhtNode;
+
+struct DhtNode * dht_node_new(void);
+void dht_node_free(struct DhtNode *node);
+struct DhtNode * dht_default_node(void);
+
+int dht_init(struct DhtNode *node, int s, int s6, const unsigned char *id, const unsigned char *v);
+int dht_insert_node(struct DhtNode *node, const unsigned char *id, struct sockaddr *sa, int salen);
+int dht_ping_node(struct DhtNode *node, struct sockaddr *sa, int salen);
+int dht_periodic(struct DhtNode *node, const unsigned char * buf, size_t buflen,
+                 const struct sockaddr *from, int fromlen,
+                 time_t *tosleep, dht_callback *callback, void *closure);
+int dht_storage_store(struct DhtNode *node, const unsigned char *id, const struct sockaddr *sa, unsigned short port);
+int dht_search(struct DhtNode *node, const unsigned char *id, int port, int af,
+               dht_callback *callback, void *closure);
+int dht_nodes(struct DhtNode *node, int af,
+              int *good_return, int *dubious_return, int *cached_return,
+              int *incoming_return);
+void dht_dump_tables(struct DhtNode *node, std::string & s);
+int dht_storage_count(struct DhtNode *node);
+int dht_search_count(struct DhtNode *node);
+int dht_get_nodes(struct DhtNode *node, struct sockaddr_in *sin, int *num,
+                  struct sockaddr_in6 *sin6, int *num6);
+int dht_send_message(struct DhtNode *node, const unsigned char * id, const unsigned char * message, const int length);
+int dht_send_broadcast(struct DhtNode *node, const unsigned char * message, const int length);
+int dht_retransmit_wait(struct DhtNode *node);
+int dht_send(struct DhtNode *node, const char * buf, size_t len, int flags,
+             const struct sockaddr *sa, int salen);
+int dht_uninit(struct DhtNode *node);
 
 int dht_init(int s, int s6, const unsigned char *id, const unsigned char *v);
 int dht_insert_node(const unsigned char *id, struct sockaddr *sa, int salen);
@@ -48,10 +85,15 @@ int dht_nodes(int af,
               int *good_return, int *dubious_return, int *cached_return,
               int *incoming_return);
 void dht_dump_tables(std::string & s);
+int dht_storage_count(void);
+int dht_search_count(void);
 int dht_get_nodes(struct sockaddr_in *sin, int *num,
                   struct sockaddr_in6 *sin6, int *num6);
 int dht_send_message(const unsigned char * id, const unsigned char * message, const int length);
 int dht_send_broadcast(const unsigned char * message, const int length);
+/* ms until dht_periodic has unacked messages or lookup requests to send
+   again, -1 if none */
+int dht_retransmit_wait(void);
 int dht_send(const char * buf, size_t len, int flags,
              const struct sockaddr *sa, int salen);
 int dht_uninit(void);
@@ -84,6 +84,16 @@ int main(int argc, char *argv[])
 {
     Settings::instance().init(std::string(*argv) + ".conf");
 
+    // -replay=<journal> applies recorded order flow and exits
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg(argv[i]);
+        if (arg.compare(0, 8, "-replay=") == 0)
+        {
+            return XBridgeExchange::instance().replay(arg.substr(8)) ? 0 : 1;
+        }
+    }
+
     XBridgeApp a(argc, argv);
 
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 0, 0))
@@ -97,12 +107,20 @@ int main(int argc, char *argv[])
               &w, SLOT(onLogMessage(const QString &)));
     w.show();
 
+    // init exchange, tables are built before sessions
+    // and dht are started and read them without lock
+    if (!XBridgeExchange::instance().init())
+    {
+        qDebug() << "exchange init failed";
+        return 1;
+    }
+
+    // auctions, sweep and checkpoint run on initialized tables
+    a.startExchangeTimers();
+
     // init xbridge network
     a.initDht();
 
-    // init exchange
-    XBridgeExchange::instance().init();
-
     int retcode = a.exec();
 
     a.stopDht();
@@ -0,0 +1,258 @@
+//******************************************************************************
+//******************************************************************************
+
+#include "metrics.h"
+#include "logger.h"
+
+#include <sstream>
+
+//******************************************************************************
+//******************************************************************************
+// static
+unsigned int MetricCounter::shardIndex()
+{
+    // threads get shards round robin on first use
+    static std::atomic<unsigned int> next(0);
+    static thread_local unsigned int idx = next.fetch_add(1) % shardCount;
+    return idx;
+}
+
+//******************************************************************************
+//******************************************************************************
+boost::uint64_t MetricCounter::value() const
+{
+    boost::uint64_t result = 0;
+    for (unsigned int i = 0; i < shardCount; ++i)
+    {
+        result += m_shards[i].value.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+//******************************************************************************
+//******************************************************************************
+MetricHistogram::MetricHistogram(const std::vector<boost::uint64_t> & bounds)
+    : m_bounds(bounds)
+{
+    // one more for +Inf
+    for (std::size_t i = 0; i <= m_bounds.size(); ++i)
+    {
+        m_buckets.push_back(new MetricCounter);
+    }
+}
+
+//******************************************************************************
+//******************************************************************************
+MetricHistogram::~MetricHistogram()
+{
+    for (std::vector<MetricCounter *>::iterator i = m_buckets.begin(); i != m_buckets.end(); ++i)
+    {
+        delete *i;
+    }
+}
+
+//******************************************************************************
+//******************************************************************************
+void MetricHistogram::observe(const boost::uint64_t v)
+{
+    // bounds are short and sorted, linear search is cheaper than bisection
+    std::size_t idx = 0;
+    while (idx < m_bounds.size() && v > m_bounds[idx])
+    {
+        ++idx;
+    }
+
+    m_buckets[idx]->inc();
+    m_sum.inc(v);
+    m_count.inc();
+}
+
+//******************************************************************************
+//******************************************************************************
+// static
+Metrics & Metrics::instance()
+{
+    static Metrics m;
+    return m;
+}
+
+//******************************************************************************
+//******************************************************************************
+Metrics::Metrics()
+{
+}
+
+//******************************************************************************
+//******************************************************************************
+Metrics::Family & Metrics::family(const std::string & name,
+                                  const std::string & help,
+                                  const Type type)
+{
+    std::map<std::string, Family>::iterator i = m_families.find(name);
+    if (i == m_families.end())
+    {
+        Family & f = m_families[name];
+        f.type = type;
+        f.help = help;
+        return f;
+    }
+
+    if (i->second.type != type)
+    {
+        ERR() << "metric <" << name << "> registered with different type " << __FUNCTION__;
+    }
+
+    return i->second;
+}
+
+//******************************************************************************
+//******************************************************************************
+MetricCounter & Metrics::counter(const std::string & name,
+                                 const std::string & help,
+                                 const std::string & labels)
+{
+    boost::mutex::scoped_lock l(m_lock);
+
+    boost::shared_ptr<MetricCounter> & ptr = family(name, help, mtCounter).counters[labels];
+    if (!ptr)
+    {
+        ptr.reset(new MetricCounter);
+    }
+    return *ptr;
+}
+
+//******************************************************************************
+//******************************************************************************
+MetricGauge & Metrics::gauge(const std::string & name,
+                             const std::string & help,
+                             const std::string & labels)
+{
+    boost::mutex::scoped_lock l(m_lock);
+
+    boost::shared_ptr<MetricGauge> & ptr = family(name, help, mtGauge).gauges[labels];
+    if (!ptr)
+    {
+        ptr.reset(new MetricGauge);
+    }
+    return *ptr;
+}
+
+//******************************************************************************
+//******************************************************************************
+MetricHistogram & Metrics::histogram(const std::string & name,
+                                     const std::string & help,
+                                     const std::vector<boost::uint64_t> & bounds,
+                                     const std::string & labels)
+{
+    boost::mutex::scoped_lock l(m_lock);
+
+    boost::shared_ptr<MetricHistogram> & ptr = family(name, help, mtHistogram).histograms[labels];
+    if (!ptr)
+    {
+        ptr.reset(new MetricHistogram(bounds));
+    }
+    return *ptr;
+}
+
+//******************************************************************************
+//******************************************************************************
+static std::string withLabels(const std::string & name,
+                              const std::string & labels,
+                              const std::string & extra = std::string())
+{
+    if (labels.empty() && extra.empty())
+    {
+        return name;
+    }
+
+    std::string result = name + "{" + labels;
+    if (!labels.empty() && !extra.empty())
+    {
+        result += ",";
+    }
+    return result + extra + "}";
+}
+
+//******************************************************************************
+//******************************************************************************
+std::string Metrics::exposition() const
+{
+    std::ostringstream out;
+
+    boost::mutex::scoped_lock l(m_lock);
+
+    for (std::map<std::string, Family>::const_iterator i = m_families.begin(); i != m_families.end(); ++i)
+    {
+        const std::string & name = i->first;
+        const Family & f = i->second;
+
+        out << "# HELP " << name << " " << f.help << "\n";
+
+        if (f.type == mtCounter)
+        {
+            out << "# TYPE " << name << " counter\n";
+            for (std::map<std::string, boost::shared_ptr<MetricCounter> >::const_iterator c = f.counters.begin();
+                 c != f.counters.end(); ++c)
+            {
+                out << withLabels(name, c->first) << " " << c->second->value() << "\n";
+            }
+        }
+        else if (f.type == mtGauge)
+        {
+            out << "# TYPE " << name << " gauge\n";
+            for (std::map<std::string, boost::shared_ptr<MetricGauge> >::const_iterator g = f.gauges.begin();
+                 g != f.gauges.end(); ++g)
+            {
+                out << withLabels(name, g->first) << " " << g->second->value() << "\n";
+            }
+        }
+        else
+        {
+            out << "# TYPE " << name << " histogram\n";
+            for (std::map<std::string, boost::shared_ptr<MetricHistogram> >::const_iterator h = f.histograms.begin();
+                 h != f.histograms.end(); ++h)
+            {
+                const MetricHistogram & hist = *h->second;
+
+                // buckets are cumulative in exposition format
+                boost::uint64_t cumulative = 0;
+                for (std::size_t b = 0; b < hist.bounds().size(); ++b)
+                {
+                    cumulative += hist.bucket(b);
+
+                    std::ostringstream le;
+                    le << "le=\"" << hist.bounds()[b] << "\"";
+                    out << withLabels(name + "_bucket", h->first, le.str()) << " " << cumulative << "\n";
+                }
+                cumulative += hist.bucket(hist.bounds().size());
+
+                out << withLabels(name + "_bucket", h->first, "le=\"+Inf\"") << " " << cumulative << "\n";
+                out << withLabels(name + "_sum", h->first) << " " << hist.sum() << "\n";
+                out << withLabels(name + "_count", h->first) << " " << hist.count() << "\n";
+            }
+        }
+    }
+
+    return out.str();
+}
+
+//******************************************************************************
+//******************************************************************************
+// static
+std::vector<boost::uint64_t> Metrics::exponentialBounds(const boost::uint64_t max)
+{
+    std::vector<boost::uint64_t> result;
+    for (boost::uint64_t base = 1; base <= max; base *= 10)
+    {
+        result.push_back(base);
+        if (base * 2 <= max)
+        {
+            result.push_back(base * 2);
+        }
+        if (base * 5 <= max)
+        {
+            result.push_back(base * 5);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,147 @@
+//******************************************************************************
+//******************************************************************************
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/noncopyable.hpp>
+
+//******************************************************************************
+// counter shards are padded to a cache line, so threads updating
+// the same counter never contend on one line
+//******************************************************************************
+struct MetricShard
+{
+    std::atomic<boost::uint64_t> value;
+    char                         pad[64 - sizeof(std::atomic<boost::uint64_t>)];
+
+    MetricShard() : value(0) {}
+};
+
+//******************************************************************************
+//******************************************************************************
+class MetricCounter : private boost::noncopyable
+{
+public:
+    enum
+    {
+        shardCount = 16
+    };
+
+public:
+    void inc(const boost::uint64_t v = 1)
+    {
+        m_shards[shardIndex()].value.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    boost::uint64_t value() const;
+
+    static unsigned int shardIndex();
+
+private:
+    MetricShard m_shards[shardCount];
+};
+
+//******************************************************************************
+//******************************************************************************
+class MetricGauge : private boost::noncopyable
+{
+public:
+    MetricGauge() : m_value(0) {}
+
+    void set(const boost::int64_t v)    { m_value.store(v, std::memory_order_relaxed); }
+    void inc(const boost::int64_t v = 1) { m_value.fetch_add(v, std::memory_order_relaxed); }
+    void dec(const boost::int64_t v = 1) { m_value.fetch_sub(v, std::memory_order_relaxed); }
+
+    boost::int64_t value() const        { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<boost::int64_t> m_value;
+};
+
+//******************************************************************************
+// integer valued histogram (sizes, microseconds), buckets are upper bounds
+//******************************************************************************
+class MetricHistogram : private boost::noncopyable
+{
+public:
+    explicit MetricHistogram(const std::vector<boost::uint64_t> & bounds);
+    ~MetricHistogram();
+
+    void observe(const boost::uint64_t v);
+
+    const std::vector<boost::uint64_t> & bounds() const { return m_bounds; }
+    // count of values in bucket, last bucket is +Inf
+    boost::uint64_t bucket(const std::size_t idx) const { return m_buckets[idx]->value(); }
+    boost::uint64_t sum() const                         { return m_sum.value(); }
+    boost::uint64_t count() const                       { return m_count.value(); }
+
+private:
+    std::vector<boost::uint64_t> m_bounds;
+    std::vector<MetricCounter *> m_buckets;
+    MetricCounter                m_sum;
+    MetricCounter                m_count;
+};
+
+//******************************************************************************
+// registry of named metrics, registration takes the lock, updates do not,
+// so callers keep returned references for the hot path
+//******************************************************************************
+class Metrics
+{
+public:
+    static Metrics & instance();
+
+    MetricCounter   & counter(const std::string & name,
+                              const std::string & help,
+                              const std::string & labels = std::string());
+    MetricGauge     & gauge(const std::string & name,
+                            const std::string & help,
+                            const std::string & labels = std::string());
+    MetricHistogram & histogram(const std::string & name,
+                                const std::string & help,
+                                const std::vector<boost::uint64_t> & bounds,
+                                const std::string & labels = std::string());
+
+    // text exposition format (prometheus 0.0.4)
+    std::string exposition() const;
+
+    // 1, 2, 5, 10, 20, 50... up to max
+    static std::vector<boost::uint64_t> exponentialBounds(const boost::uint64_t max);
+
+private:
+    Metrics();
+
+    enum Type
+    {
+        mtCounter,
+        mtGauge,
+        mtHistogram
+    };
+
+    struct Family
+    {
+        Type        type;
+        std::string help;
+
+        std::map<std::string, boost::shared_ptr<MetricCounter> >   counters;
+        std::map<std::string, boost::shared_ptr<MetricGauge> >     gauges;
+        std::map<std::string, boost::shared_ptr<MetricHistogram> > histograms;
+    };
+
+    Family & family(const std::string & name, const std::string & help, const Type type);
+
+private:
+    mutable boost::mutex          m_lock;
+    std::map<std::string, Family> m_families;
+};
+
+#endif // METRICS_H
@@ -0,0 +1,239 @@
+//******************************************************************************
+//******************************************************************************
+
+#include "metricsserver.h"
+#include "metrics.h"
+#include "logger.h"
+
+#include <sstream>
+
+#include <boost/bind.hpp>
+
+//******************************************************************************
+//******************************************************************************
+namespace
+{
+
+// seconds for client to send request and read response
+const long connectionTimeout = 5;
+
+} // namespace
+
+//******************************************************************************
+//******************************************************************************
+// static
+MetricsServer & MetricsServer::instance()
+{
+    static MetricsServer s;
+    return s;
+}
+
+//******************************************************************************
+//******************************************************************************
+MetricsServer::MetricsServer()
+{
+    addHandler("/metrics", "text/plain; version=0.0.4",
+               [](const std::string &) { return Metrics::instance().exposition(); });
+}
+
+//******************************************************************************
+//******************************************************************************
+MetricsServer::~MetricsServer()
+{
+    stop();
+}
+
+//******************************************************************************
+//******************************************************************************
+void MetricsServer::addHandler(const std::string & path,
+                               const std::string & contentType,
+                               const Handler & handler)
+{
+    boost::mutex::scoped_lock l(m_routesLock);
+
+    Route & r = m_routes[path];
+    r.contentType = contentType;
+    r.handler     = handler;
+}
+
+//******************************************************************************
+//******************************************************************************
+bool MetricsServer::start(const unsigned short port)
+{
+    if (m_acceptor)
+    {
+        return true;
+    }
+
+    try
+    {
+        boost::asio::ip::tcp::endpoint ep(boost::asio::ip::address_v4::loopback(), port);
+        m_acceptor.reset(new boost::asio::ip::tcp::acceptor(m_io, ep));
+
+        accept();
+
+        m_thread = boost::thread(boost::bind(&boost::asio::io_service::run, &m_io));
+    }
+    catch (std::exception & e)
+    {
+        ERR() << e.what() << " " << __FUNCTION__;
+        m_acceptor.reset();
+        return false;
+    }
+
+    LOG() << "metrics exported at 127.0.0.1:" << port;
+    return true;
+}
+
+//******************************************************************************
+//******************************************************************************
+void MetricsServer::stop()
+{
+    if (!m_acceptor)
+    {
+        return;
+    }
+
+    m_io.stop();
+    m_thread.join();
+    m_acceptor.reset();
+}
+
+//******************************************************************************
+//******************************************************************************
+void MetricsServer::accept()
+{
+    SocketPtr socket(new Socket(m_io));
+    m_acceptor->async_accept(*socket,
+                             boost::bind(&MetricsServer::onAccept, this, socket,
+                                         boost::asio::placeholders::error));
+}
+
+//******************************************************************************
+//******************************************************************************
+void MetricsServer::onAccept(SocketPtr socket, const boost::system::error_code & error)
+{
+    if (error == boost::asio::error::operation_aborted)
+    {
+        return;
+    }
+
+    // keep listening, failed accept affects only this connection
+    accept();
+
+    if (error)
+    {
+        ERR() << "metrics server failed to accept connection " << error.message();
+        return;
+    }
+
+    // silent clients are disconnected
+    TimerPtr timer(new Timer(m_io, boost::posix_time::seconds(connectionTimeout)));
+    timer->async_wait(boost::bind(&MetricsServer::onTimeout, this, socket,
+                                  boost::asio::placeholders::error));
+
+    // only the request line is interesting, headers are ignored
+    BufferPtr buffer(new Buffer(4096));
+    boost::asio::async_read_until(*socket, *buffer, "\r\n",
+                                  boost::bind(&MetricsServer::onRead, this, socket, buffer, timer,
+                                              boost::asio::placeholders::error));
+}
+
+//******************************************************************************
+//******************************************************************************
+void MetricsServer::onRead(SocketPtr socket, BufferPtr buffer, TimerPtr timer,
+                           const boost::system::error_code & error)
+{
+    if (error)
+    {
+        timer->cancel();
+        return;
+    }
+
+    std::istream in(buffer.get());
+    std::string requestLine;
+    std::getline(in, requestLine);
+
+    boost::shared_ptr<std::string> r(new std::string(response(requestLine)));
+    boost::asio::async_write(*socket, boost::asio::buffer(*r),
+                             boost::bind(&MetricsServer::onWrite, this, socket, r, timer,
+                                         boost::asio::placeholders::error));
+}
+
+//******************************************************************************
+//******************************************************************************
+void MetricsServer::onWrite(SocketPtr socket, boost::shared_ptr<std::string> /*response*/,
+                            TimerPtr timer, const boost::system::error_code & /*error*/)
+{
+    timer->cancel();
+
+    boost::system::error_code ec;
+    socket->shutdown(Socket::shutdown_both, ec);
+    socket->close(ec);
+}
+
+//******************************************************************************
+//******************************************************************************
+void MetricsServer::onTimeout(SocketPtr socket, const boost::system::error_code & error)
+{
+    if (error == boost::asio::error::operation_aborted)
+    {
+        return;
+    }
+
+    // pending read or write completes with error and releases the socket
+    boost::system::error_code ec;
+    socket->close(ec);
+}
+
+//******************************************************************************
+//******************************************************************************
+std::string MetricsServer::response(const std::string & requestLine)
+{
+    // GET /path?query HTTP/1.x
+    std::istringstream in(requestLine);
+    std::string method, target;
+    in >> method >> target;
+
+    std::string path  = target;
+    std::string query;
+    std::string::size_type pos = target.find('?');
+    if (pos != std::string::npos)
+    {
+        path  = target.substr(0, pos);
+        query = target.substr(pos + 1);
+    }
+
+    if (path.empty() || path == "/")
+    {
+        path = "/metrics";
+    }
+
+    Route route;
+    {
+        boost::mutex::scoped_lock l(m_routesLock);
+        std::map<std::string, Route>::const_iterator i = m_routes.find(path);
+        if (method == "GET" && i != m_routes.end())
+        {
+            route = i->second;
+        }
+    }
+
+    std::ostringstream out;
+    if (!route.handler)
+    {
+        out << "HTTP/1.0 404 Not Found\r\n"
+            << "Content-Length: 0\r\n"
+            << "Connection: close\r\n\r\n";
+        return out.str();
+    }
+
+    std::string body = route.handler(query);
+
+    out << "HTTP/1.0 200 OK\r\n"
+        << "Content-Type: " << route.contentType << "\r\n"
+        << "Content-Length: " << body.size() << "\r\n"
+        << "Connection: close\r\n\r\n"
+        << body;
+    return out.str();
+}
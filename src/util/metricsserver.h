@@ -0,0 +1,73 @@
+//******************************************************************************
+//******************************************************************************
+
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <string>
+#include <map>
+#include <functional>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+
+//******************************************************************************
+// minimal http/1.0 responder for local scraping, listens on loopback only,
+// every request is answered from a registered handler and the connection
+// is closed
+//******************************************************************************
+class MetricsServer
+{
+public:
+    typedef std::function<std::string (const std::string & query)> Handler;
+
+    typedef boost::asio::ip::tcp::socket  Socket;
+    typedef boost::shared_ptr<Socket>     SocketPtr;
+    typedef boost::asio::streambuf        Buffer;
+    typedef boost::shared_ptr<Buffer>     BufferPtr;
+    typedef boost::asio::deadline_timer   Timer;
+    typedef boost::shared_ptr<Timer>      TimerPtr;
+
+public:
+    static MetricsServer & instance();
+
+    // "/metrics" is registered by default
+    void addHandler(const std::string & path,
+                    const std::string & contentType,
+                    const Handler & handler);
+
+    bool start(const unsigned short port);
+    void stop();
+
+private:
+    MetricsServer();
+    ~MetricsServer();
+
+    void accept();
+    void onAccept(SocketPtr socket, const boost::system::error_code & error);
+    void onRead(SocketPtr socket, BufferPtr buffer, TimerPtr timer,
+                const boost::system::error_code & error);
+    void onWrite(SocketPtr socket, boost::shared_ptr<std::string> response,
+                 TimerPtr timer, const boost::system::error_code & error);
+    void onTimeout(SocketPtr socket, const boost::system::error_code & error);
+
+    std::string response(const std::string & requestLine);
+
+private:
+    struct Route
+    {
+        std::string contentType;
+        Handler     handler;
+    };
+
+    boost::asio::io_service                         m_io;
+    boost::shared_ptr<boost::asio::ip::tcp::acceptor> m_acceptor;
+    boost::thread                                   m_thread;
+
+    boost::mutex                                    m_routesLock;
+    std::map<std::string, Route>                    m_routes;
+};
+
+#endif // METRICSSERVER_H
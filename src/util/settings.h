@@ -28,6 +28,11 @@ public:
         return value;
     }
 
+    template<typename T> T get(std::string key, const T & defaultValue) const
+    {
+        return m_pt.get<T>(key, defaultValue);
+    }
+
     // boost::property_tree::ptree & properties() { return m_pt; }
 private:
     Settings();
@@ -4,6 +4,7 @@
 #include "xbridge.h"
 #include "xbridgesession.h"
 #include "xbridgeapp.h"
+#include "xbridgeexchange.h"
 #include "util/logger.h"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -14,6 +15,10 @@ XBridge::XBridge()
     : m_timerIoWork(m_timerIo)
     , m_timerThread(boost::bind(&boost::asio::io_service::run, &m_timerIo))
     , m_timer(m_timerIo, boost::posix_time::seconds(TIMER_INTERVAL))
+    , m_auctionTimer(m_timerIo)
+    , m_snapshotTimer(m_timerIo)
+    , m_marketDataTimer(m_timerIo)
+    , m_exchangeStarted(false)
 {
     try
     {
@@ -37,7 +42,6 @@ XBridge::XBridge()
         LOG() << "xbridge service listen at port " << LISTEN_PORT;
 
         m_timer.async_wait(boost::bind(&XBridge::onTimer, this));
-
     }
     catch (std::exception & e)
     {
@@ -46,6 +50,36 @@ XBridge::XBridge()
     }
 }
 
+//*****************************************************************************
+//*****************************************************************************
+void XBridge::startExchangeTimers()
+{
+    unsigned int interval = XBridgeExchange::instance().auctionInterval();
+    if (interval)
+    {
+        LOG() << "exchange batch auction every " << interval << " ms";
+
+        m_auctionTimer.expires_from_now(boost::posix_time::milliseconds(interval));
+        m_auctionTimer.async_wait(boost::bind(&XBridge::onAuctionTimer, this));
+    }
+
+    interval = XBridgeExchange::instance().snapshotInterval();
+    if (interval)
+    {
+        m_snapshotTimer.expires_from_now(boost::posix_time::milliseconds(interval));
+        m_snapshotTimer.async_wait(boost::bind(&XBridge::onSnapshotTimer, this));
+    }
+
+    interval = XBridgeExchange::instance().marketDataInterval();
+    if (interval)
+    {
+        m_marketDataTimer.expires_from_now(boost::posix_time::milliseconds(interval));
+        m_marketDataTimer.async_wait(boost::bind(&XBridge::onMarketDataTimer, this));
+    }
+
+    m_exchangeStarted = true;
+}
+
 //*****************************************************************************
 //*****************************************************************************
 void XBridge::run()
@@ -59,6 +93,9 @@ void XBridge::run()
 void XBridge::stop()
 {
     m_timer.cancel();
+    m_auctionTimer.cancel();
+    m_snapshotTimer.cancel();
+    m_marketDataTimer.cancel();
     m_timerIo.stop();
 
     for (auto i = m_services.begin(); i != m_services.end(); ++i)
@@ -109,12 +146,69 @@ void XBridge::onTimer()
 {
     // DEBUG_TRACE();
 
+    // wallet table is filled by exchange init
     XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
-    if (app)
+    if (app && m_exchangeStarted)
     {
         app->onSendListOfWallets();
     }
 
+    if (m_exchangeStarted)
+    {
+        XBridgeExchange & e = XBridgeExchange::instance();
+
+        // members of dropped transactions notified by event subscriber
+        e.sweepExpired();
+
+        e.checkpoint();
+    }
+
     m_timer.expires_at(m_timer.expires_at() + boost::posix_time::seconds(TIMER_INTERVAL));
     m_timer.async_wait(boost::bind(&XBridge::onTimer, this));
 }
+
+//******************************************************************************
+//******************************************************************************
+void XBridge::onAuctionTimer()
+{
+    XBridgeExchange & e = XBridgeExchange::instance();
+
+    // holds sent by event subscriber
+    e.runAuctions();
+
+    m_auctionTimer.expires_at(m_auctionTimer.expires_at() +
+                              boost::posix_time::milliseconds(e.auctionInterval()));
+    m_auctionTimer.async_wait(boost::bind(&XBridge::onAuctionTimer, this));
+}
+
+//******************************************************************************
+//******************************************************************************
+void XBridge::onSnapshotTimer()
+{
+    XBridgeExchange & e = XBridgeExchange::instance();
+
+    e.publishSnapshot();
+
+    m_snapshotTimer.expires_at(m_snapshotTimer.expires_at() +
+                               boost::posix_time::milliseconds(e.snapshotInterval()));
+    m_snapshotTimer.async_wait(boost::bind(&XBridge::onSnapshotTimer, this));
+}
+
+//******************************************************************************
+//******************************************************************************
+void XBridge::onMarketDataTimer()
+{
+    XBridgeExchange & e = XBridgeExchange::instance();
+
+    std::vector<XBridgeMarketData> data = e.takeMarketData();
+
+    XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
+    if (app && !data.empty())
+    {
+        app->onSendMarketData(data);
+    }
+
+    m_marketDataTimer.expires_at(m_marketDataTimer.expires_at() +
+                                 boost::posix_time::milliseconds(e.marketDataInterval()));
+    m_marketDataTimer.async_wait(boost::bind(&XBridge::onMarketDataTimer, this));
+}
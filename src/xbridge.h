@@ -5,6 +5,7 @@
 #define XBRIDGE_H
 
 #include <deque>
+#include <atomic>
 
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
@@ -32,6 +33,9 @@ public:
     void run();
     void stop();
 
+    // after exchange init, tables are built
+    void startExchangeTimers();
+
 private:
     void listen();
 
@@ -39,6 +43,9 @@ private:
                 const boost::system::error_code & error);
 
     void onTimer();
+    void onAuctionTimer();
+    void onSnapshotTimer();
+    void onMarketDataTimer();
 
 private:
     std::deque<IoServicePtr>                        m_services;
@@ -50,6 +57,12 @@ private:
     boost::asio::io_service::work                   m_timerIoWork;
     boost::thread                                   m_timerThread;
     boost::asio::deadline_timer                     m_timer;
+    boost::asio::deadline_timer                     m_auctionTimer;
+    boost::asio::deadline_timer                     m_snapshotTimer;
+    boost::asio::deadline_timer                     m_marketDataTimer;
+
+    // wallet list, sweep and checkpoint on main timer
+    std::atomic<bool>                               m_exchangeStarted;
 };
 
 #endif // XBRIDGE_H
@@ -3,7 +3,10 @@
 
 #include "xbridgeapp.h"
 #include "xbridgeexchange.h"
+#include "xbridgetrace.h"
 #include "util/util.h"
+#include "util/settings.h"
+#include "util/metricsserver.h"
 #include "dht/dht.h"
 
 #include <thread>
@@ -12,6 +15,7 @@
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 
 #include <openssl/rand.h>
 #include <openssl/md5.h>
@@ -30,9 +34,19 @@ XBridgeApp::XBridgeApp(int argc, char *argv[])
     , m_signalDump(false)
     , m_signalSearch(false)
     , m_signalSend(false)
+    , m_signalStore(false)
     , m_ipv4(true)
     , m_ipv6(true)
     , m_dhtPort(33330)
+    , m_marketDataSubscription(600)
+    , m_sendQueueDepth(Metrics::instance().gauge("xbridge_app_send_queue_depth",
+                                                 "messages waiting for dht thread"))
+    , m_searchQueueDepth(Metrics::instance().gauge("xbridge_app_search_queue_depth",
+                                                   "searches waiting for dht thread"))
+    , m_sessionCount(Metrics::instance().gauge("xbridge_app_sessions",
+                                               "addresses of connected local clients"))
+    , m_broadcastDuplicates(Metrics::instance().counter("xbridge_app_broadcast_duplicates_total",
+                                                        "already processed broadcasts dropped"))
 {
 }
 
@@ -51,6 +65,24 @@ const unsigned char hash[20] =
     0x1f, 0x81, 0x94, 0xa9, 0x3a, 0x16, 0x98, 0x8b, 0x72, 0x7b
 };
 
+//*****************************************************************************
+// value of key=value pair of http query, empty if not found
+//*****************************************************************************
+std::string queryValue(const std::string & query, const std::string & key)
+{
+    std::vector<std::string> pairs;
+    boost::algorithm::split(pairs, query, boost::is_any_of("&"));
+    for (std::vector<std::string>::iterator i = pairs.begin(); i != pairs.end(); ++i)
+    {
+        std::size_t pos = i->find('=');
+        if (pos != std::string::npos && i->substr(0, pos) == key)
+        {
+            return i->substr(pos + 1);
+        }
+    }
+    return std::string();
+}
+
 //*****************************************************************************
 //*****************************************************************************
 bool XBridgeApp::initDht()
@@ -117,6 +149,49 @@ bool XBridgeApp::initDht()
     m_sin6.sin6_port = htons(static_cast<unsigned short>(m_dhtPort));
 
     dht_debug = true;
+    dht_reliable = Settings::instance().get<bool>("Main.DhtReliable", false);
+    dht_search_alpha = Settings::instance().get<int>("Main.DhtSearchAlpha", 3);
+
+    m_marketDataSubscription = Settings::instance().get<unsigned int>("Main.MarketDataSubscription", 600);
+
+    // local metrics endpoint, disabled by default
+    unsigned short metricsPort = Settings::instance().get<unsigned short>("Main.MetricsPort", 0);
+    if (metricsPort)
+    {
+        MetricsServer & ms = MetricsServer::instance();
+        ms.addHandler("/trace", "application/json",
+                      [](const std::string &) { return XBridgeTrace::instance().json(); });
+        ms.addHandler("/trace/chrome", "application/json",
+                      [](const std::string &) { return XBridgeTrace::instance().chromeTrace(); });
+        ms.addHandler("/trace/report", "text/plain",
+                      [](const std::string &) { return XBridgeTrace::instance().report(); });
+
+        // exchange state from last snapshot, same data as xbcExchangeQuery
+        ms.addHandler("/exchange/books", "application/json",
+                      [](const std::string &)
+        {
+            return XBridgeExchange::instance().snapshot()->booksJson();
+        });
+        ms.addHandler("/exchange/orders", "application/json",
+                      [](const std::string & query)
+        {
+            // ?address=hex, all orders if omitted
+            uint160 address(queryValue(query, "address"));
+            return XBridgeExchange::instance().snapshot()->ordersJson(address);
+        });
+        ms.addHandler("/exchange/transaction", "application/json",
+                      [](const std::string & query)
+        {
+            // ?id=hex of order or hub transaction
+            uint256 id(queryValue(query, "id"));
+            return XBridgeExchange::instance().snapshot()->transactionJson(id);
+        });
+        ms.start(metricsPort);
+    }
+
+    // exchange replies are sent from event bus thread
+    XBridgeEventBus::instance().subscribe("notifier",
+                                          boost::bind(&XBridgeApp::onExchangeEvent, this, _1));
 
     // start dht thread
     m_dhtStarted = false;
@@ -129,6 +204,13 @@ bool XBridgeApp::initDht()
     return true;
 }
 
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeApp::startExchangeTimers()
+{
+    m_bridge.startExchangeTimers();
+}
+
 //*****************************************************************************
 //*****************************************************************************
 bool XBridgeApp::stopDht()
@@ -141,6 +223,11 @@ bool XBridgeApp::stopDht()
     m_bridge.stop();
     m_bridgeThread.join();
 
+    // send queue is not served after dht thread stopped
+    XBridgeEventBus::instance().stop();
+
+    MetricsServer::instance().stop();
+
     return true;
 }
 
@@ -170,6 +257,7 @@ void XBridgeApp::onDump()
 void XBridgeApp::onSearch(const std::string & id)
 {
     m_searchStrings.push_back(id);
+    m_searchQueueDepth.set(m_searchStrings.size());
     m_signalSearch = true;
 }
 
@@ -177,7 +265,9 @@ void XBridgeApp::onSearch(const std::string & id)
 //*****************************************************************************
 void XBridgeApp::onSend(const std::vector<unsigned char> & message)
 {
+    boost::mutex::scoped_lock l(m_sendLock);
     m_messages.push_back(std::make_pair(std::vector<unsigned char>(), message));
+    m_sendQueueDepth.set(m_messages.size());
     m_signalSend = true;
 }
 
@@ -196,7 +286,9 @@ void XBridgeApp::onSend(const XBridgePacketPtr packet)
 //*****************************************************************************
 void XBridgeApp::onSend(const UcharVector & id, const UcharVector & message)
 {
+    boost::mutex::scoped_lock l(m_sendLock);
     m_messages.push_back(std::make_pair(id, message));
+    m_sendQueueDepth.set(m_messages.size());
     m_signalSend = true;
 }
 
@@ -208,6 +300,34 @@ void XBridgeApp::onSend(const std::vector<unsigned char> & id, const XBridgePack
     onSend(id, v);
 }
 
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeApp::onSend(const uint160 & id, const UcharVector & message)
+{
+    onSend(UcharVector(id.begin(), id.end()), message);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeApp::onSend(const uint160 & id, const XBridgePacketPtr packet)
+{
+    onSend(UcharVector(id.begin(), id.end()), packet);
+}
+
+//*****************************************************************************
+// called on dht thread, like sends of queued broadcasts
+//*****************************************************************************
+void XBridgeApp::onSendLocal(const XBridgePacketPtr packet)
+{
+    UcharVector v(packet->header(), packet->header()+packet->allSize());
+
+    boost::mutex::scoped_lock l(m_sessionsLock);
+    for (SessionMap::iterator i = m_sessions.begin(); i != m_sessions.end(); ++i)
+    {
+        i->second->sendXBridgeMessage(v);
+    }
+}
+
 //*****************************************************************************
 //*****************************************************************************
 void XBridgeApp::onMessageReceived(const UcharVector & id, const UcharVector & message)
@@ -234,6 +354,7 @@ void XBridgeApp::onBroadcastReceived(const std::vector<unsigned char> & message)
         if (!m_processedMessages.insert(util::hash(message.begin(), message.end())).second)
         {
             // already processed
+            m_broadcastDuplicates.inc();
             return;
         }
 
@@ -245,8 +366,7 @@ void XBridgeApp::onBroadcastReceived(const std::vector<unsigned char> & message)
         ptr->processPacket(packet);
     }
 
-    // relay message
-    dht_send_broadcast(&message[0], message.size());
+    // relayed by dht, copies are dropped there by broadcast id
 }
 
 //*****************************************************************************
@@ -267,6 +387,302 @@ void XBridgeApp::onSendListOfWallets()
     onSend(packet);
 }
 
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeApp::subscribeMarketData(const uint160 & client,
+                                     const XBridgeCurrency & base,
+                                     const XBridgeCurrency & quote)
+{
+    boost::posix_time::ptime expires = boost::posix_time::microsec_clock::universal_time() +
+                                       boost::posix_time::seconds(m_marketDataSubscription);
+
+    boost::mutex::scoped_lock l(m_marketDataLock);
+    m_marketDataSubscribers[CurrencyPair(base, quote)][client] = expires;
+}
+
+//*****************************************************************************
+// one packet per book and subscriber, sent directly, nodes
+// without subscribers do not receive market data
+//*****************************************************************************
+void XBridgeApp::onSendMarketData(const std::vector<XBridgeMarketData> & data)
+{
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    unsigned char currency[8];
+
+    for (std::vector<XBridgeMarketData>::const_iterator i = data.begin(); i != data.end(); ++i)
+    {
+        std::vector<uint160> clients;
+        {
+            boost::mutex::scoped_lock l(m_marketDataLock);
+
+            std::map<CurrencyPair, Subscribers>::iterator s =
+                    m_marketDataSubscribers.find(CurrencyPair(i->base, i->quote));
+            if (s == m_marketDataSubscribers.end())
+            {
+                continue;
+            }
+
+            for (Subscribers::iterator c = s->second.begin(); c != s->second.end();)
+            {
+                if (c->second <= now)
+                {
+                    s->second.erase(c++);
+                    continue;
+                }
+                clients.push_back(c->first);
+                ++c;
+            }
+
+            if (s->second.empty())
+            {
+                m_marketDataSubscribers.erase(s);
+            }
+        }
+
+        if (clients.empty())
+        {
+            continue;
+        }
+
+        XBridgePacketPtr packet(new XBridgePacket(xbcMarketData));
+        packet->append(clients.front().begin(), 20);
+        packet->append(m_myid, 20);
+
+        i->base.copyTo(currency);
+        packet->append(currency, 8);
+        i->quote.copyTo(currency);
+        packet->append(currency, 8);
+        packet->append(i->sequence);
+        packet->append(static_cast<boost::uint32_t>(i->deltas.size()));
+
+        for (std::vector<XBridgeOrderBook::Delta>::const_iterator d = i->deltas.begin(); d != i->deltas.end(); ++d)
+        {
+            packet->append(static_cast<boost::uint32_t>(d->action));
+            packet->append(static_cast<boost::uint32_t>(d->side));
+            packet->append(d->price.quote);
+            packet->append(d->price.base);
+            packet->append(d->quantity);
+        }
+
+        // packet is copied to send queue, only address is replaced
+        for (std::vector<uint160>::const_iterator c = clients.begin(); c != clients.end(); ++c)
+        {
+            packet->setData(c->begin(), 20);
+            onSend(*c, packet);
+        }
+    }
+}
+
+//*****************************************************************************
+// called on event bus thread, transaction fields used here
+// are fixed after join
+//*****************************************************************************
+void XBridgeApp::onExchangeEvent(const XBridgeEvent & event)
+{
+    switch (event.type)
+    {
+        case XBridgeEvent::evJoined:
+            sendTransactionHold(event.transaction);
+            break;
+        case XBridgeEvent::evHold:
+            sendTransactionPay(event.transaction);
+            break;
+        case XBridgeEvent::evPaid:
+            sendTransactionCommit(event.transaction);
+            break;
+        case XBridgeEvent::evFinished:
+            sendTransactionFinished(event.transaction);
+            break;
+        case XBridgeEvent::evDropped:
+            sendTransactionDropped(event.transaction);
+            break;
+        default:
+            break;
+    }
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeApp::sendTransactionHold(const XBridgeTransactionPtr & tr)
+{
+    const uint256 & id = tr->id();
+
+    // first
+    // TODO remove this log
+    LOG() << "send xbcTransactionHold to " << util::base64_encode(std::string((char *)tr->firstAddress().begin(), 20));
+
+    XBridgePacketPtr reply1(new XBridgePacket(xbcTransactionHold));
+    reply1->append(tr->firstAddress().begin(), 20);
+    reply1->append(m_myid, 20);
+    reply1->append(tr->firstId().begin(), 32);
+    reply1->append(id.begin(), 32);
+    reply1->append(tr->firstAmount());
+    reply1->append(tr->secondAmount());
+
+    onSend(tr->firstAddress(), reply1);
+
+    // second
+    // TODO remove this log
+    LOG() << "send xbcTransactionHold to " << util::base64_encode(std::string((char *)tr->secondAddress().begin(), 20));
+
+    XBridgePacketPtr reply2(new XBridgePacket(xbcTransactionHold));
+    reply2->append(tr->secondAddress().begin(), 20);
+    reply2->append(m_myid, 20);
+    reply2->append(tr->secondId().begin(), 32);
+    reply2->append(id.begin(), 32);
+    reply2->append(tr->secondAmount());
+    reply2->append(tr->firstAmount());
+
+    onSend(tr->secondAddress(), reply2);
+
+    XBridgeTrace::instance().record(id, XBridgeTrace::tpHoldSent);
+}
+
+//*****************************************************************************
+// send payment command to clients
+//*****************************************************************************
+void XBridgeApp::sendTransactionPay(const XBridgeTransactionPtr & tr)
+{
+    XBridgeExchange & e = XBridgeExchange::instance();
+
+    const uint256 & id = tr->id();
+
+    // first
+    // TODO remove this log
+    LOG() << "send xbcTransactionPay to " << util::base64_encode(std::string((char *)tr->firstAddress().begin(), 20));
+
+    XBridgePacketPtr reply1(new XBridgePacket(xbcTransactionPay));
+    reply1->append(tr->firstAddress().begin(), 20);
+    reply1->append(m_myid, 20);
+    reply1->append(id.begin(), 32);
+    reply1->append(e.walletAddress(tr->firstCurrency()));
+    reply1->append(tr->firstAmount());
+
+    onSend(tr->firstAddress(), reply1);
+
+    // second
+    // TODO remove this log
+    LOG() << "send xbcTransactionPay to " << util::base64_encode(std::string((char *)tr->secondAddress().begin(), 20));
+
+    XBridgePacketPtr reply2(new XBridgePacket(xbcTransactionPay));
+    reply2->append(tr->secondAddress().begin(), 20);
+    reply2->append(m_myid, 20);
+    reply2->append(id.begin(), 32);
+    reply2->append(e.walletAddress(tr->secondCurrency()));
+    reply2->append(tr->secondAmount());
+
+    onSend(tr->secondAddress(), reply2);
+
+    XBridgeTrace::instance().record(id, XBridgeTrace::tpPaySent);
+}
+
+//*****************************************************************************
+// send commit payments from exchange wallets to client
+//*****************************************************************************
+void XBridgeApp::sendTransactionCommit(const XBridgeTransactionPtr & tr)
+{
+    XBridgeExchange & e = XBridgeExchange::instance();
+
+    const uint256 & id = tr->id();
+
+    {
+        // second-currency second-amount to first-destination
+        const std::vector<unsigned char> & walletAddress = e.walletAddress(tr->secondCurrency());
+
+        // TODO remove this log
+        LOG() << "send xbcTransactionCommit to "
+              << util::base64_encode(std::string((char *)&walletAddress[0], 20));
+
+        XBridgePacketPtr reply(new XBridgePacket(xbcTransactionCommit));
+        reply->append(walletAddress);
+        reply->append(m_myid, 20);
+        reply->append(id.begin(), 32);
+        reply->append(tr->firstDestination().begin(), 20);
+        reply->append(tr->secondAmount());
+
+        onSend(walletAddress, reply);
+    }
+
+    {
+        // first-currency first-amount to second-destination
+        const std::vector<unsigned char> & walletAddress = e.walletAddress(tr->firstCurrency());
+
+        // TODO remove this log
+        LOG() << "send xbcTransactionCommit to "
+              << util::base64_encode(std::string((char *)&walletAddress[0], 20));
+
+        XBridgePacketPtr reply(new XBridgePacket(xbcTransactionCommit));
+        reply->append(walletAddress);
+        reply->append(m_myid, 20);
+        reply->append(id.begin(), 32);
+        reply->append(tr->secondDestination().begin(), 20);
+        reply->append(tr->firstAmount());
+
+        onSend(walletAddress, reply);
+    }
+
+    XBridgeTrace::instance().record(id, XBridgeTrace::tpCommitSent);
+}
+
+//*****************************************************************************
+// send transaction state to clients
+//*****************************************************************************
+void XBridgeApp::sendTransactionFinished(const XBridgeTransactionPtr & tr)
+{
+    const uint256 & id = tr->id();
+
+    // TODO remove this log
+    LOG() << "send xbcTransactionFinished to "
+          << util::base64_encode(std::string((char *)tr->firstAddress().begin(), 20));
+
+    // first
+    XBridgePacketPtr reply1(new XBridgePacket(xbcTransactionFinished));
+    reply1->append(tr->firstAddress().begin(), 20);
+    reply1->append(id.begin(), 32);
+
+    onSend(tr->firstAddress(), reply1);
+
+    // TODO remove this log
+    LOG() << "send xbcTransactionFinished to "
+          << util::base64_encode(std::string((char *)tr->secondAddress().begin(), 20));
+
+    // second
+    XBridgePacketPtr reply2(new XBridgePacket(xbcTransactionFinished));
+    reply2->append(tr->secondAddress().begin(), 20);
+    reply2->append(id.begin(), 32);
+
+    onSend(tr->secondAddress(), reply2);
+
+    XBridgeTrace::instance().record(id, XBridgeTrace::tpFinishedSent);
+}
+
+//*****************************************************************************
+// pending order has only first member and is identified by client id
+//*****************************************************************************
+void XBridgeApp::sendTransactionDropped(const XBridgeTransactionPtr & tr)
+{
+    const uint256 & id = tr->id();
+
+    if (tr->firstAddress() != 0)
+    {
+        XBridgePacketPtr reply1(new XBridgePacket(xbcTransactionDropped));
+        reply1->append(tr->firstAddress().begin(), 20);
+        reply1->append(id.begin(), 32);
+
+        onSend(tr->firstAddress(), reply1);
+    }
+
+    if (tr->secondAddress() != 0)
+    {
+        XBridgePacketPtr reply2(new XBridgePacket(xbcTransactionDropped));
+        reply2->append(tr->secondAddress().begin(), 20);
+        reply2->append(id.begin(), 32);
+
+        onSend(tr->secondAddress(), reply2);
+    }
+}
+
 //*****************************************************************************
 //*****************************************************************************
 // static
@@ -294,6 +710,7 @@ void callback(void * closure, int event,
         qDebug() << ((event == DHT_EVENT_SEARCH_DONE6) ?
                         "Search done(6)" : "Search done");
 
+        boost::mutex::scoped_lock l(app->m_sendLock);
         if (app->m_messages.size())
         {
             app->m_signalSend = true;
@@ -422,6 +839,14 @@ void XBridgeApp::dhtThreadProc()
         tv.tv_sec = 1;
         tv.tv_usec = rand() % 1000000;
 
+        // wake up in time for unacked messages and lookup timeouts
+        int wait = dht_retransmit_wait();
+        if (wait >= 0 && wait < 1000)
+        {
+            tv.tv_sec  = 0;
+            tv.tv_usec = wait * 1000;
+        }
+
         FD_ZERO(&readfds);
         if(s4 >= 0)
         {
@@ -514,6 +939,7 @@ void XBridgeApp::dhtThreadProc()
             {
                 std::string str = m_searchStrings.front();
                 m_searchStrings.pop_front();
+                m_searchQueueDepth.set(m_searchStrings.size());
 
                 str = util::base64_decode(str);
                 if (!str.length())
@@ -536,78 +962,97 @@ void XBridgeApp::dhtThreadProc()
             m_signalSearch = false;
         }
 
+        if (m_signalStore)
+        {
+            std::list<UcharVector> stores;
+            {
+                boost::mutex::scoped_lock l(m_sendLock);
+                stores.swap(m_stores);
+                m_signalStore = false;
+            }
+
+            for (std::list<UcharVector>::iterator i = stores.begin(); i != stores.end(); ++i)
+            {
+                dht_storage_store(&(*i)[0], (sockaddr *)&m_sin, m_dhtPort);
+                dht_storage_store(&(*i)[0], (sockaddr *)&m_sin6, m_dhtPort);
+            }
+        }
+
         if (m_signalSend)
         {
             // qDebug() << "sendind";
 
-            if (m_messages.size())
+            std::list<MessagePair> messages;
             {
-                // TODO
-                // sync
-                std::list<MessagePair> messages = m_messages;
-                m_messages.clear();
+                boost::mutex::scoped_lock l(m_sendLock);
+                messages.swap(m_messages);
+                m_sendQueueDepth.set(0);
+                m_signalSend = false;
+            }
 
-                while (messages.size())
-                {
-                    MessagePair mpair = messages.front();
-                    messages.pop_front();
+            while (messages.size())
+            {
+                MessagePair mpair = messages.front();
+                messages.pop_front();
 
-                    // std::string id      = util::base64_decode(mpair.first);
-                    // std ::string message = mpair.second;
+                // std::string id      = util::base64_decode(mpair.first);
+                // std ::string message = mpair.second;
 
-                    // check broadcast
-                    if (mpair.first.empty())
+                // check broadcast
+                if (mpair.first.empty())
+                {
+                    // send to all local clients
                     {
-                        // send to all local clients
+                        boost::mutex::scoped_lock l(m_sessionsLock);
+                        for (SessionMap::iterator i = m_sessions.begin(); i != m_sessions.end(); ++i)
                         {
-                            boost::mutex::scoped_lock l(m_sessionsLock);
-                            for (SessionMap::iterator i = m_sessions.begin(); i != m_sessions.end(); ++i)
-                            {
-                                i->second->sendXBridgeMessage(mpair.second);
-                            }
+                            i->second->sendXBridgeMessage(mpair.second);
                         }
-
-                        // TODO send to xbridge network
-                        // dht_send_broadcast(&mpair.second[0], mpair.second.size());
                     }
 
-                    else
-                    {
-                        bool isFoundLocal = false;
+                    // send to xbridge network
+                    dht_send_broadcast(&mpair.second[0], mpair.second.size());
+                }
 
-                        // check local
+                else
+                {
+                    bool isFoundLocal = false;
+
+                    // check local
+                    {
+                        boost::mutex::scoped_lock l(m_sessionsLock);
+                        if (m_sessions.count(mpair.first))
                         {
-                            boost::mutex::scoped_lock l(m_sessionsLock);
-                            if (m_sessions.count(mpair.first))
-                            {
-                                // found local client
-                                XBridgeSessionPtr ptr = m_sessions[mpair.first];
-                                ptr->sendXBridgeMessage(mpair.second);
+                            // found local client
+                            XBridgeSessionPtr ptr = m_sessions[mpair.first];
+                            ptr->sendXBridgeMessage(mpair.second);
 
-                                isFoundLocal = true;
-                            }
+                            isFoundLocal = true;
                         }
+                    }
 
-                        if (!isFoundLocal)
+                    if (!isFoundLocal)
+                    {
+                        // not local
+                        if (dht_send_message(&mpair.first[0], &mpair.second[0], mpair.second.size()) != 0)
                         {
-                            // not local
-                            if (dht_send_message(&mpair.first[0], &mpair.second[0], mpair.second.size()) != 0)
-                            {
-                                // not send - go to search peer
-                                std::string _id;
-                                std::copy(mpair.first.begin(), mpair.first.end(), std::back_inserter(_id));
+                            // not send - go to search peer
+                            std::string _id;
+                            std::copy(mpair.first.begin(), mpair.first.end(), std::back_inserter(_id));
 
-                                // return message back and try search
+                            // return message back and try search
+                            {
+                                boost::mutex::scoped_lock l(m_sendLock);
                                 m_messages.push_back(mpair);
-                                m_searchStrings.push_back(util::base64_encode(_id));
-                                m_signalSearch = true;
+                                m_sendQueueDepth.set(m_messages.size());
                             }
+                            m_searchStrings.push_back(util::base64_encode(_id));
+                            m_searchQueueDepth.set(m_searchStrings.size());
+                            m_signalSearch = true;
                         }
                     }
                 }
             }
-
-            m_signalSend = false;
         }
 
         // For debugging, or idle curiosity
@@ -619,6 +1064,8 @@ void XBridgeApp::dhtThreadProc()
             qDebug() << dump.c_str();
             m_signalDump = false;
         }
+
+        updateDhtMetrics();
     }
 
     {
@@ -637,6 +1084,40 @@ void XBridgeApp::dhtThreadProc()
     qDebug() << "stopped";
 }
 
+//*****************************************************************************
+// dht state is owned by dht thread, so gauges are sampled from here
+//*****************************************************************************
+void XBridgeApp::updateDhtMetrics()
+{
+    static time_t lastUpdate = 0;
+    time_t current = time(0);
+    if (current == lastUpdate)
+    {
+        return;
+    }
+    lastUpdate = current;
+
+    static MetricGauge & good4    = Metrics::instance().gauge("xbridge_dht_nodes", "dht routing table nodes", "af=\"ipv4\",state=\"good\"");
+    static MetricGauge & dubious4 = Metrics::instance().gauge("xbridge_dht_nodes", "dht routing table nodes", "af=\"ipv4\",state=\"dubious\"");
+    static MetricGauge & good6    = Metrics::instance().gauge("xbridge_dht_nodes", "dht routing table nodes", "af=\"ipv6\",state=\"good\"");
+    static MetricGauge & dubious6 = Metrics::instance().gauge("xbridge_dht_nodes", "dht routing table nodes", "af=\"ipv6\",state=\"dubious\"");
+    static MetricGauge & storage  = Metrics::instance().gauge("xbridge_dht_storage", "dht stored hashes");
+    static MetricGauge & searches = Metrics::instance().gauge("xbridge_dht_searches", "dht searches in table");
+
+    int good = 0, dubious = 0;
+    dht_nodes(AF_INET, &good, &dubious, NULL, NULL);
+    good4.set(good);
+    dubious4.set(dubious);
+
+    good = 0, dubious = 0;
+    dht_nodes(AF_INET6, &good, &dubious, NULL, NULL);
+    good6.set(good);
+    dubious6.set(dubious);
+
+    storage.set(dht_storage_count());
+    searches.set(dht_search_count());
+}
+
 //*****************************************************************************
 //*****************************************************************************
 int dht_blacklisted(const struct sockaddr * /*sa*/, int /*salen*/)
@@ -721,11 +1202,16 @@ void XBridgeApp::storageStore(XBridgeSessionPtr session, const unsigned char * d
     // TODO :)
     // if (m_sessions.contains(id))
 
-    boost::mutex::scoped_lock l(m_sessionsLock);
-    m_sessions[id] = session;
+    {
+        boost::mutex::scoped_lock l(m_sessionsLock);
+        m_sessions[id] = session;
+        m_sessionCount.set(m_sessions.size());
+    }
 
-    dht_storage_store(data, (sockaddr *)&m_sin, m_dhtPort);
-    dht_storage_store(data, (sockaddr *)&m_sin6, m_dhtPort);
+    // dht storage is used by dht thread only
+    boost::mutex::scoped_lock l(m_sendLock);
+    m_stores.push_back(id);
+    m_signalStore = true;
 }
 
 //*****************************************************************************
@@ -744,4 +1230,16 @@ void XBridgeApp::storageClean(XBridgeSessionPtr session)
             ++i;
         }
     }
+    m_sessionCount.set(m_sessions.size());
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeApp::isLocalSession(const uint160 & address, XBridgeSessionPtr session)
+{
+    std::vector<unsigned char> id(address.begin(), address.end());
+
+    boost::mutex::scoped_lock l(m_sessionsLock);
+    SessionMap::const_iterator i = m_sessions.find(id);
+    return i != m_sessions.end() && i->second == session;
 }
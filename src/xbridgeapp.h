@@ -6,7 +6,11 @@
 
 #include "xbridge.h"
 #include "xbridgesession.h"
+#include "xbridgetransaction.h"
+#include "xbridgeeventbus.h"
+#include "xbridgeexchange.h"
 #include "util/uint256.h"
+#include "util/metrics.h"
 
 #include <QApplication>
 
@@ -41,12 +45,17 @@ public:
     bool initDht();
     bool stopDht();
 
+    // exchange timers, after exchange init succeeded
+    void startExchangeTimers();
+
     void logMessage(const QString & msg);
 
     // store session addresses in local table
     void storageStore(XBridgeSessionPtr session, const unsigned char * data);
     // clear local table
     void storageClean(XBridgeSessionPtr session);
+    // address is announced by this session of local wallet
+    bool isLocalSession(const uint160 & address, XBridgeSessionPtr session);
 
 public slots:
     // generate new id
@@ -60,12 +69,23 @@ public slots:
     void onSend(const XBridgePacketPtr packet);
     void onSend(const std::vector<unsigned char> & id, const std::vector<unsigned char> & message);
     void onSend(const std::vector<unsigned char> & id, const XBridgePacketPtr packet);
+    void onSend(const uint160 & id, const std::vector<unsigned char> & message);
+    void onSend(const uint160 & id, const XBridgePacketPtr packet);
+    // send packet to connected local clients only
+    void onSendLocal(const XBridgePacketPtr packet);
     // call when message from xbridge network received
     void onMessageReceived(const std::vector<unsigned char> & id, const std::vector<unsigned char> & message);
     // broadcast message
     void onBroadcastReceived(const std::vector<unsigned char> & message);
     // broadcast send list of wallets
     void onSendListOfWallets();
+    // send level changes of books to subscribed clients
+    void onSendMarketData(const std::vector<XBridgeMarketData> & data);
+    // client receives level changes of pair until subscription
+    // is not renewed by next xbcMarketDataRequest
+    void subscribeMarketData(const uint160 & client,
+                             const XBridgeCurrency & base,
+                             const XBridgeCurrency & quote);
 
 public:
     static void sleep(const unsigned int umilliseconds);
@@ -74,6 +94,16 @@ private:
     void dhtThreadProc();
     void bridgeThreadProc();
 
+    void updateDhtMetrics();
+
+    // exchange state changes, replies to transaction members
+    void onExchangeEvent(const XBridgeEvent & event);
+    void sendTransactionHold(const XBridgeTransactionPtr & tr);
+    void sendTransactionPay(const XBridgeTransactionPtr & tr);
+    void sendTransactionCommit(const XBridgeTransactionPtr & tr);
+    void sendTransactionFinished(const XBridgeTransactionPtr & tr);
+    void sendTransactionDropped(const XBridgeTransactionPtr & tr);
+
 private:
     unsigned char     m_myid[20];
 
@@ -87,12 +117,17 @@ private:
     std::atomic<bool> m_signalDump;
     std::atomic<bool> m_signalSearch;
     std::atomic<bool> m_signalSend;
+    std::atomic<bool> m_signalStore;
 
     typedef std::vector<unsigned char> UcharVector;
     typedef std::pair<UcharVector, UcharVector> MessagePair;
 
     std::list<std::string> m_searchStrings;
+    // filled by io and event bus threads, drained by dht thread
+    boost::mutex           m_sendLock;
     std::list<MessagePair> m_messages;
+    // addresses of local clients for dht storage
+    std::list<UcharVector> m_stores;
 
     const bool        m_ipv4;
     const bool        m_ipv6;
@@ -113,6 +148,18 @@ private:
     boost::mutex m_messagesLock;
     typedef std::set<uint256> ProcessedMessages;
     ProcessedMessages m_processedMessages;
+
+    // market data subscribers of pair and expiration time
+    boost::mutex m_marketDataLock;
+    typedef std::pair<XBridgeCurrency, XBridgeCurrency> CurrencyPair;
+    typedef std::map<uint160, boost::posix_time::ptime> Subscribers;
+    std::map<CurrencyPair, Subscribers> m_marketDataSubscribers;
+    unsigned int m_marketDataSubscription;
+
+    MetricGauge   & m_sendQueueDepth;
+    MetricGauge   & m_searchQueueDepth;
+    MetricGauge   & m_sessionCount;
+    MetricCounter & m_broadcastDuplicates;
 };
 
 #endif // XBRIDGEAPP_H
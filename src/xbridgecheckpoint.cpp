@@ -0,0 +1,288 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#include "xbridgecheckpoint.h"
+#include "util/logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#ifdef WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+//*****************************************************************************
+//*****************************************************************************
+namespace
+{
+
+const char            magic[8] = { 'X', 'B', 'C', 'H', 'K', 'P', 'T', 0 };
+const boost::uint32_t version  = 2;
+
+static_assert(sizeof(XBridgeCheckpointHeader)      == 40,  "checkpoint layout changed");
+static_assert(sizeof(XBridgeCheckpointOrder)       == 128, "checkpoint layout changed");
+static_assert(sizeof(XBridgeCheckpointTransaction) == 216, "checkpoint layout changed");
+
+//*****************************************************************************
+//*****************************************************************************
+template <typename T, std::size_t N>
+void copyBytes(const T & from, unsigned char (&to)[N])
+{
+    static_assert(sizeof(T) == N, "field size");
+    std::copy(from.begin(), from.end(), to);
+}
+
+} // namespace
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeCheckpoint::XBridgeCheckpoint()
+    : m_data(0)
+    , m_size(0)
+{
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeCheckpoint::add(const XBridgeOrderBook::Entry & order)
+{
+    XBridgeCheckpointOrder o;
+    std::memset(&o, 0, sizeof(o));
+
+    order.transaction->packOrder(o.order);
+    o.remaining = order.remaining;
+    o.quote     = order.quote;
+    o.resting   = order.resting ? 1 : 0;
+
+    m_orders.push_back(o);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeCheckpoint::add(const XBridgeTransactionPtr & tr)
+{
+    XBridgeCheckpointTransaction t;
+    std::memset(&t, 0, sizeof(t));
+
+    copyBytes(tr->id(),                t.id);
+    copyBytes(tr->firstId(),           t.firstId);
+    copyBytes(tr->secondId(),          t.secondId);
+    copyBytes(tr->firstAddress(),      t.firstSource);
+    copyBytes(tr->firstDestination(),  t.firstDest);
+    copyBytes(tr->secondAddress(),     t.secondSource);
+    copyBytes(tr->secondDestination(), t.secondDest);
+
+    tr->firstCurrency().copyTo(t.firstCurrency);
+    tr->secondCurrency().copyTo(t.secondCurrency);
+
+    t.firstAmount  = tr->firstAmount();
+    t.secondAmount = tr->secondAmount();
+    t.state        = static_cast<boost::uint8_t>(tr->state());
+    t.stateCounter = static_cast<boost::uint8_t>(tr->stateCounter());
+
+    m_transactions.push_back(t);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeCheckpoint::write(const std::string & path, const boost::uint64_t journalOffset) const
+{
+    XBridgeCheckpointHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::copy(magic, magic + sizeof(magic), h.magic);
+    h.version       = version;
+    h.journalOffset = journalOffset;
+    h.orders        = m_orders.size();
+    h.transactions  = m_transactions.size();
+
+    std::string tmp = path + ".tmp";
+    std::FILE * f = std::fopen(tmp.c_str(), "wb");
+    if (!f)
+    {
+        ERR() << "can't create checkpoint " << tmp << " " << __FUNCTION__;
+        return false;
+    }
+
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+    if (ok && !m_orders.empty())
+    {
+        ok = std::fwrite(&m_orders[0], sizeof(XBridgeCheckpointOrder),
+                         m_orders.size(), f) == m_orders.size();
+    }
+    if (ok && !m_transactions.empty())
+    {
+        ok = std::fwrite(&m_transactions[0], sizeof(XBridgeCheckpointTransaction),
+                         m_transactions.size(), f) == m_transactions.size();
+    }
+    // data must be on disk before rename
+    ok = ok && std::fflush(f) == 0;
+#ifdef WIN32
+    ok = ok && _commit(_fileno(f)) == 0;
+#else
+    ok = ok && fsync(fileno(f)) == 0;
+#endif
+    ok = (std::fclose(f) == 0) && ok;
+
+    if (!ok)
+    {
+        ERR() << "checkpoint " << tmp << " write failed " << __FUNCTION__;
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    // old checkpoint stays valid until replaced,
+    // rename replaces target atomically
+#ifdef WIN32
+    if (!MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+#else
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+#endif
+    {
+        ERR() << "can't rename checkpoint " << tmp << " " << __FUNCTION__;
+        return false;
+    }
+
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeCheckpoint::map(const std::string & path)
+{
+    m_region.reset();
+    m_data = 0;
+    m_size = 0;
+
+    std::FILE * f = std::fopen(path.c_str(), "rb");
+    if (!f)
+    {
+        // no checkpoint
+        return false;
+    }
+    std::fclose(f);
+
+    try
+    {
+        boost::interprocess::file_mapping file(path.c_str(), boost::interprocess::read_only);
+        m_region.reset(new boost::interprocess::mapped_region(file, boost::interprocess::read_only));
+    }
+    catch (std::exception & e)
+    {
+        ERR() << "can't map checkpoint " << path << " " << e.what() << " " << __FUNCTION__;
+        return false;
+    }
+
+    const unsigned char * data = static_cast<const unsigned char *>(m_region->get_address());
+    std::size_t size = m_region->get_size();
+
+    const XBridgeCheckpointHeader * h = reinterpret_cast<const XBridgeCheckpointHeader *>(data);
+    if (size < sizeof(XBridgeCheckpointHeader) ||
+        std::memcmp(h->magic, magic, sizeof(magic)) != 0 ||
+        h->version != version ||
+        size != sizeof(XBridgeCheckpointHeader) +
+                h->orders * sizeof(XBridgeCheckpointOrder) +
+                h->transactions * sizeof(XBridgeCheckpointTransaction))
+    {
+        ERR() << "invalid checkpoint " << path << " " << __FUNCTION__;
+        m_region.reset();
+        return false;
+    }
+
+    m_data = data;
+    m_size = size;
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint64_t XBridgeCheckpoint::journalOffset() const
+{
+    return m_data ? reinterpret_cast<const XBridgeCheckpointHeader *>(m_data)->journalOffset : 0;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::size_t XBridgeCheckpoint::orderCount() const
+{
+    return m_data ? static_cast<std::size_t>(reinterpret_cast<const XBridgeCheckpointHeader *>(m_data)->orders) : 0;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::size_t XBridgeCheckpoint::transactionCount() const
+{
+    return m_data ? static_cast<std::size_t>(reinterpret_cast<const XBridgeCheckpointHeader *>(m_data)->transactions) : 0;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+const XBridgeCheckpointOrder * XBridgeCheckpoint::orders() const
+{
+    return reinterpret_cast<const XBridgeCheckpointOrder *>(m_data + sizeof(XBridgeCheckpointHeader));
+}
+
+//*****************************************************************************
+//*****************************************************************************
+const XBridgeCheckpointTransaction * XBridgeCheckpoint::transactions() const
+{
+    return reinterpret_cast<const XBridgeCheckpointTransaction *>(orders() + orderCount());
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeOrderBook::Entry XBridgeCheckpoint::order(const std::size_t idx) const
+{
+    const XBridgeCheckpointOrder & o = orders()[idx];
+
+    XBridgeOrderBook::Entry e;
+    e.transaction = XBridgeTransaction::unpackOrder(o.order);
+    e.remaining   = o.remaining;
+    e.quote       = o.quote;
+    e.resting     = o.resting != 0;
+    return e;
+}
+
+//*****************************************************************************
+// joined transaction is rebuilt from both member orders,
+// join gives same hub id as stored one
+//*****************************************************************************
+XBridgeTransactionPtr XBridgeCheckpoint::transaction(const std::size_t idx) const
+{
+    const XBridgeCheckpointTransaction & t = transactions()[idx];
+    if (t.state < XBridgeTransaction::trJoined || t.state > XBridgeTransaction::trDropped)
+    {
+        ERR() << "checkpoint transaction state " << static_cast<unsigned int>(t.state)
+              << " is invalid " << __FUNCTION__;
+        return XBridgeTransactionPtr();
+    }
+
+    XBridgeCurrency firstCurrency(t.firstCurrency);
+    XBridgeCurrency secondCurrency(t.secondCurrency);
+
+    XBridgeTransactionPtr first = XBridgeTransaction::create(uint256(t.firstId),
+                                                             uint160(t.firstSource),
+                                                             firstCurrency, t.firstAmount,
+                                                             uint160(t.firstDest),
+                                                             secondCurrency, t.secondAmount);
+    XBridgeTransactionPtr second = XBridgeTransaction::create(uint256(t.secondId),
+                                                              uint160(t.secondSource),
+                                                              secondCurrency, t.secondAmount,
+                                                              uint160(t.secondDest),
+                                                              firstCurrency, t.firstAmount);
+
+    if (!first->tryJoin(second) || first->id() != uint256(t.id))
+    {
+        ERR() << "checkpoint transaction not restored " << __FUNCTION__;
+        return XBridgeTransactionPtr();
+    }
+
+    first->restoreState(static_cast<XBridgeTransaction::State>(t.state), t.stateCounter);
+    return first;
+}
@@ -0,0 +1,109 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#ifndef XBRIDGECHECKPOINT_H
+#define XBRIDGECHECKPOINT_H
+
+#include "xbridgetransaction.h"
+#include "xbridgeorderbook.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace boost { namespace interprocess { class mapped_region; } }
+
+//*****************************************************************************
+// checkpoint file layout, all fields are naturally aligned so file
+// can be used in place after mmap, integers are little endian
+//
+// header
+// orders       [header.orders]
+// transactions [header.transactions]
+//*****************************************************************************
+struct XBridgeCheckpointHeader
+{
+    char            magic[8];
+    boost::uint32_t version;
+    boost::uint32_t reserved;
+    // journal records before this offset are included
+    boost::uint64_t journalOffset;
+    boost::uint64_t orders;
+    boost::uint64_t transactions;
+};
+
+//*****************************************************************************
+//*****************************************************************************
+struct XBridgeCheckpointOrder
+{
+    // xbcTransaction layout
+    unsigned char   order[104];
+    boost::uint64_t remaining;
+    // quote paid by bid or received by ask so far
+    boost::uint64_t quote;
+    boost::uint8_t  resting;
+    boost::uint8_t  reserved[7];
+};
+
+//*****************************************************************************
+//*****************************************************************************
+struct XBridgeCheckpointTransaction
+{
+    unsigned char   id[32];
+    unsigned char   firstId[32];
+    unsigned char   secondId[32];
+    unsigned char   firstSource[20];
+    unsigned char   firstDest[20];
+    unsigned char   secondSource[20];
+    unsigned char   secondDest[20];
+    unsigned char   firstCurrency[8];
+    unsigned char   secondCurrency[8];
+    boost::uint64_t firstAmount;
+    boost::uint64_t secondAmount;
+    boost::uint8_t  state;
+    boost::uint8_t  stateCounter;
+    boost::uint8_t  reserved[6];
+};
+
+//*****************************************************************************
+// builds checkpoint in memory and writes it, or maps existing file
+//*****************************************************************************
+class XBridgeCheckpoint
+{
+public:
+    XBridgeCheckpoint();
+
+    void add(const XBridgeOrderBook::Entry & order);
+    void add(const XBridgeTransactionPtr & tr);
+
+    // written to temporary file and renamed
+    bool write(const std::string & path, const boost::uint64_t journalOffset) const;
+
+    // map file read only, false if missing or damaged
+    bool map(const std::string & path);
+
+    boost::uint64_t journalOffset() const;
+
+    std::size_t orderCount() const;
+    XBridgeOrderBook::Entry order(const std::size_t idx) const;
+
+    std::size_t transactionCount() const;
+    XBridgeTransactionPtr transaction(const std::size_t idx) const;
+
+private:
+    const XBridgeCheckpointOrder * orders() const;
+    const XBridgeCheckpointTransaction * transactions() const;
+
+private:
+    std::vector<XBridgeCheckpointOrder>       m_orders;
+    std::vector<XBridgeCheckpointTransaction> m_transactions;
+
+    // mapped file
+    boost::shared_ptr<boost::interprocess::mapped_region> m_region;
+    const unsigned char *                     m_data;
+    std::size_t                               m_size;
+};
+
+#endif // XBRIDGECHECKPOINT_H
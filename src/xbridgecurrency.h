@@ -0,0 +1,74 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#ifndef XBRIDGECURRENCY_H
+#define XBRIDGECURRENCY_H
+
+#include <string>
+#include <cstring>
+#include <ostream>
+#include <algorithm>
+
+#include <boost/cstdint.hpp>
+
+//*****************************************************************************
+// currency code as carried in packets, 8 bytes padded with zeroes,
+// compared as raw bytes so order is same as order of strings
+//*****************************************************************************
+class XBridgeCurrency
+{
+public:
+    enum { size = 8 };
+
+    XBridgeCurrency()
+    {
+        std::memset(m_code, 0, size);
+    }
+
+    explicit XBridgeCurrency(const std::string & code)
+    {
+        std::memset(m_code, 0, size);
+        std::copy(code.begin(), code.begin() + std::min<std::size_t>(code.size(), size), m_code);
+    }
+
+    // size bytes, not null terminated
+    explicit XBridgeCurrency(const unsigned char * data)
+    {
+        std::memcpy(m_code, data, size);
+    }
+
+    bool isNull() const                 { return m_code[0] == 0; }
+
+    // significant part of code, without padding
+    const char * begin() const          { return m_code; }
+    const char * end() const            { return m_code + length(); }
+    std::size_t  length() const         { return std::find(m_code, m_code + size, 0) - m_code; }
+
+    std::string str() const             { return std::string(begin(), end()); }
+    void copyTo(unsigned char * data) const
+    {
+        std::memcpy(data, m_code, size);
+    }
+
+    bool operator == (const XBridgeCurrency & other) const { return std::memcmp(m_code, other.m_code, size) == 0; }
+    bool operator != (const XBridgeCurrency & other) const { return std::memcmp(m_code, other.m_code, size) != 0; }
+    bool operator <  (const XBridgeCurrency & other) const { return std::memcmp(m_code, other.m_code, size) <  0; }
+
+private:
+    char m_code[size];
+};
+
+//*****************************************************************************
+//*****************************************************************************
+inline std::ostream & operator << (std::ostream & out, const XBridgeCurrency & currency)
+{
+    return out.write(currency.begin(), currency.length());
+}
+
+//*****************************************************************************
+// index of currency in wallet table of exchange, assigned on load
+//*****************************************************************************
+typedef boost::uint32_t XBridgeCurrencyId;
+const XBridgeCurrencyId xbridgeInvalidCurrency = 0xffffffff;
+
+#endif // XBRIDGECURRENCY_H
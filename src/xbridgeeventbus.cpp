@@ -0,0 +1,167 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#include "xbridgeeventbus.h"
+#include "util/logger.h"
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+//*****************************************************************************
+//*****************************************************************************
+namespace
+{
+
+const char * eventNames[XBridgeEvent::evCount] =
+{
+    "joined", "hold", "paid", "finished", "dropped"
+};
+
+// preallocated queue nodes, queue grows if consumer is slow
+const std::size_t queueCapacity = 1024;
+
+// upper bound of missed wakeup
+const unsigned int idleWait = 100;
+
+} // namespace
+
+//*****************************************************************************
+//*****************************************************************************
+// static
+XBridgeEventBus & XBridgeEventBus::instance()
+{
+    static XBridgeEventBus bus;
+    return bus;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeEventBus::XBridgeEventBus()
+{
+    for (unsigned int i = 0; i < XBridgeEvent::evCount; ++i)
+    {
+        m_published[i] = &Metrics::instance().counter("xbridge_events_total",
+                                                      "exchange events published",
+                                                      std::string("type=\"") + eventNames[i] + "\"");
+    }
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeEventBus::~XBridgeEventBus()
+{
+    stop();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeEventBus::Subscriber::Subscriber(const std::string & _name, const Handler & _handler)
+    : name(_name)
+    , handler(_handler)
+    , queue(queueCapacity)
+    , waiting(false)
+    , stop(false)
+    , depth(Metrics::instance().gauge("xbridge_events_queue_depth",
+                                      "events waiting for subscriber",
+                                      "subscriber=\"" + _name + "\""))
+{
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeEventBus::subscribe(const std::string & name, const Handler & handler)
+{
+    SubscriberPtr s(new Subscriber(name, handler));
+    s->thread = boost::thread(boost::bind(&Subscriber::threadProc, s.get()));
+    m_subscribers.push_back(s);
+
+    LOG() << "event subscriber " << name << " started";
+}
+
+//*****************************************************************************
+// called under exchange locks, only pushes to queues
+//*****************************************************************************
+void XBridgeEventBus::publish(const XBridgeEvent::Type type,
+                              const XBridgeTransactionPtr & transaction)
+{
+    m_published[type]->inc();
+
+    if (m_subscribers.empty())
+    {
+        return;
+    }
+
+    XBridgeEventPtr event(new XBridgeEvent);
+    event->type        = type;
+    event->transaction = transaction;
+
+    for (std::vector<SubscriberPtr>::iterator i = m_subscribers.begin(); i != m_subscribers.end(); ++i)
+    {
+        Subscriber & s = **i;
+
+        s.queue.push(new XBridgeEventPtr(event));
+        s.depth.inc();
+
+        if (s.waiting.load())
+        {
+            boost::mutex::scoped_lock l(s.lock);
+            s.wakeup.notify_one();
+        }
+    }
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeEventBus::stop()
+{
+    for (std::vector<SubscriberPtr>::iterator i = m_subscribers.begin(); i != m_subscribers.end(); ++i)
+    {
+        Subscriber & s = **i;
+        {
+            boost::mutex::scoped_lock l(s.lock);
+            s.stop = true;
+        }
+        s.wakeup.notify_one();
+        s.thread.join();
+    }
+    m_subscribers.clear();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeEventBus::Subscriber::threadProc()
+{
+    while (true)
+    {
+        XBridgeEventPtr * event = 0;
+        while (queue.pop(event))
+        {
+            depth.dec();
+
+            try
+            {
+                handler(**event);
+            }
+            catch (std::exception & e)
+            {
+                ERR() << "event subscriber " << name << " " << e.what() << " " << __FUNCTION__;
+            }
+
+            delete event;
+        }
+
+        boost::mutex::scoped_lock l(lock);
+        if (stop)
+        {
+            break;
+        }
+
+        // publisher checks flag after push, recheck queue after set
+        waiting = true;
+        if (queue.empty())
+        {
+            wakeup.timed_wait(l, boost::posix_time::milliseconds(idleWait));
+        }
+        waiting = false;
+    }
+}
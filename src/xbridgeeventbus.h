@@ -0,0 +1,106 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#ifndef XBRIDGEEVENTBUS_H
+#define XBRIDGEEVENTBUS_H
+
+#include "xbridgetransaction.h"
+#include "util/metrics.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <functional>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/lockfree/queue.hpp>
+
+//*****************************************************************************
+// exchange state change, transaction is shared with exchange,
+// only fields fixed after join may be read by subscribers
+//*****************************************************************************
+struct XBridgeEvent
+{
+    enum Type
+    {
+        // order matched, members must hold funds
+        evJoined = 0,
+        // both members hold, send pay
+        evHold,
+        // both members paid, send commit
+        evPaid,
+        // both commits applied
+        evFinished,
+        // cancelled or expired order or transaction
+        evDropped,
+
+        evCount
+    };
+
+    Type                  type;
+    XBridgeTransactionPtr transaction;
+};
+typedef boost::shared_ptr<XBridgeEvent> XBridgeEventPtr;
+
+//*****************************************************************************
+// exchange publishes events under its own locks, every subscriber
+// has lock free queue and thread, so publish never waits for consumer
+//
+// subscribers are added before first publish and not removed
+//*****************************************************************************
+class XBridgeEventBus
+{
+public:
+    typedef std::function<void(const XBridgeEvent & event)> Handler;
+
+public:
+    static XBridgeEventBus & instance();
+
+protected:
+    XBridgeEventBus();
+    ~XBridgeEventBus();
+
+public:
+    // handler called on subscriber thread in publish order
+    void subscribe(const std::string & name, const Handler & handler);
+
+    void publish(const XBridgeEvent::Type type, const XBridgeTransactionPtr & transaction);
+
+    // deliver queued events and join subscriber threads
+    void stop();
+
+private:
+    struct Subscriber
+    {
+        Subscriber(const std::string & name, const Handler & handler);
+
+        void threadProc();
+
+        std::string                                  name;
+        Handler                                      handler;
+
+        // owns pointer until popped
+        boost::lockfree::queue<XBridgeEventPtr *>    queue;
+
+        // consumer sleeps only when queue is empty
+        boost::mutex                                 lock;
+        boost::condition_variable                    wakeup;
+        std::atomic<bool>                            waiting;
+        std::atomic<bool>                            stop;
+
+        MetricGauge &                                depth;
+
+        boost::thread                                thread;
+    };
+    typedef boost::shared_ptr<Subscriber> SubscriberPtr;
+
+private:
+    std::vector<SubscriberPtr>                       m_subscribers;
+
+    MetricCounter *                                  m_published[XBridgeEvent::evCount];
+};
+
+#endif // XBRIDGEEVENTBUS_H
@@ -5,12 +5,49 @@
 #include "util/logger.h"
 #include "util/settings.h"
 #include "util/util.h"
+#include "xbridgetrace.h"
 
 #include <algorithm>
+#include <sstream>
+#include <cstring>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 
 //*****************************************************************************
 //*****************************************************************************
 XBridgeExchange::XBridgeExchange()
+    : m_auctionInterval(Settings::instance().get<unsigned int>("Main.AuctionInterval", 0))
+    , m_ordersIndex(Settings::instance().get<unsigned int>("Main.OrdersIndexSize", 65536))
+    , m_checkpointInterval(Settings::instance().get<unsigned int>("Main.CheckpointInterval", 600))
+    , m_checkpointOffset(0)
+    , m_snapshot(new XBridgeSnapshot(0))
+    , m_snapshotSequence(0)
+    , m_snapshotInterval(Settings::instance().get<unsigned int>("Main.SnapshotInterval", 1000))
+    , m_marketDataInterval(Settings::instance().get<unsigned int>("Main.MarketDataInterval", 200))
+    , m_ordersCount(Metrics::instance().counter("xbridge_exchange_orders_total",
+                                                "transactions received by exchange"))
+    , m_duplicatesCount(Metrics::instance().counter("xbridge_exchange_duplicate_orders_total",
+                                                    "resent orders answered with state"))
+    , m_matchesCount(Metrics::instance().counter("xbridge_exchange_matches_total",
+                                                 "transactions joined by exchange"))
+    , m_pendingCount(Metrics::instance().gauge("xbridge_exchange_pending_transactions",
+                                               "transactions waiting for pair"))
+    , m_activeCount(Metrics::instance().gauge("xbridge_exchange_active_transactions",
+                                              "joined transactions"))
+    , m_expiredCount(Metrics::instance().counter("xbridge_exchange_expired_total",
+                                                 "orders and transactions dropped by timeout"))
+    , m_auctionsCount(Metrics::instance().counter("xbridge_exchange_auctions_total",
+                                                  "auction passes with orders"))
+    , m_auctionOrders(Metrics::instance().histogram("xbridge_exchange_auction_orders",
+                                                    "orders collected per auction",
+                                                    Metrics::exponentialBounds(100000)))
+    , m_auctionClearingTime(Metrics::instance().histogram("xbridge_exchange_auction_clearing_microseconds",
+                                                          "time to clear one book",
+                                                          Metrics::exponentialBounds(1000000)))
+    , m_snapshotTime(Metrics::instance().histogram("xbridge_exchange_snapshot_microseconds",
+                                                   "time to copy tables for queries",
+                                                   Metrics::exponentialBounds(10000000)))
 {
 }
 
@@ -33,6 +70,244 @@ XBridgeExchange & XBridgeExchange::instance()
 //*****************************************************************************
 bool XBridgeExchange::init()
 {
+    if (!loadWallets())
+    {
+        return false;
+    }
+
+    Settings & s = Settings::instance();
+
+    std::string path = s.get<std::string>("Main.Journal", std::string());
+    if (path.empty())
+    {
+        return true;
+    }
+
+    boost::uint64_t started = XBridgeTrace::timestamp();
+
+    // checkpoint state, then journal tail
+    boost::uint64_t offset = 0;
+    restoreCheckpoint(path, offset);
+
+    // runs before app subscribes to events, so members
+    // notified before restart are not notified again
+    boost::uint64_t valid   = XBridgeJournal::replay(path,
+                                                     boost::bind(&XBridgeExchange::applyJournalRecord,
+                                                                 this, _1, _2, _3),
+                                                     offset);
+    LOG() << "journal replayed from " << offset << ", " << (valid - offset) << " bytes in "
+          << (XBridgeTrace::timestamp() - started) / 1000 << " ms, "
+          << m_pendingCount.value() << " pending, "
+          << m_activeCount.value() << " active";
+
+    m_checkpointOffset = offset;
+    m_lastCheckpoint   = boost::posix_time::microsec_clock::universal_time();
+
+    // restored books are not sent as deltas, sequence
+    // starts again and clients resync
+    takeMarketData();
+
+    // restored state is visible to queries before first timer
+    publishSnapshot();
+
+    return m_journal.open(path, valid, s.get<unsigned int>("Main.JournalSyncInterval", 10));
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::restoreCheckpoint(const std::string & journalPath,
+                                        boost::uint64_t & journalOffset)
+{
+    m_checkpointPath = Settings::instance().get<std::string>("Main.Checkpoint",
+                                                             journalPath + ".checkpoint");
+
+    XBridgeCheckpoint cp;
+    if (!cp.map(m_checkpointPath))
+    {
+        return false;
+    }
+
+    if (cp.journalOffset() > XBridgeJournal::fileSize(journalPath))
+    {
+        ERR() << "checkpoint " << m_checkpointPath << " is ahead of journal, ignored";
+        return false;
+    }
+
+    for (std::size_t i = 0; i < cp.orderCount(); ++i)
+    {
+        XBridgeOrderBook::Entry e = cp.order(i);
+
+        PairShardPtr sh = shard(e.transaction->firstCurrency(), e.transaction->secondCurrency());
+        if (!sh || !sh->book->restore(e))
+        {
+            continue;
+        }
+
+        indexOrder(e.transaction);
+
+        Deadline d;
+        d.time = e.transaction->deadline();
+        d.id   = e.transaction->id();
+        if (!d.time.is_not_a_date_time())
+        {
+            sh->deadlines.push_back(d);
+        }
+
+        m_pendingCount.inc();
+    }
+
+    for (std::size_t i = 0; i < cp.transactionCount(); ++i)
+    {
+        XBridgeTransactionPtr tr = cp.transaction(i);
+        if (!tr)
+        {
+            continue;
+        }
+
+        Stripe & s = stripe(tr->id());
+        s.transactions[tr->id()] = tr;
+        scheduleExpiration(s, tr);
+
+        indexMembers(tr);
+
+        m_activeCount.inc();
+    }
+
+    journalOffset = cp.journalOffset();
+
+    LOG() << "checkpoint " << m_checkpointPath << " restored, "
+          << cp.orderCount() << " orders, " << cp.transactionCount() << " transactions";
+    return true;
+}
+
+//*****************************************************************************
+// all shards and stripes are locked while tables are copied, so
+// checkpoint and journal offset describe same state
+//*****************************************************************************
+bool XBridgeExchange::checkpoint(const bool force)
+{
+    if (!m_journal.isOpen())
+    {
+        return false;
+    }
+
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    if (!force && now < m_lastCheckpoint + boost::posix_time::seconds(m_checkpointInterval))
+    {
+        return false;
+    }
+    m_lastCheckpoint = now;
+
+    if (!force && m_journal.size() == m_checkpointOffset)
+    {
+        // nothing changed
+        return false;
+    }
+
+    boost::uint64_t started = XBridgeTrace::timestamp();
+
+    XBridgeCheckpoint cp;
+    boost::uint64_t offset = 0;
+    {
+        std::deque<boost::shared_ptr<boost::mutex::scoped_lock> > locks;
+        for (PairShards::iterator i = m_shards.begin(); i != m_shards.end(); ++i)
+        {
+            locks.push_back(boost::shared_ptr<boost::mutex::scoped_lock>
+                                (new boost::mutex::scoped_lock((*i)->lock)));
+        }
+        for (unsigned int n = 0; n < StripeCount; ++n)
+        {
+            locks.push_back(boost::shared_ptr<boost::mutex::scoped_lock>
+                                (new boost::mutex::scoped_lock(m_stripes[n].lock)));
+        }
+
+        offset = m_journal.size();
+
+        for (PairShards::iterator i = m_shards.begin(); i != m_shards.end(); ++i)
+        {
+            std::vector<XBridgeOrderBook::Entry> entries = (*i)->book->entries();
+            for (std::vector<XBridgeOrderBook::Entry>::iterator e = entries.begin(); e != entries.end(); ++e)
+            {
+                cp.add(*e);
+            }
+        }
+        for (unsigned int n = 0; n < StripeCount; ++n)
+        {
+            TransactionMap & trs = m_stripes[n].transactions;
+            for (TransactionMap::iterator i = trs.begin(); i != trs.end(); ++i)
+            {
+                cp.add(i->second);
+            }
+        }
+    }
+
+    // records before offset must be durable, else restart
+    // would skip records appended after shorter journal
+    if (!m_journal.sync())
+    {
+        ERR() << "journal not synced, checkpoint skipped " << __FUNCTION__;
+        return false;
+    }
+
+    if (!cp.write(m_checkpointPath, offset))
+    {
+        return false;
+    }
+
+    m_checkpointOffset = offset;
+
+    LOG() << "checkpoint " << m_checkpointPath << " at journal offset " << offset
+          << " written in " << (XBridgeTrace::timestamp() - started) / 1000 << " ms";
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::replay(const std::string & path)
+{
+    if (!loadWallets())
+    {
+        return false;
+    }
+
+    std::size_t records = 0;
+    std::size_t orders  = 0;
+
+    boost::uint64_t started = XBridgeTrace::timestamp();
+    boost::uint64_t valid   = XBridgeJournal::replay(path,
+                                                     [&](const XBridgeJournal::RecordType type,
+                                                         const unsigned char * data,
+                                                         const std::size_t size)
+    {
+        ++records;
+        if (type == XBridgeJournal::jrOrder)
+        {
+            ++orders;
+        }
+        applyJournalRecord(type, data, size);
+    });
+    boost::uint64_t elapsed = std::max<boost::uint64_t>(XBridgeTrace::timestamp() - started, 1);
+
+    LOG() << "replay " << path << std::endl
+          << "    " << valid << " bytes, " << records << " records, " << orders << " orders" << std::endl
+          << "    " << m_matchesCount.value() << " matches, "
+          << m_pendingCount.value() << " pending, "
+          << m_activeCount.value() << " active" << std::endl
+          << "    " << elapsed << " us, " << (orders * 1000000 / elapsed) << " orders/s";
+
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::loadWallets()
+{
+    if (!m_shards.empty())
+    {
+        // already loaded
+        return true;
+    }
+
     Settings & s = Settings::instance();
 
     std::vector<std::string> wallets = s.exchangeWallets();
@@ -54,154 +329,516 @@ bool XBridgeExchange::init()
             continue;
         }
 
-        std::copy(decoded.begin(), decoded.end(), std::back_inserter(m_wallets[*i].address));
-        if (m_wallets[*i].address.size() != 20)
+        if (decoded.size() != 20)
         {
             LOG() << "incorrect wallet address size for " << *i;
-            m_wallets.erase(*i);
             continue;
         }
 
-        m_wallets[*i].title   = label;
+        WalletParam wp;
+        wp.currency = XBridgeCurrency(*i);
+        wp.title    = label;
+        std::copy(decoded.begin(), decoded.end(), std::back_inserter(wp.address));
+
+        if (wp.currency.isNull() || wp.currency.length() != i->size() ||
+            currencyId(wp.currency) != xbridgeInvalidCurrency)
+        {
+            LOG() << "incorrect or duplicate wallet name " << *i;
+            continue;
+        }
+
+        m_wallets.push_back(wp);
 
         LOG() << "read wallet " << *i << " \"" << label << "\" address <" << address << ">";
     }
 
+    // currency id is index in sorted wallet table,
+    // base currency of pair is one with smaller id
+    std::sort(m_wallets.begin(), m_wallets.end());
+
+    // shards for every pair of wallets, both orders of
+    // currencies map to same shard
+    const std::size_t count = m_wallets.size();
+    m_pairs.resize(count * count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        for (std::size_t j = i + 1; j < count; ++j)
+        {
+            PairShardPtr sh(new PairShard);
+            sh->book.reset(new XBridgeOrderBook(m_wallets[i].currency, m_wallets[j].currency));
+            m_shards.push_back(sh);
+            m_pairs[i * count + j] = sh;
+            m_pairs[j * count + i] = sh;
+        }
+    }
+
     if (isEnabled())
     {
-        LOG() << "exchange enabled";
+        LOG() << "exchange enabled, " << m_shards.size() << " currency pairs";
     }
 
     return true;
 }
 
 //*****************************************************************************
+// journal records carry same data as packets, replay goes through
+// same code as live processing with journal closed
 //*****************************************************************************
-bool XBridgeExchange::isEnabled()
+void XBridgeExchange::applyJournalRecord(const XBridgeJournal::RecordType type,
+                                         const unsigned char * data,
+                                         const std::size_t size)
+{
+    switch (type)
+    {
+        case XBridgeJournal::jrOrder:
+        {
+            if (size != XBridgeTransaction::orderSize)
+            {
+                break;
+            }
+
+            XBridgeTransactionPtr tr = XBridgeTransaction::unpackOrder(data);
+
+            registerOrder(tr->id());
+            createTransaction(tr->id(),
+                              tr->firstAddress(), tr->firstCurrency(), tr->firstAmount(),
+                              tr->firstDestination(), tr->secondCurrency(), tr->secondAmount());
+            return;
+        }
+        case XBridgeJournal::jrDrop:
+        {
+            if (size != 32)
+            {
+                break;
+            }
+
+            XBridgeTransactionPtr tr;
+            dropTransaction(uint256(data), true, tr);
+            return;
+        }
+        case XBridgeJournal::jrState:
+        {
+            if (size != 33 || data[32] < XBridgeTransaction::trJoined || data[32] >= XBridgeTransaction::trFinished)
+            {
+                break;
+            }
+
+            XBridgeTransaction::State from = static_cast<XBridgeTransaction::State>(data[32]);
+            updateTransactionState(uint256(data), from, static_cast<XBridgeTransaction::State>(from + 1));
+            return;
+        }
+        case XBridgeJournal::jrAuction:
+        {
+            if (size != 16)
+            {
+                break;
+            }
+
+            PairShardPtr sh = shard(XBridgeCurrency(data), XBridgeCurrency(data+8));
+            if (!sh)
+            {
+                break;
+            }
+
+            boost::mutex::scoped_lock l(sh->lock);
+
+            auction(*sh);
+            return;
+        }
+        default:
+            break;
+    }
+
+    ERR() << "invalid journal record " << type << " size " << size << " " << __FUNCTION__;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::isEnabled() const
 {
     return m_wallets.size() > 0;
 }
 
 //*****************************************************************************
+// wallet table is few entries, linear scan of 8 byte codes
 //*****************************************************************************
-bool XBridgeExchange::haveConnectedWallet(const std::string & walletName)
+XBridgeCurrencyId XBridgeExchange::currencyId(const XBridgeCurrency & currency) const
 {
-    return m_wallets.count(walletName);
+    for (std::size_t i = 0; i < m_wallets.size(); ++i)
+    {
+        if (m_wallets[i].currency == currency)
+        {
+            return static_cast<XBridgeCurrencyId>(i);
+        }
+    }
+    return xbridgeInvalidCurrency;
 }
 
 //*****************************************************************************
 //*****************************************************************************
-std::vector<unsigned char> XBridgeExchange::walletAddress(const std::string & walletName)
+bool XBridgeExchange::haveConnectedWallet(const XBridgeCurrency & currency) const
 {
-    if (!m_wallets.count(walletName))
+    return currencyId(currency) != xbridgeInvalidCurrency;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+const std::vector<unsigned char> & XBridgeExchange::walletAddress(const XBridgeCurrency & currency) const
+{
+    static const std::vector<unsigned char> empty;
+
+    XBridgeCurrencyId id = currencyId(currency);
+    if (id == xbridgeInvalidCurrency)
     {
-        ERR() << "reqyest address for unknown wallet <" << walletName
+        ERR() << "reqyest address for unknown wallet <" << currency
               << ">" << __FUNCTION__;
-        return std::vector<unsigned char>();
+        return empty;
     }
 
-    return m_wallets[walletName].address;
+    return m_wallets[id].address;
 }
 
 //*****************************************************************************
 //*****************************************************************************
+XBridgeExchange::PairShardPtr XBridgeExchange::shard(const XBridgeCurrency & currency1,
+                                                     const XBridgeCurrency & currency2) const
+{
+    boost::uint32_t tag = pairTag(currency1, currency2);
+    if (!tag)
+    {
+        return PairShardPtr();
+    }
+
+    // empty for same currencies
+    return m_pairs[tag - 1];
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint32_t XBridgeExchange::pairTag(const XBridgeCurrency & currency1,
+                                         const XBridgeCurrency & currency2) const
+{
+    XBridgeCurrencyId id1 = currencyId(currency1);
+    XBridgeCurrencyId id2 = currencyId(currency2);
+    if (id1 == xbridgeInvalidCurrency || id2 == xbridgeInvalidCurrency)
+    {
+        return 0;
+    }
+
+    return static_cast<boost::uint32_t>(id1 * m_wallets.size() + id2 + 1);
+}
+
+//*****************************************************************************
+// pending orders are found by pair stored in orders index, orders
+// evicted from index are not found and wait for expiration
+//*****************************************************************************
+XBridgeExchange::PairShardPtr XBridgeExchange::orderShard(const uint256 & id)
+{
+    boost::uint32_t tag = 0;
+    {
+        boost::mutex::scoped_lock l(m_ordersIndexLock);
+        if (!m_ordersIndex.findTag(id, tag) || !tag)
+        {
+            return PairShardPtr();
+        }
+    }
+
+    return m_pairs[tag - 1];
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeExchange::Stripe & XBridgeExchange::stripe(const uint256 & id)
+{
+    // ids are hashes, any byte is uniform
+    return m_stripes[*id.begin() % StripeCount];
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::registerOrder(const uint256 & id)
+{
+    boost::mutex::scoped_lock l(m_ordersIndexLock);
+    if (!m_ordersIndex.insert(id))
+    {
+        m_duplicatesCount.inc();
+        return false;
+    }
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeExchange::indexOrder(const XBridgeTransactionPtr & order)
+{
+    boost::uint32_t tag = pairTag(order->firstCurrency(), order->secondCurrency());
+
+    boost::mutex::scoped_lock l(m_ordersIndexLock);
+
+    // orders restored from checkpoint are not registered yet
+    m_ordersIndex.insert(order->id());
+    m_ordersIndex.setTag(order->id(), tag);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeExchange::indexMembers(const XBridgeTransactionPtr & tr)
+{
+    boost::mutex::scoped_lock l(m_ordersIndexLock);
+
+    // orders restored from checkpoint are not registered yet
+    m_ordersIndex.insert(tr->firstId());
+    m_ordersIndex.set(tr->firstId(), tr->id());
+    m_ordersIndex.insert(tr->secondId());
+    m_ordersIndex.set(tr->secondId(), tr->id());
+}
+
+//*****************************************************************************
+// pending rest of order is reported as trNew even if part
+// of it is already joined
+//*****************************************************************************
+XBridgeTransaction::State XBridgeExchange::orderState(const uint256 & id, uint256 & transactionId)
+{
+    {
+        boost::mutex::scoped_lock l(m_ordersIndexLock);
+        if (!m_ordersIndex.find(id, transactionId))
+        {
+            return XBridgeTransaction::trInvalid;
+        }
+    }
+
+    PairShardPtr sh = orderShard(id);
+    if (sh)
+    {
+        boost::mutex::scoped_lock l(sh->lock);
+        if (sh->book->contains(id))
+        {
+            return XBridgeTransaction::trNew;
+        }
+    }
+
+    if (transactionId == 0)
+    {
+        // rejected, cancelled or expired before match
+        return XBridgeTransaction::trInvalid;
+    }
+
+    XBridgeTransactionPtr tr = transaction(transactionId);
+    return tr ? tr->state() : XBridgeTransaction::trInvalid;
+}
+
+//*****************************************************************************
+// place order to book of currency pair, every match with resting orders
+// produces joined transaction, published as evJoined
+//*****************************************************************************
 bool XBridgeExchange::createTransaction(const uint256 & id,
-                                        const std::vector<unsigned char> & sourceAddr,
-                                        const std::string & sourceCurrency,
+                                        const uint160 & sourceAddr,
+                                        const XBridgeCurrency & sourceCurrency,
                                         const boost::uint64_t sourceAmount,
-                                        const std::vector<unsigned char> & destAddr,
-                                        const std::string & destCurrency,
-                                        const boost::uint64_t destAmount,
-                                        uint256 & transactionId)
+                                        const uint160 & destAddr,
+                                        const XBridgeCurrency & destCurrency,
+                                        const boost::uint64_t destAmount)
 {
     DEBUG_TRACE();
 
-    // transactionId = id;
+    if (sourceCurrency == destCurrency)
+    {
+        LOG() << "same currencies, transaction rejected";
+        return false;
+    }
+
+    PairShardPtr sh = shard(sourceCurrency, destCurrency);
+    if (!sh)
+    {
+        LOG() << "no book for " << sourceCurrency << "/" << destCurrency
+              << ", transaction rejected";
+        return false;
+    }
 
-    XBridgeTransactionPtr tr(new XBridgeTransaction(id,
-                                                    sourceAddr, sourceCurrency,
-                                                    sourceAmount,
-                                                    destAddr, destCurrency,
-                                                    destAmount));
+    XBridgeTransactionPtr tr = XBridgeTransaction::create(id,
+                                                          sourceAddr, sourceCurrency,
+                                                          sourceAmount,
+                                                          destAddr, destCurrency,
+                                                          destAmount);
     if (!tr->isValid())
     {
         return false;
     }
 
-    uint256 h = tr->hash2();
+    m_ordersCount.inc();
+
+    std::vector<XBridgeTransactionPtr> joined;
+
+    boost::mutex::scoped_lock l(sh->lock);
 
-    XBridgeTransactionPtr tmp;
+    XBridgeOrderBookPtr & book = sh->book;
+    if (book->contains(id))
+    {
+        // retransmitted order
+        return true;
+    }
 
+    if (m_journal.isOpen())
     {
-        boost::mutex::scoped_lock l(m_pendingTransactionsLock);
+        unsigned char record[XBridgeTransaction::orderSize];
+        tr->packOrder(record);
+        m_journal.append(XBridgeJournal::jrOrder, record, sizeof(record));
+    }
 
-        if (!m_pendingTransactions.count(h))
+    std::size_t before = book->size();
+    if (m_auctionInterval)
+    {
+        // matched by next auction
+        if (!book->enqueue(tr))
         {
-            // new transaction or update existing (update timestamp)
-            h = tr->hash1();
-            m_pendingTransactions[h] = tr;
+            return false;
         }
-        else
-        {
-            // found, check if expired
-            if (m_pendingTransactions[h]->isExpired())
-            {
-                // if expired - delete old transaction
-                m_pendingTransactions.erase(h);
+    }
+    else if (!book->add(tr, joined))
+    {
+        return false;
+    }
 
-                // create new
-                h = tr->hash1();
-                m_pendingTransactions[h] = tr;
-            }
-            else
-            {
-                // try join with existing transaction
-                if (!m_pendingTransactions[h]->tryJoin(tr))
-                {
-                    LOG() << "transaction not joined";
-                    // return false;
+    m_pendingCount.inc(static_cast<boost::int64_t>(book->size()) -
+                       static_cast<boost::int64_t>(before));
 
-                    // create new transaction
-                    h = tr->hash1();
-                    m_pendingTransactions[h] = tr;
-                }
-                else
-                {
-                    LOG() << "transactions joined, new id "
-                          << util::base64_encode(std::string((char *)(tr->id().begin()), 32));
+    if (book->contains(id))
+    {
+        indexOrder(tr);
+    }
 
-                    tmp = m_pendingTransactions[h];
-                }
-            }
-        }
+    if (book->contains(id) && !tr->deadline().is_not_a_date_time())
+    {
+        Deadline d;
+        d.time = tr->deadline();
+        d.id   = id;
+        sh->deadlines.push_back(d);
     }
 
-    if (tmp)
+    promote(joined);
+
+    for (std::vector<XBridgeTransactionPtr>::iterator i = joined.begin(); i != joined.end(); ++i)
     {
-        // new transaction id
-        transactionId = tmp->id();
+        LOG() << "transactions joined, new id "
+              << util::base64_encode(std::string((char *)((*i)->id().begin()), 32));
+    }
 
-        // move to transactions
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeExchange::promote(const std::vector<XBridgeTransactionPtr> & joined)
+{
+    for (std::vector<XBridgeTransactionPtr>::const_iterator i = joined.begin(); i != joined.end(); ++i)
+    {
+        Stripe & s = stripe((*i)->id());
+
+        boost::mutex::scoped_lock l(s.lock);
+        s.transactions[(*i)->id()] = *i;
+        scheduleExpiration(s, *i);
+
+        indexMembers(*i);
+
+        publish(XBridgeEvent::evJoined, *i);
+    }
+
+    m_activeCount.inc(joined.size());
+    m_matchesCount.inc(joined.size());
+}
+
+//*****************************************************************************
+// books are cleared one by one, each under own shard lock,
+// joined transactions are published as evJoined
+//*****************************************************************************
+std::size_t XBridgeExchange::runAuctions()
+{
+    std::size_t result = 0;
+
+    for (PairShards::iterator i = m_shards.begin(); i != m_shards.end(); ++i)
+    {
+        PairShardPtr & sh = *i;
+
+        boost::mutex::scoped_lock l(sh->lock);
+
+        XBridgeOrderBookPtr & book = sh->book;
+        if (!book->queued() && !book->crossed())
         {
-            boost::mutex::scoped_lock l(m_transactionsLock);
-            m_transactions[tmp->id()] = tmp;
+            // nothing to clear
+            continue;
         }
+
+        boost::uint64_t started = XBridgeTrace::timestamp();
+        XBridgeAuctionStats stats = auction(*sh);
+        boost::uint64_t elapsed = XBridgeTrace::timestamp() - started;
+
+        if (!stats.orders && !stats.matched)
         {
-            boost::mutex::scoped_lock l(m_pendingTransactionsLock);
-            m_pendingTransactions.erase(h);
+            continue;
         }
 
+        result += stats.matched;
+
+        m_auctionsCount.inc();
+        m_auctionOrders.observe(stats.orders);
+        m_auctionClearingTime.observe(elapsed);
+
+        std::ostringstream labels;
+        labels << "pair=\"" << book->baseCurrency() << "/" << book->quoteCurrency() << "\"";
+        Metrics::instance().counter("xbridge_exchange_auction_volume_total",
+                                    "matched amount of base currency",
+                                    labels.str()).inc(stats.volume);
+
+        LOG() << "auction " << book->baseCurrency() << "/" << book->quoteCurrency()
+              << " orders " << stats.orders
+              << " matched " << stats.matched
+              << " volume " << stats.volume
+              << " price " << stats.price.quote << "/" << stats.price.base
+              << " clearing " << elapsed << "us";
     }
 
-    return true;
+    return result;
 }
 
 //*****************************************************************************
 //*****************************************************************************
-bool XBridgeExchange::updateTransactionWhenHoldApplyReceived(const uint256 & id)
+XBridgeAuctionStats XBridgeExchange::auction(PairShard & sh)
 {
-    boost::mutex::scoped_lock l(m_transactionsLock);
-    if (!m_transactions.count(id))
+    XBridgeOrderBookPtr & book = sh.book;
+
+    if (m_journal.isOpen())
+    {
+        unsigned char record[16];
+        book->baseCurrency().copyTo(record);
+        book->quoteCurrency().copyTo(record+8);
+        m_journal.append(XBridgeJournal::jrAuction, record, sizeof(record));
+    }
+
+    std::size_t before = book->size();
+
+    std::vector<XBridgeTransactionPtr> joined;
+    XBridgeAuctionStats stats = book->auction(joined);
+
+    m_pendingCount.inc(static_cast<boost::int64_t>(book->size()) -
+                       static_cast<boost::int64_t>(before));
+
+    promote(joined);
+
+    return stats;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::updateTransactionState(const uint256 & id,
+                                             const XBridgeTransaction::State from,
+                                             const XBridgeTransaction::State to)
+{
+    Stripe & s = stripe(id);
+
+    boost::mutex::scoped_lock l(s.lock);
+
+    TransactionMap::iterator i = s.transactions.find(id);
+    if (i == s.transactions.end())
     {
         // unknown transaction
         LOG() << "unknown transaction, id <"
@@ -210,12 +847,46 @@ bool XBridgeExchange::updateTransactionWhenHoldApplyReceived(const uint256 & id)
         return false;
     }
 
-    if (m_transactions[id]->increaseStateCounter(XBridgeTransaction::trJoined) == XBridgeTransaction::trHold)
+    XBridgeTransactionPtr & tr = i->second;
+    XBridgeTransaction::State before = tr->state();
+
+    if (m_journal.isOpen() && before == from)
     {
-        return true;
+        unsigned char record[33];
+        std::copy(id.begin(), id.end(), record);
+        record[32] = static_cast<unsigned char>(from);
+        m_journal.append(XBridgeJournal::jrState, record, sizeof(record));
+    }
+
+    // timestamp is refreshed only when state moves forward,
+    // so resent stale replies do not keep transaction alive
+    XBridgeTransaction::State state = tr->increaseStateCounter(from);
+    if (tr->state() != before)
+    {
+        scheduleExpiration(s, tr);
+    }
+
+    if (state != to)
+    {
+        return false;
     }
 
-    return false;
+    switch (to)
+    {
+        case XBridgeTransaction::trHold:     publish(XBridgeEvent::evHold, tr);     break;
+        case XBridgeTransaction::trPaid:     publish(XBridgeEvent::evPaid, tr);     break;
+        case XBridgeTransaction::trFinished: publish(XBridgeEvent::evFinished, tr); break;
+        default:                                                                     break;
+    }
+
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::updateTransactionWhenHoldApplyReceived(const uint256 & id)
+{
+    return updateTransactionState(id, XBridgeTransaction::trJoined, XBridgeTransaction::trHold);
 }
 
 //*****************************************************************************
@@ -224,65 +895,227 @@ bool XBridgeExchange::updateTransactionWhenHoldApplyReceived(const uint256 & id)
 bool XBridgeExchange::updateTransactionWhenPayApplyReceived(const uint256 & id,
                                                             const uint256 & /*paymentId*/)
 {
-    boost::mutex::scoped_lock l(m_transactionsLock);
-    if (!m_transactions.count(id))
-    {
-        // unknown transaction
-        LOG() << "unknown transaction, id <"
-              << util::base64_encode(std::string((char *)(id.begin()), 32))
-              << ">";
-        return false;
-    }
-
     // TODO process paymentId
 
     // update transaction state
-    if (m_transactions[id]->increaseStateCounter(XBridgeTransaction::trHold) == XBridgeTransaction::trPaid)
+    return updateTransactionState(id, XBridgeTransaction::trHold, XBridgeTransaction::trPaid);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::updateTransactionWhenCommitApplyReceived(const uint256 & id)
+{
+    // update transaction state
+    return updateTransactionState(id, XBridgeTransaction::trPaid, XBridgeTransaction::trFinished);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeExchange::updateTransaction(const uint256 & hash)
+{
+    // DEBUG_TRACE();
+    m_walletTransactions.insert(hash);
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeTransactionPtr XBridgeExchange::order(const uint256 & id)
+{
+    PairShardPtr sh = orderShard(id);
+    if (!sh)
     {
-        return true;
+        return XBridgeTransactionPtr();
     }
 
-    return false;
+    boost::mutex::scoped_lock l(sh->lock);
+    return sh->book->order(id);
 }
 
 //*****************************************************************************
 //*****************************************************************************
-bool XBridgeExchange::updateTransactionWhenCommitApplyReceived(const uint256 & id)
+bool XBridgeExchange::cancelTransaction(const uint256 & hash,
+                                        XBridgeTransactionPtr & cancelled)
+{
+    DEBUG_TRACE();
+
+    return dropTransaction(hash, false, cancelled);
+}
+
+//*****************************************************************************
+// pending order or joined transaction, paid transactions
+// are dropped only on replay of expiration
+//*****************************************************************************
+bool XBridgeExchange::dropTransaction(const uint256 & id,
+                                      const bool anyState,
+                                      XBridgeTransactionPtr & dropped)
 {
-    boost::mutex::scoped_lock l(m_transactionsLock);
-    if (!m_transactions.count(id))
+    PairShardPtr sh = orderShard(id);
+    if (sh)
+    {
+        boost::mutex::scoped_lock l(sh->lock);
+
+        XBridgeTransactionPtr tr = sh->book->order(id);
+        if (tr && sh->book->cancel(id))
+        {
+            m_journal.append(XBridgeJournal::jrDrop, id.begin(), 32);
+
+            tr->drop();
+            dropped = tr;
+
+            m_pendingCount.dec();
+
+            publish(XBridgeEvent::evDropped, tr);
+            return true;
+        }
+    }
+
+    Stripe & s = stripe(id);
+
+    boost::mutex::scoped_lock l(s.lock);
+
+    TransactionMap::iterator i = s.transactions.find(id);
+    if (i == s.transactions.end())
     {
-        // unknown transaction
-        LOG() << "unknown transaction, id <"
-              << util::base64_encode(std::string((char *)(id.begin()), 32))
-              << ">";
         return false;
     }
 
-    // update transaction state
-    if (m_transactions[id]->increaseStateCounter(XBridgeTransaction::trPaid) == XBridgeTransaction::trFinished)
+    XBridgeTransactionPtr tr = i->second;
+    if (!anyState &&
+        tr->state() != XBridgeTransaction::trJoined &&
+        tr->state() != XBridgeTransaction::trHold)
     {
-        return true;
+        // payments sent, must be finished
+        LOG() << "transaction in state " << tr->state() << " not cancelled";
+        return false;
     }
 
-    return false;
+    m_journal.append(XBridgeJournal::jrDrop, id.begin(), 32);
+
+    tr->drop();
+    dropped = tr;
+
+    s.transactions.erase(i);
+    m_activeCount.dec();
+
+    publish(XBridgeEvent::evDropped, tr);
+    return true;
 }
 
 //*****************************************************************************
 //*****************************************************************************
-bool XBridgeExchange::updateTransaction(const uint256 & hash)
+void XBridgeExchange::scheduleExpiration(Stripe & s, const XBridgeTransactionPtr & tr)
 {
-    // DEBUG_TRACE();
-    m_walletTransactions.insert(hash);
-    return true;
+    XBridgeTransaction::State state = tr->state();
+    boost::posix_time::ptime  time  = tr->deadline();
+    if (state > XBridgeTransaction::trDropped || time.is_not_a_date_time())
+    {
+        return;
+    }
+
+    Deadline d;
+    d.time = time;
+    d.id   = tr->id();
+    s.deadlines[state].push_back(d);
 }
 
 //*****************************************************************************
+// only queue heads are checked, each entry is visited once
 //*****************************************************************************
-bool XBridgeExchange::cancelTransaction(const uint256 & /*hash*/)
+std::size_t XBridgeExchange::sweepExpired()
 {
-    DEBUG_TRACE();
-    return true;
+    std::size_t result = 0;
+
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    for (PairShards::iterator i = m_shards.begin(); i != m_shards.end(); ++i)
+    {
+        PairShardPtr & sh = *i;
+
+        boost::mutex::scoped_lock l(sh->lock);
+
+        while (!sh->deadlines.empty() && sh->deadlines.front().time <= now)
+        {
+            Deadline d = sh->deadlines.front();
+            sh->deadlines.pop_front();
+
+            XBridgeTransactionPtr tr = sh->book->order(d.id);
+            if (!tr || !tr->isExpired() || !sh->book->cancel(d.id))
+            {
+                // filled or cancelled
+                continue;
+            }
+
+            m_journal.append(XBridgeJournal::jrDrop, d.id.begin(), 32);
+
+            tr->drop();
+            ++result;
+
+            m_pendingCount.dec();
+
+            publish(XBridgeEvent::evDropped, tr);
+        }
+    }
+
+    for (unsigned int n = 0; n < StripeCount; ++n)
+    {
+        Stripe & s = m_stripes[n];
+
+        boost::mutex::scoped_lock l(s.lock);
+
+        for (unsigned int state = XBridgeTransaction::trJoined; state <= XBridgeTransaction::trDropped; ++state)
+        {
+            std::deque<Deadline> & queue = s.deadlines[state];
+            while (!queue.empty() && queue.front().time <= now)
+            {
+                Deadline d = queue.front();
+                queue.pop_front();
+
+                TransactionMap::iterator i = s.transactions.find(d.id);
+                if (i == s.transactions.end())
+                {
+                    continue;
+                }
+
+                XBridgeTransactionPtr tr = i->second;
+                if (tr->state() != state || !tr->isExpired())
+                {
+                    // has newer entry
+                    continue;
+                }
+
+                s.transactions.erase(i);
+                m_activeCount.dec();
+
+                m_journal.append(XBridgeJournal::jrDrop, d.id.begin(), 32);
+
+                if (state == XBridgeTransaction::trFinished ||
+                    state == XBridgeTransaction::trDropped)
+                {
+                    // completed, members already notified
+                    continue;
+                }
+
+                tr->drop();
+                ++result;
+
+                publish(XBridgeEvent::evDropped, tr);
+            }
+        }
+    }
+
+    m_expiredCount.inc(result);
+
+    return result;
+}
+
+//*****************************************************************************
+// caller holds shard or stripe lock, so events of one
+// transaction are queued in order of state changes
+//*****************************************************************************
+void XBridgeExchange::publish(const XBridgeEvent::Type type, const XBridgeTransactionPtr & tr)
+{
+    XBridgeEventBus::instance().publish(type, tr);
 }
 
 //*****************************************************************************
@@ -290,26 +1123,91 @@ bool XBridgeExchange::cancelTransaction(const uint256 & /*hash*/)
 const XBridgeTransactionPtr XBridgeExchange::transaction(const uint256 & hash)
 {
     {
-        boost::mutex::scoped_lock l(m_transactionsLock);
+        Stripe & s = stripe(hash);
+
+        boost::mutex::scoped_lock l(s.lock);
+
+        TransactionMap::const_iterator i = s.transactions.find(hash);
+        if (i != s.transactions.end())
+        {
+            return i->second;
+        }
+    }
+
+    // pending orders are not transactions yet
+    return XBridgeTransactionPtr();
+}
+
+//*****************************************************************************
+// tables are copied one at a time, so snapshot may show transaction
+// joined after order was copied, queries tolerate this
+//*****************************************************************************
+void XBridgeExchange::publishSnapshot()
+{
+    // price levels per side of each book
+    static const std::size_t maxDepth = 50;
+
+    boost::uint64_t started = XBridgeTrace::timestamp();
+
+    boost::shared_ptr<XBridgeSnapshot> snapshot(new XBridgeSnapshot(++m_snapshotSequence));
+
+    for (PairShards::iterator i = m_shards.begin(); i != m_shards.end(); ++i)
+    {
+        boost::mutex::scoped_lock l((*i)->lock);
+        snapshot->add(*(*i)->book, maxDepth);
+    }
+
+    for (unsigned int n = 0; n < StripeCount; ++n)
+    {
+        Stripe & s = m_stripes[n];
 
-        if (m_transactions.count(hash))
+        boost::mutex::scoped_lock l(s.lock);
+        for (TransactionMap::iterator i = s.transactions.begin(); i != s.transactions.end(); ++i)
         {
-            return m_transactions[hash];
+            snapshot->add(i->second);
         }
     }
 
-    // TODO not search in pending transactions
-//    {
-//        boost::mutex::scoped_lock l(m_pendingTransactionsLock);
+    snapshot->seal();
 
-//        if (m_pendingTransactions.count(hash))
-//        {
-//            return m_pendingTransactions[hash];
-//        }
-//    }
+    boost::atomic_store(&m_snapshot, XBridgeSnapshotPtr(snapshot));
+
+    m_snapshotTime.observe(XBridgeTrace::timestamp() - started);
+}
 
-    // return XBridgeTransaction::trInvalid;
-    return XBridgeTransactionPtr(new XBridgeTransaction);
+//*****************************************************************************
+//*****************************************************************************
+XBridgeSnapshotPtr XBridgeExchange::snapshot() const
+{
+    return boost::atomic_load(&m_snapshot);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::vector<XBridgeMarketData> XBridgeExchange::takeMarketData()
+{
+    std::vector<XBridgeMarketData> result;
+
+    for (PairShards::iterator i = m_shards.begin(); i != m_shards.end(); ++i)
+    {
+        boost::mutex::scoped_lock l((*i)->lock);
+
+        XBridgeOrderBookPtr & book = (*i)->book;
+
+        XBridgeMarketData md;
+        md.deltas = book->takeDeltas();
+        if (md.deltas.empty())
+        {
+            continue;
+        }
+
+        md.base     = book->baseCurrency();
+        md.quote    = book->quoteCurrency();
+        md.sequence = book->sequence();
+        result.push_back(md);
+    }
+
+    return result;
 }
 
 //*****************************************************************************
@@ -319,7 +1217,7 @@ std::vector<StringPair> XBridgeExchange::listOfWallets() const
     std::vector<StringPair> result;
     for (WalletList::const_iterator i = m_wallets.begin(); i != m_wallets.end(); ++i)
     {
-        result.push_back(std::make_pair(i->first, i->second.title));
+        result.push_back(std::make_pair(i->currency.str(), i->title));
     }
     return result;
 }
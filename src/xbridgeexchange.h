@@ -5,14 +5,25 @@
 #define XBRIDGEEXCHANGE_H
 
 #include "util/uint256.h"
+#include "util/metrics.h"
+#include "xbridgecurrency.h"
 #include "xbridgetransaction.h"
+#include "xbridgeorderbook.h"
+#include "xbridgejournal.h"
+#include "xbridgecheckpoint.h"
+#include "xbridgeeventbus.h"
+#include "xbridgesnapshot.h"
+#include "xbridgeidindex.h"
 
 #include <string>
 #include <set>
 #include <map>
+#include <deque>
 
 #include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
 
 //*****************************************************************************
 //*****************************************************************************
@@ -22,8 +33,23 @@ typedef std::pair<std::string, std::string> StringPair;
 //*****************************************************************************
 struct WalletParam
 {
+    XBridgeCurrency            currency;
     std::string                title;
     std::vector<unsigned char> address;
+
+    bool operator < (const WalletParam & other) const { return currency < other.currency; }
+};
+
+//*****************************************************************************
+// sequence numbered level changes of one book, client applies deltas
+// with sequence = last + 1, on gap resyncs from snapshot
+//*****************************************************************************
+struct XBridgeMarketData
+{
+    XBridgeCurrency                      base;
+    XBridgeCurrency                      quote;
+    boost::uint64_t                      sequence;
+    std::vector<XBridgeOrderBook::Delta> deltas;
 };
 
 //*****************************************************************************
@@ -38,45 +64,195 @@ protected:
     ~XBridgeExchange();
 
 public:
+    // load wallets, restore state from journal
     bool init();
+    // apply recorded journal without network and report throughput
+    bool replay(const std::string & path);
+
+    // write checkpoint if interval passed since previous one
+    bool checkpoint(const bool force = false);
+
+    bool isEnabled() const;
 
-    bool isEnabled();
-    bool haveConnectedWallet(const std::string & walletName);
+    // index in wallet table, xbridgeInvalidCurrency if not connected
+    XBridgeCurrencyId currencyId(const XBridgeCurrency & currency) const;
+    bool haveConnectedWallet(const XBridgeCurrency & currency) const;
 
-    std::vector<unsigned char> walletAddress(const std::string & walletName);
+    const std::vector<unsigned char> & walletAddress(const XBridgeCurrency & currency) const;
+
+    // remember client order id, false if already received,
+    // checked before order is parsed or relayed
+    bool registerOrder(const uint256 & id);
+    // state of order by client id, transactionId of last fill
+    // or zero, trInvalid if not known or already removed
+    XBridgeTransaction::State orderState(const uint256 & id, uint256 & transactionId);
 
     bool createTransaction(const uint256 & id,
-                           const std::vector<unsigned char> & sourceAddr,
-                           const std::string & sourceCurrency,
+                           const uint160 & sourceAddr,
+                           const XBridgeCurrency & sourceCurrency,
                            const boost::uint64_t sourceAmount,
-                           const std::vector<unsigned char> & destAddr,
-                           const std::string & destCurrency,
-                           const boost::uint64_t destAmount,
-                           uint256 & transactionId);
+                           const uint160 & destAddr,
+                           const XBridgeCurrency & destCurrency,
+                           const boost::uint64_t destAmount);
+
+    // batch auction mode, orders matched by timer, 0 if continuous
+    unsigned int auctionInterval() const { return m_auctionInterval; }
+    // clear books collected during interval, return count of joined transactions
+    std::size_t runAuctions();
 
     bool updateTransactionWhenHoldApplyReceived(const uint256 & id);
     bool updateTransactionWhenPayApplyReceived(const uint256 & id, const uint256 & paymentId);
     bool updateTransactionWhenCommitApplyReceived(const uint256 & id);
 
     bool updateTransaction(const uint256 & hash);
-    bool cancelTransaction(const uint256 & hash);
+    // pending order by client id, empty if not in book
+    XBridgeTransactionPtr order(const uint256 & id);
+    // cancel pending order or not paid transaction
+    bool cancelTransaction(const uint256 & hash, XBridgeTransactionPtr & cancelled);
 
+    // drop expired orders and transactions, return count of dropped
+    std::size_t sweepExpired();
+
+    // joined transaction, empty if not found
     const XBridgeTransactionPtr transaction(const uint256 & hash);
 
+    // snapshot of books and transactions for queries, ms between rebuilds
+    unsigned int snapshotInterval() const { return m_snapshotInterval; }
+    // copy tables, shard by shard and stripe by stripe, and replace
+    // published snapshot, matching waits only for copy of one table
+    void publishSnapshot();
+    // last published, never null after init, read without exchange locks
+    XBridgeSnapshotPtr snapshot() const;
+
+    // ms between market data broadcasts, 0 if disabled
+    unsigned int marketDataInterval() const { return m_marketDataInterval; }
+    // level changes of every book since previous call
+    std::vector<XBridgeMarketData> takeMarketData();
+
     std::vector<StringPair> listOfWallets() const;
 
 private:
-    // connected wallets
-    typedef std::map<std::string, WalletParam> WalletList;
+    // expiration queue entry, timeouts are fixed per state so queue
+    // is ordered by time, entries of updated transactions are skipped
+    struct Deadline
+    {
+        boost::posix_time::ptime time;
+        uint256                  id;
+    };
+
+    // pending orders of one currency pair, matching and promotion
+    // of joined transactions happen under shard lock
+    struct PairShard
+    {
+        boost::mutex             lock;
+        XBridgeOrderBookPtr      book;
+        std::deque<Deadline>     deadlines;
+    };
+    typedef boost::shared_ptr<PairShard> PairShardPtr;
+
+    typedef boost::unordered_map<uint256, XBridgeTransactionPtr, XBridgeIdHash> TransactionMap;
+
+    // joined transactions, striped by hub transaction id,
+    // lock order is shard then stripe
+    struct Stripe
+    {
+        boost::mutex                             lock;
+        TransactionMap                           transactions;
+        std::deque<Deadline>                     deadlines[XBridgeTransaction::trDropped + 1];
+    };
+
+    enum
+    {
+        StripeCount = 16
+    };
+
+private:
+    bool loadWallets();
+    bool restoreCheckpoint(const std::string & journalPath, boost::uint64_t & journalOffset);
+
+    PairShardPtr shard(const XBridgeCurrency & currency1, const XBridgeCurrency & currency2) const;
+    // position of pair shard plus one, zero if wallet not connected
+    boost::uint32_t pairTag(const XBridgeCurrency & currency1, const XBridgeCurrency & currency2) const;
+    // shard of pending order, empty if not indexed
+    PairShardPtr orderShard(const uint256 & id);
+    Stripe &     stripe(const uint256 & id);
+
+    // caller holds shard lock
+    void promote(const std::vector<XBridgeTransactionPtr> & joined);
+    // caller holds stripe lock
+    void scheduleExpiration(Stripe & s, const XBridgeTransactionPtr & tr);
+    // pending order points to its pair
+    void indexOrder(const XBridgeTransactionPtr & order);
+    // member order ids point to joined transaction
+    void indexMembers(const XBridgeTransactionPtr & tr);
+
+    bool updateTransactionState(const uint256 & id,
+                                const XBridgeTransaction::State from,
+                                const XBridgeTransaction::State to);
+    bool dropTransaction(const uint256 & id,
+                         const bool anyState,
+                         XBridgeTransactionPtr & dropped);
+    // caller holds shard lock
+    XBridgeAuctionStats auction(PairShard & sh);
+
+    // state change to subscribers of event bus, journal replay
+    // runs before app subscribes and is not published
+    void publish(const XBridgeEvent::Type type, const XBridgeTransactionPtr & tr);
+
+    void applyJournalRecord(const XBridgeJournal::RecordType type,
+                            const unsigned char * data,
+                            const std::size_t size);
+
+private:
+    // connected wallets sorted by currency, indexed by currency id
+    typedef std::vector<WalletParam> WalletList;
     WalletList                               m_wallets;
 
-    boost::mutex                             m_pendingTransactionsLock;
-    std::map<uint256, XBridgeTransactionPtr> m_pendingTransactions;
+    // one shard per pair of connected wallets, created by init
+    // before sessions and dht are started, tables are not
+    // changed later and read without lock
+    typedef std::vector<PairShardPtr> PairShards;
+    PairShards                               m_shards;
+    // shard of pair (id1, id2) at id1 * wallets + id2
+    std::vector<PairShardPtr>                m_pairs;
+    unsigned int                             m_auctionInterval;
 
-    boost::mutex                             m_transactionsLock;
-    std::map<uint256, XBridgeTransactionPtr> m_transactions;
+    Stripe                                   m_stripes[StripeCount];
 
     std::set<uint256>                        m_walletTransactions;
+
+    // received client order ids, value is hub id of last fill,
+    // tag is pair of pending order,
+    // lock taken after shard and stripe locks
+    boost::mutex                             m_ordersIndexLock;
+    XBridgeIdIndex                           m_ordersIndex;
+
+    // state changes are appended under shard or stripe lock,
+    // so journal order matches order of application
+    XBridgeJournal                           m_journal;
+
+    std::string                              m_checkpointPath;
+    unsigned int                             m_checkpointInterval;
+    boost::posix_time::ptime                 m_lastCheckpoint;
+    boost::uint64_t                          m_checkpointOffset;
+
+    // replaced by atomic store, readers keep old copy alive
+    XBridgeSnapshotPtr                       m_snapshot;
+    boost::uint64_t                          m_snapshotSequence;
+    unsigned int                             m_snapshotInterval;
+
+    unsigned int                             m_marketDataInterval;
+
+    MetricCounter &                          m_ordersCount;
+    MetricCounter &                          m_duplicatesCount;
+    MetricCounter &                          m_matchesCount;
+    MetricGauge &                            m_pendingCount;
+    MetricGauge &                            m_activeCount;
+    MetricCounter &                          m_expiredCount;
+    MetricCounter &                          m_auctionsCount;
+    MetricHistogram &                        m_auctionOrders;
+    MetricHistogram &                        m_auctionClearingTime;
+    MetricHistogram &                        m_snapshotTime;
 };
 
 #endif // XBRIDGEEXCHANGE_H
@@ -0,0 +1,160 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#include "xbridgeidindex.h"
+#include "xbridgetransaction.h"
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeIdIndex::XBridgeIdIndex(const std::size_t capacity)
+    : m_size(0)
+    , m_order(capacity ? capacity : 1)
+    , m_head(0)
+{
+    std::size_t slots = 1;
+    while (slots < m_order.size() * 2)
+    {
+        slots <<= 1;
+    }
+
+    m_slots.resize(slots);
+    m_mask = slots - 1;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::size_t XBridgeIdIndex::probe(const uint256 & id) const
+{
+    std::size_t i = XBridgeIdHash()(id) & m_mask;
+    while (m_slots[i].used && m_slots[i].id != id)
+    {
+        i = (i + 1) & m_mask;
+    }
+    return i;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeIdIndex::insert(const uint256 & id)
+{
+    if (contains(id))
+    {
+        return false;
+    }
+
+    if (m_size == m_order.size())
+    {
+        // full, drop oldest
+        erase(m_order[m_head]);
+    }
+
+    // probe again, eviction could move entries
+    Slot & s = m_slots[probe(id)];
+    s.id    = id;
+    s.value = 0;
+    s.tag   = 0;
+    s.used  = true;
+    ++m_size;
+
+    m_order[m_head] = id;
+    m_head = (m_head + 1) % m_order.size();
+
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeIdIndex::contains(const uint256 & id) const
+{
+    return m_slots[probe(id)].used;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeIdIndex::find(const uint256 & id, uint256 & value) const
+{
+    const Slot & s = m_slots[probe(id)];
+    if (!s.used)
+    {
+        return false;
+    }
+
+    value = s.value;
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeIdIndex::set(const uint256 & id, const uint256 & value)
+{
+    Slot & s = m_slots[probe(id)];
+    if (!s.used)
+    {
+        return false;
+    }
+
+    s.value = value;
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeIdIndex::findTag(const uint256 & id, boost::uint32_t & tag) const
+{
+    const Slot & s = m_slots[probe(id)];
+    if (!s.used)
+    {
+        return false;
+    }
+
+    tag = s.tag;
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeIdIndex::setTag(const uint256 & id, const boost::uint32_t tag)
+{
+    Slot & s = m_slots[probe(id)];
+    if (!s.used)
+    {
+        return false;
+    }
+
+    s.tag = tag;
+    return true;
+}
+
+//*****************************************************************************
+// backward shift deletion, entries after removed slot are moved
+// back if their home position allows, so no tombstones are needed
+//*****************************************************************************
+void XBridgeIdIndex::erase(const uint256 & id)
+{
+    std::size_t i = probe(id);
+    if (!m_slots[i].used)
+    {
+        return;
+    }
+
+    std::size_t j = i;
+    while (true)
+    {
+        j = (j + 1) & m_mask;
+        if (!m_slots[j].used)
+        {
+            break;
+        }
+
+        // entry at j may fill hole at i if its home is not in (i, j]
+        std::size_t home = XBridgeIdHash()(m_slots[j].id) & m_mask;
+        if (((j - home) & m_mask) >= ((j - i) & m_mask))
+        {
+            m_slots[i] = m_slots[j];
+            i = j;
+        }
+    }
+
+    m_slots[i] = Slot();
+    --m_size;
+}
@@ -0,0 +1,66 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#ifndef XBRIDGEIDINDEX_H
+#define XBRIDGEIDINDEX_H
+
+#include "util/uint256.h"
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+//*****************************************************************************
+// bounded set of ids with attached value, open addressing with linear
+// probing, oldest id is evicted when full, so memory is fixed at start
+//
+// not thread safe, caller is responsible for locking
+//*****************************************************************************
+class XBridgeIdIndex
+{
+public:
+    XBridgeIdIndex(const std::size_t capacity);
+
+    // false if id is already in index
+    bool insert(const uint256 & id);
+    bool contains(const uint256 & id) const;
+
+    // value attached to id, zero until set
+    bool find(const uint256 & id, uint256 & value) const;
+    // false if id is not in index
+    bool set(const uint256 & id, const uint256 & value);
+
+    // small number attached to id, zero until set
+    bool findTag(const uint256 & id, boost::uint32_t & tag) const;
+    bool setTag(const uint256 & id, const boost::uint32_t tag);
+
+    std::size_t size() const     { return m_size; }
+    std::size_t capacity() const { return m_order.size(); }
+
+private:
+    struct Slot
+    {
+        uint256         id;
+        uint256         value;
+        boost::uint32_t tag;
+        bool            used;
+
+        Slot() : tag(0), used(false) {}
+    };
+
+    // slot with id or first free slot of probe sequence
+    std::size_t probe(const uint256 & id) const;
+    void        erase(const uint256 & id);
+
+private:
+    // power of two, at least twice capacity
+    std::vector<Slot>    m_slots;
+    std::size_t          m_mask;
+    std::size_t          m_size;
+
+    // ids in insertion order, next to evict at m_head
+    std::vector<uint256> m_order;
+    std::size_t          m_head;
+};
+
+#endif // XBRIDGEIDINDEX_H
@@ -0,0 +1,371 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#include "xbridgejournal.h"
+#include "util/logger.h"
+
+#include <algorithm>
+
+#include <boost/crc.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+//*****************************************************************************
+//*****************************************************************************
+namespace
+{
+
+const std::size_t headerSize = 3;
+const std::size_t crcSize    = 4;
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint32_t checksum(const unsigned char * data, const std::size_t size)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(data, size);
+    return crc.checksum();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool fileSync(std::FILE * f)
+{
+    if (std::fflush(f) != 0)
+    {
+        return false;
+    }
+#ifdef WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+//*****************************************************************************
+// offsets over 2GB, long is 32 bit on windows and 32 bit posix
+//*****************************************************************************
+bool fileSeek(std::FILE * f, const boost::uint64_t offset)
+{
+#ifdef WIN32
+    return _fseeki64(f, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+    return fseeko(f, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint64_t fileTell(std::FILE * f)
+{
+#ifdef WIN32
+    __int64 offset = _ftelli64(f);
+#else
+    off_t offset = ftello(f);
+#endif
+    return offset > 0 ? static_cast<boost::uint64_t>(offset) : 0;
+}
+
+} // namespace
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeJournal::XBridgeJournal()
+    : m_file(0)
+    , m_syncInterval(0)
+    , m_appended(0)
+    , m_written(0)
+    , m_failures(0)
+    , m_stop(false)
+{
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeJournal::~XBridgeJournal()
+{
+    close();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+// static
+boost::uint64_t XBridgeJournal::replay(const std::string & path,
+                                       const RecordHandler & handler,
+                                       const boost::uint64_t offset)
+{
+    std::FILE * f = std::fopen(path.c_str(), "rb");
+    if (!f)
+    {
+        // new journal
+        return 0;
+    }
+
+    if (offset && !fileSeek(f, offset))
+    {
+        ERR() << "journal " << path << " shorter than " << offset << " " << __FUNCTION__;
+        std::fclose(f);
+        return 0;
+    }
+
+    boost::uint64_t valid = offset;
+    std::vector<unsigned char> record;
+    while (true)
+    {
+        unsigned char header[headerSize];
+        if (std::fread(header, 1, headerSize, f) != headerSize)
+        {
+            break;
+        }
+
+        std::size_t size = header[0] | (header[1] << 8);
+        record.resize(1 + size + crcSize);
+        record[0] = header[2];
+        if (std::fread(&record[1], 1, size + crcSize, f) != size + crcSize)
+        {
+            LOG() << "journal " << path << " truncated at " << valid;
+            break;
+        }
+
+        const unsigned char * c = &record[1 + size];
+        boost::uint32_t crc = c[0] | (c[1] << 8) | (c[2] << 16) | (static_cast<boost::uint32_t>(c[3]) << 24);
+        if (crc != checksum(&record[0], 1 + size))
+        {
+            ERR() << "journal " << path << " damaged at " << valid;
+            break;
+        }
+
+        handler(static_cast<RecordType>(record[0]), size ? &record[1] : 0, size);
+
+        valid += headerSize + size + crcSize;
+    }
+
+    std::fclose(f);
+    return valid;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+// static
+boost::uint64_t XBridgeJournal::fileSize(const std::string & path)
+{
+    std::FILE * f = std::fopen(path.c_str(), "rb");
+    if (!f)
+    {
+        return 0;
+    }
+
+#ifdef WIN32
+    _fseeki64(f, 0, SEEK_END);
+#else
+    fseeko(f, 0, SEEK_END);
+#endif
+    boost::uint64_t size = fileTell(f);
+    std::fclose(f);
+
+    return size;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeJournal::open(const std::string & path,
+                          const boost::uint64_t validSize,
+                          const unsigned int syncInterval)
+{
+    close();
+
+    // r+b keeps content, create if missing
+    std::FILE * f = std::fopen(path.c_str(), "r+b");
+    if (!f)
+    {
+        f = std::fopen(path.c_str(), "w+b");
+    }
+    if (!f)
+    {
+        ERR() << "can't open journal " << path << " " << __FUNCTION__;
+        return false;
+    }
+
+    // drop damaged tail, new records are written after valid part
+#ifdef WIN32
+    _chsize_s(_fileno(f), validSize);
+#else
+    if (ftruncate(fileno(f), validSize) != 0)
+    {
+        ERR() << "can't truncate journal " << path << " " << __FUNCTION__;
+    }
+#endif
+    fileSeek(f, validSize);
+
+    m_file         = f;
+    m_path         = path;
+    m_syncInterval = syncInterval;
+    m_appended     = validSize;
+    m_written      = validSize;
+    m_failures     = 0;
+    m_stop         = false;
+
+    m_thread = boost::thread(boost::bind(&XBridgeJournal::syncThreadProc, this));
+
+    LOG() << "journal " << path << " opened at " << validSize;
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeJournal::close()
+{
+    if (!m_file)
+    {
+        return;
+    }
+
+    {
+        boost::mutex::scoped_lock l(m_lock);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    m_thread.join();
+
+    std::fclose(m_file);
+    m_file = 0;
+}
+
+//*****************************************************************************
+// called under caller locks, only copies record to buffer
+//*****************************************************************************
+void XBridgeJournal::append(const RecordType type,
+                            const unsigned char * data,
+                            const std::size_t size)
+{
+    if (!m_file || size > 0xffff)
+    {
+        return;
+    }
+
+    boost::mutex::scoped_lock l(m_lock);
+
+    std::size_t offset = m_buffer.size();
+    m_buffer.resize(offset + headerSize + size + crcSize);
+
+    unsigned char * p = &m_buffer[offset];
+    p[0] = static_cast<unsigned char>(size & 0xff);
+    p[1] = static_cast<unsigned char>(size >> 8);
+    p[2] = static_cast<unsigned char>(type);
+    if (size)
+    {
+        std::copy(data, data + size, p + headerSize);
+    }
+
+    boost::uint32_t crc = checksum(p + 2, 1 + size);
+    unsigned char * c = p + headerSize + size;
+    c[0] = static_cast<unsigned char>(crc);
+    c[1] = static_cast<unsigned char>(crc >> 8);
+    c[2] = static_cast<unsigned char>(crc >> 16);
+    c[3] = static_cast<unsigned char>(crc >> 24);
+
+    m_appended += headerSize + size + crcSize;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint64_t XBridgeJournal::size() const
+{
+    boost::mutex::scoped_lock l(m_lock);
+    return m_appended;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeJournal::sync()
+{
+    boost::mutex::scoped_lock l(m_lock);
+
+    boost::uint64_t target   = m_appended;
+    boost::uint64_t failures = m_failures;
+    m_wakeup.notify_all();
+    while (m_file && !m_stop && m_written < target && m_failures == failures)
+    {
+        m_synced.wait(l);
+    }
+
+    return m_written >= target;
+}
+
+//*****************************************************************************
+// group commit, all records appended during interval share one fsync
+//*****************************************************************************
+void XBridgeJournal::syncThreadProc()
+{
+    std::vector<unsigned char> buffer;
+    bool failed = false;
+
+    while (true)
+    {
+        boost::uint64_t target  = 0;
+        boost::uint64_t written = 0;
+        bool stop = false;
+        {
+            boost::mutex::scoped_lock l(m_lock);
+            if (!m_stop && (m_buffer.empty() || failed))
+            {
+                // after failure retry once per interval
+                m_wakeup.timed_wait(l, boost::posix_time::milliseconds(std::max(m_syncInterval, 1u)));
+            }
+
+            buffer.swap(m_buffer);
+            target  = m_appended;
+            written = m_written;
+            stop    = m_stop;
+        }
+
+        failed = !buffer.empty() && !writeBuffer(buffer, written);
+
+        {
+            boost::mutex::scoped_lock l(m_lock);
+            if (failed)
+            {
+                // keep records for retry, before ones appended meanwhile
+                buffer.insert(buffer.end(), m_buffer.begin(), m_buffer.end());
+                m_buffer.swap(buffer);
+                ++m_failures;
+            }
+            else
+            {
+                m_written = target;
+            }
+        }
+        m_synced.notify_all();
+
+        buffer.clear();
+
+        if (stop)
+        {
+            break;
+        }
+    }
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeJournal::writeBuffer(std::vector<unsigned char> & buffer,
+                                 const boost::uint64_t offset)
+{
+    if (std::fwrite(&buffer[0], 1, buffer.size(), m_file) != buffer.size() ||
+        !fileSync(m_file))
+    {
+        ERR() << "journal " << m_path << " write failed " << __FUNCTION__;
+
+        // partly written group is overwritten by retry
+        std::clearerr(m_file);
+        fileSeek(m_file, offset);
+        return false;
+    }
+    return true;
+}
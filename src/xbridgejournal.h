@@ -0,0 +1,105 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#ifndef XBRIDGEJOURNAL_H
+#define XBRIDGEJOURNAL_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <functional>
+
+#include <boost/cstdint.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+//*****************************************************************************
+// append-only log of exchange state changes
+//
+// record
+//     uint16 payload size
+//     uint8  record type
+//     payload
+//     uint32 crc32 of type and payload
+//
+// records are buffered and written with one fsync per group
+// by background thread, replay stops at first damaged record
+//*****************************************************************************
+class XBridgeJournal
+{
+public:
+    enum RecordType
+    {
+        jrInvalid = 0,
+
+        // xbcTransaction payload, 104 bytes
+        jrOrder,
+        // uint256 order or hub transaction id
+        jrDrop,
+        // uint256 hub transaction id
+        // uint8   state of applied reply
+        jrState,
+        // 8 bytes base currency
+        // 8 bytes quote currency
+        jrAuction
+    };
+
+    typedef std::function<void(const RecordType type,
+                               const unsigned char * data,
+                               const std::size_t size)> RecordHandler;
+
+public:
+    XBridgeJournal();
+    ~XBridgeJournal();
+
+    // read records starting at offset, return size of valid part
+    static boost::uint64_t replay(const std::string & path,
+                                  const RecordHandler & handler,
+                                  const boost::uint64_t offset = 0);
+    static boost::uint64_t fileSize(const std::string & path);
+
+    // open for append, file is truncated to validSize
+    bool open(const std::string & path,
+              const boost::uint64_t validSize,
+              const unsigned int syncInterval);
+    void close();
+
+    bool isOpen() const { return m_file != 0; }
+
+    void append(const RecordType type,
+                const unsigned char * data,
+                const std::size_t size);
+
+    // journal size including not synced records
+    boost::uint64_t size() const;
+
+    // wait until all appended records are on disk,
+    // false if write failed meanwhile
+    bool sync();
+
+private:
+    void syncThreadProc();
+    bool writeBuffer(std::vector<unsigned char> & buffer,
+                     const boost::uint64_t offset);
+
+private:
+    std::FILE *                    m_file;
+    std::string                    m_path;
+    unsigned int                   m_syncInterval;
+
+    mutable boost::mutex           m_lock;
+    boost::condition_variable      m_wakeup;
+    boost::condition_variable      m_synced;
+    std::vector<unsigned char>     m_buffer;
+    boost::uint64_t                m_appended;
+    // durable size, not advanced by failed write
+    boost::uint64_t                m_written;
+    // failed writes, waiters return when changed
+    boost::uint64_t                m_failures;
+    bool                           m_stop;
+
+    boost::thread                  m_thread;
+};
+
+#endif // XBRIDGEJOURNAL_H
@@ -0,0 +1,793 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#include "xbridgeorderbook.h"
+#include "util/logger.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <boost/multiprecision/cpp_int.hpp>
+
+//*****************************************************************************
+//*****************************************************************************
+namespace
+{
+
+typedef boost::multiprecision::uint128_t uint128;
+
+} // namespace
+
+//*****************************************************************************
+// compare ratios without rounding, q1/b1 < q2/b2 <=> q1*b2 < q2*b1
+//*****************************************************************************
+bool XBridgePrice::operator < (const XBridgePrice & other) const
+{
+    return uint128(quote) * other.base < uint128(other.quote) * base;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgePrice::operator == (const XBridgePrice & other) const
+{
+    return uint128(quote) * other.base == uint128(other.quote) * base;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint64_t XBridgePrice::quoteFor(const boost::uint64_t baseAmount) const
+{
+    uint128 result = uint128(baseAmount) * quote / base;
+    if (result > std::numeric_limits<boost::uint64_t>::max())
+    {
+        return std::numeric_limits<boost::uint64_t>::max();
+    }
+    return static_cast<boost::uint64_t>(result);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint64_t XBridgePrice::quoteForUp(const boost::uint64_t baseAmount) const
+{
+    uint128 result = (uint128(baseAmount) * quote + base - 1) / base;
+    if (result > std::numeric_limits<boost::uint64_t>::max())
+    {
+        return std::numeric_limits<boost::uint64_t>::max();
+    }
+    return static_cast<boost::uint64_t>(result);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeOrderBook::XBridgeOrderBook(const XBridgeCurrency & baseCurrency,
+                                   const XBridgeCurrency & quoteCurrency)
+    : m_base(baseCurrency)
+    , m_quote(quoteCurrency)
+    , m_sequence(0)
+{
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeOrderBook::OrderPtr XBridgeOrderBook::makeOrder(XBridgeTransactionPtr tr) const
+{
+    if (!tr->firstAmount() || !tr->secondAmount())
+    {
+        ERR() << "zero amount, order rejected " << __FUNCTION__;
+        return OrderPtr();
+    }
+
+    if (m_orders.count(tr->id()))
+    {
+        // already in book
+        return OrderPtr();
+    }
+
+    OrderPtr order(new Order);
+    order->transaction = tr;
+    order->quote       = 0;
+    order->resting     = false;
+
+    if (tr->firstCurrency() == m_base && tr->secondCurrency() == m_quote)
+    {
+        order->side      = Ask;
+        order->price     = XBridgePrice(tr->secondAmount(), tr->firstAmount());
+        order->remaining = tr->firstAmount();
+    }
+    else if (tr->firstCurrency() == m_quote && tr->secondCurrency() == m_base)
+    {
+        order->side      = Bid;
+        order->price     = XBridgePrice(tr->firstAmount(), tr->secondAmount());
+        order->remaining = tr->secondAmount();
+    }
+    else
+    {
+        ERR() << "order currencies not match book " << m_base << "/" << m_quote
+              << " " << __FUNCTION__;
+        return OrderPtr();
+    }
+
+    return order;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeOrderBook::add(XBridgeTransactionPtr order,
+                           std::vector<XBridgeTransactionPtr> & joined)
+{
+    OrderPtr taker = makeOrder(order);
+    if (!taker)
+    {
+        return false;
+    }
+
+    match(taker, joined);
+
+    if (taker->remaining)
+    {
+        place(taker);
+    }
+
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeOrderBook::enqueue(XBridgeTransactionPtr order)
+{
+    OrderPtr o = makeOrder(order);
+    if (!o)
+    {
+        return false;
+    }
+
+    m_batch.push_back(o);
+    m_orders[order->id()] = o;
+    return true;
+}
+
+//*****************************************************************************
+// match taker with opposite side while prices cross, at maker price
+//*****************************************************************************
+void XBridgeOrderBook::match(OrderPtr taker, std::vector<XBridgeTransactionPtr> & joined)
+{
+    Levels & opposite = levels(taker->side == Ask ? Bid : Ask);
+
+    while (taker->remaining && !opposite.empty())
+    {
+        Level & best = opposite.back();
+        if (!crosses(taker, best))
+        {
+            break;
+        }
+
+        if (best.orders.empty())
+        {
+            opposite.pop_back();
+            continue;
+        }
+
+        OrderPtr maker = best.orders.front();
+        if (!maker->remaining)
+        {
+            // cancelled
+            best.orders.pop_front();
+            popEmpty(opposite);
+            continue;
+        }
+
+        // trade at maker price, rounding in favour of maker
+        // but never over order amount of bid
+        const OrderPtr & bid = maker->side == Bid ? maker : taker;
+
+        boost::uint64_t baseAmount  = std::min(taker->remaining, maker->remaining);
+        boost::uint64_t quoteAmount = maker->side == Ask ?
+                                          best.price.quoteForUp(baseAmount) :
+                                          best.price.quoteFor(baseAmount);
+        quoteAmount = std::min(quoteAmount, budget(bid));
+
+        if (!quoteAmount)
+        {
+            // too small for this price
+            break;
+        }
+
+        XBridgeTransactionPtr tr = maker->side == Ask ?
+                                       fill(maker, taker, baseAmount, quoteAmount) :
+                                       fill(taker, maker, baseAmount, quoteAmount);
+        if (!tr)
+        {
+            break;
+        }
+
+        joined.push_back(tr);
+
+        touch(maker->side, best);
+
+        maker->remaining -= baseAmount;
+        taker->remaining -= baseAmount;
+        best.quantity    -= baseAmount;
+        maker->quote     += quoteAmount;
+        taker->quote     += quoteAmount;
+
+        if (!budget(bid))
+        {
+            // paid in full by rounding, rest of base is not payable
+            if (bid == maker)
+            {
+                best.quantity -= bid->remaining;
+            }
+            bid->remaining = 0;
+        }
+
+        if (!maker->remaining)
+        {
+            m_orders.erase(maker->transaction->id());
+            best.orders.pop_front();
+            popEmpty(opposite);
+        }
+    }
+}
+
+//*****************************************************************************
+// collected orders are placed without matching, then crossed part of book
+// is executed at price with maximum matched volume
+//*****************************************************************************
+XBridgeAuctionStats XBridgeOrderBook::auction(std::vector<XBridgeTransactionPtr> & joined)
+{
+    XBridgeAuctionStats stats;
+
+    for (std::vector<OrderPtr>::iterator i = m_batch.begin(); i != m_batch.end(); ++i)
+    {
+        if ((*i)->remaining)
+        {
+            // not cancelled while waiting
+            ++stats.orders;
+            place(*i);
+        }
+    }
+    m_batch.clear();
+
+    XBridgePrice price;
+    if (!clearingPrice(price))
+    {
+        return stats;
+    }
+
+    stats.price = price;
+
+    std::size_t before = joined.size();
+    while (true)
+    {
+        popEmpty(m_asks);
+        popEmpty(m_bids);
+        if (m_asks.empty() || m_bids.empty())
+        {
+            break;
+        }
+
+        Level & ask = m_asks.back();
+        Level & bid = m_bids.back();
+        if (price < ask.price || bid.price < price)
+        {
+            break;
+        }
+
+        OrderPtr a = ask.orders.front();
+        OrderPtr b = bid.orders.front();
+
+        // rounding in favour of ask as in continuous matching,
+        // so seller gets at least its limit
+        boost::uint64_t baseAmount  = std::min(a->remaining, b->remaining);
+        boost::uint64_t quoteAmount = std::min(price.quoteForUp(baseAmount), budget(b));
+        if (!quoteAmount)
+        {
+            break;
+        }
+
+        XBridgeTransactionPtr tr = fill(a, b, baseAmount, quoteAmount);
+        if (!tr)
+        {
+            break;
+        }
+
+        joined.push_back(tr);
+        stats.volume += baseAmount;
+
+        touch(Ask, ask);
+        touch(Bid, bid);
+
+        a->remaining  -= baseAmount;
+        b->remaining  -= baseAmount;
+        ask.quantity  -= baseAmount;
+        bid.quantity  -= baseAmount;
+        a->quote      += quoteAmount;
+        b->quote      += quoteAmount;
+
+        if (!budget(b))
+        {
+            // paid in full by rounding
+            bid.quantity -= b->remaining;
+            b->remaining  = 0;
+        }
+
+        if (!a->remaining)
+        {
+            m_orders.erase(a->transaction->id());
+        }
+        if (!b->remaining)
+        {
+            m_orders.erase(b->transaction->id());
+        }
+    }
+
+    stats.matched = joined.size() - before;
+    return stats;
+}
+
+//*****************************************************************************
+// levels removed lazily have zero quantity
+//*****************************************************************************
+bool XBridgeOrderBook::crossed() const
+{
+    Levels::const_reverse_iterator a = m_asks.rbegin();
+    while (a != m_asks.rend() && !a->quantity)
+    {
+        ++a;
+    }
+    Levels::const_reverse_iterator b = m_bids.rbegin();
+    while (b != m_bids.rend() && !b->quantity)
+    {
+        ++b;
+    }
+
+    return a != m_asks.rend() && b != m_bids.rend() && a->price <= b->price;
+}
+
+//*****************************************************************************
+// candidate prices are levels inside crossed range, executed volume
+// at price p is min(bids at p or higher, asks at p or lower),
+// ties resolved by smaller imbalance
+//*****************************************************************************
+bool XBridgeOrderBook::clearingPrice(XBridgePrice & price) const
+{
+    if (m_asks.empty() || m_bids.empty() || m_bids.back().price < m_asks.back().price)
+    {
+        // not crossed
+        return false;
+    }
+
+    const XBridgePrice & lowestAsk  = m_asks.back().price;
+    const XBridgePrice & highestBid = m_bids.back().price;
+
+    // asks ascending from best, bids descending from best
+    std::vector<const Level *> asks;
+    for (Levels::const_reverse_iterator i = m_asks.rbegin(); i != m_asks.rend() && i->price <= highestBid; ++i)
+    {
+        asks.push_back(&*i);
+    }
+    std::vector<const Level *> bids;
+    for (Levels::const_reverse_iterator i = m_bids.rbegin(); i != m_bids.rend() && lowestAsk <= i->price; ++i)
+    {
+        bids.push_back(&*i);
+    }
+
+    std::vector<XBridgePrice> candidates;
+    for (std::size_t i = 0; i < asks.size(); ++i)
+    {
+        candidates.push_back(asks[i]->price);
+    }
+    for (std::size_t i = 0; i < bids.size(); ++i)
+    {
+        candidates.push_back(bids[i]->price);
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    // supply grows and demand falls with price, walk both once
+    boost::uint64_t supply = 0;
+    boost::uint64_t demand = 0;
+    for (std::size_t i = 0; i < bids.size(); ++i)
+    {
+        demand += bids[i]->quantity;
+    }
+
+    boost::uint64_t bestVolume    = 0;
+    boost::uint64_t bestImbalance = 0;
+    std::size_t     a = 0;
+    std::size_t     b = bids.size();
+    for (std::vector<XBridgePrice>::const_iterator p = candidates.begin(); p != candidates.end(); ++p)
+    {
+        while (a < asks.size() && asks[a]->price <= *p)
+        {
+            supply += asks[a++]->quantity;
+        }
+        // bids below p drop out, bids[b-1] is lowest
+        while (b > 0 && bids[b-1]->price < *p)
+        {
+            demand -= bids[--b]->quantity;
+        }
+
+        boost::uint64_t volume    = std::min(supply, demand);
+        boost::uint64_t imbalance = supply > demand ? supply - demand : demand - supply;
+        if (volume > bestVolume || (volume == bestVolume && volume && imbalance < bestImbalance))
+        {
+            bestVolume    = volume;
+            bestImbalance = imbalance;
+            price         = *p;
+        }
+    }
+
+    return bestVolume > 0;
+}
+
+//*****************************************************************************
+// first level with price not better than given,
+// asks sorted descending, bids ascending
+//*****************************************************************************
+XBridgeOrderBook::Levels::iterator XBridgeOrderBook::findLevel(Levels & lvls,
+                                                               const Side side,
+                                                               const XBridgePrice & price)
+{
+    if (side == Ask)
+    {
+        return std::lower_bound(lvls.begin(), lvls.end(), price,
+                                [](const Level & l, const XBridgePrice & p) { return p < l.price; });
+    }
+    return std::lower_bound(lvls.begin(), lvls.end(), price,
+                            [](const Level & l, const XBridgePrice & p) { return l.price < p; });
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeOrderBook::place(OrderPtr order)
+{
+    Levels & lvls = levels(order->side);
+
+    Levels::iterator i = findLevel(lvls, order->side, order->price);
+    if (i == lvls.end() || !(i->price == order->price))
+    {
+        Level l;
+        l.price    = order->price;
+        l.quantity = 0;
+        i = lvls.insert(i, l);
+    }
+
+    touch(order->side, *i);
+
+    i->orders.push_back(order);
+    i->quantity += order->remaining;
+
+    order->resting = true;
+
+    m_orders[order->transaction->id()] = order;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeOrderBook::popEmpty(Levels & lvls)
+{
+    while (!lvls.empty())
+    {
+        Level & best = lvls.back();
+        while (!best.orders.empty() && !best.orders.front()->remaining)
+        {
+            best.orders.pop_front();
+        }
+        if (!best.orders.empty())
+        {
+            break;
+        }
+        lvls.pop_back();
+    }
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeOrderBook::crosses(const OrderPtr & taker, const Level & best) const
+{
+    if (taker->side == Ask)
+    {
+        // sell not cheaper than best bid
+        return taker->price <= best.price;
+    }
+    // buy not more expensive than best ask
+    return best.price <= taker->price;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint64_t XBridgeOrderBook::budget(const OrderPtr & bid) const
+{
+    boost::uint64_t amount = bid->transaction->firstAmount();
+    return amount > bid->quote ? amount - bid->quote : 0;
+}
+
+//*****************************************************************************
+// make joined transaction for one fill, seller of base is first member
+//*****************************************************************************
+XBridgeTransactionPtr XBridgeOrderBook::fill(const OrderPtr & ask, const OrderPtr & bid,
+                                             const boost::uint64_t baseAmount,
+                                             const boost::uint64_t quoteAmount) const
+{
+    const XBridgeTransactionPtr & a = ask->transaction;
+    const XBridgeTransactionPtr & b = bid->transaction;
+
+    XBridgeTransactionPtr first = XBridgeTransaction::create(a->id(),
+                                                             a->firstAddress(), a->firstCurrency(),
+                                                             baseAmount,
+                                                             a->firstDestination(), a->secondCurrency(),
+                                                             quoteAmount);
+    XBridgeTransactionPtr second = XBridgeTransaction::create(b->id(),
+                                                              b->firstAddress(), b->firstCurrency(),
+                                                              quoteAmount,
+                                                              b->firstDestination(), b->secondCurrency(),
+                                                              baseAmount);
+
+    if (!first->tryJoin(second))
+    {
+        return XBridgeTransactionPtr();
+    }
+
+    return first;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeOrderBook::cancel(const uint256 & id)
+{
+    OrderIndex::iterator it = m_orders.find(id);
+    if (it == m_orders.end())
+    {
+        return false;
+    }
+
+    OrderPtr order = it->second;
+    m_orders.erase(it);
+
+    if (!order->resting)
+    {
+        // skipped by next auction
+        order->remaining = 0;
+        return true;
+    }
+
+    Levels & lvls = levels(order->side);
+    Levels::iterator i = findLevel(lvls, order->side, order->price);
+    if (i != lvls.end() && i->price == order->price)
+    {
+        touch(order->side, *i);
+
+        i->quantity -= order->remaining;
+        order->remaining = 0;
+
+        if (!i->quantity)
+        {
+            // no live orders on level
+            lvls.erase(i);
+        }
+    }
+
+    order->remaining = 0;
+    return true;
+}
+
+//*****************************************************************************
+// levels from best, fifo inside level, so restore in same
+// order keeps time priority
+//*****************************************************************************
+std::vector<XBridgeOrderBook::Entry> XBridgeOrderBook::entries() const
+{
+    std::vector<Entry> result;
+    result.reserve(m_orders.size());
+
+    const Levels * sides[] = { &m_asks, &m_bids };
+    for (std::size_t s = 0; s < 2; ++s)
+    {
+        for (Levels::const_reverse_iterator l = sides[s]->rbegin(); l != sides[s]->rend(); ++l)
+        {
+            for (std::deque<OrderPtr>::const_iterator i = l->orders.begin(); i != l->orders.end(); ++i)
+            {
+                if ((*i)->remaining)
+                {
+                    Entry e = { (*i)->transaction, (*i)->remaining, (*i)->quote, true };
+                    result.push_back(e);
+                }
+            }
+        }
+    }
+
+    for (std::vector<OrderPtr>::const_iterator i = m_batch.begin(); i != m_batch.end(); ++i)
+    {
+        if ((*i)->remaining)
+        {
+            Entry e = { (*i)->transaction, (*i)->remaining, (*i)->quote, false };
+            result.push_back(e);
+        }
+    }
+
+    return result;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeOrderBook::restore(const Entry & entry)
+{
+    OrderPtr o = makeOrder(entry.transaction);
+    if (!o || !entry.remaining || entry.remaining > o->remaining)
+    {
+        return false;
+    }
+
+    // fills after restart are capped by same budget as before
+    o->quote     = entry.quote;
+    o->remaining = entry.remaining;
+    if (o->side == Bid && !budget(o))
+    {
+        return false;
+    }
+
+    if (entry.resting)
+    {
+        place(o);
+    }
+    else
+    {
+        m_batch.push_back(o);
+        m_orders[entry.transaction->id()] = o;
+    }
+
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeOrderBook::contains(const uint256 & id) const
+{
+    return m_orders.count(id) > 0;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::vector<XBridgeOrderBook::DepthLevel> XBridgeOrderBook::depth(const std::size_t maxLevels) const
+{
+    std::vector<DepthLevel> result;
+
+    const Levels * sides[] = { &m_asks, &m_bids };
+    for (std::size_t s = 0; s < 2; ++s)
+    {
+        std::size_t count = 0;
+        for (Levels::const_reverse_iterator l = sides[s]->rbegin();
+             l != sides[s]->rend() && count < maxLevels; ++l)
+        {
+            if (!l->quantity)
+            {
+                continue;
+            }
+
+            DepthLevel d = { s == 0 ? Ask : Bid, l->price, l->quantity };
+            result.push_back(d);
+            ++count;
+        }
+    }
+
+    return result;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeOrderBook::touch(const Side side, const Level & level)
+{
+    LevelKey key = { side, level.price };
+    m_changed.insert(std::make_pair(key, level.quantity));
+}
+
+//*****************************************************************************
+// level removed lazily has zero quantity, so quantity alone
+// tells if level is visible to clients
+//*****************************************************************************
+std::vector<XBridgeOrderBook::Delta> XBridgeOrderBook::takeDeltas()
+{
+    std::vector<Delta> result;
+
+    for (std::map<LevelKey, boost::uint64_t>::const_iterator i = m_changed.begin(); i != m_changed.end(); ++i)
+    {
+        const LevelKey & key    = i->first;
+        boost::uint64_t  before = i->second;
+        boost::uint64_t  after  = 0;
+
+        Levels & lvls = levels(key.side);
+        Levels::iterator l = findLevel(lvls, key.side, key.price);
+        if (l != lvls.end() && l->price == key.price)
+        {
+            after = l->quantity;
+        }
+
+        if (before == after)
+        {
+            continue;
+        }
+
+        Delta d;
+        d.action   = !before ? Delta::Add : !after ? Delta::Remove : Delta::Modify;
+        d.side     = key.side;
+        d.price    = key.price;
+        d.quantity = after;
+        result.push_back(d);
+    }
+
+    m_changed.clear();
+
+    if (!result.empty())
+    {
+        ++m_sequence;
+    }
+
+    return result;
+}
+
+//*****************************************************************************
+// current levels with touched ones rolled back
+//*****************************************************************************
+std::vector<XBridgeOrderBook::DepthLevel> XBridgeOrderBook::publishedDepth() const
+{
+    std::map<LevelKey, boost::uint64_t> published;
+
+    const Levels * sides[] = { &m_asks, &m_bids };
+    for (std::size_t s = 0; s < 2; ++s)
+    {
+        for (Levels::const_iterator l = sides[s]->begin(); l != sides[s]->end(); ++l)
+        {
+            if (l->quantity)
+            {
+                LevelKey key = { s == 0 ? Ask : Bid, l->price };
+                published[key] = l->quantity;
+            }
+        }
+    }
+
+    for (std::map<LevelKey, boost::uint64_t>::const_iterator i = m_changed.begin(); i != m_changed.end(); ++i)
+    {
+        if (i->second)
+        {
+            published[i->first] = i->second;
+        }
+        else
+        {
+            published.erase(i->first);
+        }
+    }
+
+    // asks ascending, then bids descending, best first
+    std::vector<DepthLevel> result;
+    result.reserve(published.size());
+    for (std::map<LevelKey, boost::uint64_t>::const_iterator i = published.begin(); i != published.end(); ++i)
+    {
+        if (i->first.side == Ask)
+        {
+            DepthLevel d = { Ask, i->first.price, i->second };
+            result.push_back(d);
+        }
+    }
+    for (std::map<LevelKey, boost::uint64_t>::const_reverse_iterator i = published.rbegin(); i != published.rend(); ++i)
+    {
+        if (i->first.side == Bid)
+        {
+            DepthLevel d = { Bid, i->first.price, i->second };
+            result.push_back(d);
+        }
+    }
+
+    return result;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeTransactionPtr XBridgeOrderBook::order(const uint256 & id) const
+{
+    OrderIndex::const_iterator i = m_orders.find(id);
+    if (i == m_orders.end())
+    {
+        return XBridgeTransactionPtr();
+    }
+    return i->second->transaction;
+}
@@ -0,0 +1,230 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#ifndef XBRIDGEORDERBOOK_H
+#define XBRIDGEORDERBOOK_H
+
+#include "util/uint256.h"
+#include "xbridgetransaction.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+//*****************************************************************************
+// price of base currency in quote currency, kept as exact ratio
+//*****************************************************************************
+struct XBridgePrice
+{
+    boost::uint64_t quote;
+    boost::uint64_t base;
+
+    XBridgePrice() : quote(0), base(1) {}
+    XBridgePrice(const boost::uint64_t q, const boost::uint64_t b) : quote(q), base(b) {}
+
+    bool operator <  (const XBridgePrice & other) const;
+    bool operator == (const XBridgePrice & other) const;
+    bool operator <= (const XBridgePrice & other) const { return !(other < *this); }
+
+    // amount * quote / base, rounded down
+    boost::uint64_t quoteFor(const boost::uint64_t baseAmount) const;
+    // rounded up
+    boost::uint64_t quoteForUp(const boost::uint64_t baseAmount) const;
+};
+
+//*****************************************************************************
+// result of one auction pass of a book
+//*****************************************************************************
+struct XBridgeAuctionStats
+{
+    // orders collected during interval
+    std::size_t     orders;
+    // joined transactions
+    std::size_t     matched;
+    // matched amount of base currency
+    boost::uint64_t volume;
+    // uniform clearing price, valid if matched
+    XBridgePrice    price;
+
+    XBridgeAuctionStats() : orders(0), matched(0), volume(0) {}
+};
+
+//*****************************************************************************
+// price-time priority book of one currency pair, orders are pending
+// transactions, each fill produces new joined transaction,
+// not thread safe, caller is responsible for locking
+//*****************************************************************************
+class XBridgeOrderBook
+{
+public:
+    enum Side
+    {
+        // sell base currency
+        Ask,
+        // sell quote currency
+        Bid
+    };
+
+public:
+    XBridgeOrderBook(const XBridgeCurrency & baseCurrency,
+                     const XBridgeCurrency & quoteCurrency);
+
+    const XBridgeCurrency & baseCurrency() const  { return m_base; }
+    const XBridgeCurrency & quoteCurrency() const { return m_quote; }
+
+    // match order with opposite side, rest of order is placed to book
+    // return false if order not match with this pair or already exists
+    bool add(XBridgeTransactionPtr order,
+             std::vector<XBridgeTransactionPtr> & joined);
+
+    // batch mode, order waits for next auction
+    bool enqueue(XBridgeTransactionPtr order);
+    // clear collected and resting orders at single price
+    XBridgeAuctionStats auction(std::vector<XBridgeTransactionPtr> & joined);
+
+    bool cancel(const uint256 & id);
+
+    // order with not filled amount, for checkpoint
+    struct Entry
+    {
+        XBridgeTransactionPtr transaction;
+        boost::uint64_t       remaining;
+        // quote paid or received by filled part
+        boost::uint64_t       quote;
+        // false if waiting for auction
+        bool                  resting;
+    };
+    // resting orders in priority order, then queued
+    std::vector<Entry> entries() const;
+    // put back order saved by entries, no matching
+    bool restore(const Entry & entry);
+
+    // aggregated price level, for queries
+    struct DepthLevel
+    {
+        Side                  side;
+        XBridgePrice          price;
+        // not filled amount of base currency
+        boost::uint64_t       quantity;
+    };
+    // best levels of each side, best first, asks then bids
+    std::vector<DepthLevel> depth(const std::size_t maxLevels) const;
+
+    // market data, change of level quantity since previous takeDeltas
+    struct Delta
+    {
+        enum Action
+        {
+            Add = 0,
+            Modify,
+            Remove
+        };
+
+        Action                action;
+        Side                  side;
+        XBridgePrice          price;
+        // new quantity of level, 0 for Remove
+        boost::uint64_t       quantity;
+    };
+    // net changes of touched levels, sequence increased if not empty
+    std::vector<Delta> takeDeltas();
+    // sequence of last taken deltas
+    boost::uint64_t sequence() const { return m_sequence; }
+    // all levels as of last takeDeltas, for client resync
+    std::vector<DepthLevel> publishedDepth() const;
+
+    bool contains(const uint256 & id) const;
+    XBridgeTransactionPtr order(const uint256 & id) const;
+
+    // number of orders in book
+    std::size_t size() const { return m_orders.size(); }
+    // orders waiting for auction
+    std::size_t queued() const { return m_batch.size(); }
+    // best bid is not lower than best ask
+    bool crossed() const;
+
+private:
+    struct Order
+    {
+        XBridgeTransactionPtr transaction;
+        Side                  side;
+        XBridgePrice          price;
+        // not filled amount of base currency
+        boost::uint64_t       remaining;
+        // quote currency paid by bid or received by ask
+        boost::uint64_t       quote;
+        // placed to price level, false while waiting for auction
+        bool                  resting;
+    };
+    typedef boost::shared_ptr<Order> OrderPtr;
+
+    struct Level
+    {
+        XBridgePrice          price;
+        boost::uint64_t       quantity;
+        // fifo, cancelled orders have zero remaining and popped lazily
+        std::deque<OrderPtr>  orders;
+    };
+    // sorted so that best price is at the back
+    typedef std::vector<Level> Levels;
+
+    Levels & levels(const Side side) { return side == Ask ? m_asks : m_bids; }
+
+    OrderPtr         makeOrder(XBridgeTransactionPtr tr) const;
+    void             match(OrderPtr taker, std::vector<XBridgeTransactionPtr> & joined);
+    bool             clearingPrice(XBridgePrice & price) const;
+
+    Levels::iterator findLevel(Levels & lvls, const Side side, const XBridgePrice & price);
+    void             place(OrderPtr order);
+    void             popEmpty(Levels & lvls);
+
+    bool             crosses(const OrderPtr & taker, const Level & best) const;
+    // quote amount bid can still pay, fills are rounded separately
+    // so total is capped by order amount
+    boost::uint64_t  budget(const OrderPtr & bid) const;
+
+    // remember quantity before first change since previous takeDeltas,
+    // called before level quantity is modified
+    void             touch(const Side side, const Level & level);
+    XBridgeTransactionPtr fill(const OrderPtr & ask, const OrderPtr & bid,
+                               const boost::uint64_t baseAmount,
+                               const boost::uint64_t quoteAmount) const;
+
+private:
+    XBridgeCurrency             m_base;
+    XBridgeCurrency             m_quote;
+
+    // descending, lowest ask at back
+    Levels                      m_asks;
+    // ascending, highest bid at back
+    Levels                      m_bids;
+
+    // resting and collected orders
+    typedef boost::unordered_map<uint256, OrderPtr, XBridgeIdHash> OrderIndex;
+    OrderIndex                  m_orders;
+    // collected for next auction, in arrival order
+    std::vector<OrderPtr>       m_batch;
+
+    // touched levels and their quantity at last takeDeltas
+    struct LevelKey
+    {
+        Side                  side;
+        XBridgePrice          price;
+
+        bool operator < (const LevelKey & other) const
+        {
+            return side != other.side ? side < other.side : price < other.price;
+        }
+    };
+    std::map<LevelKey, boost::uint64_t> m_changed;
+    boost::uint64_t             m_sequence;
+};
+
+typedef boost::shared_ptr<XBridgeOrderBook> XBridgeOrderBookPtr;
+
+#endif // XBRIDGEORDERBOOK_H
@@ -64,6 +64,10 @@ enum XBridgeCommand
     //    uint160 hub address
     //    uint256 client transaction id
     //    uint256 hub transaction id
+    //    uint64 source amount of this fill
+    //    uint64 destination amount of this fill
+    //    (one order may be split into several hub transactions,
+    //     each filled at own amounts)
     xbcTransactionHold,
     //
     // xbcTransactionHoldApply
@@ -76,6 +80,7 @@ enum XBridgeCommand
     //    uint160 hub address
     //    uint256 hub transaction id
     //    uint160 hub wallet address
+    //    uint64 amount to pay
     xbcTransactionPay,
     //
     // xbcTransactionPayApply
@@ -128,7 +133,96 @@ enum XBridgeCommand
     //
     // xbcReceivedTransaction
     //     uint256 transaction id (bitcoin transaction hash)
-    xbcReceivedTransaction
+    xbcReceivedTransaction,
+
+    // wallet asks hub for exchange state, reply is built from
+    // last published snapshot and may lag by snapshot interval
+    //
+    // xbcExchangeQuery
+    //     uint160 hub address
+    //     uint160 client address
+    //     uint32  query type (XBridgeQuery)
+    //     xqOrders      - no data, orders placed from client address
+    //     xqDepth       - 8 bytes base currency, 8 bytes quote currency
+    //     xqTransaction - uint256 order id or hub transaction id
+    xbcExchangeQuery,
+    //
+    // xbcExchangeQueryReply
+    //     uint160 client address
+    //     uint160 hub address
+    //     uint32  query type
+    //     uint64  snapshot sequence
+    //     uint32  records count, then records
+    //     xqOrders      - uint256 order id, 8 bytes source currency, uint64 source amount,
+    //                     8 bytes destination currency, uint64 destination amount,
+    //                     uint64 not filled amount of base currency
+    //     xqDepth       - uint32 side (0 - ask, 1 - bid), uint64 price quote,
+    //                     uint64 price base, uint64 quantity of base currency
+    //     xqTransaction - uint256 id, uint32 state (XBridgeTransaction::State),
+    //                     8 bytes first currency, uint64 first amount,
+    //                     8 bytes second currency, uint64 second amount
+    xbcExchangeQueryReply,
+
+    // hub periodically sends changes of price levels of each book
+    // to clients subscribed by xbcMarketDataRequest, sequence grows
+    // by one per message of pair, gap or lower sequence means client
+    // must request snapshot, subscription ends if not renewed by
+    // request within Main.MarketDataSubscription seconds
+    //
+    // xbcMarketData
+    //     uint160 client address
+    //     uint160 hub address
+    //     8 bytes base currency
+    //     8 bytes quote currency
+    //     uint64  sequence
+    //     uint32  count of deltas, then deltas
+    //         uint32 action (0 - add, 1 - modify, 2 - remove)
+    //         uint32 side (0 - ask, 1 - bid)
+    //         uint64 price quote
+    //         uint64 price base
+    //         uint64 new quantity of base currency, 0 for remove
+    xbcMarketData,
+    //
+    // xbcMarketDataRequest
+    //     uint160 hub address
+    //     uint160 client address
+    //     8 bytes base currency
+    //     8 bytes quote currency
+    xbcMarketDataRequest,
+    //
+    // all levels of book as of sequence, may be older than last
+    // xbcMarketData, client applies buffered deltas above sequence
+    //
+    // xbcMarketDataSnapshot
+    //     uint160 client address
+    //     uint160 hub address
+    //     8 bytes base currency
+    //     8 bytes quote currency
+    //     uint64  sequence
+    //     uint32  count of levels, then levels
+    //         uint32 side (0 - ask, 1 - bid)
+    //         uint64 price quote
+    //         uint64 price base
+    //         uint64 quantity of base currency
+    xbcMarketDataSnapshot,
+
+    // reply to resent xbcTransaction, order is not processed again
+    //
+    // xbcTransactionState
+    //     uint160 client address
+    //     uint256 client transaction id
+    //     uint32  state (XBridgeTransaction::State), 0 if unknown
+    //     uint256 hub transaction id of last fill, zero if not matched
+    xbcTransactionState
+};
+
+//******************************************************************************
+//******************************************************************************
+enum XBridgeQuery
+{
+    xqOrders = 0,
+    xqDepth,
+    xqTransaction
 };
 
 //******************************************************************************
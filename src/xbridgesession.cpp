@@ -4,13 +4,17 @@
 #include "xbridgesession.h"
 #include "xbridgeapp.h"
 #include "xbridgeexchange.h"
+#include "xbridgetrace.h"
 #include "util/util.h"
 #include "util/logger.h"
+#include "util/metrics.h"
 #include "dht/dht.h"
 
 #include <boost/asio.hpp>
 #include <boost/asio/buffer.hpp>
 
+#include <atomic>
+
 //******************************************************************************
 //******************************************************************************
 struct PrintErrorCode
@@ -25,6 +29,90 @@ struct PrintErrorCode
     }
 };
 
+//*****************************************************************************
+//*****************************************************************************
+namespace
+{
+
+const int commandCount = xbcTransactionState + 1;
+
+const char * commandNames[commandCount] =
+{
+    "invalid", "announce_addresses", "xchat_message",
+    "transaction", "transaction_hold", "transaction_hold_apply",
+    "transaction_pay", "transaction_pay_apply",
+    "transaction_commit", "transaction_commit_apply",
+    "transaction_cancel", "transaction_finished", "transaction_dropped",
+    "exchange_wallets", "received_transaction",
+    "exchange_query", "exchange_query_reply",
+    "market_data", "market_data_request", "market_data_snapshot",
+    "transaction_state"
+};
+
+} // namespace
+
+//*****************************************************************************
+// per-command traffic counters, registered on first packet of command,
+// unknown codes share one slot
+//*****************************************************************************
+class PacketCounters
+{
+public:
+    explicit PacketCounters(const std::string & direction)
+        : m_direction(direction)
+    {
+        for (int i = 0; i <= commandCount; ++i)
+        {
+            m_packets[i] = 0;
+            m_bytes[i]   = 0;
+        }
+    }
+
+    void count(const int command, const std::size_t bytes)
+    {
+        int idx = command >= 0 && command < commandCount ? command : commandCount;
+
+        MetricCounter * bytesCounter = m_bytes[idx].load();
+        if (!bytesCounter)
+        {
+            // registry returns same counter for same labels, so
+            // threads racing here store same pointers
+            std::string labels = "direction=\"" + m_direction + "\",command=\"" +
+                                 (idx < commandCount ? commandNames[idx] : "unknown") + "\"";
+
+            m_packets[idx] = &Metrics::instance().counter("xbridge_session_packets_total",
+                                                          "xbridge packets processed by sessions",
+                                                          labels);
+            bytesCounter   = &Metrics::instance().counter("xbridge_session_bytes_total",
+                                                          "xbridge packet bytes processed by sessions",
+                                                          labels);
+            m_bytes[idx]   = bytesCounter;
+        }
+
+        m_packets[idx].load()->inc();
+        bytesCounter->inc(bytes);
+    }
+
+    static PacketCounters & received()
+    {
+        static PacketCounters c("in");
+        return c;
+    }
+
+    static PacketCounters & sent()
+    {
+        static PacketCounters c("out");
+        return c;
+    }
+
+private:
+    const std::string             m_direction;
+
+    // last slot for unknown commands
+    std::atomic<MetricCounter *>  m_packets[commandCount + 1];
+    std::atomic<MetricCounter *>  m_bytes[commandCount + 1];
+};
+
 //*****************************************************************************
 //*****************************************************************************
 XBridgeSession::XBridgeSession()
@@ -45,6 +133,10 @@ XBridgeSession::XBridgeSession()
     m_processors[xbcTransactionCommitApply].bind(this, &XBridgeSession::processTransactionCommitApply);
     m_processors[xbcTransactionCancel]     .bind(this, &XBridgeSession::processTransactionCancel);
 
+    // exchange state, answered from snapshot
+    m_processors[xbcExchangeQuery]         .bind(this, &XBridgeSession::processExchangeQuery);
+    m_processors[xbcMarketDataRequest]     .bind(this, &XBridgeSession::processMarketDataRequest);
+
     // retranslate messages to xbridge network
     m_processors[xbcXChatMessage]          .bind(this, &XBridgeSession::processXBridgeMessage);
 }
@@ -204,6 +296,8 @@ bool XBridgeSession::processPacket(XBridgePacketPtr packet)
 
     XBridgeCommand c = packet->command();
 
+    PacketCounters::received().count(c, packet->allSize());
+
     if (m_processors.count(c) == 0)
     {
         m_processors[xbcInvalid](packet);
@@ -265,6 +359,8 @@ bool XBridgeSession::sendXBridgeMessage(const std::vector<unsigned char> & messa
         return false;
     }
 
+    PacketCounters::sent().count(packet->command(), packet->allSize());
+
     return false;
 }
 
@@ -319,27 +415,53 @@ bool XBridgeSession::processTransaction(XBridgePacketPtr packet)
         return false;
     }
 
-    // check and process packet if bridge is exchange
     XBridgeExchange & e = XBridgeExchange::instance();
+
+    // resent order, neither processed nor relayed again
+    if (!e.registerOrder(uint256(packet->data())))
+    {
+        if (e.isEnabled())
+        {
+            uint256 id(packet->data());
+            uint160 saddr(packet->data()+32);
+
+            uint256 transactionId;
+            XBridgeTransaction::State state = e.orderState(id, transactionId);
+
+            XBridgePacketPtr reply(new XBridgePacket(xbcTransactionState));
+            reply->append(saddr.begin(), 20);
+            reply->append(id.begin(), 32);
+            reply->append(static_cast<boost::uint32_t>(state));
+            reply->append(transactionId.begin(), 32);
+
+            XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
+            app->onSend(saddr, reply);
+        }
+        return true;
+    }
+
+    // check and process packet if bridge is exchange
     if (e.isEnabled())
     {
         // read packet data
         uint256 id(packet->data());
 
+        XBridgeTrace::instance().record(id, XBridgeTrace::tpOrderReceived);
+
         // source
-        std::vector<unsigned char> saddr(packet->data()+32, packet->data()+52);
-        std::string scurrency((const char *)packet->data()+52);
+        uint160 saddr(packet->data()+32);
+        XBridgeCurrency scurrency(packet->data()+52);
         boost::uint64_t samount = *static_cast<boost::uint64_t *>(static_cast<void *>(packet->data()+60));
 
         // destination
-        std::vector<unsigned char> daddr(packet->data()+68, packet->data()+88);
-        std::string dcurrency((const char *)packet->data()+88);
+        uint160 daddr(packet->data()+68);
+        XBridgeCurrency dcurrency(packet->data()+88);
         boost::uint64_t damount = *static_cast<boost::uint64_t *>(static_cast<void *>(packet->data()+96));
 
         LOG() << "received transaction " << util::base64_encode(std::string((char *)id.begin(), 32)) << std::endl
-              << "    from " << util::base64_encode(std::string((char *)&saddr[0], 20)) << std::endl
+              << "    from " << util::base64_encode(std::string((char *)saddr.begin(), 20)) << std::endl
               << "             " << scurrency << " : " << samount << std::endl
-              << "    to   " << util::base64_encode(std::string((char *)&daddr[0], 20)) << std::endl
+              << "    to   " << util::base64_encode(std::string((char *)daddr.begin(), 20)) << std::endl
               << "             " << dcurrency << " : " << damount << std::endl;
 
         if (!e.haveConnectedWallet(scurrency) || !e.haveConnectedWallet(dcurrency))
@@ -349,51 +471,21 @@ bool XBridgeSession::processTransaction(XBridgePacketPtr packet)
         else
         {
             // float rate = (float) destAmount / sourceAmount;
-            uint256 transactionId;
-            if (e.createTransaction(id, saddr, scurrency, samount, daddr, dcurrency, damount, transactionId))
-            {
-                // check transaction state, if trNew - do nothing,
-                // if trJoined = send hold to client
-                XBridgeTransactionPtr tr = e.transaction(transactionId);
-                if (tr && tr->state() == XBridgeTransaction::trJoined)
-                {
-                    // send hold to clients
-                    XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
-
-                    // first
-                    // TODO remove this log
-                    LOG() << "send xbcTransactionHold to " << util::base64_encode(std::string((char *)&tr->firstAddress()[0], 20));
-
-                    XBridgePacketPtr reply1(new XBridgePacket(xbcTransactionHold));
-                    reply1->append(tr->firstAddress());
-                    reply1->append(app->myid(), 20);
-                    reply1->append(tr->firstId().begin(), 32);
-                    reply1->append(transactionId.begin(), 32);
-
-                    app->onSend(tr->firstAddress(),
-                                std::vector<unsigned char>(reply1->header(),
-                                                           reply1->header()+reply1->allSize()));
-
-                    // second
-                    // TODO remove this log
-                    LOG() << "send xbcTransactionHold to " << util::base64_encode(std::string((char *)&tr->secondAddress()[0], 20));
-
-                    XBridgePacketPtr reply2(new XBridgePacket(xbcTransactionHold));
-                    reply2->append(tr->secondAddress());
-                    reply2->append(app->myid(), 20);
-                    reply2->append(tr->secondId().begin(), 32);
-                    reply2->append(transactionId.begin(), 32);
-
-                    app->onSend(tr->secondAddress(),
-                                std::vector<unsigned char>(reply2->header(),
-                                                           reply2->header()+reply2->allSize()));
-                }
-            }
+            // holds for joined transactions are sent by event subscriber
+            e.createTransaction(id, saddr, scurrency, samount, daddr, dcurrency, damount);
         }
     }
 
-    // ..and retranslate
-    return processXBridgeBroadcastMessage(packet);
+    // ..and retranslate, orders of local wallets go to network,
+    // orders received from network are already relayed by dht
+    XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
+    if (app->isLocalSession(uint160(packet->data()+32), shared_from_this()))
+    {
+        return processXBridgeBroadcastMessage(packet);
+    }
+
+    app->onSendLocal(packet);
+    return true;
 }
 
 //*****************************************************************************
@@ -427,42 +519,10 @@ bool XBridgeSession::processTransactionHoldApply(XBridgePacketPtr packet)
 
     // transaction id
     uint256 id(packet->data()+20);
-    if (e.updateTransactionWhenHoldApplyReceived(id))
-    {
-        XBridgeTransactionPtr tr = e.transaction(id);
-        if (tr->state() == XBridgeTransaction::trHold)
-        {
-            // send payment command to clients
-
-            // first
-            // TODO remove this log
-            LOG() << "send xbcTransactionPay to " << util::base64_encode(std::string((char *)&tr->firstAddress()[0], 20));
-
-            XBridgePacketPtr reply1(new XBridgePacket(xbcTransactionPay));
-            reply1->append(tr->firstAddress());
-            reply1->append(app->myid(), 20);
-            reply1->append(id.begin(), 32);
-            reply1->append(e.walletAddress(tr->firstCurrency()));
-
-            app->onSend(tr->firstAddress(),
-                        std::vector<unsigned char>(reply1->header(),
-                                                   reply1->header()+reply1->allSize()));
-
-            // second
-            // TODO remove this log
-            LOG() << "send xbcTransactionPay to " << util::base64_encode(std::string((char *)&tr->secondAddress()[0], 20));
-
-            XBridgePacketPtr reply2(new XBridgePacket(xbcTransactionPay));
-            reply2->append(tr->secondAddress());
-            reply2->append(app->myid(), 20);
-            reply2->append(id.begin(), 32);
-            reply2->append(e.walletAddress(tr->secondCurrency()));
-
-            app->onSend(tr->secondAddress(),
-                        std::vector<unsigned char>(reply2->header(),
-                                                   reply2->header()+reply2->allSize()));
-        }
-    }
+    XBridgeTrace::instance().record(id, XBridgeTrace::tpHoldApplyReceived);
+
+    // pay is sent by event subscriber when both members hold
+    e.updateTransactionWhenHoldApplyReceived(id);
 
     return true;
 }
@@ -499,54 +559,10 @@ bool XBridgeSession::processTransactionPayApply(XBridgePacketPtr packet)
     // transaction id
     uint256 id(packet->data()+20);
     uint256 paymentId(packet->data()+52);
-    if (e.updateTransactionWhenPayApplyReceived(id, paymentId))
-    {
-        XBridgeTransactionPtr tr = e.transaction(id);
-        if (tr->state() == XBridgeTransaction::trPaid)
-        {
-            // send commit payments from exchange wallets to client
-
-            {
-                // second-currency second-amount to first-destination
-                std::vector<unsigned char> walletAddress = e.walletAddress(tr->secondCurrency());
-
-                // TODO remove this log
-                LOG() << "send xbcTransactionCommit to "
-                      << util::base64_encode(std::string((char *)&walletAddress[0], 20));
-
-                XBridgePacketPtr reply(new XBridgePacket(xbcTransactionCommit));
-                reply->append(walletAddress);
-                reply->append(app->myid(), 20);
-                reply->append(id.begin(), 32);
-                reply->append(tr->firstDestination());
-                reply->append(tr->secondAmount());
-
-                app->onSend(walletAddress,
-                            std::vector<unsigned char>(reply->header(),
-                                                       reply->header()+reply->allSize()));
-            }
+    XBridgeTrace::instance().record(id, XBridgeTrace::tpPayApplyReceived);
 
-            {
-                // first-currency first-amount to second-destination
-                std::vector<unsigned char> walletAddress = e.walletAddress(tr->firstCurrency());
-
-                // TODO remove this log
-                LOG() << "send xbcTransactionCommit to "
-                      << util::base64_encode(std::string((char *)&walletAddress[0], 20));
-
-                XBridgePacketPtr reply(new XBridgePacket(xbcTransactionCommit));
-                reply->append(walletAddress);
-                reply->append(app->myid(), 20);
-                reply->append(id.begin(), 32);
-                reply->append(tr->secondDestination());
-                reply->append(tr->firstAmount());
-
-                app->onSend(walletAddress,
-                            std::vector<unsigned char>(reply->header(),
-                                                       reply->header()+reply->allSize()));
-            }
-        }
-    }
+    // commit is sent by event subscriber when both members paid
+    e.updateTransactionWhenPayApplyReceived(id, paymentId);
 
     return true;
 }
@@ -580,67 +596,272 @@ bool XBridgeSession::processTransactionCommitApply(XBridgePacketPtr packet)
 
     // transaction id
     uint256 id(packet->data()+20);
-    if (e.updateTransactionWhenCommitApplyReceived(id))
+    XBridgeTrace::instance().record(id, XBridgeTrace::tpCommitApplyReceived);
+
+    // state is sent by event subscriber when both commits applied
+    e.updateTransactionWhenCommitApplyReceived(id);
+
+    return true;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+bool XBridgeSession::processTransactionCancel(XBridgePacketPtr packet)
+{
+    // DEBUG_TRACE();
+
+    // size must be == 52 bytes
+    if (packet->size() != 52)
     {
-        XBridgeTransactionPtr tr = e.transaction(id);
-        if (tr->state() == XBridgeTransaction::trFinished)
-        {
-            // send transaction state to clients
+        ERR() << "invalid packet size for xbcTransactionCancel " << __FUNCTION__;
+        return false;
+    }
+
+    // check address
+    XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
+    if (memcmp(packet->data(), app->myid(), 20) != 0)
+    {
+        // not for me, retranslate packet
+        std::vector<unsigned char> addr(packet->data(), packet->data() + 20);
+        app->onSend(addr, packet);
+        return true;
+    }
+
+    XBridgeExchange & e = XBridgeExchange::instance();
+    if (!e.isEnabled())
+    {
+        return true;
+    }
 
-            // TODO remove this log
-            LOG() << "send xbcTransactionFinished to "
-                  << util::base64_encode(std::string((char *)&tr->firstAddress()[0], 20));
+    uint256 id(packet->data()+20);
+    LOG() << "cancel transaction <" << id.GetHex() << ">";
+    XBridgeTrace::instance().record(id, XBridgeTrace::tpCancelReceived);
+
+    // only wallet of order or transaction member can cancel it
+    XBridgeTransactionPtr tr = e.order(id);
+    if (!tr)
+    {
+        tr = e.transaction(id);
+    }
+    if (!tr ||
+        (!app->isLocalSession(tr->firstAddress(), shared_from_this()) &&
+         !app->isLocalSession(tr->secondAddress(), shared_from_this())))
+    {
+        LOG() << "cancel of <" << id.GetHex() << "> not from member, ignored";
+        return true;
+    }
+
+    // members are notified by event subscriber
+    e.cancelTransaction(id, tr);
+    return true;
+}
+
+//*****************************************************************************
+// never takes exchange locks, reply reflects last published snapshot
+//*****************************************************************************
+bool XBridgeSession::processExchangeQuery(XBridgePacketPtr packet)
+{
+    // DEBUG_TRACE();
+
+    // size must be >= 44 bytes
+    if (packet->size() < 44)
+    {
+        ERR() << "invalid packet size for xbcExchangeQuery " << __FUNCTION__;
+        return false;
+    }
+
+    // check address
+    XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
+    if (memcmp(packet->data(), app->myid(), 20) != 0)
+    {
+        // not for me, retranslate packet
+        std::vector<unsigned char> addr(packet->data(), packet->data() + 20);
+        app->onSend(addr, packet);
+        return true;
+    }
+
+    XBridgeExchange & e = XBridgeExchange::instance();
+    if (!e.isEnabled())
+    {
+        return true;
+    }
+
+    uint160 client(packet->data()+20);
+    boost::uint32_t type = *static_cast<boost::uint32_t *>(static_cast<void *>(packet->data()+40));
+
+    XBridgeSnapshotPtr snapshot = e.snapshot();
+
+    XBridgePacketPtr reply(new XBridgePacket(xbcExchangeQueryReply));
+    reply->append(client.begin(), 20);
+    reply->append(app->myid(), 20);
+    reply->append(type);
+    reply->append(snapshot->sequence());
+
+    unsigned char currency[8];
+
+    switch (type)
+    {
+        case xqOrders:
+        {
+            std::vector<const XBridgeSnapshot::Order *> orders = snapshot->ordersOf(client);
 
-            // first
-            XBridgePacketPtr reply1(new XBridgePacket(xbcTransactionFinished));
-            reply1->append(tr->firstAddress());
-            reply1->append(id.begin(), 32);
+            reply->append(static_cast<boost::uint32_t>(orders.size()));
+            for (std::vector<const XBridgeSnapshot::Order *>::iterator i = orders.begin(); i != orders.end(); ++i)
+            {
+                const XBridgeSnapshot::Order & o = **i;
+                reply->append(o.id.begin(), 32);
+                o.sourceCurrency.copyTo(currency);
+                reply->append(currency, 8);
+                reply->append(o.sourceAmount);
+                o.destCurrency.copyTo(currency);
+                reply->append(currency, 8);
+                reply->append(o.destAmount);
+                reply->append(o.remaining);
+            }
+            break;
+        }
+        case xqDepth:
+        {
+            if (packet->size() != 60)
+            {
+                ERR() << "invalid packet size for xbcExchangeQuery " << __FUNCTION__;
+                return false;
+            }
 
-            app->onSend(tr->firstAddress(),
-                        std::vector<unsigned char>(reply1->header(),
-                                                   reply1->header()+reply1->allSize()));
+            const XBridgeSnapshot::Book * book =
+                    snapshot->book(XBridgeCurrency(packet->data()+44), XBridgeCurrency(packet->data()+52));
+            if (!book)
+            {
+                reply->append(static_cast<boost::uint32_t>(0));
+                break;
+            }
 
-            // TODO remove this log
-            LOG() << "send xbcTransactionFinished to "
-                  << util::base64_encode(std::string((char *)&tr->secondAddress()[0], 20));
+            reply->append(static_cast<boost::uint32_t>(book->depth.size()));
+            for (std::vector<XBridgeOrderBook::DepthLevel>::const_iterator i = book->depth.begin(); i != book->depth.end(); ++i)
+            {
+                reply->append(static_cast<boost::uint32_t>(i->side));
+                reply->append(i->price.quote);
+                reply->append(i->price.base);
+                reply->append(i->quantity);
+            }
+            break;
+        }
+        case xqTransaction:
+        {
+            if (packet->size() != 76)
+            {
+                ERR() << "invalid packet size for xbcExchangeQuery " << __FUNCTION__;
+                return false;
+            }
 
-            // second
-            XBridgePacketPtr reply2(new XBridgePacket(xbcTransactionFinished));
-            reply2->append(tr->secondAddress());
-            reply2->append(id.begin(), 32);
+            uint256 id(packet->data()+44);
 
-            app->onSend(tr->secondAddress(),
-                        std::vector<unsigned char>(reply2->header(),
-                                                   reply2->header()+reply2->allSize()));
+            if (const XBridgeSnapshot::Order * o = snapshot->order(id))
+            {
+                reply->append(static_cast<boost::uint32_t>(1));
+                reply->append(o->id.begin(), 32);
+                reply->append(static_cast<boost::uint32_t>(XBridgeTransaction::trNew));
+                o->sourceCurrency.copyTo(currency);
+                reply->append(currency, 8);
+                reply->append(o->sourceAmount);
+                o->destCurrency.copyTo(currency);
+                reply->append(currency, 8);
+                reply->append(o->destAmount);
+            }
+            else if (const XBridgeSnapshot::Transaction * t = snapshot->transaction(id))
+            {
+                reply->append(static_cast<boost::uint32_t>(1));
+                reply->append(t->id.begin(), 32);
+                reply->append(static_cast<boost::uint32_t>(t->state));
+                t->firstCurrency.copyTo(currency);
+                reply->append(currency, 8);
+                reply->append(t->firstAmount);
+                t->secondCurrency.copyTo(currency);
+                reply->append(currency, 8);
+                reply->append(t->secondAmount);
+            }
+            else
+            {
+                reply->append(static_cast<boost::uint32_t>(0));
+            }
+            break;
+        }
+        default:
+        {
+            ERR() << "unknown query type " << type << " " << __FUNCTION__;
+            return false;
         }
     }
 
+    app->onSend(client, reply);
     return true;
 }
 
 //*****************************************************************************
+// resync after gap in xbcMarketData, answered from snapshot
 //*****************************************************************************
-bool XBridgeSession::processTransactionCancel(XBridgePacketPtr packet)
+bool XBridgeSession::processMarketDataRequest(XBridgePacketPtr packet)
 {
     // DEBUG_TRACE();
 
-    // size must be == 52 bytes
-    if (packet->size() != 52)
+    // size must be 56 bytes
+    if (packet->size() != 56)
     {
-        ERR() << "invalid packet size for xbcReceivedTransaction " << __FUNCTION__;
+        ERR() << "invalid packet size for xbcMarketDataRequest " << __FUNCTION__;
         return false;
     }
 
+    // check address
+    XBridgeApp * app = qobject_cast<XBridgeApp *>(qApp);
+    if (memcmp(packet->data(), app->myid(), 20) != 0)
+    {
+        // not for me, retranslate packet
+        std::vector<unsigned char> addr(packet->data(), packet->data() + 20);
+        app->onSend(addr, packet);
+        return true;
+    }
+
     XBridgeExchange & e = XBridgeExchange::instance();
     if (!e.isEnabled())
     {
         return true;
     }
 
-    uint256 id(packet->data()+20);
-    LOG() << "cancel transaction <" << id.GetHex() << ">";
+    uint160 client(packet->data()+20);
+
+    XBridgeSnapshotPtr snapshot = e.snapshot();
+    const XBridgeSnapshot::Book * book =
+            snapshot->book(XBridgeCurrency(packet->data()+40), XBridgeCurrency(packet->data()+48));
+    if (!book)
+    {
+        LOG() << "market data requested for unknown pair";
+        return true;
+    }
+
+    // deltas above snapshot sequence follow directly
+    app->subscribeMarketData(client, book->base, book->quote);
+
+    unsigned char currency[8];
+
+    XBridgePacketPtr reply(new XBridgePacket(xbcMarketDataSnapshot));
+    reply->append(client.begin(), 20);
+    reply->append(app->myid(), 20);
+    book->base.copyTo(currency);
+    reply->append(currency, 8);
+    book->quote.copyTo(currency);
+    reply->append(currency, 8);
+    reply->append(book->sequence);
+    reply->append(static_cast<boost::uint32_t>(book->levels.size()));
+
+    for (std::vector<XBridgeOrderBook::DepthLevel>::const_iterator i = book->levels.begin(); i != book->levels.end(); ++i)
+    {
+        reply->append(static_cast<boost::uint32_t>(i->side));
+        reply->append(i->price.quote);
+        reply->append(i->price.base);
+        reply->append(i->quantity);
+    }
 
-    e.cancelTransaction(id);
+    app->onSend(client, reply);
     return true;
 }
 
@@ -57,6 +57,9 @@ private:
     bool processTransactionCommitApply(XBridgePacketPtr packet);
     bool processTransactionCancel(XBridgePacketPtr packet);
 
+    bool processExchangeQuery(XBridgePacketPtr packet);
+    bool processMarketDataRequest(XBridgePacketPtr packet);
+
     bool processBitcoinTransactionHash(XBridgePacketPtr packet);
 
 private:
@@ -0,0 +1,263 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#include "xbridgesnapshot.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+//*****************************************************************************
+//*****************************************************************************
+namespace
+{
+
+template <class T>
+bool idLess(const T & item, const uint256 & id)
+{
+    return item.id < id;
+}
+
+template <class T>
+const T * find(const std::vector<T> & items, const uint256 & id)
+{
+    typename std::vector<T>::const_iterator i =
+            std::lower_bound(items.begin(), items.end(), id, idLess<T>);
+    if (i == items.end() || i->id != id)
+    {
+        return 0;
+    }
+    return &*i;
+}
+
+const char * stateName(const XBridgeTransaction::State state)
+{
+    static const char * names[] =
+    {
+        "invalid", "new", "joined", "hold", "paid", "finished", "dropped"
+    };
+
+    return state <= XBridgeTransaction::trDropped ? names[state] : "unknown";
+}
+
+void orderJson(std::ostream & out, const XBridgeSnapshot::Order & o)
+{
+    out << "{\"id\":\"" << o.id.GetHex() << "\""
+        << ",\"address\":\"" << o.address.GetHex() << "\""
+        << ",\"from\":\"" << o.sourceCurrency << "\",\"fromAmount\":" << o.sourceAmount
+        << ",\"to\":\"" << o.destCurrency << "\",\"toAmount\":" << o.destAmount
+        << ",\"remaining\":" << o.remaining
+        << ",\"resting\":" << (o.resting ? "true" : "false") << "}";
+}
+
+} // namespace
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeSnapshot::XBridgeSnapshot(const boost::uint64_t sequence)
+    : m_sequence(sequence)
+    , m_time(boost::posix_time::microsec_clock::universal_time())
+{
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeSnapshot::add(const XBridgeOrderBook & book, const std::size_t maxLevels)
+{
+    std::vector<XBridgeOrderBook::Entry> entries = book.entries();
+
+    Book b;
+    b.base     = book.baseCurrency();
+    b.quote    = book.quoteCurrency();
+    b.orders   = entries.size();
+    b.depth    = book.depth(maxLevels);
+    b.sequence = book.sequence();
+    b.levels   = book.publishedDepth();
+    m_books.push_back(b);
+
+    for (std::vector<XBridgeOrderBook::Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i)
+    {
+        const XBridgeTransactionPtr & tr = i->transaction;
+
+        Order o;
+        o.id             = tr->id();
+        o.address        = tr->firstAddress();
+        o.sourceCurrency = tr->firstCurrency();
+        o.sourceAmount   = tr->firstAmount();
+        o.destCurrency   = tr->secondCurrency();
+        o.destAmount     = tr->secondAmount();
+        o.remaining      = i->remaining;
+        o.resting        = i->resting;
+        m_orders.push_back(o);
+    }
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeSnapshot::add(const XBridgeTransactionPtr & tr)
+{
+    Transaction t;
+    t.id             = tr->id();
+    t.state          = tr->state();
+    t.firstId        = tr->firstId();
+    t.firstAddress   = tr->firstAddress();
+    t.firstCurrency  = tr->firstCurrency();
+    t.firstAmount    = tr->firstAmount();
+    t.secondId       = tr->secondId();
+    t.secondAddress  = tr->secondAddress();
+    t.secondCurrency = tr->secondCurrency();
+    t.secondAmount   = tr->secondAmount();
+    t.lastActivity   = tr->lastActivityTime();
+    m_transactions.push_back(t);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeSnapshot::seal()
+{
+    std::sort(m_orders.begin(), m_orders.end(),
+              [](const Order & a, const Order & b) { return a.id < b.id; });
+    std::sort(m_transactions.begin(), m_transactions.end(),
+              [](const Transaction & a, const Transaction & b) { return a.id < b.id; });
+}
+
+//*****************************************************************************
+//*****************************************************************************
+const XBridgeSnapshot::Book * XBridgeSnapshot::book(const XBridgeCurrency & currency1,
+                                                    const XBridgeCurrency & currency2) const
+{
+    for (std::vector<Book>::const_iterator i = m_books.begin(); i != m_books.end(); ++i)
+    {
+        if ((i->base == currency1 && i->quote == currency2) ||
+            (i->base == currency2 && i->quote == currency1))
+        {
+            return &*i;
+        }
+    }
+    return 0;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+const XBridgeSnapshot::Order * XBridgeSnapshot::order(const uint256 & id) const
+{
+    return find(m_orders, id);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+const XBridgeSnapshot::Transaction * XBridgeSnapshot::transaction(const uint256 & id) const
+{
+    return find(m_transactions, id);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::vector<const XBridgeSnapshot::Order *> XBridgeSnapshot::ordersOf(const uint160 & address) const
+{
+    std::vector<const Order *> result;
+    for (std::vector<Order>::const_iterator i = m_orders.begin(); i != m_orders.end(); ++i)
+    {
+        if (i->address == address)
+        {
+            result.push_back(&*i);
+        }
+    }
+    return result;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::string XBridgeSnapshot::booksJson() const
+{
+    std::ostringstream out;
+    out << "{\"sequence\":" << m_sequence
+        << ",\"time\":\"" << boost::posix_time::to_iso_extended_string(m_time) << "\""
+        << ",\"books\":[";
+
+    for (std::vector<Book>::const_iterator b = m_books.begin(); b != m_books.end(); ++b)
+    {
+        if (b != m_books.begin())
+        {
+            out << ",";
+        }
+
+        out << "\n{\"base\":\"" << b->base << "\",\"quote\":\"" << b->quote << "\""
+            << ",\"orders\":" << b->orders << ",\"sequence\":" << b->sequence << ",\"levels\":[";
+
+        for (std::vector<XBridgeOrderBook::DepthLevel>::const_iterator l = b->depth.begin(); l != b->depth.end(); ++l)
+        {
+            if (l != b->depth.begin())
+            {
+                out << ",";
+            }
+
+            out << "{\"side\":\"" << (l->side == XBridgeOrderBook::Ask ? "ask" : "bid") << "\""
+                << ",\"quote\":" << l->price.quote << ",\"base\":" << l->price.base
+                << ",\"quantity\":" << l->quantity << "}";
+        }
+        out << "]}";
+    }
+    out << "\n]}\n";
+
+    return out.str();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::string XBridgeSnapshot::ordersJson(const uint160 & address) const
+{
+    std::ostringstream out;
+    out << "{\"sequence\":" << m_sequence << ",\"orders\":[";
+
+    bool first = true;
+    for (std::vector<Order>::const_iterator i = m_orders.begin(); i != m_orders.end(); ++i)
+    {
+        if (address != 0 && i->address != address)
+        {
+            continue;
+        }
+
+        out << (first ? "\n" : ",\n");
+        first = false;
+
+        orderJson(out, *i);
+    }
+    out << "\n]}\n";
+
+    return out.str();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::string XBridgeSnapshot::transactionJson(const uint256 & id) const
+{
+    std::ostringstream out;
+    out << "{\"sequence\":" << m_sequence;
+
+    if (const Order * o = order(id))
+    {
+        out << ",\"state\":\"" << stateName(XBridgeTransaction::trNew) << "\",\"order\":";
+        orderJson(out, *o);
+    }
+    else if (const Transaction * t = transaction(id))
+    {
+        out << ",\"state\":\"" << stateName(t->state) << "\""
+            << ",\"transaction\":{\"id\":\"" << t->id.GetHex() << "\""
+            << ",\"first\":{\"id\":\"" << t->firstId.GetHex() << "\""
+            << ",\"address\":\"" << t->firstAddress.GetHex() << "\""
+            << ",\"currency\":\"" << t->firstCurrency << "\",\"amount\":" << t->firstAmount << "}"
+            << ",\"second\":{\"id\":\"" << t->secondId.GetHex() << "\""
+            << ",\"address\":\"" << t->secondAddress.GetHex() << "\""
+            << ",\"currency\":\"" << t->secondCurrency << "\",\"amount\":" << t->secondAmount << "}"
+            << ",\"lastActivity\":\"" << boost::posix_time::to_iso_extended_string(t->lastActivity) << "\"}";
+    }
+    else
+    {
+        out << ",\"state\":\"unknown\"";
+    }
+    out << "}\n";
+
+    return out.str();
+}
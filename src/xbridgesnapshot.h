@@ -0,0 +1,111 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#ifndef XBRIDGESNAPSHOT_H
+#define XBRIDGESNAPSHOT_H
+
+#include "util/uint256.h"
+#include "xbridgecurrency.h"
+#include "xbridgetransaction.h"
+#include "xbridgeorderbook.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+//*****************************************************************************
+// copy of exchange tables, built by exchange and never changed after
+// publication, so queries are answered without exchange locks
+//*****************************************************************************
+class XBridgeSnapshot
+{
+public:
+    // pending order, first member only
+    struct Order
+    {
+        uint256                   id;
+        uint160                   address;
+        XBridgeCurrency           sourceCurrency;
+        boost::uint64_t           sourceAmount;
+        XBridgeCurrency           destCurrency;
+        boost::uint64_t           destAmount;
+        // not filled amount of base currency of pair
+        boost::uint64_t           remaining;
+        // false if waiting for auction
+        bool                      resting;
+    };
+
+    // joined transaction
+    struct Transaction
+    {
+        uint256                   id;
+        XBridgeTransaction::State state;
+        uint256                   firstId;
+        uint160                   firstAddress;
+        XBridgeCurrency           firstCurrency;
+        boost::uint64_t           firstAmount;
+        uint256                   secondId;
+        uint160                   secondAddress;
+        XBridgeCurrency           secondCurrency;
+        boost::uint64_t           secondAmount;
+        boost::posix_time::ptime  lastActivity;
+    };
+
+    struct Book
+    {
+        XBridgeCurrency                          base;
+        XBridgeCurrency                          quote;
+        std::size_t                              orders;
+        std::vector<XBridgeOrderBook::DepthLevel> depth;
+        // all levels as of market data sequence, for resync
+        boost::uint64_t                          sequence;
+        std::vector<XBridgeOrderBook::DepthLevel> levels;
+    };
+
+public:
+    XBridgeSnapshot(const boost::uint64_t sequence);
+
+    // filled by exchange before publication
+    void add(const XBridgeOrderBook & book, const std::size_t maxLevels);
+    void add(const XBridgeTransactionPtr & tr);
+    // sort tables for lookup
+    void seal();
+
+    boost::uint64_t sequence() const                     { return m_sequence; }
+    const boost::posix_time::ptime & time() const        { return m_time; }
+
+    const std::vector<Book> & books() const              { return m_books; }
+    const std::vector<Order> & orders() const            { return m_orders; }
+    const std::vector<Transaction> & transactions() const { return m_transactions; }
+
+    // pair in any order, 0 if not found
+    const Book * book(const XBridgeCurrency & currency1,
+                      const XBridgeCurrency & currency2) const;
+    // pending order by client id, 0 if not found
+    const Order * order(const uint256 & id) const;
+    // joined transaction by hub id, 0 if not found
+    const Transaction * transaction(const uint256 & id) const;
+    // pending orders placed from address
+    std::vector<const Order *> ordersOf(const uint160 & address) const;
+
+    // admin endpoint, all orders if address is null
+    std::string booksJson() const;
+    std::string ordersJson(const uint160 & address) const;
+    std::string transactionJson(const uint256 & id) const;
+
+private:
+    boost::uint64_t                 m_sequence;
+    boost::posix_time::ptime        m_time;
+
+    std::vector<Book>               m_books;
+    // sorted by id after seal
+    std::vector<Order>              m_orders;
+    std::vector<Transaction>        m_transactions;
+};
+
+typedef boost::shared_ptr<const XBridgeSnapshot> XBridgeSnapshotPtr;
+
+#endif // XBRIDGESNAPSHOT_H
@@ -0,0 +1,319 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#include "xbridgetrace.h"
+#include "util/settings.h"
+
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+
+//*****************************************************************************
+//*****************************************************************************
+namespace
+{
+
+// legs reported by percentiles and chrome trace
+struct Leg
+{
+    XBridgeTrace::Phase from;
+    XBridgeTrace::Phase to;
+    const char *        name;
+};
+
+const Leg legs[] =
+{
+    { XBridgeTrace::tpOrderReceived,       XBridgeTrace::tpJoined,       "match"           },
+    { XBridgeTrace::tpJoined,              XBridgeTrace::tpHoldSent,     "hold_send"       },
+    { XBridgeTrace::tpHoldSent,            XBridgeTrace::tpHold,         "hold_apply"      },
+    { XBridgeTrace::tpHold,                XBridgeTrace::tpPaySent,      "pay_send"        },
+    { XBridgeTrace::tpPaySent,             XBridgeTrace::tpPaid,         "pay_apply"       },
+    { XBridgeTrace::tpPaid,                XBridgeTrace::tpCommitSent,   "commit_send"     },
+    { XBridgeTrace::tpCommitSent,          XBridgeTrace::tpFinished,     "commit_apply"    },
+    { XBridgeTrace::tpFinished,            XBridgeTrace::tpFinishedSent, "finished_send"   },
+    { XBridgeTrace::tpJoined,              XBridgeTrace::tpFinished,     "total"           }
+};
+
+const std::size_t legCount = sizeof(legs) / sizeof(legs[0]);
+
+typedef std::map<uint256, std::vector<boost::uint64_t> > PhaseTimes;
+
+//*****************************************************************************
+// first timestamp of every phase for every id, 0 if not seen,
+// the match leg starts at order arrival, so joined transactions
+// inherit received time of the earliest member order
+//*****************************************************************************
+PhaseTimes phaseTimes(const std::vector<XBridgeTrace::Event> & events)
+{
+    PhaseTimes result;
+    for (std::vector<XBridgeTrace::Event>::const_iterator i = events.begin(); i != events.end(); ++i)
+    {
+        std::vector<boost::uint64_t> & times = result[i->id];
+        if (times.empty())
+        {
+            times.resize(XBridgeTrace::tpPhaseCount, 0);
+        }
+        if (!times[i->phase])
+        {
+            times[i->phase] = i->timestamp;
+        }
+    }
+
+    for (std::vector<XBridgeTrace::Event>::const_iterator i = events.begin(); i != events.end(); ++i)
+    {
+        if (i->phase != XBridgeTrace::tpJoined)
+        {
+            continue;
+        }
+
+        PhaseTimes::const_iterator order = result.find(i->ref);
+        if (order == result.end() || !order->second[XBridgeTrace::tpOrderReceived])
+        {
+            continue;
+        }
+
+        boost::uint64_t received = order->second[XBridgeTrace::tpOrderReceived];
+        boost::uint64_t & times  = result[i->id][XBridgeTrace::tpOrderReceived];
+        if (!times || times > received)
+        {
+            times = received;
+        }
+    }
+
+    return result;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::uint64_t percentile(const std::vector<boost::uint64_t> & sorted, const double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    std::size_t idx = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+} // namespace
+
+//*****************************************************************************
+//*****************************************************************************
+// static
+XBridgeTrace & XBridgeTrace::instance()
+{
+    static XBridgeTrace t;
+    return t;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+XBridgeTrace::XBridgeTrace()
+    : m_next(0)
+{
+    unsigned int capacity = Settings::instance().get<unsigned int>("Main.TraceCapacity", 65536);
+    m_ring.resize(std::max(capacity, 16u));
+}
+
+//*****************************************************************************
+//*****************************************************************************
+// static
+boost::uint64_t XBridgeTrace::timestamp()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>
+            (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeTrace::record(const uint256 & id, const Phase phase)
+{
+    record(id, uint256(), phase);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeTrace::record(const uint256 & id, const uint256 & ref, const Phase phase)
+{
+    boost::uint64_t ts = timestamp();
+
+    boost::mutex::scoped_lock l(m_lock);
+
+    Event & e    = m_ring[m_next % m_ring.size()];
+    e.id         = id;
+    e.ref        = ref;
+    e.timestamp  = ts;
+    e.phase      = phase;
+
+    ++m_next;
+}
+
+//*****************************************************************************
+// events in order of recording
+//*****************************************************************************
+std::vector<XBridgeTrace::Event> XBridgeTrace::events() const
+{
+    boost::mutex::scoped_lock l(m_lock);
+
+    std::vector<Event> result;
+    if (m_next <= m_ring.size())
+    {
+        result.assign(m_ring.begin(), m_ring.begin() + static_cast<std::size_t>(m_next));
+        return result;
+    }
+
+    std::size_t start = static_cast<std::size_t>(m_next % m_ring.size());
+    result.reserve(m_ring.size());
+    result.insert(result.end(), m_ring.begin() + start, m_ring.end());
+    result.insert(result.end(), m_ring.begin(), m_ring.begin() + start);
+    return result;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+// static
+const char * XBridgeTrace::phaseName(const Phase phase)
+{
+    static const char * names[tpPhaseCount] =
+    {
+        "order_received",
+        "new",
+        "joined",
+        "hold_sent",
+        "hold_apply_received",
+        "hold",
+        "pay_sent",
+        "pay_apply_received",
+        "paid",
+        "commit_sent",
+        "commit_apply_received",
+        "finished",
+        "finished_sent",
+        "cancel_received",
+        "dropped"
+    };
+
+    return phase < tpPhaseCount ? names[phase] : "unknown";
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::string XBridgeTrace::json() const
+{
+    std::vector<Event> all = events();
+
+    std::ostringstream out;
+    out << "[";
+    for (std::vector<Event>::const_iterator i = all.begin(); i != all.end(); ++i)
+    {
+        if (i != all.begin())
+        {
+            out << ",";
+        }
+
+        out << "\n{\"id\":\"" << i->id.GetHex() << "\""
+            << ",\"phase\":\"" << phaseName(i->phase) << "\""
+            << ",\"ts\":" << i->timestamp;
+        if (i->ref != 0)
+        {
+            out << ",\"ref\":\"" << i->ref.GetHex() << "\"";
+        }
+        out << "}";
+    }
+    out << "\n]\n";
+
+    return out.str();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::string XBridgeTrace::chromeTrace() const
+{
+    PhaseTimes times = phaseTimes(events());
+
+    std::ostringstream out;
+    out << "{\"traceEvents\":[";
+
+    bool first = true;
+    unsigned int row = 0;
+    for (PhaseTimes::const_iterator i = times.begin(); i != times.end(); ++i)
+    {
+        const std::vector<boost::uint64_t> & t = i->second;
+        if (!t[tpJoined])
+        {
+            // orders are shown as part of joined transaction
+            continue;
+        }
+
+        ++row;
+
+        // legs except total
+        for (std::size_t l = 0; l < legCount - 1; ++l)
+        {
+            boost::uint64_t from = t[legs[l].from];
+            boost::uint64_t to   = t[legs[l].to];
+            if (!from || !to || to < from)
+            {
+                continue;
+            }
+
+            out << (first ? "\n" : ",\n")
+                << "{\"name\":\"" << legs[l].name << "\",\"ph\":\"X\""
+                << ",\"ts\":" << from << ",\"dur\":" << (to - from)
+                << ",\"pid\":1,\"tid\":" << row
+                << ",\"args\":{\"id\":\"" << i->first.GetHex() << "\"}}";
+            first = false;
+        }
+
+        if (t[tpDropped])
+        {
+            out << (first ? "\n" : ",\n")
+                << "{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"t\""
+                << ",\"ts\":" << t[tpDropped]
+                << ",\"pid\":1,\"tid\":" << row << "}";
+            first = false;
+        }
+    }
+
+    out << "\n]}\n";
+    return out.str();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+std::string XBridgeTrace::report() const
+{
+    PhaseTimes times = phaseTimes(events());
+
+    std::vector<std::vector<boost::uint64_t> > durations(legCount);
+    for (PhaseTimes::const_iterator i = times.begin(); i != times.end(); ++i)
+    {
+        const std::vector<boost::uint64_t> & t = i->second;
+        for (std::size_t l = 0; l < legCount; ++l)
+        {
+            boost::uint64_t from = t[legs[l].from];
+            boost::uint64_t to   = t[legs[l].to];
+            if (from && to && to >= from)
+            {
+                durations[l].push_back(to - from);
+            }
+        }
+    }
+
+    std::ostringstream out;
+    out << "leg count p50 p90 p99 max (us)\n";
+    for (std::size_t l = 0; l < legCount; ++l)
+    {
+        std::vector<boost::uint64_t> & d = durations[l];
+        std::sort(d.begin(), d.end());
+
+        out << legs[l].name << " " << d.size()
+            << " " << percentile(d, 0.5)
+            << " " << percentile(d, 0.9)
+            << " " << percentile(d, 0.99)
+            << " " << (d.empty() ? 0 : d.back()) << "\n";
+    }
+
+    return out.str();
+}
@@ -0,0 +1,80 @@
+//*****************************************************************************
+//*****************************************************************************
+
+#ifndef XBRIDGETRACE_H
+#define XBRIDGETRACE_H
+
+#include "util/uint256.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+
+//*****************************************************************************
+// per-transaction timestamps of state transitions and packets,
+// kept in bounded ring, oldest events are overwritten
+//*****************************************************************************
+class XBridgeTrace
+{
+public:
+    enum Phase
+    {
+        tpOrderReceived = 0,
+        tpNew,
+        tpJoined,
+        tpHoldSent,
+        tpHoldApplyReceived,
+        tpHold,
+        tpPaySent,
+        tpPayApplyReceived,
+        tpPaid,
+        tpCommitSent,
+        tpCommitApplyReceived,
+        tpFinished,
+        tpFinishedSent,
+        tpCancelReceived,
+        tpDropped,
+
+        tpPhaseCount
+    };
+
+    struct Event
+    {
+        // order id before join, hub transaction id after
+        uint256         id;
+        // order id of member for tpJoined
+        uint256         ref;
+        boost::uint64_t timestamp;
+        Phase           phase;
+    };
+
+public:
+    static XBridgeTrace & instance();
+
+    void record(const uint256 & id, const Phase phase);
+    void record(const uint256 & id, const uint256 & ref, const Phase phase);
+
+    std::vector<Event> events() const;
+
+    // [{"id":..., "phase":..., "ts":...}, ...]
+    std::string json() const;
+    // chrome://tracing, one row per transaction
+    std::string chromeTrace() const;
+    // percentiles of every leg, microseconds
+    std::string report() const;
+
+    static const char * phaseName(const Phase phase);
+    static boost::uint64_t timestamp();
+
+private:
+    XBridgeTrace();
+
+private:
+    mutable boost::mutex m_lock;
+    std::vector<Event>   m_ring;
+    boost::uint64_t      m_next;
+};
+
+#endif // XBRIDGETRACE_H
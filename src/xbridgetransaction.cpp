@@ -2,15 +2,27 @@
 //*****************************************************************************
 
 #include "xbridgetransaction.h"
+#include "xbridgetrace.h"
 #include "util/logger.h"
 #include "util/util.h"
+#include "util/settings.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/pool/pool_alloc.hpp>
 
 //*****************************************************************************
 //*****************************************************************************
 XBridgeTransaction::XBridgeTransaction()
     : m_state(trInvalid)
     , m_stateCounter(0)
+    , m_sourceAmount(0)
+    , m_destAmount(0)
+    , m_created(boost::posix_time::microsec_clock::universal_time())
+    , m_lastActivity(m_created)
 {
 
 }
@@ -18,11 +30,11 @@ XBridgeTransaction::XBridgeTransaction()
 //*****************************************************************************
 //*****************************************************************************
 XBridgeTransaction::XBridgeTransaction(const uint256 & id,
-                                       const std::vector<unsigned char> & sourceAddr,
-                                       const std::string & sourceCurrency,
+                                       const uint160 & sourceAddr,
+                                       const XBridgeCurrency & sourceCurrency,
                                        const boost::uint64_t sourceAmount,
-                                       const std::vector<unsigned char> & destAddr,
-                                       const std::string & destCurrency,
+                                       const uint160 & destAddr,
+                                       const XBridgeCurrency & destCurrency,
                                        const boost::uint64_t destAmount)
     : m_id(id)
     , m_state(trNew)
@@ -31,10 +43,14 @@ XBridgeTransaction::XBridgeTransaction(const uint256 & id,
     , m_destCurrency(destCurrency)
     , m_sourceAmount(sourceAmount)
     , m_destAmount(destAmount)
+    , m_created(boost::posix_time::microsec_clock::universal_time())
+    , m_lastActivity(m_created)
     , m_first(id)
 {
     m_first.setSource(sourceAddr);
     m_first.setDest(destAddr);
+
+    XBridgeTrace::instance().record(m_id, XBridgeTrace::tpNew);
 }
 
 //*****************************************************************************
@@ -43,9 +59,27 @@ XBridgeTransaction::~XBridgeTransaction()
 {
 }
 
+//*****************************************************************************
+// object and reference counter in one block from shared pool
+//*****************************************************************************
+// static
+XBridgeTransactionPtr XBridgeTransaction::create(const uint256 & id,
+                                                 const uint160 & sourceAddr,
+                                                 const XBridgeCurrency & sourceCurrency,
+                                                 const boost::uint64_t sourceAmount,
+                                                 const uint160 & destAddr,
+                                                 const XBridgeCurrency & destCurrency,
+                                                 const boost::uint64_t destAmount)
+{
+    return boost::allocate_shared<XBridgeTransaction>(boost::fast_pool_allocator<XBridgeTransaction>(),
+                                                      id,
+                                                      sourceAddr, sourceCurrency, sourceAmount,
+                                                      destAddr, destCurrency, destAmount);
+}
+
 //*****************************************************************************
 //*****************************************************************************
-uint256 XBridgeTransaction::id() const
+const uint256 & XBridgeTransaction::id() const
 {
     return m_id;
 }
@@ -68,6 +102,9 @@ XBridgeTransaction::State XBridgeTransaction::increaseStateCounter(XBridgeTransa
         {
             m_state = trHold;
             m_stateCounter = 0;
+            updateTimestamp();
+
+            XBridgeTrace::instance().record(m_id, XBridgeTrace::tpHold);
         }
         return m_state;
     }
@@ -77,6 +114,9 @@ XBridgeTransaction::State XBridgeTransaction::increaseStateCounter(XBridgeTransa
         {
             m_state = trPaid;
             m_stateCounter = 0;
+            updateTimestamp();
+
+            XBridgeTrace::instance().record(m_id, XBridgeTrace::tpPaid);
         }
         return m_state;
     }
@@ -86,6 +126,9 @@ XBridgeTransaction::State XBridgeTransaction::increaseStateCounter(XBridgeTransa
         {
             m_state = trFinished;
             m_stateCounter = 0;
+            updateTimestamp();
+
+            XBridgeTrace::instance().record(m_id, XBridgeTrace::tpFinished);
         }
         return m_state;
     }
@@ -94,6 +137,15 @@ XBridgeTransaction::State XBridgeTransaction::increaseStateCounter(XBridgeTransa
     return trInvalid;
 }
 
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeTransaction::restoreState(const State state, const unsigned int counter)
+{
+    m_state        = state;
+    m_stateCounter = counter;
+    updateTimestamp();
+}
+
 //*****************************************************************************
 //*****************************************************************************
 bool XBridgeTransaction::isValid() const
@@ -106,64 +158,110 @@ bool XBridgeTransaction::isValid() const
 //*****************************************************************************
 bool XBridgeTransaction::isExpired() const
 {
-    // TODO implementation
-    return false;
+    boost::posix_time::ptime d = deadline();
+    if (d.is_not_a_date_time())
+    {
+        return false;
+    }
+    return d <= boost::posix_time::microsec_clock::universal_time();
 }
 
 //*****************************************************************************
 //*****************************************************************************
-void XBridgeTransaction::drop()
+void XBridgeTransaction::updateTimestamp()
 {
-    LOG() << "drop transaction <"
-          << util::base64_encode(std::string((char *)(m_id.begin()), 32))
-          << ">";
-    m_state = trDropped;
+    m_lastActivity = boost::posix_time::microsec_clock::universal_time();
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::posix_time::ptime XBridgeTransaction::createdTime() const
+{
+    return m_created;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::posix_time::ptime XBridgeTransaction::lastActivityTime() const
+{
+    return m_lastActivity;
+}
+
+//*****************************************************************************
+//*****************************************************************************
+boost::posix_time::ptime XBridgeTransaction::deadline() const
+{
+    boost::posix_time::time_duration t = timeout(m_state);
+    if (t.is_zero())
+    {
+        return boost::posix_time::ptime(boost::posix_time::not_a_date_time);
+    }
+    return m_lastActivity + t;
 }
 
 //*****************************************************************************
+// seconds from config, read once
 //*****************************************************************************
-uint256 XBridgeTransaction::hash1() const
+// static
+boost::posix_time::time_duration XBridgeTransaction::timeout(const State state)
 {
-    return util::hash(m_sourceCurrency.begin(), m_sourceCurrency.end(),
-                      BEGIN(m_sourceAmount), END(m_sourceAmount),
-                      m_destCurrency.begin(), m_destCurrency.end(),
-                      BEGIN(m_destAmount), END(m_destAmount));
+    static const unsigned int timeouts[] =
+    {
+        // trInvalid
+        0,
+        Settings::instance().get<unsigned int>("Main.PendingTimeout",  600),
+        Settings::instance().get<unsigned int>("Main.JoinedTimeout",   60),
+        Settings::instance().get<unsigned int>("Main.HoldTimeout",     300),
+        Settings::instance().get<unsigned int>("Main.PaidTimeout",     3600),
+        // finished and dropped are kept for late replies
+        Settings::instance().get<unsigned int>("Main.FinishedTimeout", 60),
+        Settings::instance().get<unsigned int>("Main.FinishedTimeout", 60)
+    };
+
+    if (state > trDropped)
+    {
+        return boost::posix_time::seconds(0);
+    }
+    return boost::posix_time::seconds(timeouts[state]);
 }
 
 //*****************************************************************************
 //*****************************************************************************
-uint256 XBridgeTransaction::hash2() const
+void XBridgeTransaction::drop()
 {
-    return util::hash(m_destCurrency.begin(), m_destCurrency.end(),
-                      BEGIN(m_destAmount), END(m_destAmount),
-                      m_sourceCurrency.begin(), m_sourceCurrency.end(),
-                      BEGIN(m_sourceAmount), END(m_sourceAmount));
+    LOG() << "drop transaction <"
+          << util::base64_encode(std::string((char *)(m_id.begin()), 32))
+          << ">";
+    m_state = trDropped;
+    updateTimestamp();
+
+    XBridgeTrace::instance().record(m_id, XBridgeTrace::tpDropped);
 }
 
 //*****************************************************************************
 //*****************************************************************************
-uint256 XBridgeTransaction::firstId() const
+const uint256 & XBridgeTransaction::firstId() const
 {
     return m_first.id();
 }
 
 //*****************************************************************************
 //*****************************************************************************
-std::vector<unsigned char> XBridgeTransaction::firstAddress() const
+const uint160 & XBridgeTransaction::firstAddress() const
 {
     return m_first.source();
 }
 
 //*****************************************************************************
 //*****************************************************************************
-std::vector<unsigned char> XBridgeTransaction::firstDestination() const
+const uint160 & XBridgeTransaction::firstDestination() const
 {
     return m_first.dest();
 }
 
 //*****************************************************************************
 //*****************************************************************************
-std::string XBridgeTransaction::firstCurrency() const
+const XBridgeCurrency & XBridgeTransaction::firstCurrency() const
 {
     return m_sourceCurrency;
 }
@@ -177,28 +275,28 @@ boost::uint64_t XBridgeTransaction::firstAmount() const
 
 //*****************************************************************************
 //*****************************************************************************
-uint256 XBridgeTransaction::secondId() const
+const uint256 & XBridgeTransaction::secondId() const
 {
     return m_second.id();
 }
 
 //*****************************************************************************
 //*****************************************************************************
-std::vector<unsigned char> XBridgeTransaction::secondAddress() const
+const uint160 & XBridgeTransaction::secondAddress() const
 {
     return m_second.source();
 }
 
 //*****************************************************************************
 //*****************************************************************************
-std::vector<unsigned char> XBridgeTransaction::secondDestination() const
+const uint160 & XBridgeTransaction::secondDestination() const
 {
     return m_second.dest();
 }
 
 //*****************************************************************************
 //*****************************************************************************
-std::string XBridgeTransaction::secondCurrency() const
+const XBridgeCurrency & XBridgeTransaction::secondCurrency() const
 {
     return m_destCurrency;
 }
@@ -250,6 +348,47 @@ bool XBridgeTransaction::tryJoin(const XBridgeTransactionPtr other)
                       BEGIN(other->m_id), END(other->m_id));
 
     m_state = trJoined;
+    updateTimestamp();
+
+    XBridgeTrace::instance().record(m_id, m_first.id(), XBridgeTrace::tpJoined);
+    XBridgeTrace::instance().record(m_id, m_second.id(), XBridgeTrace::tpJoined);
 
     return true;
 }
+
+//*****************************************************************************
+//*****************************************************************************
+void XBridgeTransaction::packOrder(unsigned char * data) const
+{
+    std::fill(data, data + orderSize, 0);
+
+    const uint256 & id    = m_first.id();
+    const uint160 & saddr = m_first.source();
+    const uint160 & daddr = m_first.dest();
+
+    std::copy(id.begin(), id.end(), data);
+    std::copy(saddr.begin(), saddr.end(), data+32);
+    m_sourceCurrency.copyTo(data+52);
+    std::copy(BEGIN(m_sourceAmount), END(m_sourceAmount), data+60);
+    std::copy(daddr.begin(), daddr.end(), data+68);
+    m_destCurrency.copyTo(data+88);
+    std::copy(BEGIN(m_destAmount), END(m_destAmount), data+96);
+}
+
+//*****************************************************************************
+//*****************************************************************************
+// static
+XBridgeTransactionPtr XBridgeTransaction::unpackOrder(const unsigned char * data)
+{
+    uint256 id(data);
+
+    uint160 saddr(data+32);
+    XBridgeCurrency scurrency(data+52);
+    boost::uint64_t samount = *static_cast<const boost::uint64_t *>(static_cast<const void *>(data+60));
+
+    uint160 daddr(data+68);
+    XBridgeCurrency dcurrency(data+88);
+    boost::uint64_t damount = *static_cast<const boost::uint64_t *>(static_cast<const void *>(data+96));
+
+    return create(id, saddr, scurrency, samount, daddr, dcurrency, damount);
+}
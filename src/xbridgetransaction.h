@@ -5,12 +5,14 @@
 #define XBRIDGETRANSACTION_H
 
 #include "util/uint256.h"
+#include "xbridgecurrency.h"
 
 #include <vector>
 #include <string>
 
 #include <boost/cstdint.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 
 //*****************************************************************************
 //*****************************************************************************
@@ -20,19 +22,31 @@ public:
     XBridgeTransactionMember()                              {}
     XBridgeTransactionMember(const uint256 & id) : m_id(id) {}
 
-    bool isEmpty() const { return m_sourceAddr.empty() || m_destAddr.empty(); }
+    bool isEmpty() const { return !m_sourceAddr || !m_destAddr; }
 
-    const uint256 id() const                                { return m_id; }
-    const std::vector<unsigned char> & source() const       { return m_sourceAddr; }
-    void setSource(const std::vector<unsigned char> & addr) { m_sourceAddr = addr; }
-    const std::vector<unsigned char> & dest() const         { return m_destAddr; }
-    void setDest(const std::vector<unsigned char> & addr)   { m_destAddr = addr; }
+    const uint256 & id() const                              { return m_id; }
+    const uint160 & source() const                          { return m_sourceAddr; }
+    void setSource(const uint160 & addr)                    { m_sourceAddr = addr; }
+    const uint160 & dest() const                            { return m_destAddr; }
+    void setDest(const uint160 & addr)                      { m_destAddr = addr; }
 
 private:
     uint256                    m_id;
-    std::vector<unsigned char> m_sourceAddr;
-    std::vector<unsigned char> m_destAddr;
-    uint256                    m_transactionHash;
+    uint160                    m_sourceAddr;
+    uint160                    m_destAddr;
+};
+
+//*****************************************************************************
+// hash table key of order and transaction ids, ids are random
+// or sha256 so folding words is enough
+//*****************************************************************************
+struct XBridgeIdHash
+{
+    std::size_t operator()(const uint256 & id) const
+    {
+        boost::uint64_t h = id.Get64(0) ^ id.Get64(1) ^ id.Get64(2) ^ id.Get64(3);
+        return static_cast<std::size_t>(h ^ (h >> 32));
+    }
 };
 
 //*****************************************************************************
@@ -41,6 +55,8 @@ class XBridgeTransaction;
 typedef boost::shared_ptr<XBridgeTransaction> XBridgeTransactionPtr;
 
 //*****************************************************************************
+// fixed size record, addresses and currencies are stored inline,
+// instances are allocated from pool by create()
 //*****************************************************************************
 class XBridgeTransaction
 {
@@ -59,55 +75,80 @@ public:
 public:
     XBridgeTransaction();
     XBridgeTransaction(const uint256 & id,
-                       const std::vector<unsigned char> & sourceAddr,
-                       const std::string & sourceCurrency,
+                       const uint160 & sourceAddr,
+                       const XBridgeCurrency & sourceCurrency,
                        const boost::uint64_t sourceAmount,
-                       const std::vector<unsigned char> & destAddr,
-                       const std::string & destCurrency,
+                       const uint160 & destAddr,
+                       const XBridgeCurrency & destCurrency,
                        const boost::uint64_t destAmount);
     ~XBridgeTransaction();
 
-    uint256 id() const;
+    static XBridgeTransactionPtr create(const uint256 & id,
+                                        const uint160 & sourceAddr,
+                                        const XBridgeCurrency & sourceCurrency,
+                                        const boost::uint64_t sourceAmount,
+                                        const uint160 & destAddr,
+                                        const XBridgeCurrency & destCurrency,
+                                        const boost::uint64_t destAmount);
+
+    const uint256 & id() const;
     // state of transaction
     State state() const;
     // update state counter and update state
     State increaseStateCounter(State state);
+    unsigned int stateCounter() const { return m_stateCounter; }
+    // state loaded from checkpoint
+    void restoreState(const State state, const unsigned int counter);
 
     bool isValid() const;
     bool isExpired() const;
 
-    void drop();
+    // state change or reply from member
+    void updateTimestamp();
+    boost::posix_time::ptime createdTime() const;
+    boost::posix_time::ptime lastActivityTime() const;
+    // expiration time in current state, not_a_date_time if never expires
+    boost::posix_time::ptime deadline() const;
+
+    // configured time in state without activity, zero if unlimited
+    static boost::posix_time::time_duration timeout(const State state);
 
-    // hash of transaction
-    uint256 hash1() const;
-    uint256 hash2() const;
+    void drop();
 
-    uint256                    firstId() const;
-    std::vector<unsigned char> firstAddress() const;
-    std::vector<unsigned char> firstDestination() const;
-    std::string                firstCurrency() const;
+    const uint256 &            firstId() const;
+    const uint160 &            firstAddress() const;
+    const uint160 &            firstDestination() const;
+    const XBridgeCurrency &    firstCurrency() const;
     boost::uint64_t            firstAmount() const;
 
-    uint256                    secondId() const;
-    std::vector<unsigned char> secondAddress() const;
-    std::vector<unsigned char> secondDestination() const;
-    std::string                secondCurrency() const;
+    const uint256 &            secondId() const;
+    const uint160 &            secondAddress() const;
+    const uint160 &            secondDestination() const;
+    const XBridgeCurrency &    secondCurrency() const;
     boost::uint64_t            secondAmount() const;
 
     bool tryJoin(const XBridgeTransactionPtr other);
 
+    // first member order in xbcTransaction layout
+    enum { orderSize = 104 };
+    void packOrder(unsigned char * data) const;
+    static XBridgeTransactionPtr unpackOrder(const unsigned char * data);
+
 private:
     uint256                    m_id;
 
     State                      m_state;
     unsigned int               m_stateCounter;
 
-    std::string                m_sourceCurrency;
-    std::string                m_destCurrency;
+    XBridgeCurrency            m_sourceCurrency;
+    XBridgeCurrency            m_destCurrency;
 
     boost::uint64_t            m_sourceAmount;
     boost::uint64_t            m_destAmount;
 
+    boost::posix_time::ptime   m_created;
+    boost::posix_time::ptime   m_lastActivity;
+
     XBridgeTransactionMember   m_first;
     XBridgeTransactionMember   m_second;
 };
@@ -30,7 +30,16 @@ SOURCES += \
     src/xbridgesession.cpp \
     src/xbridgeexchange.cpp \
     src/xbridgetransaction.cpp \
-    src/util/settings.cpp
+    src/xbridgetrace.cpp \
+    src/xbridgeorderbook.cpp \
+    src/xbridgejournal.cpp \
+    src/xbridgecheckpoint.cpp \
+    src/xbridgeeventbus.cpp \
+    src/xbridgesnapshot.cpp \
+    src/xbridgeidindex.cpp \
+    src/util/settings.cpp \
+    src/util/metrics.cpp \
+    src/util/metricsserver.cpp
 
 HEADERS += \
     src/statdialog.h \
@@ -44,7 +53,17 @@ HEADERS += \
     src/xbridgepacket.h \
     src/xbridgeexchange.h \
     src/xbridgetransaction.h \
-    src/util/settings.h
+    src/xbridgetrace.h \
+    src/xbridgeorderbook.h \
+    src/xbridgejournal.h \
+    src/xbridgecheckpoint.h \
+    src/xbridgeeventbus.h \
+    src/xbridgesnapshot.h \
+    src/xbridgeidindex.h \
+    src/xbridgecurrency.h \
+    src/util/settings.h \
+    src/util/metrics.h \
+    src/util/metricsserver.h
 
 LIBS += \
     -llibeay32 \